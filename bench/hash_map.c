@@ -0,0 +1,279 @@
+/*
+ * hash_map against the implementation it replaced: linear probing with
+ * '%' on every step, no stored hashes, rehashing every key to grow.
+ * Keys are identifier-like names, as sema and the IR passes use.
+ *
+ *   make bench
+ *   build/bench/hash_map
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../src/base/hash_map.h"
+
+#define RUNS 5
+#define TARGET_OPS 1000000  // Per measurement
+
+/* The previous hash_map */
+
+typedef struct {
+    const char *key;
+    int key_len;
+    void *value;
+} old_entry;
+
+typedef struct {
+    old_entry *entries;
+    size_t count;
+    size_t capacity;
+} old_map;
+
+static uint32_t old_hash(const char *key, int len)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static old_entry *old_find(old_entry *entries, size_t capacity, const char *key, int key_len)
+{
+    uint32_t idx = old_hash(key, key_len) % capacity;
+    for (;;) {
+        old_entry *entry = &entries[idx];
+        if (!entry->key)
+            return entry;
+        if (entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0)
+            return entry;
+        idx = (idx + 1) % capacity;
+    }
+}
+
+static void old_grow(old_map *m, size_t capacity)
+{
+    old_entry *entries = calloc(capacity, sizeof(old_entry));
+    for (size_t i = 0; i < m->capacity; i++) {
+        if (m->entries[i].key)
+            *old_find(entries, capacity, m->entries[i].key, m->entries[i].key_len) = m->entries[i];
+    }
+    free(m->entries);
+    m->entries = entries;
+    m->capacity = capacity;
+}
+
+static void old_init(old_map *m)
+{
+    m->count = 0;
+    m->capacity = 16;
+    m->entries = calloc(m->capacity, sizeof(old_entry));
+}
+
+static void old_set(old_map *m, const char *key, int key_len, void *value)
+{
+    if (m->count >= (size_t)(m->capacity * 0.75))
+        old_grow(m, m->capacity * 2);
+
+    old_entry *entry = old_find(m->entries, m->capacity, key, key_len);
+    if (!entry->key)
+        m->count++;
+    entry->key = key;
+    entry->key_len = key_len;
+    entry->value = value;
+}
+
+static void *old_get(old_map *m, const char *key, int key_len)
+{
+    old_entry *entry = old_find(m->entries, m->capacity, key, key_len);
+    return entry->key ? entry->value : NULL;
+}
+
+/* Workloads */
+
+static char **keys;         // Present in the maps
+static char **missing;      // Never inserted
+static int *lengths;
+static int *missing_lengths;
+
+static void make_keys(int n)
+{
+    static const char *stems[] = { "tmp", "x", "count", "b.for", "case", "node", "i" };
+
+    keys = malloc(n * sizeof(*keys));
+    missing = malloc(n * sizeof(*missing));
+    lengths = malloc(n * sizeof(*lengths));
+    missing_lengths = malloc(n * sizeof(*missing_lengths));
+
+    for (int i = 0; i < n; i++) {
+        const char *stem = stems[i % 7];
+        keys[i] = malloc(32);
+        missing[i] = malloc(32);
+        lengths[i] = snprintf(keys[i], 32, "%s.%d", stem, i);
+        missing_lengths[i] = snprintf(missing[i], 32, "%s_%d", stem, i);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static volatile uintptr_t sink;
+
+enum workload { INSERT, HIT, MISS, REMOVE };
+
+/*
+ * Inserts are timed from an empty map, lookups on one built up front.
+ * Removals are timed with the inserts refilling the map, which
+ * main takes out again.
+ */
+static double run_new(enum workload w, int n, int reps)
+{
+    hash_map m;
+    hashmap_init(&m);
+    for (int i = 0; i < n; i++)
+        hashmap_set(&m, keys[i], lengths[i], keys[i]);
+
+    double start = now();
+
+    for (int r = 0; r < reps; r++) {
+        if (w == INSERT || w == REMOVE) {
+            hashmap_free(&m);
+            hashmap_init(&m);
+            for (int i = 0; i < n; i++)
+                hashmap_set(&m, keys[i], lengths[i], keys[i]);
+        }
+
+        if (w == HIT)
+            for (int i = 0; i < n; i++)
+                sink += (uintptr_t)hashmap_get(&m, keys[i], lengths[i]);
+        else if (w == MISS)
+            for (int i = 0; i < n; i++)
+                sink += (uintptr_t)hashmap_get(&m, missing[i], missing_lengths[i]);
+        else if (w == REMOVE)
+            for (int i = 0; i < n; i++)
+                sink += hashmap_remove(&m, keys[i], lengths[i]);
+    }
+
+    double elapsed = now() - start;
+    hashmap_free(&m);
+    return elapsed;
+}
+
+static double run_old(enum workload w, int n, int reps)
+{
+    old_map m;
+    old_init(&m);
+    for (int i = 0; i < n; i++)
+        old_set(&m, keys[i], lengths[i], keys[i]);
+
+    double start = now();
+
+    for (int r = 0; r < reps; r++) {
+        if (w == INSERT) {
+            free(m.entries);
+            old_init(&m);
+            for (int i = 0; i < n; i++)
+                old_set(&m, keys[i], lengths[i], keys[i]);
+        }
+
+        if (w == HIT)
+            for (int i = 0; i < n; i++)
+                sink += (uintptr_t)old_get(&m, keys[i], lengths[i]);
+        else if (w == MISS)
+            for (int i = 0; i < n; i++)
+                sink += (uintptr_t)old_get(&m, missing[i], missing_lengths[i]);
+    }
+
+    double elapsed = now() - start;
+    free(m.entries);
+    return elapsed;
+}
+
+// Both maps hold the same values, and removing leaves the rest findable
+static void check(int n)
+{
+    hash_map m;
+    old_map o;
+    hashmap_init(&m);
+    old_init(&o);
+
+    for (int i = 0; i < n; i++) {
+        hashmap_set(&m, keys[i], lengths[i], keys[i]);
+        old_set(&o, keys[i], lengths[i], keys[i]);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (hashmap_get(&m, keys[i], lengths[i]) != old_get(&o, keys[i], lengths[i]) ||
+            hashmap_get(&m, missing[i], missing_lengths[i])) {
+            fprintf(stderr, "hash_map: lookup mismatch at %d\n", i);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < n; i += 2)
+        hashmap_remove(&m, keys[i], lengths[i]);
+
+    for (int i = 0; i < n; i++) {
+        void *expected = i % 2 ? keys[i] : NULL;
+        if (hashmap_get(&m, keys[i], lengths[i]) != expected) {
+            fprintf(stderr, "hash_map: lookup after remove mismatch at %d\n", i);
+            exit(1);
+        }
+    }
+
+    hashmap_free(&m);
+    free(o.entries);
+}
+
+static double best_ns_per_op(double (*run)(enum workload, int, int), enum workload w, int n)
+{
+    int reps = TARGET_OPS / n + 1;
+    double best = -1;
+
+    for (int i = 0; i < RUNS; i++) {
+        double t = run(w, n, reps);
+        if (best < 0 || t < best)
+            best = t;
+    }
+
+    return best * 1e9 / ((double)reps * n);
+}
+
+int main(void)
+{
+    static const int sizes[] = { 8, 100, 10000, 200000 };
+    static const char *names[] = { "insert", "hit", "miss", "remove" };
+
+    make_keys(sizes[3]);
+
+    for (int s = 0; s < 4; s++)
+        check(sizes[s]);
+
+    printf("%-8s %8s %12s %12s\n", "", "keys", "old ns/op", "new ns/op");
+
+    for (int w = INSERT; w <= REMOVE; w++) {
+        for (int s = 0; s < 4; s++) {
+            int n = sizes[s];
+
+            if (w == REMOVE) {
+                double fresh = best_ns_per_op(run_new, REMOVE, n) -
+                               best_ns_per_op(run_new, INSERT, n);
+                printf("%-8s %8d %12s %12.1f\n", names[w], n, "-", fresh);
+                continue;
+            }
+
+            printf("%-8s %8d %12.1f %12.1f\n", names[w], n,
+                   best_ns_per_op(run_old, w, n), best_ns_per_op(run_new, w, n));
+        }
+    }
+
+    return 0;
+}
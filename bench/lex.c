@@ -0,0 +1,118 @@
+/*
+ * Lexer throughput: lexes the given files into token streams (with
+ * identifiers interned), or a generated source heavy in indentation
+ * and comments, and prints GB/s.
+ *
+ *   make bench
+ *   build/bench/lex [file.c...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/lexer.h"
+
+#define TARGET_BYTES (64 << 20)   // Lexed per run
+#define RUNS 5
+
+static const char *snippet =
+    "/*\n"
+    " * Sums the first n odd numbers, which is n squared.\n"
+    " */\n"
+    "static int odd_sum(int n) {\n"
+    "    int sum = 0;\n"
+    "    for (int i = 0; i < n; i = i + 1) {\n"
+    "        // Next odd number\n"
+    "        sum += 2 * i + 1;\n"
+    "    }\n"
+    "\n"
+    "    return sum;     /* n * n */\n"
+    "}\n"
+    "\n";
+
+static char *generated_source(size_t *size)
+{
+    size_t len = strlen(snippet);
+    size_t copies = (1 << 20) / len;
+
+    *size = copies * len;
+    char *source = calloc(*size + 1 + LEXER_PADDING, 1);
+    for (size_t i = 0; i < copies; i++)
+        memcpy(source + i * len, snippet, len);
+
+    return source;
+}
+
+static char *read_source(const char *filename, size_t *size)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Opening file %s failed\n", filename);
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char *source = calloc(*size + 1 + LEXER_PADDING, 1);
+    *size = fread(source, 1, *size, file);
+
+    fclose(file);
+    return source;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(const char *name, const char *source, size_t size)
+{
+    struct source_file file = { name, source };
+    size_t passes = TARGET_BYTES / size + 1;
+    double best = 0;
+    long tokens = 0;
+
+    for (int run = 0; run < RUNS; run++) {
+        double start = now();
+        tokens = 0;
+
+        for (size_t pass = 0; pass < passes; pass++) {
+            struct token_stream *stream = lex_source(&file);
+            tokens += stream->count;
+            token_stream_free(stream);
+        }
+
+        double rate = (double)size * passes / (now() - start) / 1e9;
+        if (rate > best)
+            best = rate;
+    }
+
+    printf("%-32s %8zu bytes %9ld tokens/pass %6.3f GB/s\n",
+           name, size, tokens / (long)passes, best);
+}
+
+int main(int argc, char **argv)
+{
+    size_t size;
+
+    if (argc < 2) {
+        char *source = generated_source(&size);
+        bench("<generated>", source, size);
+        free(source);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        char *source = read_source(argv[i], &size);
+        bench(argv[i], source, size);
+        free(source);
+    }
+
+    return 0;
+}
@@ -17,8 +17,12 @@
  *   - expr->is_lvalue
  *   - expr identifiers with expr->ident.sym
  *   - decl->sym
- *   - decl->ir_name
- *   - break/continue/switch/case labels
+ *   - decl->ir_name, of functions and static objects
+ *   - decl->sym->local, of automatic objects
+ *   - labels of loops, switches, cases and goto targets
+ *
+ * Labels and automatic objects are numbered per function from 1, 0 is
+ * none. IR lowering makes them its own label and pseudo numbers.
  */
 
 #define LIST_APPEND(head, tail, node)  \
@@ -45,7 +49,7 @@ enum expr_kind {
 
 struct expr {
     enum expr_kind kind;
-    struct token tok;
+    tok_id tok;     // The operator, or the identifier or literal itself
     struct expr *next; // Arguments list and other expression lists
 
     // Filled by sema
@@ -56,23 +60,19 @@ struct expr {
         long int_value;
 
         struct {
-            struct token name;
             struct symbol *sym;
         } identifier;
 
         struct {
-            struct token op;
             struct expr *operand;
         } unary;
 
         struct {
-            struct token op;
             struct expr *left;
             struct expr *right;
         } binary;
 
         struct {
-            struct token op;
             struct expr *lvalue;
             struct expr *rvalue;
         } assignment;
@@ -118,7 +118,7 @@ enum storage_duration {
 
 struct decl {
     enum decl_kind kind;
-    struct token name;
+    tok_id name;            // NO_TOKEN for unnamed parameters
     struct decl *next;
 
     struct type *type;
@@ -142,6 +142,10 @@ struct decl {
         struct {
             struct decl *params;
             struct stmt *body;
+
+            // Sema-computed, the numbers the body uses
+            int label_count;
+            int local_count;
         } func;
     };
 };
@@ -156,7 +160,7 @@ enum block_item_kind {
 struct block_item {
     enum block_item_kind kind;
     struct block_item *next;
-    struct token tok;
+    tok_id tok;
 
     union {
         struct stmt *stmt;
@@ -192,7 +196,7 @@ enum stmt_kind {
 
 struct stmt {
     enum stmt_kind kind;
-    struct token tok;
+    tok_id tok;
     struct stmt *next;
 
     union {
@@ -207,20 +211,22 @@ struct stmt {
         } if_stmt;
 
         struct {
-            struct token label;
+            tok_id label;
+            int target_label;
         } goto_stmt;
 
         struct {
-            struct token name;
+            tok_id name;
             struct stmt *stmt;
+            int label;
         } label_stmt;
 
         struct {
-            const char *target_label;
+            int target_label;
         } break_stmt;
 
         struct {
-            const char *target_label;
+            int target_label;
         } continue_stmt;
 
         struct {
@@ -228,40 +234,40 @@ struct stmt {
             struct expr *condition;
             struct expr *post;
             struct stmt *body;
-            const char *break_label;
-            const char *continue_label;
+            int break_label;
+            int continue_label;
         } for_stmt;
 
         struct {
             struct expr *condition;
             struct stmt *body;
-            const char *break_label;
-            const char *continue_label;
+            int break_label;
+            int continue_label;
         } while_stmt;
 
         struct {
             struct stmt *body;
             struct expr *condition;
-            const char *break_label;
-            const char *continue_label;
+            int break_label;
+            int continue_label;
         } dowhile_stmt;
 
         struct {
             struct stmt *body;
             struct expr *condition;
-            const char *break_label;
+            int break_label;
             struct switch_annotation *annotation;
         } switch_stmt;
 
         struct {
             struct expr *value;
             struct block_item *items;
-            const char *label;
+            int label;
         } case_stmt;
 
         struct {
             struct block_item *items;
-            const char *label;
+            int label;
         } default_stmt;
 
         struct {
@@ -280,7 +286,7 @@ struct ast_program {
     struct decl *decls;
 };
 
-static inline struct expr *expr_new(enum expr_kind kind, struct token tok)
+static inline struct expr *expr_new(enum expr_kind kind, tok_id tok)
 {
     struct expr *e = calloc(1, sizeof(struct expr));
     e->kind = kind;
@@ -288,7 +294,7 @@ static inline struct expr *expr_new(enum expr_kind kind, struct token tok)
     return e;
 }
 
-static inline struct stmt *stmt_new(enum stmt_kind kind, struct token tok)
+static inline struct stmt *stmt_new(enum stmt_kind kind, tok_id tok)
 {
     struct stmt *s = calloc(1, sizeof(struct stmt));
     s->kind = kind;
@@ -296,7 +302,7 @@ static inline struct stmt *stmt_new(enum stmt_kind kind, struct token tok)
     return s;
 }
 
-static inline struct decl *decl_new(enum decl_kind kind, struct token tok)
+static inline struct decl *decl_new(enum decl_kind kind, tok_id tok)
 {
     struct decl *d = calloc(1, sizeof(struct decl));
     d->kind = kind;
@@ -307,7 +313,7 @@ static inline struct decl *decl_new(enum decl_kind kind, struct token tok)
     return d;
 }
 
-static inline struct block_item *block_item_new(enum block_item_kind kind, struct token tok)
+static inline struct block_item *block_item_new(enum block_item_kind kind, tok_id tok)
 {
     struct block_item *i = calloc(1, sizeof(struct block_item));
     i->kind = kind;
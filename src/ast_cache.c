@@ -0,0 +1,914 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ast_cache.h"
+#include "sema.h"
+#include "type.h"
+#include "preprocessor.h"
+
+extern struct symbol *all_symbols; // From sema
+
+#define CACHE_MAGIC "CINCAST"
+#define CACHE_VERSION 2     // Bump when the AST or sema's annotations change meaning
+
+// Offset of 'member' of the struct at 'offset' in the image
+#define FIELD(offset, type, member) ((offset) + offsetof(type, member))
+
+enum fixup_kind {
+    FIXUP_POINTER,      // Holds an offset in the image
+    FIXUP_ATOM,         // Holds the offset of the name
+    FIXUP_TYPE_INT,     // Builtin types are compared by address, they aren't copied
+    FIXUP_TYPE_VOID,
+};
+
+struct fixup {
+    uint32_t offset;    // Of the field
+    uint32_t kind;
+};
+
+// The tokens the AST refers to, renumbered in the order they are met
+struct cached_token {
+    uint32_t type;
+    uint32_t name;      // Offset of an identifier's name, 0 for other tokens
+};
+
+struct dependency {
+    uint64_t path;      // Offset of the name
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;        // Of the cached structs, see layout_hash()
+    uint64_t options;       // pp_options_hash()
+
+    uint64_t program;
+    uint64_t symbols;       // all_symbols
+
+    uint64_t tokens;
+    uint64_t dependencies;
+    uint64_t fixups;
+    uint32_t token_count;
+    uint32_t dependency_count;
+    uint32_t fixup_count;
+};
+
+/*
+ * The image is only valid for the struct layouts of the build that
+ * wrote it. Sizes catch most header changes, CACHE_VERSION the rest.
+ */
+static uint32_t layout_hash(void)
+{
+    const size_t sizes[] = {
+        sizeof(struct ast_program), sizeof(struct decl), sizeof(struct stmt),
+        sizeof(struct expr), sizeof(struct block_item), sizeof(struct for_init),
+        sizeof(struct type), sizeof(struct symbol), sizeof(struct switch_annotation),
+        sizeof(struct case_entry),
+    };
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        hash = (hash ^ (uint32_t)sizes[i]) * 16777619;
+
+    return hash;
+}
+
+/* Writing */
+
+struct placed {
+    const void *ptr;
+    uint64_t offset;
+};
+
+enum node_kind {
+    NODE_EXPR,
+    NODE_DECL,
+    NODE_SYMBOL,
+    NODE_BLOCK_ITEM,
+    NODE_STMT,
+    NODE_CASE_ENTRY,
+    NODE_TYPE,
+    NODE_FOR_INIT,
+    NODE_ANNOTATION,
+};
+
+struct pending {
+    enum node_kind kind;
+    void *node;
+    uint64_t offset;
+};
+
+static struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+
+    struct fixup *fixups;
+    uint32_t fixup_count;
+    uint32_t fixup_capacity;
+
+    // Objects already copied, by address. Open addressing, half full at most.
+    struct placed *placed;
+    size_t placed_count;
+    size_t placed_capacity;
+
+    // Nodes copied whose pointer fields are still to be written
+    struct pending *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+
+    tok_id *token_ids;      // Unit token -> cached token, NO_TOKEN until met
+    struct cached_token *tokens;
+    uint32_t token_count;
+    uint32_t token_capacity;
+} image;
+
+static char *at(uint64_t offset)
+{
+    return image.data + offset;
+}
+
+// Zeroed and 8 byte aligned. Offset 0 is the header, so no object is at 0.
+static uint64_t image_alloc(size_t size)
+{
+    size_t offset = (image.size + 7) & ~(size_t)7;
+
+    if (offset + size > image.capacity) {
+        size_t capacity = image.capacity ? image.capacity : 4096;
+        while (capacity < offset + size)
+            capacity *= 2;
+
+        image.data = realloc(image.data, capacity);
+        memset(image.data + image.capacity, 0, capacity - image.capacity);
+        image.capacity = capacity;
+    }
+
+    image.size = offset + size;
+    return offset;
+}
+
+static void add_fixup(uint64_t field, enum fixup_kind kind)
+{
+    if (image.fixup_count == image.fixup_capacity) {
+        image.fixup_capacity = image.fixup_capacity ? image.fixup_capacity * 2 : 256;
+        image.fixups = realloc(image.fixups, image.fixup_capacity * sizeof(struct fixup));
+    }
+
+    image.fixups[image.fixup_count++] = (struct fixup) { (uint32_t)field, kind };
+}
+
+static size_t placed_slot(struct placed *table, size_t capacity, const void *ptr)
+{
+    size_t mask = capacity - 1;
+    size_t idx = (size_t)(((uintptr_t)ptr >> 3) * 0x9e3779b97f4a7c15u) & mask;
+
+    while (table[idx].ptr && table[idx].ptr != ptr)
+        idx = (idx + 1) & mask;
+
+    return idx;
+}
+
+static uint64_t placed_get(const void *ptr)
+{
+    if (!image.placed_capacity)
+        return 0;
+
+    return image.placed[placed_slot(image.placed, image.placed_capacity, ptr)].offset;
+}
+
+static void placed_set(const void *ptr, uint64_t offset)
+{
+    if ((image.placed_count + 1) * 2 > image.placed_capacity) {
+        size_t capacity = image.placed_capacity ? image.placed_capacity * 2 : 1024;
+        struct placed *table = calloc(capacity, sizeof(struct placed));
+
+        for (size_t i = 0; i < image.placed_capacity; i++)
+            if (image.placed[i].ptr)
+                table[placed_slot(table, capacity, image.placed[i].ptr)] = image.placed[i];
+
+        free(image.placed);
+        image.placed = table;
+        image.placed_capacity = capacity;
+    }
+
+    image.placed[placed_slot(image.placed, image.placed_capacity, ptr)] =
+        (struct placed) { ptr, offset };
+    image.placed_count++;
+}
+
+/*
+ * Copies the object at 'ptr' once. Only when 'fresh' do its pointer
+ * fields still hold addresses, the caller defers writing them.
+ */
+static uint64_t place(const void *ptr, size_t size, bool *fresh)
+{
+    uint64_t offset = placed_get(ptr);
+
+    *fresh = offset == 0;
+    if (offset)
+        return offset;
+
+    offset = image_alloc(size);
+    memcpy(at(offset), ptr, size);
+    placed_set(ptr, offset);
+
+    return offset;
+}
+
+static void set_pointer(uint64_t field, uint64_t target)
+{
+    uintptr_t value = target;
+    memcpy(at(field), &value, sizeof(value));
+
+    if (target)
+        add_fixup(field, FIXUP_POINTER);
+}
+
+static uint64_t write_string(const char *s)
+{
+    if (!s)
+        return 0;
+
+    bool fresh;
+    return place(s, strlen(s) + 1, &fresh);
+}
+
+// For strings that don't outlive the write, and so can't be shared by address
+static uint64_t place_string_copy(const char *s)
+{
+    size_t size = strlen(s) + 1;
+    uint64_t offset = image_alloc(size);
+
+    memcpy(at(offset), s, size);
+    return offset;
+}
+
+static void put_string(uint64_t field, const char *s)
+{
+    set_pointer(field, write_string(s));
+}
+
+// Renumbers the token in 'field'
+static void put_token(uint64_t field)
+{
+    tok_id tok;
+    memcpy(&tok, at(field), sizeof(tok));
+
+    if (tok == NO_TOKEN)
+        return;
+
+    if (image.token_ids[tok] == NO_TOKEN) {
+        if (image.token_count == image.token_capacity) {
+            image.token_capacity = image.token_capacity ? image.token_capacity * 2 : 256;
+            image.tokens = realloc(image.tokens,
+                                   image.token_capacity * sizeof(struct cached_token));
+        }
+
+        atom name = tok_atom(tok);
+        image.tokens[image.token_count] = (struct cached_token) {
+            .type = tok_type(tok),
+            .name = name ? (uint32_t)write_string(atom_name(name)) : 0,
+        };
+        image.token_ids[tok] = image.token_count++;
+    }
+
+    memcpy(at(field), &image.token_ids[tok], sizeof(tok_id));
+}
+
+static void put_atom(uint64_t field, atom a)
+{
+    uint32_t name = (uint32_t)write_string(atom_name(a));
+    memcpy(at(field), &name, sizeof(name));
+    add_fixup(field, FIXUP_ATOM);
+}
+
+static uint64_t write_type(struct type *ty);
+
+static void put_type(uint64_t field, struct type *ty)
+{
+    if (ty == type_int() || ty == type_void()) {
+        set_pointer(field, 0);
+        add_fixup(field, ty == type_int() ? FIXUP_TYPE_INT : FIXUP_TYPE_VOID);
+        return;
+    }
+
+    set_pointer(field, write_type(ty));
+}
+
+/*
+ * The fields of a copied node are written from a worklist rather than
+ * by recursion, an AST as deep as generated code makes it doesn't fit
+ * the C stack.
+ */
+static void defer_fill(enum node_kind kind, void *node, uint64_t offset)
+{
+    if (image.pending_count == image.pending_capacity) {
+        image.pending_capacity = image.pending_capacity ? image.pending_capacity * 2 : 256;
+        image.pending = realloc(image.pending, image.pending_capacity * sizeof(struct pending));
+    }
+
+    image.pending[image.pending_count++] = (struct pending) { kind, node, offset };
+}
+
+/*
+ * Each writer copies a list from 'first' on and returns where 'first'
+ * went. A node placed before ends the walk: the rest of the list went
+ * with it.
+ */
+#define WRITE_LIST(type, kind, first)                                       \
+    do {                                                                    \
+        uint64_t head = 0, prev = 0;                                        \
+        for (type *node = (first); node; node = node->next) {               \
+            bool fresh;                                                     \
+            uint64_t offset = place(node, sizeof(type), &fresh);            \
+                                                                            \
+            if (prev)                                                       \
+                set_pointer(FIELD(prev, type, next), offset);               \
+            else                                                            \
+                head = offset;                                              \
+                                                                            \
+            if (!fresh)                                                     \
+                break;                                                      \
+                                                                            \
+            defer_fill(kind, node, offset);                                 \
+            prev = offset;                                                  \
+        }                                                                   \
+        return head;                                                        \
+    } while (0)
+
+static uint64_t write_exprs(struct expr *first);
+static uint64_t write_stmts(struct stmt *first);
+static uint64_t write_decls(struct decl *first);
+static uint64_t write_symbols(struct symbol *first);
+static uint64_t write_block_items(struct block_item *first);
+
+static uint64_t write_type(struct type *ty)
+{
+    if (!ty)
+        return 0;
+
+    bool fresh;
+    uint64_t offset = place(ty, sizeof(struct type), &fresh);
+    if (fresh && ty->kind == TYPE_FUNCTION)
+        defer_fill(NODE_TYPE, ty, offset);
+
+    return offset;
+}
+
+static void fill_type(uint64_t offset, struct type *ty)
+{
+    put_type(FIELD(offset, struct type, func.return_type), ty->func.return_type);
+    set_pointer(FIELD(offset, struct type, func.params), write_decls(ty->func.params));
+}
+
+static void fill_expr(uint64_t offset, struct expr *e)
+{
+    put_token(FIELD(offset, struct expr, tok));
+    put_type(FIELD(offset, struct expr, type), e->type);
+
+    switch (e->kind) {
+        case EXPR_INT_LITERAL:
+            break;
+        case EXPR_IDENTIFIER:
+            set_pointer(FIELD(offset, struct expr, identifier.sym),
+                        write_symbols(e->identifier.sym));
+            break;
+        case EXPR_UNARY:
+        case EXPR_PRE:
+        case EXPR_POST:
+            set_pointer(FIELD(offset, struct expr, unary.operand),
+                        write_exprs(e->unary.operand));
+            break;
+        case EXPR_BINARY:
+            set_pointer(FIELD(offset, struct expr, binary.left), write_exprs(e->binary.left));
+            set_pointer(FIELD(offset, struct expr, binary.right), write_exprs(e->binary.right));
+            break;
+        case EXPR_ASSIGNMENT:
+            set_pointer(FIELD(offset, struct expr, assignment.lvalue),
+                        write_exprs(e->assignment.lvalue));
+            set_pointer(FIELD(offset, struct expr, assignment.rvalue),
+                        write_exprs(e->assignment.rvalue));
+            break;
+        case EXPR_CONDITIONAL:
+            set_pointer(FIELD(offset, struct expr, conditional.condition),
+                        write_exprs(e->conditional.condition));
+            set_pointer(FIELD(offset, struct expr, conditional.then_expr),
+                        write_exprs(e->conditional.then_expr));
+            set_pointer(FIELD(offset, struct expr, conditional.else_expr),
+                        write_exprs(e->conditional.else_expr));
+            break;
+        case EXPR_CALL:
+            set_pointer(FIELD(offset, struct expr, call.callee), write_exprs(e->call.callee));
+            set_pointer(FIELD(offset, struct expr, call.args), write_exprs(e->call.args));
+            break;
+    }
+}
+
+static uint64_t write_exprs(struct expr *first)
+{
+    WRITE_LIST(struct expr, NODE_EXPR, first);
+}
+
+static void fill_decl(uint64_t offset, struct decl *d)
+{
+    put_token(FIELD(offset, struct decl, name));
+    put_type(FIELD(offset, struct decl, type), d->type);
+    set_pointer(FIELD(offset, struct decl, sym), write_symbols(d->sym));
+    put_string(FIELD(offset, struct decl, ir_name), d->ir_name);
+
+    if (d->kind == DECL_OBJECT) {
+        set_pointer(FIELD(offset, struct decl, object.init), write_exprs(d->object.init));
+    } else {
+        set_pointer(FIELD(offset, struct decl, func.params), write_decls(d->func.params));
+        set_pointer(FIELD(offset, struct decl, func.body), write_stmts(d->func.body));
+    }
+}
+
+static uint64_t write_decls(struct decl *first)
+{
+    WRITE_LIST(struct decl, NODE_DECL, first);
+}
+
+static void fill_symbol(uint64_t offset, struct symbol *sym)
+{
+    put_atom(FIELD(offset, struct symbol, name), sym->name);
+    put_type(FIELD(offset, struct symbol, ty), sym->ty);
+    set_pointer(FIELD(offset, struct symbol, decl), write_decls(sym->decl));
+    put_string(FIELD(offset, struct symbol, ir_name), sym->ir_name);
+}
+
+static uint64_t write_symbols(struct symbol *first)
+{
+    WRITE_LIST(struct symbol, NODE_SYMBOL, first);
+}
+
+static void fill_block_item(uint64_t offset, struct block_item *item)
+{
+    put_token(FIELD(offset, struct block_item, tok));
+
+    if (item->kind == BLOCK_ITEM_STMT)
+        set_pointer(FIELD(offset, struct block_item, stmt), write_stmts(item->stmt));
+    else
+        set_pointer(FIELD(offset, struct block_item, decls), write_decls(item->decls));
+}
+
+static uint64_t write_block_items(struct block_item *first)
+{
+    WRITE_LIST(struct block_item, NODE_BLOCK_ITEM, first);
+}
+
+static uint64_t write_for_init(struct for_init *init)
+{
+    if (!init)
+        return 0;
+
+    bool fresh;
+    uint64_t offset = place(init, sizeof(struct for_init), &fresh);
+    if (fresh)
+        defer_fill(NODE_FOR_INIT, init, offset);
+
+    return offset;
+}
+
+static void fill_for_init(uint64_t offset, struct for_init *init)
+{
+    if (init->is_decl)
+        set_pointer(FIELD(offset, struct for_init, decls), write_decls(init->decls));
+    else
+        set_pointer(FIELD(offset, struct for_init, expr), write_exprs(init->expr));
+}
+
+static void fill_case_entry(uint64_t offset, struct case_entry *entry)
+{
+    set_pointer(FIELD(offset, struct case_entry, node), write_stmts(entry->node));
+}
+
+static uint64_t write_case_entries(struct case_entry *first)
+{
+    WRITE_LIST(struct case_entry, NODE_CASE_ENTRY, first);
+}
+
+static uint64_t write_annotation(struct switch_annotation *ann)
+{
+    if (!ann)
+        return 0;
+
+    bool fresh;
+    uint64_t offset = place(ann, sizeof(struct switch_annotation), &fresh);
+    if (fresh)
+        defer_fill(NODE_ANNOTATION, ann, offset);
+
+    return offset;
+}
+
+static void fill_annotation(uint64_t offset, struct switch_annotation *ann)
+{
+    set_pointer(FIELD(offset, struct switch_annotation, cases), write_case_entries(ann->cases));
+    set_pointer(FIELD(offset, struct switch_annotation, default_node),
+                write_stmts(ann->default_node));
+}
+
+#define STMT_FIELD(offset, member) FIELD(offset, struct stmt, member)
+
+static void fill_stmt(uint64_t offset, struct stmt *s)
+{
+    put_token(STMT_FIELD(offset, tok));
+
+    switch (s->kind) {
+        case STMT_NULL:
+        case STMT_BREAK:
+        case STMT_CONTINUE:
+            break;
+        case STMT_EXPR:
+            set_pointer(STMT_FIELD(offset, expr_stmt.expr), write_exprs(s->expr_stmt.expr));
+            break;
+        case STMT_IF:
+            set_pointer(STMT_FIELD(offset, if_stmt.condition), write_exprs(s->if_stmt.condition));
+            set_pointer(STMT_FIELD(offset, if_stmt.then_stmt), write_stmts(s->if_stmt.then_stmt));
+            set_pointer(STMT_FIELD(offset, if_stmt.else_stmt), write_stmts(s->if_stmt.else_stmt));
+            break;
+        case STMT_GOTO:
+            put_token(STMT_FIELD(offset, goto_stmt.label));
+            break;
+        case STMT_LABEL:
+            put_token(STMT_FIELD(offset, label_stmt.name));
+            set_pointer(STMT_FIELD(offset, label_stmt.stmt), write_stmts(s->label_stmt.stmt));
+            break;
+        case STMT_FOR:
+            set_pointer(STMT_FIELD(offset, for_stmt.init), write_for_init(s->for_stmt.init));
+            set_pointer(STMT_FIELD(offset, for_stmt.condition), write_exprs(s->for_stmt.condition));
+            set_pointer(STMT_FIELD(offset, for_stmt.post), write_exprs(s->for_stmt.post));
+            set_pointer(STMT_FIELD(offset, for_stmt.body), write_stmts(s->for_stmt.body));
+            break;
+        case STMT_WHILE:
+            set_pointer(STMT_FIELD(offset, while_stmt.condition),
+                        write_exprs(s->while_stmt.condition));
+            set_pointer(STMT_FIELD(offset, while_stmt.body), write_stmts(s->while_stmt.body));
+            break;
+        case STMT_DOWHILE:
+            set_pointer(STMT_FIELD(offset, dowhile_stmt.body), write_stmts(s->dowhile_stmt.body));
+            set_pointer(STMT_FIELD(offset, dowhile_stmt.condition),
+                        write_exprs(s->dowhile_stmt.condition));
+            break;
+        case STMT_SWITCH:
+            set_pointer(STMT_FIELD(offset, switch_stmt.body), write_stmts(s->switch_stmt.body));
+            set_pointer(STMT_FIELD(offset, switch_stmt.condition),
+                        write_exprs(s->switch_stmt.condition));
+            set_pointer(STMT_FIELD(offset, switch_stmt.annotation),
+                        write_annotation(s->switch_stmt.annotation));
+            break;
+        case STMT_CASE:
+            set_pointer(STMT_FIELD(offset, case_stmt.value), write_exprs(s->case_stmt.value));
+            set_pointer(STMT_FIELD(offset, case_stmt.items), write_block_items(s->case_stmt.items));
+            break;
+        case STMT_DEFAULT:
+            set_pointer(STMT_FIELD(offset, default_stmt.items),
+                        write_block_items(s->default_stmt.items));
+            break;
+        case STMT_RETURN:
+            set_pointer(STMT_FIELD(offset, return_stmt.expr), write_exprs(s->return_stmt.expr));
+            break;
+        case STMT_BLOCK:
+            set_pointer(STMT_FIELD(offset, block.items), write_block_items(s->block.items));
+            break;
+    }
+}
+
+static uint64_t write_stmts(struct stmt *first)
+{
+    WRITE_LIST(struct stmt, NODE_STMT, first);
+}
+
+static void fill_pending(void)
+{
+    while (image.pending_count) {
+        struct pending p = image.pending[--image.pending_count];
+
+        switch (p.kind) {
+            case NODE_EXPR:         fill_expr(p.offset, p.node); break;
+            case NODE_DECL:         fill_decl(p.offset, p.node); break;
+            case NODE_SYMBOL:       fill_symbol(p.offset, p.node); break;
+            case NODE_BLOCK_ITEM:   fill_block_item(p.offset, p.node); break;
+            case NODE_STMT:         fill_stmt(p.offset, p.node); break;
+            case NODE_CASE_ENTRY:   fill_case_entry(p.offset, p.node); break;
+            case NODE_TYPE:         fill_type(p.offset, p.node); break;
+            case NODE_FOR_INIT:     fill_for_init(p.offset, p.node); break;
+            case NODE_ANNOTATION:   fill_annotation(p.offset, p.node); break;
+        }
+    }
+}
+
+static uint64_t write_program(struct ast_program *program)
+{
+    bool fresh;
+    uint64_t offset = place(program, sizeof(struct ast_program), &fresh);
+
+    set_pointer(FIELD(offset, struct ast_program, decls), write_decls(program->decls));
+    return offset;
+}
+
+static uint64_t write_dependencies(uint32_t *count)
+{
+    const char **paths;
+    int path_count = pp_dependencies(&paths);
+
+    uint64_t offset = image_alloc(path_count * sizeof(struct dependency));
+
+    for (int i = 0; i < path_count; i++) {
+        // Resolved, so a cache doesn't depend on the directory it was made from
+        char *path = realpath(paths[i], NULL);
+        struct stat st;
+        if (!path || stat(path, &st)) {
+            free(path);
+            return 0;
+        }
+
+        struct dependency dep = {
+            .path = place_string_copy(path),
+            .size = st.st_size,
+            .mtime_sec = st.st_mtim.tv_sec,
+            .mtime_nsec = st.st_mtim.tv_nsec,
+        };
+        memcpy(at(offset + i * sizeof(struct dependency)), &dep, sizeof(dep));
+        free(path);
+    }
+
+    *count = path_count;
+    return offset;
+}
+
+static void image_free(void)
+{
+    free(image.data);
+    free(image.fixups);
+    free(image.placed);
+    free(image.pending);
+    free(image.token_ids);
+    free(image.tokens);
+    memset(&image, 0, sizeof(image));
+}
+
+bool ast_cache_write(const char *path, struct ast_program *program)
+{
+    image.token_ids = malloc(current_tokens->count * sizeof(tok_id));
+    memset(image.token_ids, 0xff, current_tokens->count * sizeof(tok_id));
+
+    struct cache_header header = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .layout = layout_hash(),
+        .options = pp_options_hash(),
+    };
+
+    image_alloc(sizeof(header));
+
+    header.program = write_program(program);
+    header.symbols = write_symbols(all_symbols);
+    fill_pending();
+    header.dependencies = write_dependencies(&header.dependency_count);
+
+    // Names are written as tokens are met, the table goes after them
+    header.token_count = image.token_count;
+    header.tokens = image_alloc(image.token_count * sizeof(struct cached_token));
+    memcpy(at(header.tokens), image.tokens, image.token_count * sizeof(struct cached_token));
+
+    header.fixup_count = image.fixup_count;
+    header.fixups = image_alloc(image.fixup_count * sizeof(struct fixup));
+    memcpy(at(header.fixups), image.fixups, image.fixup_count * sizeof(struct fixup));
+
+    memcpy(at(0), &header, sizeof(header));
+
+    bool ok = header.dependencies != 0 && image.size <= UINT32_MAX;
+
+    // Written aside and renamed, a reader never sees half a cache
+    size_t tmp_size = strlen(path) + 5;
+    char *tmp = malloc(tmp_size);
+    snprintf(tmp, tmp_size, "%s.tmp", path);
+
+    FILE *file = ok ? fopen(tmp, "wb") : NULL;
+    if (file) {
+        ok = fwrite(image.data, 1, image.size, file) == image.size;
+        ok &= fclose(file) == 0;
+        ok = ok && rename(tmp, path) == 0;
+        if (!ok)
+            remove(tmp);
+    } else {
+        ok = false;
+    }
+
+    free(tmp);
+    image_free();
+    return ok;
+}
+
+/* Reading */
+
+static bool in_image(uint64_t offset, uint64_t length, size_t size)
+{
+    return offset <= size && length <= size - offset;
+}
+
+static bool is_string(const char *base, uint64_t offset, size_t size)
+{
+    return offset < size && memchr(base + offset, '\0', size - offset);
+}
+
+// The first dependency is the unit's own source, which is 'source'
+static bool dependencies_unchanged(const char *base, size_t size,
+                                   const struct cache_header *header, const char *source)
+{
+    const struct dependency *deps = (const void *)(base + header->dependencies);
+
+    char *path = realpath(source, NULL);
+    bool same_source = path && header->dependency_count &&
+                       is_string(base, deps[0].path, size) && !strcmp(path, base + deps[0].path);
+    free(path);
+
+    if (!same_source)
+        return false;
+
+    for (uint32_t i = 0; i < header->dependency_count; i++) {
+        if (!is_string(base, deps[i].path, size))
+            return false;
+
+        struct stat st;
+        if (stat(base + deps[i].path, &st))
+            return false;
+
+        if (st.st_size != deps[i].size || st.st_mtim.tv_sec != deps[i].mtime_sec ||
+            st.st_mtim.tv_nsec != deps[i].mtime_nsec)
+            return false;
+    }
+
+    return true;
+}
+
+// Checks everything before fixing anything up, a bad file is left alone
+static bool cache_valid(const char *base, size_t size, const char *source)
+{
+    const struct cache_header *header = (const void *)base;
+
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) ||
+        header->version != CACHE_VERSION || header->layout != layout_hash() ||
+        header->options != pp_options_hash())
+        return false;
+
+    if (!in_image(header->program, sizeof(struct ast_program), size) ||
+        !in_image(header->tokens, header->token_count * sizeof(struct cached_token), size) ||
+        !in_image(header->dependencies,
+                  header->dependency_count * sizeof(struct dependency), size) ||
+        !in_image(header->fixups, header->fixup_count * sizeof(struct fixup), size))
+        return false;
+
+    if (!dependencies_unchanged(base, size, header, source))
+        return false;
+
+    const struct fixup *fixups = (const void *)(base + header->fixups);
+
+    for (uint32_t i = 0; i < header->fixup_count; i++) {
+        uint64_t field = fixups[i].offset;
+
+        switch (fixups[i].kind) {
+            case FIXUP_POINTER: {
+                uintptr_t value;
+                if (!in_image(field, sizeof(value), size))
+                    return false;
+                memcpy(&value, base + field, sizeof(value));
+                if (value >= size)
+                    return false;
+                break;
+            }
+            case FIXUP_ATOM: {
+                uint32_t name;
+                if (!in_image(field, sizeof(name), size))
+                    return false;
+                memcpy(&name, base + field, sizeof(name));
+                if (!is_string(base, name, size))
+                    return false;
+                break;
+            }
+            case FIXUP_TYPE_INT:
+            case FIXUP_TYPE_VOID:
+                if (!in_image(field, sizeof(struct type *), size))
+                    return false;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    const struct cached_token *tokens = (const void *)(base + header->tokens);
+    for (uint32_t i = 0; i < header->token_count; i++)
+        if (tokens[i].name && !is_string(base, tokens[i].name, size))
+            return false;
+
+    return true;
+}
+
+static void apply_fixups(char *base, const struct cache_header *header)
+{
+    const struct fixup *fixups = (const void *)(base + header->fixups);
+
+    for (uint32_t i = 0; i < header->fixup_count; i++) {
+        char *field = base + fixups[i].offset;
+
+        switch (fixups[i].kind) {
+            case FIXUP_POINTER: {
+                uintptr_t value;
+                memcpy(&value, field, sizeof(value));
+                value = (uintptr_t)(base + value);
+                memcpy(field, &value, sizeof(value));
+                break;
+            }
+            case FIXUP_ATOM: {
+                uint32_t name;
+                memcpy(&name, field, sizeof(name));
+                atom a = intern(base + name, strlen(base + name));
+                memcpy(field, &a, sizeof(a));
+                break;
+            }
+            case FIXUP_TYPE_INT:
+            case FIXUP_TYPE_VOID: {
+                struct type *ty = fixups[i].kind == FIXUP_TYPE_INT ? type_int() : type_void();
+                memcpy(field, &ty, sizeof(ty));
+                break;
+            }
+        }
+    }
+}
+
+// Stands in for the text, the cached tokens have none
+static struct source_file cached_source = { "<ast cache>", "" };
+
+static struct token_stream *read_tokens(const char *base, const struct cache_header *header)
+{
+    const struct cached_token *tokens = (const void *)(base + header->tokens);
+    uint32_t count = header->token_count;
+
+    struct token_stream *stream = calloc(1, sizeof(struct token_stream));
+    stream->count = count;
+    stream->types = malloc(count + 1);
+    stream->offsets = calloc(count + 1, sizeof(*stream->offsets));
+    stream->lengths = calloc(count + 1, sizeof(*stream->lengths));
+    stream->atoms = malloc((count + 1) * sizeof(*stream->atoms));
+    stream->files = calloc(count + 1, sizeof(*stream->files));
+    stream->sources = malloc(sizeof(*stream->sources));
+    stream->sources[0] = &cached_source;
+    stream->source_count = 1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const char *name = tokens[i].name ? base + tokens[i].name : NULL;
+
+        stream->types[i] = tokens[i].type;
+        stream->atoms[i] = name ? intern(name, strlen(name)) : NO_ATOM;
+    }
+
+    return stream;
+}
+
+struct ast_program *ast_cache_read(const char *path, const char *source)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+
+    // Private, the fixups write to pages of our own
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (!cache_valid(base, size, source)) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    const struct cache_header *header = (const void *)base;
+
+    apply_fixups(base, header);
+
+    current_tokens = read_tokens(base, header);
+    all_symbols = header->symbols ? (struct symbol *)(base + header->symbols) : NULL;
+
+    // The AST stays mapped for the rest of the run, like allocated ones stay
+    return (struct ast_program *)(base + header->program);
+}
@@ -0,0 +1,30 @@
+/*
+ * Cache of the front end's result: the AST of a unit as sema left it.
+ *
+ * The file is an image of the AST structs themselves, with pointers
+ * stored as offsets in the file. Reading maps it privately and turns
+ * the offsets back into pointers in place, nothing is parsed and no
+ * node is allocated. A cache is only used by the build of the compiler
+ * that wrote it, with the same preprocessor options, while every file
+ * the unit was preprocessed from is unchanged.
+ */
+
+#ifndef CINC_AST_CACHE_H
+#define CINC_AST_CACHE_H
+
+#include <stdbool.h>
+
+#include "ast.h"
+
+// Right after sema, with the unit's tokens current. False if it couldn't be written.
+bool ast_cache_write(const char *path, struct ast_program *program);
+
+/*
+ * The cache of 'source' at 'path', NULL if it is missing, stale or of
+ * another source. Otherwise current_tokens has what the AST refers to
+ * (types and identifiers, not the text), and sema's all_symbols is set
+ * as after sema_analysis.
+ */
+struct ast_program *ast_cache_read(const char *path, const char *source);
+
+#endif
@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "atom_map.h"
+
+#define AM_INITIAL_CAP 8   // Power of two
+
+// Fibonacci hashing, atoms are dense small integers
+static size_t slot_of(atom key, size_t capacity)
+{
+    return (uint32_t)(key * 2654435761u) & (capacity - 1);
+}
+
+static am_entry *find_entry(am_entry *entries, size_t capacity, atom key)
+{
+    for (size_t idx = slot_of(key, capacity);; idx = (idx + 1) & (capacity - 1)) {
+        am_entry *entry = &entries[idx];
+        if (entry->key == key || entry->key == NO_ATOM)
+            return entry;
+    }
+}
+
+static void grow_capacity(atom_map *am, size_t capacity)
+{
+    am_entry *entries = calloc(capacity, sizeof(am_entry));
+
+    for (size_t i = 0; i < am->capacity; i++) {
+        am_entry *entry = &am->entries[i];
+        if (entry->key == NO_ATOM)
+            continue;
+
+        *find_entry(entries, capacity, entry->key) = *entry;
+    }
+
+    free(am->entries);
+    am->entries = entries;
+    am->capacity = capacity;
+}
+
+void atommap_init(atom_map *am)
+{
+    am->count = 0;
+    am->capacity = AM_INITIAL_CAP;
+    am->entries = calloc(am->capacity, sizeof(am_entry));
+}
+
+void atommap_free(atom_map *am)
+{
+    free(am->entries);
+    am->entries = NULL;
+    am->capacity = 0;
+    am->count = 0;
+}
+
+bool atommap_set(atom_map *am, atom key, void *value)
+{
+    if (am->count * 4 >= am->capacity * 3)
+        grow_capacity(am, am->capacity * 2);
+
+    am_entry *entry = find_entry(am->entries, am->capacity, key);
+    bool is_new = entry->key == NO_ATOM;
+    if (is_new)
+        am->count++;
+
+    entry->key = key;
+    entry->value = value;
+
+    return is_new;
+}
+
+void *atommap_get(atom_map *am, atom key)
+{
+    am_entry *entry = find_entry(am->entries, am->capacity, key);
+    return entry->key != NO_ATOM ? entry->value : NULL;
+}
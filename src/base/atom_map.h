@@ -0,0 +1,27 @@
+#ifndef CINC_ATOM_MAP_H
+#define CINC_ATOM_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "intern.h"
+
+// Like hash_map, keyed by atom: nothing is hashed or compared but the integer
+
+typedef struct {
+    atom key;
+    void *value;
+} am_entry;
+
+typedef struct {
+    am_entry *entries;
+    size_t count;
+    size_t capacity;
+} atom_map;
+
+void atommap_init(atom_map *am);
+void atommap_free(atom_map *am);
+bool atommap_set(atom_map *am, atom key, void *value);
+void *atommap_get(atom_map *am, atom key);
+
+#endif
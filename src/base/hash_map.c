@@ -5,7 +5,12 @@
 #include "hash_map.h"
 
 #define HM_INITIAL_CAP 16
-#define HM_LOAD_FACTOR 0.75
+
+// At most 3/4 full
+static size_t max_count(size_t capacity)
+{
+    return capacity - capacity / 4;
+}
 
 static uint32_t fnv1a_hash(const char *key, int len)
 {
@@ -17,31 +22,68 @@ static uint32_t fnv1a_hash(const char *key, int len)
     return hash;
 }
 
-static hm_entry *find_entry(hm_entry *entries, size_t capacity,
-                            const char *key, int key_len)
+// How far the entry at 'idx' is from where its hash puts it
+static size_t probe_distance(const hm_entry *entry, size_t idx, size_t mask)
 {
-    uint32_t idx = fnv1a_hash(key, key_len) % capacity;
-    for(;;) {
-        hm_entry *entry = &entries[idx];
+    return (idx - (entry->hash & mask)) & mask;
+}
+
+/*
+ * Entries are ordered by probe distance along a run, so the search
+ * for a missing key stops at the first entry closer to its home slot.
+ */
+static hm_entry *find_entry(const hash_map *hm, const char *key, int key_len,
+                            uint32_t hash)
+{
+    size_t mask = hm->capacity - 1;
+
+    for (size_t idx = hash & mask, dist = 0;; idx = (idx + 1) & mask, dist++) {
+        hm_entry *entry = &hm->entries[idx];
+
         if (!entry->key)
-            return entry; // Empty entry
-        if (entry->key_len == key_len && (memcmp(entry->key, key, key_len)) == 0)
+            return NULL;
+
+        if (entry->hash == hash && entry->key_len == key_len &&
+            memcmp(entry->key, key, key_len) == 0)
             return entry;
-        idx = (idx + 1) % capacity;
+
+        if (probe_distance(entry, idx, mask) < dist)
+            return NULL;
     }
 }
 
+// 'entry' is known not to be in the map
+static void insert_entry(hm_entry *entries, size_t capacity, hm_entry entry)
+{
+    size_t mask = capacity - 1;
+
+    for (size_t idx = entry.hash & mask, dist = 0;; idx = (idx + 1) & mask, dist++) {
+        hm_entry *slot = &entries[idx];
+
+        if (!slot->key) {
+            *slot = entry;
+            return;
+        }
+
+        // Take the slot from an entry closer to home, carry that one on
+        size_t slot_dist = probe_distance(slot, idx, mask);
+        if (slot_dist < dist) {
+            hm_entry displaced = *slot;
+            *slot = entry;
+            entry = displaced;
+            dist = slot_dist;
+        }
+    }
+}
+
+// Moves entries over, with their stored hashes
 static void grow_capacity(hash_map *hm, size_t capacity)
 {
     hm_entry *entries = calloc(capacity, sizeof(hm_entry));
 
     for (size_t i = 0; i < hm->capacity; i++) {
-        hm_entry *entry = &hm->entries[i];
-        if (entry->key == NULL)
-            continue;
-
-        hm_entry *dest = find_entry(entries, capacity, entry->key, entry->key_len);
-        *dest = *entry;
+        if (hm->entries[i].key)
+            insert_entry(entries, capacity, hm->entries[i]);
     }
 
     free(hm->entries);
@@ -64,24 +106,73 @@ void hashmap_free(hash_map *hm)
     hm->count = 0;
 }
 
+void hashmap_reserve(hash_map *hm, size_t count)
+{
+    size_t capacity = hm->capacity;
+    while (max_count(capacity) < count)
+        capacity *= 2;
+
+    if (capacity != hm->capacity)
+        grow_capacity(hm, capacity);
+}
+
 bool hashmap_set(hash_map *hm, const char *key, int key_len, void *value)
 {
-    if (hm->count >= (size_t)(hm->capacity * HM_LOAD_FACTOR))
-        grow_capacity(hm, hm->capacity * 2);
+    uint32_t hash = fnv1a_hash(key, key_len);
 
-    hm_entry *entry = find_entry(hm->entries, hm->capacity, key, key_len);
-    bool is_new = entry->key == NULL;
-    if (is_new) hm->count++;
+    hm_entry *entry = find_entry(hm, key, key_len, hash);
+    if (entry) {
+        entry->key = key;
+        entry->value = value;
+        return false;
+    }
+
+    if (hm->count + 1 > max_count(hm->capacity))
+        grow_capacity(hm, hm->capacity * 2);
 
-    entry->key = key;
-    entry->key_len = key_len;
-    entry->value = value;
+    insert_entry(hm->entries, hm->capacity, (hm_entry) {
+        .key = key,
+        .key_len = key_len,
+        .hash = hash,
+        .value = value,
+    });
+    hm->count++;
 
-    return is_new;
+    return true;
 }
 
 void *hashmap_get(hash_map *hm, const char *key, int key_len)
 {
-    hm_entry *entry = find_entry(hm->entries, hm->capacity, key, key_len);
-    return entry->key ? entry->value : NULL;
+    hm_entry *entry = find_entry(hm, key, key_len, fnv1a_hash(key, key_len));
+    return entry ? entry->value : NULL;
+}
+
+/*
+ * The entries after it shift back one slot, up to an empty slot or an
+ * entry in its home slot, so no tombstones are left.
+ */
+bool hashmap_remove(hash_map *hm, const char *key, int key_len)
+{
+    hm_entry *entry = find_entry(hm, key, key_len, fnv1a_hash(key, key_len));
+    if (!entry)
+        return false;
+
+    size_t mask = hm->capacity - 1;
+    size_t idx = entry - hm->entries;
+
+    for (;;) {
+        size_t next = (idx + 1) & mask;
+        hm_entry *moved = &hm->entries[next];
+
+        if (!moved->key || probe_distance(moved, next, mask) == 0)
+            break;
+
+        hm->entries[idx] = *moved;
+        idx = next;
+    }
+
+    hm->entries[idx] = (hm_entry){0};
+    hm->count--;
+
+    return true;
 }
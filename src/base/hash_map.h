@@ -3,17 +3,25 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+/*
+ * String keyed, open addressing with Robin Hood probing. Keys aren't
+ * copied. Empty entries have a NULL key and value, so callers may walk
+ * 'entries' up to 'capacity'.
+ */
 
 typedef struct {
     const char *key;
     int key_len;
+    uint32_t hash;
     void *value;
 } hm_entry;
 
 typedef struct {
     hm_entry *entries;
     size_t count;
-    size_t capacity;
+    size_t capacity;    // Power of two
 } hash_map;
 
 void hashmap_init(hash_map *hm);
@@ -21,4 +29,10 @@ void hashmap_free(hash_map *hm);
 bool hashmap_set(hash_map *hm, const char *key, int key_len, void *value);
 void *hashmap_get(hash_map *hm, const char *key, int key_len);
 
+// Removes 'key', false if it wasn't there
+bool hashmap_remove(hash_map *hm, const char *key, int key_len);
+
+// Makes room for 'count' entries in total without growing again
+void hashmap_reserve(hash_map *hm, size_t count);
+
 #endif
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+
+#define INTERN_INITIAL_CAP 256
+#define ARENA_CHUNK 4096
+
+struct atom_entry {
+    const char *name;
+    int length;
+    uint32_t hash;
+};
+
+static struct atom_entry *atoms;    // Indexed by atom
+static uint32_t atom_count = 1;
+static uint32_t atom_capacity;
+
+static atom *slots;                 // Open addressing, NO_ATOM when empty
+static uint32_t slot_capacity;      // Power of two
+
+static char *arena;                 // Names, copied out of the sources
+static size_t arena_left;
+
+static uint32_t fnv1a_hash(const char *key, int len)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static const char *copy_name(const char *name, int length)
+{
+    if ((size_t)length + 1 > arena_left) {
+        size_t size = length + 1 > ARENA_CHUNK ? (size_t)length + 1 : ARENA_CHUNK;
+        arena = malloc(size);
+        arena_left = size;
+    }
+
+    char *copy = arena;
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+
+    arena += length + 1;
+    arena_left -= length + 1;
+    return copy;
+}
+
+static atom *find_slot(atom *table, uint32_t capacity, const char *name,
+                       int length, uint32_t hash)
+{
+    uint32_t mask = capacity - 1;
+
+    for (uint32_t idx = hash & mask;; idx = (idx + 1) & mask) {
+        atom a = table[idx];
+        if (a == NO_ATOM)
+            return &table[idx];
+
+        struct atom_entry *e = &atoms[a];
+        if (e->hash == hash && e->length == length && !memcmp(e->name, name, length))
+            return &table[idx];
+    }
+}
+
+// Rehashes from the stored hashes, names aren't read again
+static void grow_slots(void)
+{
+    uint32_t capacity = slot_capacity ? slot_capacity * 2 : INTERN_INITIAL_CAP;
+    atom *table = calloc(capacity, sizeof(atom));
+
+    for (uint32_t i = 0; i < slot_capacity; i++) {
+        atom a = slots[i];
+        if (a == NO_ATOM)
+            continue;
+
+        uint32_t mask = capacity - 1;
+        uint32_t idx = atoms[a].hash & mask;
+        while (table[idx] != NO_ATOM)
+            idx = (idx + 1) & mask;
+        table[idx] = a;
+    }
+
+    free(slots);
+    slots = table;
+    slot_capacity = capacity;
+}
+
+atom intern(const char *name, int length)
+{
+    // Load factor at most 1/2
+    if (atom_count * 2 >= slot_capacity)
+        grow_slots();
+
+    uint32_t hash = fnv1a_hash(name, length);
+    atom *slot = find_slot(slots, slot_capacity, name, length, hash);
+    if (*slot != NO_ATOM)
+        return *slot;
+
+    if (atom_count >= atom_capacity) {
+        atom_capacity = atom_capacity ? atom_capacity * 2 : INTERN_INITIAL_CAP;
+        atoms = realloc(atoms, atom_capacity * sizeof(struct atom_entry));
+    }
+
+    atom a = atom_count++;
+    atoms[a] = (struct atom_entry) {
+        .name = copy_name(name, length),
+        .length = length,
+        .hash = hash,
+    };
+
+    *slot = a;
+    return a;
+}
+
+const char *atom_name(atom a)
+{
+    return atoms[a].name;
+}
+
+int atom_length(atom a)
+{
+    return atoms[a].length;
+}
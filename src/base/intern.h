@@ -0,0 +1,19 @@
+#ifndef CINC_INTERN_H
+#define CINC_INTERN_H
+
+#include <stdint.h>
+
+/*
+ * Identifiers are interned while lexing, equal names get the same atom.
+ * Atoms are shared by every file of one invocation and never freed.
+ */
+typedef uint32_t atom;
+
+#define NO_ATOM 0   // Atoms start from 1
+
+atom intern(const char *name, int length);
+
+const char *atom_name(atom a);  // NUL terminated
+int atom_length(atom a);
+
+#endif
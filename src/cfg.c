@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "cfg.h"
+#include "ir.h"
+
+bool ir_is_terminator(struct ir_instr *instr)
+{
+    return instr->kind == IR_INSTR_JUMP || instr->kind == IR_INSTR_RETURN;
+}
+
+bool ir_is_branch(struct ir_instr *instr)
+{
+    return instr->kind == IR_INSTR_JUMP ||
+           instr->kind == IR_INSTR_JUMP_IF_ZERO ||
+           instr->kind == IR_INSTR_JUMP_IF_NOT_ZERO;
+}
+
+int *ir_branch_target(struct ir_instr *instr)
+{
+    switch (instr->kind) {
+        case IR_INSTR_JUMP:             return &instr->jump.label_id;
+        case IR_INSTR_JUMP_IF_ZERO:     return &instr->jump_if_zero.label_id;
+        case IR_INSTR_JUMP_IF_NOT_ZERO: return &instr->jump_if_not_zero.label_id;
+        default:                        return NULL;
+    }
+}
+
+void ir_for_each_value(struct ir_instr *instr,
+                       void (*fn)(struct ir_value *value, void *ctx), void *ctx)
+{
+    switch (instr->kind) {
+        case IR_INSTR_RETURN:
+            if (instr->ret.has_value)
+                fn(&instr->ret.src, ctx);
+            break;
+        case IR_INSTR_UNARY:
+            fn(&instr->unary.src, ctx);
+            fn(&instr->unary.dst, ctx);
+            break;
+        case IR_INSTR_BINARY:
+            fn(&instr->binary.lhs, ctx);
+            fn(&instr->binary.rhs, ctx);
+            fn(&instr->binary.dst, ctx);
+            break;
+        case IR_INSTR_COPY:
+            fn(&instr->copy.src, ctx);
+            fn(&instr->copy.dst, ctx);
+            break;
+        case IR_INSTR_CALL:
+            for (int i = 0; i < instr->call.arg_count; i++)
+                fn(&instr->call.args[i], ctx);
+            if (instr->call.has_dst)
+                fn(&instr->call.dst, ctx);
+            break;
+        case IR_INSTR_JUMP_IF_ZERO:
+            fn(&instr->jump_if_zero.cond, ctx);
+            break;
+        case IR_INSTR_JUMP_IF_NOT_ZERO:
+            fn(&instr->jump_if_not_zero.cond, ctx);
+            break;
+        case IR_INSTR_COUNT:
+            fn(&instr->count.counter, ctx);
+            break;
+        case IR_INSTR_JUMP:
+        case IR_INSTR_LABEL:
+            break;
+    }
+}
+
+/*
+ * Program-wide pseudo -> the function's number, kept between calls
+ * and cleared through 'originals' so a function costs its own size.
+ */
+static int *dense;
+static int dense_capacity;
+static int *originals;
+static int originals_capacity;
+
+static void number_pseudo(struct ir_value *value, void *ctx)
+{
+    int *count = ctx;
+
+    if (value->kind != IR_VALUE_PSEUDO)
+        return;
+
+    int pseudo = value->pseudo;
+
+    if (pseudo >= dense_capacity) {
+        int capacity = dense_capacity ? dense_capacity : 1024;
+        while (capacity <= pseudo)
+            capacity *= 2;
+
+        dense = realloc(dense, capacity * sizeof(int));
+        for (int i = dense_capacity; i < capacity; i++)
+            dense[i] = 0;
+        dense_capacity = capacity;
+    }
+
+    if (!dense[pseudo]) {
+        if (*count + 1 >= originals_capacity) {
+            originals_capacity = originals_capacity ? originals_capacity * 2 : 256;
+            originals = realloc(originals, originals_capacity * sizeof(int));
+        }
+
+        dense[pseudo] = ++*count;
+        originals[*count] = pseudo;
+    }
+
+    value->pseudo = dense[pseudo];
+}
+
+void ir_number_pseudos(struct ir_function *fn)
+{
+    int count = 0;
+
+    for (struct ir_param *p = fn->params; p; p = p->next) {
+        struct ir_value value = { .kind = IR_VALUE_PSEUDO, .pseudo = p->pseudo };
+        number_pseudo(&value, &count);
+        p->pseudo = value.pseudo;
+    }
+
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next)
+        ir_for_each_value(instr, number_pseudo, &count);
+
+    for (int i = 1; i <= count; i++)
+        dense[originals[i]] = 0;
+
+    fn->pseudo_count = count;
+}
+
+struct ir_instr *ir_make_label(int label_id)
+{
+    struct ir_instr *label = calloc(1, sizeof(struct ir_instr));
+    label->kind = IR_INSTR_LABEL;
+    label->label.label_id = label_id;
+    return label;
+}
+
+struct ir_instr *ir_make_jump(int label_id)
+{
+    struct ir_instr *jump = calloc(1, sizeof(struct ir_instr));
+    jump->kind = IR_INSTR_JUMP;
+    jump->jump.label_id = label_id;
+    return jump;
+}
+
+static int max_label_id(struct ir_function *fn)
+{
+    int max = 0;
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+        if (instr->kind == IR_INSTR_LABEL && instr->label.label_id > max)
+            max = instr->label.label_id;
+
+        int *target = ir_branch_target(instr);
+        if (target && *target > max)
+            max = *target;
+    }
+
+    return max;
+}
+
+/*
+ * A block starts at a label that follows a non-label, and after
+ * every branch or return.
+ */
+static void split_blocks(struct ir_cfg *cfg, struct ir_function *fn)
+{
+    int cap = 16;
+    cfg->blocks = malloc(cap * sizeof(struct ir_block));
+    cfg->count = 0;
+
+    struct ir_instr *instr = fn->first;
+    while (instr) {
+        if (cfg->count == cap) {
+            cap *= 2;
+            cfg->blocks = realloc(cfg->blocks, cap * sizeof(struct ir_block));
+        }
+
+        struct ir_block *b = &cfg->blocks[cfg->count++];
+        *b = (struct ir_block) { .layout_pred = -1 };
+
+        if (instr->kind == IR_INSTR_LABEL) {
+            b->label = instr->label.label_id;
+            b->first = instr;
+        } else {
+            b->label = ir_new_label();
+            b->first = ir_make_label(b->label);
+            b->first->next = instr;
+        }
+
+        struct ir_instr *last = b->first;
+        while (last->next && last->next->kind == IR_INSTR_LABEL)
+            last = last->next;
+
+        while (last->next && last->next->kind != IR_INSTR_LABEL &&
+               !ir_is_branch(last) && !ir_is_terminator(last))
+            last = last->next;
+
+        b->last = last;
+        instr = last->next;
+        last->next = NULL;
+    }
+}
+
+static void append_to_block(struct ir_block *b, struct ir_instr *instr)
+{
+    b->last->next = instr;
+    b->last = instr;
+}
+
+void cfg_build(struct ir_cfg *cfg, struct ir_function *fn)
+{
+    int max_label = max_label_id(fn);
+
+    split_blocks(cfg, fn);
+
+    for (int i = 0; i + 1 < cfg->count; i++) {
+        if (ir_is_terminator(cfg->blocks[i].last))
+            continue;
+
+        cfg->blocks[i + 1].layout_pred = i;
+        append_to_block(&cfg->blocks[i], ir_make_jump(cfg->blocks[i + 1].label));
+    }
+
+    // Labels split_blocks added
+    for (int i = 0; i < cfg->count; i++)
+        if (cfg->blocks[i].label > max_label)
+            max_label = cfg->blocks[i].label;
+
+    cfg->max_label = max_label;
+    cfg->block_of = malloc((max_label + 1) * sizeof(int));
+
+    for (int i = 0; i < cfg->count; i++)
+        for (struct ir_instr *instr = cfg->blocks[i].first;
+             instr && instr->kind == IR_INSTR_LABEL; instr = instr->next)
+            cfg->block_of[instr->label.label_id] = i;
+}
+
+void cfg_relink(struct ir_cfg *cfg, struct ir_function *fn, const int *order, int count)
+{
+    struct ir_instr *head = NULL;
+    struct ir_instr *tail = NULL;
+
+    for (int i = 0; i < count; i++) {
+        struct ir_block *b = &cfg->blocks[order[i]];
+
+        if (!head)
+            head = b->first;
+        else
+            tail->next = b->first;
+        tail = b->last;
+    }
+
+    fn->first = head;
+    fn->last = tail;
+}
+
+void cfg_free(struct ir_cfg *cfg)
+{
+    free(cfg->blocks);
+    free(cfg->block_of);
+}
+
+void cfg_block_exits(struct ir_block *b, struct ir_instr **cond, struct ir_instr **jump)
+{
+    *cond = NULL;
+    *jump = NULL;
+
+    if (b->last->kind != IR_INSTR_JUMP)
+        return;
+
+    *jump = b->last;
+
+    for (struct ir_instr *instr = b->first; instr != b->last; instr = instr->next)
+        if (instr->next == b->last && ir_is_branch(instr))
+            *cond = instr;
+}
@@ -0,0 +1,67 @@
+/*
+ * Basic blocks of an IR function.
+ * Shared by the passes that reorder or instrument control flow.
+ */
+
+#ifndef CINC_CFG_H
+#define CINC_CFG_H
+
+#include "ir.h"
+
+struct ir_block {
+    struct ir_instr *first;     // Always a label
+    struct ir_instr *last;      // Jump or return, except maybe in the last block
+    int label;                  // Leading label
+    int layout_pred;            // Block that fell through into this one, or -1
+
+    bool reachable;
+    bool placed;
+};
+
+/*
+ * The blocks of a function in source order. While it exists the
+ * function's instruction list is split up between the blocks.
+ */
+struct ir_cfg {
+    struct ir_block *blocks;
+    int count;
+
+    int *block_of;      // Label id -> block index
+    int max_label;
+};
+
+bool ir_is_branch(struct ir_instr *instr);
+bool ir_is_terminator(struct ir_instr *instr);
+
+// Label a branch jumps to, NULL if 'instr' isn't a branch
+int *ir_branch_target(struct ir_instr *instr);
+
+// Calls 'fn' on every value 'instr' reads or writes
+void ir_for_each_value(struct ir_instr *instr,
+                       void (*fn)(struct ir_value *value, void *ctx), void *ctx);
+
+/*
+ * Renumbers the pseudos of 'fn' from 1 to fn->pseudo_count, for the
+ * backend to index arrays with. Runs after every pass that makes pseudos.
+ */
+void ir_number_pseudos(struct ir_function *fn);
+
+struct ir_instr *ir_make_label(int label_id);
+struct ir_instr *ir_make_jump(int label_id);
+
+/*
+ * Splits 'fn' into blocks. Every block gets a leading label and
+ * every fall-through becomes an explicit jump, so blocks can be
+ * put back in any order.
+ */
+void cfg_build(struct ir_cfg *cfg, struct ir_function *fn);
+
+// Links blocks back into 'fn' in 'order' (block indices, 'count' of them)
+void cfg_relink(struct ir_cfg *cfg, struct ir_function *fn, const int *order, int count);
+
+void cfg_free(struct ir_cfg *cfg);
+
+// Conditional branch and jump ending 'b', either may be NULL
+void cfg_block_exits(struct ir_block *b, struct ir_instr **cond, struct ir_instr **jump);
+
+#endif
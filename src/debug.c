@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "ast.h"
+#include "sema.h"
 #include "type.h"
 #include "lexer.h"
 
@@ -101,21 +103,6 @@ static void print_expr_ann(struct expr *expr)
         printf(" :lvalue true");
 }
 
-static void print_named_expr(const char *name, struct expr *expr, int depth)
-{
-    indent(depth);
-
-    if (!expr) {
-        printf("(%s nil)\n", name);
-        return;
-    }
-
-    printf("(%s\n", name);
-    print_expr(expr, depth + 1);
-    indent(depth);
-    printf(")\n");
-}
-
 static void print_named_stmt(const char *name, struct stmt *stmt, int depth)
 {
     indent(depth);
@@ -131,25 +118,6 @@ static void print_named_stmt(const char *name, struct stmt *stmt, int depth)
     printf(")\n");
 }
 
-static void print_expr_list(const char *name, struct expr *exprs, int depth)
-{
-    indent(depth);
-    printf("(%s", name);
-
-    if (!exprs) {
-        printf(")\n");
-        return;
-    }
-
-    printf("\n");
-
-    for (struct expr *e = exprs; e; e = e->next)
-        print_expr(e, depth + 1);
-
-    indent(depth);
-    printf(")\n");
-}
-
 static void print_block_items(struct block_item *items, int depth)
 {
     indent(depth);
@@ -169,9 +137,7 @@ static void print_block_items(struct block_item *items, int depth)
     printf(")\n");
 }
 
-static void print_loop_labels(const char *break_label,
-                              const char *continue_label,
-                              int depth)
+static void print_loop_labels(int break_label, int continue_label, int depth)
 {
     if (!break_label && !continue_label)
         return;
@@ -180,15 +146,63 @@ static void print_loop_labels(const char *break_label,
     printf("(labels");
 
     if (break_label)
-        printf(" (break %s)", break_label);
+        printf(" (break L%d)", break_label);
 
     if (continue_label)
-        printf(" (continue %s)", continue_label);
+        printf(" (continue L%d)", continue_label);
 
     printf(")\n");
 }
 
-static void print_expr(struct expr *expr, int depth)
+/*
+ * Expressions print from an explicit stack of tasks, trees as deep as
+ * generated code makes them don't fit the C stack. A task prints one
+ * line, and pushes what prints after it in reverse order.
+ */
+enum print_task_kind {
+    PRINT_EXPR,
+    PRINT_NAMED,    // (name expr)
+    PRINT_LIST,     // (name exprs...)
+    PRINT_ARGS,     // 'expr' and the ones after it
+    PRINT_CLOSE,    // )
+};
+
+struct print_task {
+    enum print_task_kind kind;
+    struct expr *expr;
+    const char *name;
+    int depth;
+};
+
+static struct print_task *print_tasks;
+static int print_task_count;
+static int print_task_capacity;
+
+static void push_print_task(enum print_task_kind kind, struct expr *expr,
+                            const char *name, int depth)
+{
+    if (print_task_count == print_task_capacity) {
+        print_task_capacity = print_task_capacity ? print_task_capacity * 2 : 64;
+        print_tasks = realloc(print_tasks, print_task_capacity * sizeof(struct print_task));
+    }
+
+    print_tasks[print_task_count++] = (struct print_task) { kind, expr, name, depth };
+}
+
+// "(<kind> <op>" and the annotations, then its operands close it
+static void print_expr_open(const char *kind, struct expr *expr, bool op, int depth)
+{
+    indent(depth);
+    printf("(%s", kind);
+    if (op)
+        printf(" %s", token_to_cstr(expr->tok));
+    print_expr_ann(expr);
+    printf("\n");
+
+    push_print_task(PRINT_CLOSE, NULL, NULL, depth);
+}
+
+static void print_expr_task(struct expr *expr, int depth)
 {
     if (!expr) {
         indent(depth);
@@ -206,88 +220,111 @@ static void print_expr(struct expr *expr, int depth)
 
         case EXPR_IDENTIFIER:
             indent(depth);
-            printf("(ident %s", token_to_cstr(expr->identifier.name));
+            printf("(ident %s", token_to_cstr(expr->tok));
             print_expr_ann(expr);
             printf(")\n");
             break;
 
         case EXPR_UNARY:
-            indent(depth);
-            printf("(unary %s", token_to_cstr(expr->unary.op));
-            print_expr_ann(expr);
-            printf("\n");
-            print_expr(expr->unary.operand, depth + 1);
-            indent(depth);
-            printf(")\n");
-            break;
-
         case EXPR_PRE:
-            indent(depth);
-            printf("(pre %s", token_to_cstr(expr->unary.op));
-            print_expr_ann(expr);
-            printf("\n");
-            print_expr(expr->unary.operand, depth + 1);
-            indent(depth);
-            printf(")\n");
-            break;
-
         case EXPR_POST:
-            indent(depth);
-            printf("(post %s", token_to_cstr(expr->unary.op));
-            print_expr_ann(expr);
-            printf("\n");
-            print_expr(expr->unary.operand, depth + 1);
-            indent(depth);
-            printf(")\n");
+            print_expr_open(expr->kind == EXPR_UNARY ? "unary" :
+                            expr->kind == EXPR_PRE ? "pre" : "post", expr, true, depth);
+            push_print_task(PRINT_EXPR, expr->unary.operand, NULL, depth + 1);
             break;
 
         case EXPR_BINARY:
-            indent(depth);
-            printf("(binary %s", token_to_cstr(expr->binary.op));
-            print_expr_ann(expr);
-            printf("\n");
-            print_expr(expr->binary.left, depth + 1);
-            print_expr(expr->binary.right, depth + 1);
-            indent(depth);
-            printf(")\n");
+            print_expr_open("binary", expr, true, depth);
+            push_print_task(PRINT_EXPR, expr->binary.right, NULL, depth + 1);
+            push_print_task(PRINT_EXPR, expr->binary.left, NULL, depth + 1);
             break;
 
         case EXPR_ASSIGNMENT:
-            indent(depth);
-            printf("(assign %s", token_to_cstr(expr->assignment.op));
-            print_expr_ann(expr);
-            printf("\n");
-            print_named_expr("lhs", expr->assignment.lvalue, depth + 1);
-            print_named_expr("rhs", expr->assignment.rvalue, depth + 1);
-            indent(depth);
-            printf(")\n");
+            print_expr_open("assign", expr, true, depth);
+            push_print_task(PRINT_NAMED, expr->assignment.rvalue, "rhs", depth + 1);
+            push_print_task(PRINT_NAMED, expr->assignment.lvalue, "lhs", depth + 1);
             break;
 
         case EXPR_CONDITIONAL:
-            indent(depth);
-            printf("(conditional");
-            print_expr_ann(expr);
-            printf("\n");
-            print_named_expr("cond", expr->conditional.condition, depth + 1);
-            print_named_expr("then", expr->conditional.then_expr, depth + 1);
-            print_named_expr("else", expr->conditional.else_expr, depth + 1);
-            indent(depth);
-            printf(")\n");
+            print_expr_open("conditional", expr, false, depth);
+            push_print_task(PRINT_NAMED, expr->conditional.else_expr, "else", depth + 1);
+            push_print_task(PRINT_NAMED, expr->conditional.then_expr, "then", depth + 1);
+            push_print_task(PRINT_NAMED, expr->conditional.condition, "cond", depth + 1);
             break;
 
         case EXPR_CALL:
-            indent(depth);
-            printf("(call");
-            print_expr_ann(expr);
-            printf("\n");
-            print_named_expr("callee", expr->call.callee, depth + 1);
-            print_expr_list("args", expr->call.args, depth + 1);
-            indent(depth);
-            printf(")\n");
+            print_expr_open("call", expr, false, depth);
+            push_print_task(PRINT_LIST, expr->call.args, "args", depth + 1);
+            push_print_task(PRINT_NAMED, expr->call.callee, "callee", depth + 1);
             break;
     }
 }
 
+static void run_print_tasks(int floor)
+{
+    while (print_task_count > floor) {
+        struct print_task task = print_tasks[--print_task_count];
+
+        switch (task.kind) {
+            case PRINT_EXPR:
+                print_expr_task(task.expr, task.depth);
+                break;
+
+            case PRINT_NAMED:
+                indent(task.depth);
+
+                if (!task.expr) {
+                    printf("(%s nil)\n", task.name);
+                    break;
+                }
+
+                printf("(%s\n", task.name);
+                push_print_task(PRINT_CLOSE, NULL, NULL, task.depth);
+                push_print_task(PRINT_EXPR, task.expr, NULL, task.depth + 1);
+                break;
+
+            case PRINT_LIST:
+                indent(task.depth);
+                printf("(%s", task.name);
+
+                if (!task.expr) {
+                    printf(")\n");
+                    break;
+                }
+
+                printf("\n");
+                push_print_task(PRINT_CLOSE, NULL, NULL, task.depth);
+                push_print_task(PRINT_ARGS, task.expr, NULL, task.depth + 1);
+                break;
+
+            case PRINT_ARGS:
+                if (task.expr->next)
+                    push_print_task(PRINT_ARGS, task.expr->next, NULL, task.depth);
+                push_print_task(PRINT_EXPR, task.expr, NULL, task.depth);
+                break;
+
+            case PRINT_CLOSE:
+                indent(task.depth);
+                printf(")\n");
+                break;
+        }
+    }
+}
+
+static void print_expr(struct expr *expr, int depth)
+{
+    int floor = print_task_count;
+    push_print_task(PRINT_EXPR, expr, NULL, depth);
+    run_print_tasks(floor);
+}
+
+static void print_named_expr(const char *name, struct expr *expr, int depth)
+{
+    int floor = print_task_count;
+    push_print_task(PRINT_NAMED, expr, name, depth);
+    run_print_tasks(floor);
+}
+
 static void print_decl_attrs(struct decl *d, int depth)
 {
     indent(depth);
@@ -307,6 +344,8 @@ static void print_decl_attrs(struct decl *d, int depth)
 
     if (d->ir_name)
         printf(" (ir-name %s)", d->ir_name);
+    else if (d->sym && d->sym->local)
+        printf(" (local %d)", d->sym->local);
 
     printf(")\n");
 }
@@ -314,7 +353,7 @@ static void print_decl_attrs(struct decl *d, int depth)
 static void print_param_decl(struct decl *p, int depth)
 {
     indent(depth);
-    printf("(param %s (type ", token_to_cstr(p->name));
+    printf("(param %s (type ", p->name == NO_TOKEN ? "" : token_to_cstr(p->name));
     print_type_inline(p->type);
     printf(")");
 
@@ -468,7 +507,7 @@ static void print_stmt(struct stmt *stmt, int depth)
         case STMT_BREAK:
             indent(depth);
             if (stmt->break_stmt.target_label)
-                printf("(break %s)\n", stmt->break_stmt.target_label);
+                printf("(break L%d)\n", stmt->break_stmt.target_label);
             else
                 printf("(break)\n");
             break;
@@ -476,7 +515,7 @@ static void print_stmt(struct stmt *stmt, int depth)
         case STMT_CONTINUE:
             indent(depth);
             if (stmt->continue_stmt.target_label)
-                printf("(continue %s)\n", stmt->continue_stmt.target_label);
+                printf("(continue L%d)\n", stmt->continue_stmt.target_label);
             else
                 printf("(continue)\n");
             break;
@@ -527,7 +566,7 @@ static void print_stmt(struct stmt *stmt, int depth)
 
             if (stmt->switch_stmt.break_label) {
                 indent(depth + 1);
-                printf("(break-label %s)\n", stmt->switch_stmt.break_label);
+                printf("(break-label L%d)\n", stmt->switch_stmt.break_label);
             }
 
             indent(depth);
@@ -541,7 +580,7 @@ static void print_stmt(struct stmt *stmt, int depth)
 
             if (stmt->case_stmt.label) {
                 indent(depth + 1);
-                printf("(label %s)\n", stmt->case_stmt.label);
+                printf("(label L%d)\n", stmt->case_stmt.label);
             }
 
             print_block_items(stmt->case_stmt.items, depth + 1);
@@ -555,7 +594,7 @@ static void print_stmt(struct stmt *stmt, int depth)
 
             if (stmt->default_stmt.label) {
                 indent(depth + 1);
-                printf("(label %s)\n", stmt->default_stmt.label);
+                printf("(label L%d)\n", stmt->default_stmt.label);
             }
 
             print_block_items(stmt->default_stmt.items, depth + 1);
@@ -0,0 +1,980 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "ipo.h"
+#include "cfg.h"
+#include "ir.h"
+#include "base/hash_map.h"
+
+/* Call graph */
+
+enum node_state {
+    NODE_NEW,
+    NODE_VISITING,  // On the DFS stack, calls back to it are recursion
+    NODE_DONE,
+};
+
+struct call_site {
+    struct ir_function *caller;
+    struct ir_instr *call;
+
+    struct call_site *next;
+};
+
+struct call_graph_node {
+    struct ir_function *fn;
+    int size;           // Instructions, labels don't count
+    int call_sites;     // Calls to it in the whole program
+    enum node_state state;
+    bool moved;         // Body moved into its only caller, the function goes
+
+    struct call_site *sites;    // As built, the inliner doesn't keep them up to date
+};
+
+static hash_map call_graph;     // Function name -> node
+
+static struct call_graph_node *node_of(const char *name)
+{
+    return hashmap_get(&call_graph, name, strlen(name));
+}
+
+static int function_size(struct ir_function *fn)
+{
+    int size = 0;
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next)
+        if (instr->kind != IR_INSTR_LABEL)
+            size++;
+
+    return size;
+}
+
+static int count_params(struct ir_function *fn)
+{
+    int count = 0;
+    for (struct ir_param *p = fn->params; p; p = p->next)
+        count++;
+
+    return count;
+}
+
+static void build_call_graph(struct ir_program *program)
+{
+    hashmap_init(&call_graph);
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        struct call_graph_node *node = calloc(1, sizeof(*node));
+        node->fn = fn;
+        node->size = function_size(fn);
+        hashmap_set(&call_graph, fn->name, strlen(fn->name), node);
+    }
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+            if (instr->kind != IR_INSTR_CALL)
+                continue;
+
+            struct call_graph_node *callee = node_of(instr->call.calle);
+            if (!callee)
+                continue;
+
+            struct call_site *site = calloc(1, sizeof(*site));
+            site->caller = fn;
+            site->call = instr;
+            site->next = callee->sites;
+            callee->sites = site;
+
+            callee->call_sites++;
+        }
+    }
+}
+
+static void free_call_graph(void)
+{
+    for (size_t i = 0; i < call_graph.capacity; i++) {
+        struct call_graph_node *node = call_graph.entries[i].value;
+        if (!node)
+            continue;
+
+        while (node->sites) {
+            struct call_site *next = node->sites->next;
+            free(node->sites);
+            node->sites = next;
+        }
+        free(node);
+    }
+
+    hashmap_free(&call_graph);
+}
+
+/* Inlining */
+
+#define INLINE_SIZE_LIMIT 20        // Callees inlined at any call site
+#define INLINE_HOT_SIZE_LIMIT 60    // At call sites the profile saw run
+#define INLINE_COLD_SIZE_LIMIT 3    // At call sites the profile never saw run
+#define INLINE_GROWTH_LIMIT 1000    // Callers stop taking callees past this size
+
+/*
+ * Execution count of a call site, from the label of its block.
+ * Known only when the caller has a profile.
+ */
+struct site_count {
+    bool known;
+    long count;
+};
+
+// Nothing else calls it, the caller can take the body itself
+static bool moves_body(struct call_graph_node *callee)
+{
+    return callee->fn->linkage == LINK_INTERNAL && callee->call_sites == 1;
+}
+
+static bool should_inline(struct call_graph_node *caller, struct call_graph_node *callee,
+                          struct ir_instr *call, struct site_count site)
+{
+    // Callees on the DFS stack are recursive, they'd never stop growing
+    if (callee->state != NODE_DONE || callee == caller)
+        return false;
+
+    if (call->call.arg_count != count_params(callee->fn))
+        return false;
+
+    if (caller->size + callee->size > INLINE_GROWTH_LIMIT)
+        return false;
+
+    int limit = INLINE_SIZE_LIMIT;
+    if (site.known)
+        limit = site.count > 0 ? INLINE_HOT_SIZE_LIMIT : INLINE_COLD_SIZE_LIMIT;
+
+    if (callee->size <= limit)
+        return true;
+
+    // The body is moved rather than copied, see moves_body
+    return moves_body(callee) && !(site.known && site.count == 0);
+}
+
+/*
+ * One inlined copy. Callee pseudos (its parameters too) become fresh
+ * temporaries and its labels fresh labels, so a callee can be inlined
+ * more than once into the same caller.
+ */
+struct inline_copy {
+    int *pseudos;           // Callee pseudo -> caller pseudo
+    int *labels;            // Callee label -> caller label
+    int max_pseudo;
+    int max_label;
+
+    // Profile counts of the callee are scaled by site count / entry count
+    bool scale_counts;
+    long site_count;
+    long entry_count;
+};
+
+static void rename_value(struct ir_value *value, void *ctx)
+{
+    struct inline_copy *copy = ctx;
+
+    if (value->kind != IR_VALUE_PSEUDO)
+        return;
+
+    if (!copy->pseudos[value->pseudo])
+        copy->pseudos[value->pseudo] = ir_new_temp().pseudo;
+
+    value->pseudo = copy->pseudos[value->pseudo];
+}
+
+static int rename_label(struct inline_copy *copy, int label)
+{
+    if (!copy->labels[label])
+        copy->labels[label] = ir_new_label();
+
+    return copy->labels[label];
+}
+
+static long scale_count(struct inline_copy *copy, long count)
+{
+    return count * copy->site_count / copy->entry_count;
+}
+
+static void copy_counts(struct inline_copy *copy, struct ir_instr *instr)
+{
+    switch (instr->kind) {
+        case IR_INSTR_LABEL:
+            if (copy->scale_counts)
+                instr->label.count = scale_count(copy, instr->label.count);
+            else
+                instr->label.has_count = false;
+            break;
+        case IR_INSTR_JUMP_IF_ZERO:
+            if (copy->scale_counts)
+                instr->jump_if_zero.taken_count = scale_count(copy, instr->jump_if_zero.taken_count);
+            else
+                instr->jump_if_zero.has_count = false;
+            break;
+        case IR_INSTR_JUMP_IF_NOT_ZERO:
+            if (copy->scale_counts)
+                instr->jump_if_not_zero.taken_count = scale_count(copy, instr->jump_if_not_zero.taken_count);
+            else
+                instr->jump_if_not_zero.has_count = false;
+            break;
+        default:
+            break;
+    }
+}
+
+static int max_label_of(struct ir_function *fn)
+{
+    int max = 0;
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+        if (instr->kind == IR_INSTR_LABEL && instr->label.label_id > max)
+            max = instr->label.label_id;
+
+        int *target = ir_branch_target(instr);
+        if (target && *target > max)
+            max = *target;
+    }
+
+    return max;
+}
+
+static void max_pseudo(struct ir_value *value, void *ctx)
+{
+    int *max = ctx;
+
+    if (value->kind == IR_VALUE_PSEUDO && value->pseudo > *max)
+        *max = value->pseudo;
+}
+
+static int max_pseudo_of(struct ir_function *fn)
+{
+    int max = 0;
+    for (struct ir_param *p = fn->params; p; p = p->next)
+        if (p->pseudo > max)
+            max = p->pseudo;
+
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next)
+        ir_for_each_value(instr, max_pseudo, &max);
+
+    return max;
+}
+
+static struct ir_instr *new_copy(struct ir_value src, struct ir_value dst)
+{
+    struct ir_instr *instr = calloc(1, sizeof(struct ir_instr));
+    instr->kind = IR_INSTR_COPY;
+    instr->copy.src = src;
+    instr->copy.dst = dst;
+
+    return instr;
+}
+
+static void free_inline_copy(struct inline_copy *copy)
+{
+    free(copy->pseudos);
+    free(copy->labels);
+}
+
+// call f(args) -> dst; return dst     (or a void call and return)
+static bool is_tail_call(struct ir_instr *call)
+{
+    struct ir_instr *ret = call->next;
+    if (!ret || ret->kind != IR_INSTR_RETURN)
+        return false;
+
+    if (!call->call.has_dst)
+        return !ret->ret.has_value;
+
+    return ret->ret.has_value &&
+           ret->ret.src.kind == IR_VALUE_PSEUDO &&
+           ret->ret.src.pseudo == call->call.dst.pseudo;
+}
+
+/*
+ * dst = call f(a, b)          p.1 = a
+ *                             p.2 = b
+ *                             <body of f, renamed>
+ *                               return x  ->  dst = x; jump end
+ *                             end:
+ *
+ * A call in tail position replaces the return after it too, the body
+ * keeps its returns, so calls in tail position within it stay there.
+ * With 'move' the callee's own instructions are spliced in, its pseudos
+ * and labels are already unique in the program. Returns the first and
+ * last instructions replacing the call.
+ */
+static void inline_call(struct ir_function *caller, struct ir_instr *call, bool tail,
+                        bool move, struct site_count site, struct ir_instr **first,
+                        struct ir_instr **last)
+{
+    struct ir_function *callee = node_of(call->call.calle)->fn;
+
+    struct inline_copy copy = {
+        .max_pseudo = max_pseudo_of(callee),
+        .max_label = max_label_of(callee),
+        .scale_counts = caller->has_profile && site.known &&
+                        callee->has_profile && callee->entry_count > 0,
+        .site_count = site.count,
+        .entry_count = callee->entry_count,
+    };
+    copy.pseudos = calloc(copy.max_pseudo + 1, sizeof(int));
+    copy.labels = calloc(copy.max_label + 1, sizeof(int));
+
+    struct ir_instr *head = NULL;
+    struct ir_instr *list_tail = NULL;
+
+    int i = 0;
+    for (struct ir_param *p = callee->params; p; p = p->next, i++) {
+        struct ir_value param = { .kind = IR_VALUE_PSEUDO, .pseudo = p->pseudo };
+        if (!move)
+            rename_value(&param, &copy);
+
+        struct ir_instr *instr = new_copy(call->call.args[i], param);
+        LIST_APPEND(head, list_tail, instr);
+    }
+
+    int end_label = ir_new_label();
+
+    struct ir_instr *next;
+    for (struct ir_instr *orig = callee->first; orig; orig = next) {
+        next = orig->next;
+
+        if (orig->kind == IR_INSTR_RETURN && !tail) {
+            if (call->call.has_dst && orig->ret.has_value) {
+                struct ir_value src = orig->ret.src;
+                if (!move)
+                    rename_value(&src, &copy);
+
+                struct ir_instr *instr = new_copy(src, call->call.dst);
+                LIST_APPEND(head, list_tail, instr);
+            }
+
+            // The last return falls through into 'end'
+            if (next) {
+                struct ir_instr *jump = ir_make_jump(end_label);
+                LIST_APPEND(head, list_tail, jump);
+            }
+
+            if (move)
+                free(orig);
+            continue;
+        }
+
+        struct ir_instr *instr = orig;
+
+        if (!move) {
+            instr = malloc(sizeof(*instr));
+            *instr = *orig;
+
+            if (instr->kind == IR_INSTR_CALL) {
+                size_t size = instr->call.arg_count * sizeof(struct ir_value);
+                instr->call.args = malloc(size ? size : 1);
+                memcpy(instr->call.args, orig->call.args, size);
+
+                struct call_graph_node *node = node_of(instr->call.calle);
+                if (node)
+                    node->call_sites++;
+            }
+
+            ir_for_each_value(instr, rename_value, &copy);
+
+            int *target = ir_branch_target(instr);
+            if (target)
+                *target = rename_label(&copy, *target);
+            if (instr->kind == IR_INSTR_LABEL)
+                instr->label.label_id = rename_label(&copy, instr->label.label_id);
+        }
+
+        instr->next = NULL;
+        copy_counts(&copy, instr);
+        LIST_APPEND(head, list_tail, instr);
+    }
+
+    if (move) {
+        callee->first = NULL;
+        callee->last = NULL;
+    }
+
+    if (!tail) {
+        struct ir_instr *end = ir_make_label(end_label);
+        end->label.has_count = site.known;
+        end->label.count = site.count;
+        LIST_APPEND(head, list_tail, end);
+    }
+
+    free_inline_copy(&copy);
+
+    *first = head;
+    *last = list_tail;
+}
+
+static void inline_calls(struct call_graph_node *caller)
+{
+    struct ir_function *fn = caller->fn;
+
+    struct site_count site = {
+        .known = fn->has_profile,
+        .count = fn->entry_count,
+    };
+
+    struct ir_instr *prev = NULL;
+    struct ir_instr *instr = fn->first;
+
+    while (instr) {
+        if (instr->kind == IR_INSTR_LABEL && fn->has_profile) {
+            site.known = instr->label.has_count;
+            site.count = instr->label.count;
+        }
+
+        struct call_graph_node *callee = instr->kind == IR_INSTR_CALL
+            ? node_of(instr->call.calle)
+            : NULL;
+
+        if (!callee || !should_inline(caller, callee, instr, site)) {
+            prev = instr;
+            instr = instr->next;
+            continue;
+        }
+
+        bool tail = is_tail_call(instr);
+        struct ir_instr *replaced = tail ? instr->next : instr;
+
+        bool move = moves_body(callee);
+
+        struct ir_instr *first, *last;
+        inline_call(fn, instr, tail, move, site, &first, &last);
+
+        if (prev)
+            prev->next = first;
+        else
+            fn->first = first;
+
+        last->next = replaced->next;
+        if (fn->last == replaced)
+            fn->last = last;
+
+        caller->size += callee->size;
+        callee->call_sites--;
+        callee->moved = move;
+
+        // The copy already had its own calls inlined
+        prev = last;
+        instr = last->next;
+    }
+}
+
+// A function on the DFS stack and the next instruction to look for calls in
+struct visit_frame {
+    struct call_graph_node *node;
+    struct ir_instr *next;
+};
+
+static struct visit_frame *visit_frames;
+static int visit_frame_count;
+static int visit_frame_capacity;
+
+static void push_visit(struct call_graph_node *node)
+{
+    if (visit_frame_count == visit_frame_capacity) {
+        visit_frame_capacity = visit_frame_capacity ? visit_frame_capacity * 2 : 64;
+        visit_frames = realloc(visit_frames, visit_frame_capacity * sizeof(struct visit_frame));
+    }
+
+    node->state = NODE_VISITING;
+    visit_frames[visit_frame_count++] = (struct visit_frame) {
+        .node = node,
+        .next = node->fn->first,
+    };
+}
+
+/*
+ * Callees first, so callers take copies that are already inlined into.
+ * On an explicit stack, call chains can be longer than the C stack is deep.
+ */
+static void visit(struct call_graph_node *root)
+{
+    push_visit(root);
+
+    while (visit_frame_count) {
+        struct visit_frame *frame = &visit_frames[visit_frame_count - 1];
+        struct call_graph_node *callee = NULL;
+
+        while (frame->next && !callee) {
+            struct ir_instr *instr = frame->next;
+            frame->next = instr->next;
+
+            if (instr->kind == IR_INSTR_CALL)
+                callee = node_of(instr->call.calle);
+            if (callee && callee->state != NODE_NEW)
+                callee = NULL;
+        }
+
+        if (callee) {
+            push_visit(callee);
+            continue;
+        }
+
+        struct call_graph_node *node = frame->node;
+        visit_frame_count--;
+
+        inline_calls(node);
+        node->state = NODE_DONE;
+    }
+}
+
+void ipo_inline(struct ir_program *program)
+{
+    build_call_graph(program);
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        struct call_graph_node *node = node_of(fn->name);
+        if (node->state == NODE_NEW)
+            visit(node);
+    }
+
+    free(visit_frames);
+    visit_frames = NULL;
+    visit_frame_capacity = 0;
+
+    struct ir_function **fn_link = &program->functions;
+    while (*fn_link) {
+        if (node_of((*fn_link)->name)->moved)
+            *fn_link = (*fn_link)->next;
+        else
+            fn_link = &(*fn_link)->next;
+    }
+
+    free_call_graph();
+}
+
+/* Constant propagation and dead arguments */
+
+/*
+ * Only static functions qualify: every call to them is in the program.
+ * Calls with the wrong argument count (undefined behaviour) rule it out.
+ */
+static bool all_sites_known(struct call_graph_node *node)
+{
+    if (node->fn->linkage != LINK_INTERNAL)
+        return false;
+
+    int params = count_params(node->fn);
+    for (struct call_site *site = node->sites; site; site = site->next)
+        if (site->call->call.arg_count != params)
+            return false;
+
+    return true;
+}
+
+static bool is_pseudo(struct ir_value value, int pseudo)
+{
+    return value.kind == IR_VALUE_PSEUDO && value.pseudo == pseudo;
+}
+
+static struct ir_value *instr_dst(struct ir_instr *instr)
+{
+    switch (instr->kind) {
+        case IR_INSTR_UNARY:  return &instr->unary.dst;
+        case IR_INSTR_BINARY: return &instr->binary.dst;
+        case IR_INSTR_COPY:   return &instr->copy.dst;
+        case IR_INSTR_CALL:   return instr->call.has_dst ? &instr->call.dst : NULL;
+        default:              return NULL;
+    }
+}
+
+static bool writes(struct ir_function *fn, int pseudo)
+{
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+        struct ir_value *dst = instr_dst(instr);
+        if (dst && is_pseudo(*dst, pseudo))
+            return true;
+    }
+
+    return false;
+}
+
+struct read_count {
+    int pseudo;
+    struct ir_value *skip;  // Destination of the instruction, not a read
+    int reads;
+};
+
+static void count_read(struct ir_value *value, void *ctx)
+{
+    struct read_count *rc = ctx;
+
+    if (value != rc->skip && is_pseudo(*value, rc->pseudo))
+        rc->reads++;
+}
+
+/*
+ * Reads of 'pseudo' in 'fn'. With 'self_arg' >= 0, passing it on as
+ * that same argument of a recursive call doesn't count.
+ */
+static int count_reads(struct ir_function *fn, int pseudo, int self_arg)
+{
+    struct read_count rc = { .pseudo = pseudo };
+
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+        rc.skip = instr_dst(instr);
+
+        ir_for_each_value(instr, count_read, &rc);
+
+        if (self_arg >= 0 && instr->kind == IR_INSTR_CALL &&
+            !strcmp(instr->call.calle, fn->name) &&
+            instr->call.arg_count > self_arg &&
+            is_pseudo(instr->call.args[self_arg], pseudo))
+            rc.reads--;
+    }
+
+    return rc.reads;
+}
+
+/*
+ * The constant every call passes as argument 'i'. A recursive call may
+ * pass the parameter itself back, if the function never changes it.
+ */
+static bool constant_argument(struct call_graph_node *node, int i,
+                              int param, long *value)
+{
+    bool found = false;
+    bool written = writes(node->fn, param);
+
+    for (struct call_site *site = node->sites; site; site = site->next) {
+        struct ir_value arg = site->call->call.args[i];
+
+        if (site->caller == node->fn && !written && is_pseudo(arg, param))
+            continue;
+
+        if (arg.kind != IR_VALUE_CONSTANT)
+            return false;
+        if (found && arg.constant != *value)
+            return false;
+
+        found = true;
+        *value = arg.constant;
+    }
+
+    return found;
+}
+
+struct replace_param {
+    int pseudo;
+    long value;
+};
+
+static void replace_with_constant(struct ir_value *value, void *ctx)
+{
+    struct replace_param *rp = ctx;
+
+    if (is_pseudo(*value, rp->pseudo))
+        *value = (struct ir_value) { .kind = IR_VALUE_CONSTANT, .constant = rp->value };
+}
+
+/*
+ * f(p) always called as f(7): reads of p become 7. If f assigns p
+ * it starts with p = 7 instead, either way the incoming value is dead.
+ */
+static void propagate_argument(struct ir_function *fn, int param, long value)
+{
+    if (writes(fn, param)) {
+        struct ir_instr *copy = new_copy(
+            (struct ir_value) { .kind = IR_VALUE_CONSTANT, .constant = value },
+            (struct ir_value) { .kind = IR_VALUE_PSEUDO, .pseudo = param });
+
+        copy->next = fn->first;
+        fn->first = copy;
+        if (!fn->last)
+            fn->last = copy;
+        return;
+    }
+
+    struct replace_param rp = { .pseudo = param, .value = value };
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next)
+        ir_for_each_value(instr, replace_with_constant, &rp);
+}
+
+// The constant every return of 'fn' returns
+static bool constant_return(struct ir_function *fn, long *value)
+{
+    bool found = false;
+
+    struct ir_instr *prev = NULL;
+    for (struct ir_instr *instr = fn->first; instr; prev = instr, instr = instr->next) {
+        if (instr->kind != IR_INSTR_RETURN)
+            continue;
+
+        // Unreachable, like the implicit 'return 0' after a last return
+        if (prev && ir_is_terminator(prev))
+            continue;
+
+        if (!instr->ret.has_value || instr->ret.src.kind != IR_VALUE_CONSTANT)
+            return false;
+        if (found && instr->ret.src.constant != *value)
+            return false;
+
+        found = true;
+        *value = instr->ret.src.constant;
+    }
+
+    return found;
+}
+
+// dst = call f()  ->  call f(); dst = 7
+static void propagate_return(struct call_graph_node *node, long value)
+{
+    for (struct call_site *site = node->sites; site; site = site->next) {
+        struct ir_instr *call = site->call;
+        if (!call->call.has_dst)
+            continue;
+
+        struct ir_instr *copy = new_copy(
+            (struct ir_value) { .kind = IR_VALUE_CONSTANT, .constant = value },
+            call->call.dst);
+
+        copy->next = call->next;
+        call->next = copy;
+        if (site->caller->last == call)
+            site->caller->last = copy;
+
+        call->call.has_dst = false;
+    }
+}
+
+void ipo_propagate_constants(struct ir_program *program)
+{
+    build_call_graph(program);
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        struct call_graph_node *node = node_of(fn->name);
+        if (!node->sites || !all_sites_known(node))
+            continue;
+
+        int i = 0;
+        for (struct ir_param *p = fn->params; p; p = p->next, i++) {
+            long value;
+            if (constant_argument(node, i, p->pseudo, &value))
+                propagate_argument(fn, p->pseudo, value);
+        }
+
+        long value;
+        if (constant_return(fn, &value))
+            propagate_return(node, value);
+    }
+
+    free_call_graph();
+}
+
+// The value 'fn' receives as parameter 'i' is never used
+static bool is_dead_param(struct ir_function *fn, struct ir_param *param, int i)
+{
+    struct ir_instr *first = fn->first;
+
+    // Left by propagate_argument
+    if (first && first->kind == IR_INSTR_COPY &&
+        is_pseudo(first->copy.dst, param->pseudo) &&
+        !is_pseudo(first->copy.src, param->pseudo))
+        return true;
+
+    return count_reads(fn, param->pseudo, i) == 0;
+}
+
+static void remove_argument(struct call_graph_node *node, int i)
+{
+    for (struct call_site *site = node->sites; site; site = site->next) {
+        struct ir_instr *call = site->call;
+
+        for (int j = i; j < call->call.arg_count - 1; j++)
+            call->call.args[j] = call->call.args[j + 1];
+        call->call.arg_count--;
+    }
+}
+
+static void remove_dead_params(struct call_graph_node *node)
+{
+    struct ir_function *fn = node->fn;
+
+    struct ir_param *prev = NULL;
+    struct ir_param *p = fn->params;
+    int i = 0;
+
+    while (p) {
+        struct ir_param *next = p->next;
+
+        if (!is_dead_param(fn, p, i)) {
+            prev = p;
+            p = next;
+            i++;
+            continue;
+        }
+
+        // Recursive calls may still pass it on, as their now dead argument
+        remove_argument(node, i);
+
+        if (prev)
+            prev->next = next;
+        else
+            fn->params = next;
+        free(p);
+        p = next;
+    }
+}
+
+// Some call uses the result, or 'fn' already returns nothing
+static bool return_value_used(struct call_graph_node *node)
+{
+    bool returns_value = false;
+    for (struct ir_instr *instr = node->fn->first; instr; instr = instr->next)
+        if (instr->kind == IR_INSTR_RETURN && instr->ret.has_value)
+            returns_value = true;
+
+    if (!returns_value)
+        return true;
+
+    for (struct call_site *site = node->sites; site; site = site->next) {
+        struct ir_instr *call = site->call;
+
+        if (call->call.has_dst && count_reads(site->caller, call->call.dst.pseudo, -1) > 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void remove_return_value(struct call_graph_node *node)
+{
+    for (struct call_site *site = node->sites; site; site = site->next)
+        site->call->call.has_dst = false;
+
+    for (struct ir_instr *instr = node->fn->first; instr; instr = instr->next)
+        if (instr->kind == IR_INSTR_RETURN)
+            instr->ret.has_value = false;
+}
+
+void ipo_remove_dead_arguments(struct ir_program *program)
+{
+    build_call_graph(program);
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        struct call_graph_node *node = node_of(fn->name);
+        if (!all_sites_known(node))
+            continue;
+
+        remove_dead_params(node);
+
+        if (!return_value_used(node))
+            remove_return_value(node);
+    }
+
+    free_call_graph();
+}
+
+/* Dead functions and variables */
+
+struct reachability {
+    hash_map functions;     // Name -> struct ir_function, of the program
+    hash_map live;          // Names reached so far
+
+    // Live functions whose bodies aren't walked yet
+    struct ir_function **pending;
+    int pending_count;
+    int pending_capacity;
+};
+
+static void mark_live_value(struct ir_value *value, void *ctx)
+{
+    struct reachability *r = ctx;
+
+    if (value->kind == IR_VALUE_STATIC)
+        hashmap_set(&r->live, value->name, strlen(value->name), (void *)value->name);
+}
+
+static void mark_live_function(struct reachability *r, const char *name)
+{
+    struct ir_function *fn = hashmap_get(&r->functions, name, strlen(name));
+
+    // Defined elsewhere, or already walked
+    if (!fn || hashmap_get(&r->live, name, strlen(name)))
+        return;
+
+    hashmap_set(&r->live, name, strlen(name), (void *)name);
+
+    if (r->pending_count == r->pending_capacity) {
+        r->pending_capacity = r->pending_capacity ? r->pending_capacity * 2 : 64;
+        r->pending = realloc(r->pending, r->pending_capacity * sizeof(struct ir_function *));
+    }
+    r->pending[r->pending_count++] = fn;
+}
+
+// From a worklist, call chains can be longer than the C stack is deep
+static void walk_live_functions(struct reachability *r)
+{
+    while (r->pending_count) {
+        struct ir_function *fn = r->pending[--r->pending_count];
+
+        for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+            ir_for_each_value(instr, mark_live_value, r);
+
+            if (instr->kind == IR_INSTR_CALL)
+                mark_live_function(r, instr->call.calle);
+        }
+    }
+}
+
+static bool is_live(struct reachability *r, const char *name)
+{
+    return hashmap_get(&r->live, name, strlen(name)) != NULL;
+}
+
+/*
+ * Everything reachable from external definitions stays, through calls
+ * and static variable references. Counters of removed functions go
+ * from the -fprofile-generate table too.
+ */
+void ipo_remove_dead_symbols(struct ir_program *program)
+{
+    struct reachability r = { 0 };
+    hashmap_init(&r.functions);
+    hashmap_init(&r.live);
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next)
+        hashmap_set(&r.functions, fn->name, strlen(fn->name), fn);
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next)
+        if (fn->linkage == LINK_EXTERNAL)
+            mark_live_function(&r, fn->name);
+    walk_live_functions(&r);
+
+    for (struct ir_static_variable *var = program->static_vars; var; var = var->next)
+        if (var->linkage == LINK_EXTERNAL)
+            hashmap_set(&r.live, var->name, strlen(var->name), (void *)var->name);
+
+    struct ir_function **fn_link = &program->functions;
+    while (*fn_link) {
+        if (is_live(&r, (*fn_link)->name))
+            fn_link = &(*fn_link)->next;
+        else
+            *fn_link = (*fn_link)->next;
+    }
+
+    struct ir_static_variable **var_link = &program->static_vars;
+    while (*var_link) {
+        if (is_live(&r, (*var_link)->name))
+            var_link = &(*var_link)->next;
+        else
+            *var_link = (*var_link)->next;
+    }
+
+    struct ir_profile_counter **counter_link = &program->profile_counters;
+    while (*counter_link) {
+        if (is_live(&r, (*counter_link)->symbol))
+            counter_link = &(*counter_link)->next;
+        else
+            *counter_link = (*counter_link)->next;
+    }
+
+    hashmap_free(&r.functions);
+    hashmap_free(&r.live);
+    free(r.pending);
+}
@@ -0,0 +1,26 @@
+/*
+ * Interprocedural passes, over every function of an ir_program.
+ * With -flto the program is the whole executable.
+ */
+
+#ifndef CINC_IPO_H
+#define CINC_IPO_H
+
+#include "ir.h"
+
+// Inlines small callees, and static functions called from one place
+void ipo_inline(struct ir_program *program);
+
+/*
+ * Arguments every call of a static function passes the same constant
+ * move into the function, constant return values into the callers.
+ */
+void ipo_propagate_constants(struct ir_program *program);
+
+// Drops the parameters static functions never read, and results no caller uses
+void ipo_remove_dead_arguments(struct ir_program *program);
+
+// Removes functions and static variables unreachable from external definitions
+void ipo_remove_dead_symbols(struct ir_program *program);
+
+#endif
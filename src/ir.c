@@ -7,19 +7,20 @@
 #include "ast.h"
 #include "sema.h"
 #include "type.h"
-#include "base/hash_map.h"
 
 static struct ir_function *current_function;
 extern struct symbol *all_symbols; // From sema (for now simple) TODO: Change this
 
+// Not reset between translation units, -flto puts their functions together
+static int next_temp_id = 1;
+static int next_label_id = 1;
+
 /*
- * One per function.
- * Maps label string to label int.
+ * Sema's numbers of the current function's labels and locals start
+ * from 1, these are what their IR numbers are offset by.
  */
-static hash_map label_ids;
-
-static int next_temp_id;
-static int next_label_id;
+static int label_base;
+static int local_base;
 
 static struct ir_value ir_constant(long c) 
 {
@@ -29,11 +30,11 @@ static struct ir_value ir_constant(long c)
     };
 }
 
-static struct ir_value ir_pseudo(const char *name)
+static struct ir_value ir_pseudo(int pseudo)
 {
     return (struct ir_value) {
         .kind = IR_VALUE_PSEUDO,
-        .name = name
+        .pseudo = pseudo
     };
 }
 
@@ -50,17 +51,12 @@ static struct ir_value emit_object_value(struct symbol *sym)
     if (sym->storage_duration == SD_STATIC)
         return ir_static(sym->ir_name);
 
-    return ir_pseudo(sym->ir_name);
+    return ir_pseudo(local_base + sym->local);
 }
 
 static struct ir_value make_temp(void)
 {
-    int len = snprintf(NULL, 0, "tmp.%d", next_temp_id);
-    char *buf = malloc(len + 1);
-
-    snprintf(buf, len + 1, "tmp.%d", next_temp_id++);
-
-    return ir_pseudo(buf);
+    return ir_pseudo(next_temp_id++);
 }
 
 static int make_label(void)
@@ -68,31 +64,15 @@ static int make_label(void)
     return next_label_id++;
 }
 
-static int get_or_create_label_id(const char *name, int len)
-{
-    void *value = hashmap_get(&label_ids, name, len);
-    if (value)
-        return (int)(intptr_t)value;
-
-    int id = make_label();
-    hashmap_set(&label_ids, name, len, (void *)(intptr_t)id);
-
-    return id;
-}
-
-static int get_or_create_label_id_tok(struct token *tok)
+// A label sema numbered
+static int ast_label(int label)
 {
-    return get_or_create_label_id(tok->start, tok->length);
+    return label_base + label;
 }
 
-static int get_or_create_label_id_cstr(const char *str)
+static enum ir_unary_op convert_unary_op(tok_id tok)
 {
-    return get_or_create_label_id(str, strlen(str));
-}
-
-static enum ir_unary_op convert_unary_op(struct token tok)
-{
-    switch (tok.type) {
+    switch (tok_type(tok)) {
         case TOKEN_MINUS:
             return IR_UNOP_NEG;
         case TOKEN_TILDE:
@@ -104,9 +84,9 @@ static enum ir_unary_op convert_unary_op(struct token tok)
     }
 }
 
-static enum ir_binary_op convert_binary_op(struct token tok)
+static enum ir_binary_op convert_binary_op(tok_id tok)
 {
-    switch (tok.type) {
+    switch (tok_type(tok)) {
         case TOKEN_PLUS:            return IR_BINOP_ADD;
         case TOKEN_MINUS:           return IR_BINOP_SUB;
         case TOKEN_STAR:            return IR_BINOP_MUL;
@@ -286,118 +266,200 @@ static void emit_call(const char *calle, struct ir_value *args, int arg_count,
     append_instr(instr);
 }
 
-static struct ir_value emit_expr(struct expr *expr);
-static void emit_stmt(struct stmt *stmt);
-static void emit_decl_list(struct decl *decls);
-static void emit_block_item(struct block_item *item);
+/*
+ * Expressions and statements are lowered from explicit stacks of
+ * frames, nesting as deep as generated code likes costs no C stack. A
+ * frame is one node part way through its code: 'stage' counts what of
+ * it is emitted, and the values of its emitted operands wait on the
+ * value stack.
+ */
+struct expr_frame {
+    struct expr *expr;
+    int stage;
+    int labels[2];
+    struct ir_value dst;
+    struct ir_value *args;      // Of a call
+    struct expr *arg;           // Next one
+};
+
+static struct expr_frame *expr_frames;
+static int expr_frame_count;
+static int expr_frame_capacity;
+
+static struct ir_value *values;
+static int value_count;
+static int value_capacity;
+
+static void push_expr_frame(struct expr *expr)
+{
+    if (expr_frame_count == expr_frame_capacity) {
+        expr_frame_capacity = expr_frame_capacity ? expr_frame_capacity * 2 : 64;
+        expr_frames = realloc(expr_frames, expr_frame_capacity * sizeof(struct expr_frame));
+    }
 
-static struct ir_value emit_expr(struct expr *expr)
+    expr_frames[expr_frame_count++] = (struct expr_frame) { .expr = expr };
+}
+
+static void push_value(struct ir_value value)
+{
+    if (value_count == value_capacity) {
+        value_capacity = value_capacity ? value_capacity * 2 : 64;
+        values = realloc(values, value_capacity * sizeof(struct ir_value));
+    }
+
+    values[value_count++] = value;
+}
+
+static struct ir_value pop_value(void)
+{
+    return values[--value_count];
+}
+
+// The expression of the innermost frame is done, with 'value'
+static struct expr *finish_expr(struct ir_value value)
 {
+    push_value(value);
+    expr_frame_count--;
+    return NULL;
+}
+
+/*
+ * Emits the code of 'frame' up to its next operand and returns that,
+ * or finishes the expression and returns NULL.
+ */
+static struct expr *step_expr(struct expr_frame *frame)
+{
+    struct expr *expr = frame->expr;
+    int stage = frame->stage++;
+
     switch (expr->kind) {
         case EXPR_INT_LITERAL:
-            return ir_constant(expr->int_value);
+            return finish_expr(ir_constant(expr->int_value));
 
         case EXPR_IDENTIFIER:
-            return emit_object_value(expr->identifier.sym);
+            return finish_expr(emit_object_value(expr->identifier.sym));
 
         case EXPR_UNARY: {
-            struct ir_value src = emit_expr(expr->unary.operand);
+            if (stage == 0)
+                return expr->unary.operand;
+
+            struct ir_value src = pop_value();
 
             // Unary plus doesn't do anything
-            if (expr->tok.type == TOKEN_PLUS)
-                return src;
+            if (tok_type(expr->tok) == TOKEN_PLUS)
+                return finish_expr(src);
             
             struct ir_value dst = make_temp();
 
             emit_unary(convert_unary_op(expr->tok), src, dst);
-            return dst;
+            return finish_expr(dst);
         }
 
         case EXPR_BINARY: {
             // Special cases for && and || (short-circut)
-           if (expr->tok.type == TOKEN_AND_AND) {
+            if (tok_type(expr->tok) == TOKEN_AND_AND) {
                 // a && b ->
                 //  v1 = emit_expr(a); if a == 0 jump false
                 //  v2 = emit_expr(b); if b == 0 jump false
                 //  dst = 1; jump end
                 //  false: dst = 0
                 //  end:
-                int false_label = make_label();
-                int end_label = make_label();
-                struct ir_value dst = make_temp();
+                int *false_label = &frame->labels[0];
+                int *end_label = &frame->labels[1];
+
+                switch (stage) {
+                    case 0:
+                        *false_label = make_label();
+                        *end_label = make_label();
+                        frame->dst = make_temp();
+                        return expr->binary.left;
 
-                struct ir_value lhs = emit_expr(expr->binary.left);
-                emit_jump_if_zero(lhs, false_label);
+                    case 1:
+                        emit_jump_if_zero(pop_value(), *false_label);
+                        return expr->binary.right;
+                }
 
-                struct ir_value rhs = emit_expr(expr->binary.right);
-                emit_jump_if_zero(rhs, false_label);
+                emit_jump_if_zero(pop_value(), *false_label);
 
-                emit_copy(ir_constant(1), dst);
-                emit_jump(end_label);
+                emit_copy(ir_constant(1), frame->dst);
+                emit_jump(*end_label);
 
-                emit_label(false_label);
-                emit_copy(ir_constant(0), dst);
+                emit_label(*false_label);
+                emit_copy(ir_constant(0), frame->dst);
 
-                emit_label(end_label);
-                return dst;
+                emit_label(*end_label);
+                return finish_expr(frame->dst);
             }
 
-            if (expr->tok.type == TOKEN_OR_OR) {
+            if (tok_type(expr->tok) == TOKEN_OR_OR) {
                 // a || b ->
                 //  v1 = emit_expr(a); if a != 0 jump true
                 //  v2 = emit_expr(b); if b != 0 jump true
                 //  dst = 0; jump end
                 //  true: dst = 1
                 //  end:
-                int true_label = make_label();
-                int end_label = make_label();
-                struct ir_value dst = make_temp();
+                int *true_label = &frame->labels[0];
+                int *end_label = &frame->labels[1];
 
-                struct ir_value lhs = emit_expr(expr->binary.left);
-                emit_jump_if_not_zero(lhs, true_label);
+                switch (stage) {
+                    case 0:
+                        *true_label = make_label();
+                        *end_label = make_label();
+                        frame->dst = make_temp();
+                        return expr->binary.left;
 
-                struct ir_value rhs = emit_expr(expr->binary.right);
-                emit_jump_if_not_zero(rhs, true_label);
+                    case 1:
+                        emit_jump_if_not_zero(pop_value(), *true_label);
+                        return expr->binary.right;
+                }
 
-                emit_copy(ir_constant(0), dst);
-                emit_jump(end_label);
+                emit_jump_if_not_zero(pop_value(), *true_label);
 
-                emit_label(true_label);
-                emit_copy(ir_constant(1), dst);
+                emit_copy(ir_constant(0), frame->dst);
+                emit_jump(*end_label);
 
-                emit_label(end_label);
-                return dst;
+                emit_label(*true_label);
+                emit_copy(ir_constant(1), frame->dst);
+
+                emit_label(*end_label);
+                return finish_expr(frame->dst);
             }
 
             // Standard case for binary operations
-            struct ir_value lhs = emit_expr(expr->binary.left);
-            struct ir_value rhs = emit_expr(expr->binary.right);
+            if (stage == 0)
+                return expr->binary.left;
+            if (stage == 1)
+                return expr->binary.right;
+
+            struct ir_value rhs = pop_value();
+            struct ir_value lhs = pop_value();
             struct ir_value dst = make_temp();
 
             emit_binary(convert_binary_op(expr->tok), lhs, rhs, dst);
-            return dst;
+            return finish_expr(dst);
         }
 
         case EXPR_ASSIGNMENT: {
-            struct ir_value lhs = emit_object_value(expr->assignment.lvalue->identifier.sym);
+            if (stage == 0)
+                return expr->assignment.rvalue;
 
-            if (expr->tok.type == TOKEN_EQUAL) {
-                struct ir_value rhs = emit_expr(expr->assignment.rvalue);
+            struct ir_value lhs = emit_object_value(expr->assignment.lvalue->identifier.sym);
+            struct ir_value rhs = pop_value();
 
+            if (tok_type(expr->tok) == TOKEN_EQUAL) {
                 emit_copy(rhs, lhs);
-                return lhs;
+                return finish_expr(lhs);
             }
 
             // Otherwise compound assignment (+= -= &= ...)
             // lvalue = lvalue op rvalue
-            struct ir_value rhs = emit_expr(expr->assignment.rvalue);
             emit_binary(convert_binary_op(expr->tok), lhs, rhs, lhs);
-            return lhs;
+            return finish_expr(lhs);
         }
 
         case EXPR_PRE:
         case EXPR_POST: {
-            bool is_incr = expr->tok.type == TOKEN_PLUS_PLUS;
+            bool is_incr = tok_type(expr->tok) == TOKEN_PLUS_PLUS;
 
             struct expr *lhs_expr = expr->unary.operand;
             struct ir_value lhs = emit_object_value(lhs_expr->identifier.sym);
@@ -411,7 +473,7 @@ static struct ir_value emit_expr(struct expr *expr)
                             ir_constant(1),
                             lhs);
 
-                return old_lhs;
+                return finish_expr(old_lhs);
             }
 
             emit_binary(is_incr ? IR_BINOP_ADD : IR_BINOP_SUB,
@@ -419,64 +481,91 @@ static struct ir_value emit_expr(struct expr *expr)
                         ir_constant(1),
                         lhs);
 
-            return lhs;
+            return finish_expr(lhs);
         }
 
         case EXPR_CONDITIONAL: {
-            int else_label = make_label();
-            int end_label = make_label();
-
-            struct ir_value dst = make_temp();
-
-            struct ir_value cond = emit_expr(expr->conditional.condition);
-            emit_jump_if_zero(cond, else_label);
-
-            struct ir_value then_val = emit_expr(expr->conditional.then_expr);
-            emit_copy(then_val, dst);
-            emit_jump(end_label);
-
-            emit_label(else_label);
+            int *else_label = &frame->labels[0];
+            int *end_label = &frame->labels[1];
+
+            switch (stage) {
+                case 0:
+                    *else_label = make_label();
+                    *end_label = make_label();
+                    frame->dst = make_temp();
+                    return expr->conditional.condition;
+
+                case 1:
+                    emit_jump_if_zero(pop_value(), *else_label);
+                    return expr->conditional.then_expr;
+
+                case 2:
+                    emit_copy(pop_value(), frame->dst);
+                    emit_jump(*end_label);
+
+                    emit_label(*else_label);
+                    return expr->conditional.else_expr;
+            }
 
-            struct ir_value else_val = emit_expr(expr->conditional.else_expr);
-            emit_copy(else_val, dst);
+            emit_copy(pop_value(), frame->dst);
 
-            emit_label(end_label);
-            return dst;
+            emit_label(*end_label);
+            return finish_expr(frame->dst);
         }
 
         case EXPR_CALL: {
-            struct symbol *sym = expr->call.callee->identifier.sym;
-            const char *calle = sym->ir_name;
+            if (stage == 0) {
+                int arg_count = 0;
+                for (struct expr *arg = expr->call.args; arg; arg = arg->next)
+                    arg_count++;
 
-            int arg_count = 0;
-            for (struct expr *arg = expr->call.args; arg; arg = arg->next)
-                arg_count++;
+                frame->args = NULL;
+                if (arg_count > 0)
+                    frame->args = calloc(arg_count, sizeof(struct ir_value));
 
-            struct ir_value *args = NULL;
-            if (arg_count > 0)
-                args = calloc(arg_count, sizeof(struct ir_value));
+                frame->arg = expr->call.args;
+            } else {
+                frame->args[stage - 1] = pop_value();
+            }
 
-            int i = 0;
-            for (struct expr *arg = expr->call.args; arg; arg = arg->next)
-                args[i++] = emit_expr(arg);
+            if (frame->arg) {
+                struct expr *arg = frame->arg;
+                frame->arg = arg->next;
+                return arg;
+            }
 
+            struct symbol *sym = expr->call.callee->identifier.sym;
+            const char *calle = sym->ir_name;
             struct type *ret_ty = expr->call.callee->type->func.return_type;
 
             if (type_is_void(ret_ty)) {
-                emit_call(calle, args, arg_count, false, ir_constant(0));
-                return ir_constant(0); // Dummy value, should not be used
+                emit_call(calle, frame->args, stage, false, ir_constant(0));
+                return finish_expr(ir_constant(0)); // Dummy value, should not be used
             }
 
             struct ir_value dst = make_temp();
             
-            emit_call(calle, args, arg_count, true, dst);
+            emit_call(calle, frame->args, stage, true, dst);
 
-            return dst;
+            return finish_expr(dst);
         }     
+    }
 
-        default:
-            break;
+    return finish_expr(ir_constant(0));
+}
+
+static struct ir_value emit_expr(struct expr *expr)
+{
+    int floor = expr_frame_count;
+    push_expr_frame(expr);
+
+    while (expr_frame_count > floor) {
+        struct expr *operand = step_expr(&expr_frames[expr_frame_count - 1]);
+        if (operand)
+            push_expr_frame(operand);
     }
+
+    return pop_value();
 }
 
 static void emit_decl_list(struct decl *decls)
@@ -490,7 +579,7 @@ static void emit_decl_list(struct decl *decls)
             continue;
 
         if (decl->object.init) {
-            struct ir_value dst = ir_pseudo(decl->sym->ir_name);
+            struct ir_value dst = ir_pseudo(local_base + decl->sym->local);
             struct ir_value src = emit_expr(decl->object.init);
             
             emit_copy(src, dst);
@@ -498,10 +587,54 @@ static void emit_decl_list(struct decl *decls)
     }
 }
 
-static void emit_stmt(struct stmt *stmt)
+struct stmt_frame {
+    struct stmt *stmt;
+    int stage;
+    int labels[4];
+    struct block_item *item;    // Next one
+};
+
+static struct stmt_frame *stmt_frames;
+static int stmt_frame_count;
+static int stmt_frame_capacity;
+
+static void push_stmt_frame(struct stmt *stmt)
 {
-    if (!stmt)
-        return;
+    if (stmt_frame_count == stmt_frame_capacity) {
+        stmt_frame_capacity = stmt_frame_capacity ? stmt_frame_capacity * 2 : 32;
+        stmt_frames = realloc(stmt_frames, stmt_frame_capacity * sizeof(struct stmt_frame));
+    }
+
+    stmt_frames[stmt_frame_count++] = (struct stmt_frame) { .stmt = stmt };
+}
+
+// Emits the items of a block, case or default up to the next statement
+static bool next_item(struct stmt_frame *frame, struct stmt **nested)
+{
+    while (frame->item) {
+        struct block_item *item = frame->item;
+        frame->item = item->next;
+
+        if (item->kind == BLOCK_ITEM_DECL) {
+            emit_decl_list(item->decls);
+            continue;
+        }
+
+        *nested = item->stmt;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Emits the code of 'frame' up to its next nested statement, which
+ * goes to 'nested', or to its end and returns false.
+ */
+static bool step_stmt(struct stmt_frame *frame, struct stmt **nested)
+{
+    struct stmt *stmt = frame->stmt;
+    int stage = frame->stage++;
 
     switch (stmt->kind) {
         case STMT_NULL:
@@ -519,99 +652,155 @@ static void emit_stmt(struct stmt *stmt)
             break;
 
         case STMT_IF: {
-            struct ir_value cond = emit_expr(stmt->if_stmt.condition);
+            int *end_label = &frame->labels[0];
+            int *else_label = &frame->labels[1];
 
-            if (!stmt->if_stmt.else_stmt) {
-                int end_label = make_label();
+            if (stage == 0) {
+                struct ir_value cond = emit_expr(stmt->if_stmt.condition);
 
-                emit_jump_if_zero(cond, end_label);
-                emit_stmt(stmt->if_stmt.then_stmt);
-                emit_label(end_label);
-                break;
-            } 
+                *end_label = make_label();
 
-            int end_label = make_label();
-            int else_label = make_label();
+                if (!stmt->if_stmt.else_stmt) {
+                    emit_jump_if_zero(cond, *end_label);
+                } else {
+                    *else_label = make_label();
+                    emit_jump_if_zero(cond, *else_label);
+                }
 
-            emit_jump_if_zero(cond, else_label);
-            emit_stmt(stmt->if_stmt.then_stmt);
-            emit_jump(end_label);
+                *nested = stmt->if_stmt.then_stmt;
+                return true;
+            }
+
+            if (stage == 1 && stmt->if_stmt.else_stmt) {
+                emit_jump(*end_label);
 
-            emit_label(else_label);
-            emit_stmt(stmt->if_stmt.else_stmt);
+                emit_label(*else_label);
+                *nested = stmt->if_stmt.else_stmt;
+                return true;
+            }
 
-            emit_label(end_label);
+            emit_label(*end_label);
             break;
         }
 
+        /*
+         * Loops are rotated to test at the bottom, so each iteration
+         * runs a single (taken) branch:
+         *   init
+         *   jump cond
+         * start:
+         *   body
+         * continue:
+         *   post
+         * cond:
+         *   if cond != 0 jump start
+         * break:
+         */
         case STMT_FOR: {
-            int start_label = make_label();
-            int break_label = get_or_create_label_id_cstr(stmt->for_stmt.break_label);
-            int continue_label = get_or_create_label_id_cstr(stmt->for_stmt.continue_label);
-
-            if (stmt->for_stmt.init) {
-                if (stmt->for_stmt.init->is_decl)
-                    emit_decl_list(stmt->for_stmt.init->decls);
-                else
-                    emit_expr(stmt->for_stmt.init->expr);
+            int *start_label = &frame->labels[0];
+            int *cond_label = &frame->labels[1];
+            int *break_label = &frame->labels[2];
+            int *continue_label = &frame->labels[3];
+
+            if (stage == 0) {
+                *start_label = make_label();
+                *cond_label = make_label();
+                *break_label = ast_label(stmt->for_stmt.break_label);
+                *continue_label = ast_label(stmt->for_stmt.continue_label);
+
+                if (stmt->for_stmt.init) {
+                    if (stmt->for_stmt.init->is_decl)
+                        emit_decl_list(stmt->for_stmt.init->decls);
+                    else
+                        emit_expr(stmt->for_stmt.init->expr);
+                }
+
+                emit_jump(*cond_label);
+                emit_label(*start_label);
+
+                *nested = stmt->for_stmt.body;
+                return true;
             }
 
-            emit_label(start_label);
+            emit_label(*continue_label);
+
+            if (stmt->for_stmt.post)
+                emit_expr(stmt->for_stmt.post);
+
+            emit_label(*cond_label);
 
             if (stmt->for_stmt.condition) {
                 struct ir_value cond = emit_expr(stmt->for_stmt.condition);
 
-                emit_jump_if_zero(cond, break_label);
+                emit_jump_if_not_zero(cond, *start_label);
+            } else {
+                emit_jump(*start_label);
             }
 
-            emit_stmt(stmt->for_stmt.body);
-
-            emit_label(continue_label);
-
-            if (stmt->for_stmt.post)
-                emit_expr(stmt->for_stmt.post);
-
-            emit_jump(start_label);
-            emit_label(break_label);
+            emit_label(*break_label);
             break;
         }
 
         case STMT_WHILE: {
-            int break_label = get_or_create_label_id_cstr(stmt->while_stmt.break_label);
-            int continue_label = get_or_create_label_id_cstr(stmt->while_stmt.continue_label);
+            int *start_label = &frame->labels[0];
+            int *break_label = &frame->labels[1];
+            int *continue_label = &frame->labels[2];
 
-            emit_label(continue_label);
+            if (stage == 0) {
+                *start_label = make_label();
+                *break_label = ast_label(stmt->while_stmt.break_label);
+                *continue_label = ast_label(stmt->while_stmt.continue_label);
 
-            struct ir_value cond = emit_expr(stmt->while_stmt.condition);
-            emit_jump_if_zero(cond, break_label);
+                emit_jump(*continue_label);
+                emit_label(*start_label);
+
+                *nested = stmt->while_stmt.body;
+                return true;
+            }
+
+            emit_label(*continue_label);
 
-            emit_stmt(stmt->while_stmt.body);
+            struct ir_value cond = emit_expr(stmt->while_stmt.condition);
+            emit_jump_if_not_zero(cond, *start_label);
 
-            emit_jump(continue_label);
-            emit_label(break_label);
+            emit_label(*break_label);
             break;
         }
 
         case STMT_DOWHILE: {
-            int start_label = make_label();
-            int break_label = get_or_create_label_id_cstr(stmt->dowhile_stmt.break_label);
-            int continue_label = get_or_create_label_id_cstr(stmt->dowhile_stmt.continue_label);
+            int *start_label = &frame->labels[0];
+            int *break_label = &frame->labels[1];
+            int *continue_label = &frame->labels[2];
+
+            if (stage == 0) {
+                *start_label = make_label();
+                *break_label = ast_label(stmt->dowhile_stmt.break_label);
+                *continue_label = ast_label(stmt->dowhile_stmt.continue_label);
 
-            emit_label(start_label);
+                emit_label(*start_label);
 
-            emit_stmt(stmt->dowhile_stmt.body);
+                *nested = stmt->dowhile_stmt.body;
+                return true;
+            }
 
-            emit_label(continue_label);
+            emit_label(*continue_label);
 
             struct ir_value cond = emit_expr(stmt->dowhile_stmt.condition);
-            emit_jump_if_not_zero(cond, start_label);
+            emit_jump_if_not_zero(cond, *start_label);
 
-            emit_label(break_label);
+            emit_label(*break_label);
             break;
         }
 
         case STMT_SWITCH: {
-            int break_label = get_or_create_label_id_cstr(stmt->switch_stmt.break_label);
+            int *break_label = &frame->labels[0];
+
+            if (stage == 1) {
+                emit_label(*break_label);
+                break;
+            }
+
+            *break_label = ast_label(stmt->switch_stmt.break_label);
             
             struct ir_value cond = emit_expr(stmt->switch_stmt.condition);
             struct switch_annotation *ann = stmt->switch_stmt.annotation;
@@ -632,7 +821,7 @@ static void emit_stmt(struct stmt *stmt)
                 int value = case_node->case_stmt.value->int_value;
                 struct ir_value case_value = ir_constant(value);
                 
-                int case_label = get_or_create_label_id_cstr(case_node->case_stmt.label);
+                int case_label = ast_label(case_node->case_stmt.label);
 
                 struct ir_value cmp = make_temp();
                 emit_binary(IR_BINOP_EQ, cond, case_value, cmp);
@@ -640,73 +829,75 @@ static void emit_stmt(struct stmt *stmt)
             }
 
             if (ann->default_node) {
-                int default_label = get_or_create_label_id_cstr(ann->default_node->default_stmt.label);
+                int default_label = ast_label(ann->default_node->default_stmt.label);
                 emit_jump(default_label);
             } else {
-                emit_jump(break_label);
+                emit_jump(*break_label);
             }
 
             // The body itself emits cases/defaults or other statements
-            emit_stmt(stmt->switch_stmt.body);
-
-            emit_label(break_label);
-            break;
+            *nested = stmt->switch_stmt.body;
+            return true;
         }
 
-        case STMT_DEFAULT: {
-            int label_id = get_or_create_label_id_cstr(stmt->default_stmt.label);
-
-            emit_label(label_id);
-
-            for (struct block_item *item = stmt->default_stmt.items; item; item = item->next)
-                emit_block_item(item);
-            break;
-        }
-
-        case STMT_CASE: {
-            int label_id = get_or_create_label_id_cstr(stmt->case_stmt.label);
+        case STMT_DEFAULT:
+            if (stage == 0) {
+                emit_label(ast_label(stmt->default_stmt.label));
+                frame->item = stmt->default_stmt.items;
+            }
+            return next_item(frame, nested);
 
-            emit_label(label_id);
+        case STMT_CASE:
+            if (stage == 0) {
+                emit_label(ast_label(stmt->case_stmt.label));
+                frame->item = stmt->case_stmt.items;
+            }
+            return next_item(frame, nested);
 
-            for (struct block_item *item = stmt->case_stmt.items; item; item = item->next)
-                emit_block_item(item);
-            break;
-        }
         case STMT_BREAK:
-            emit_jump(get_or_create_label_id_cstr(stmt->break_stmt.target_label));
+            emit_jump(ast_label(stmt->break_stmt.target_label));
             break;
         case STMT_CONTINUE:
-            emit_jump(get_or_create_label_id_cstr(stmt->continue_stmt.target_label));
+            emit_jump(ast_label(stmt->continue_stmt.target_label));
             break;
 
         case STMT_GOTO:
-            emit_jump(get_or_create_label_id_tok(&stmt->goto_stmt.label));
+            emit_jump(ast_label(stmt->goto_stmt.target_label));
             break;
 
-        case STMT_LABEL: {
-            int label_id = get_or_create_label_id_tok(&stmt->label_stmt.name);
-
-            emit_label(label_id);
-            emit_stmt(stmt->label_stmt.stmt);
+        case STMT_LABEL:
+            if (stage == 0) {
+                emit_label(ast_label(stmt->label_stmt.label));
+                *nested = stmt->label_stmt.stmt;
+                return true;
+            }
             break;
-        }
 
         case STMT_BLOCK:
-            for (struct block_item *item = stmt->block.items; item; item = item->next)
-                emit_block_item(item);
-            break;
+            if (stage == 0)
+                frame->item = stmt->block.items;
+            return next_item(frame, nested);
     }
+
+    return false;
 }
 
-static void emit_block_item(struct block_item *item)
+static void emit_stmt(struct stmt *stmt)
 {
-    if (!item)
+    if (!stmt)
         return;
 
-    if (item->kind == BLOCK_ITEM_DECL)
-        emit_decl_list(item->decls);
-    else
-        emit_stmt(item->stmt);
+    int floor = stmt_frame_count;
+    push_stmt_frame(stmt);
+
+    while (stmt_frame_count > floor) {
+        struct stmt *nested;
+
+        if (!step_stmt(&stmt_frames[stmt_frame_count - 1], &nested))
+            stmt_frame_count--;
+        else if (nested)
+            push_stmt_frame(nested);
+    }
 }
 
 static void emit_static_variables(struct ir_program *ir)
@@ -725,6 +916,7 @@ static void emit_static_variables(struct ir_program *ir)
         var->name = sym->ir_name;
         var->linkage = sym->linkage;
         var->init = sym->has_static_init ? sym->static_init : 0;
+        var->tentative = !sym->has_static_init;
 
         append_static_variable(ir, var);
     }
@@ -734,7 +926,7 @@ static void emit_function_params(struct ir_function *fn, struct decl *params)
 {
     for (struct decl *param = params; param; param = param->next) {
         struct ir_param *ir_param = calloc(1, sizeof(struct ir_param));
-        ir_param->name = param->ir_name;
+        ir_param->pseudo = local_base + param->sym->local;
 
         append_param(fn, ir_param);
     }
@@ -763,18 +955,19 @@ static struct ir_function *emit_function(struct decl *decl)
     fn->name = decl->ir_name;
     fn->linkage = decl->linkage;
 
+    label_base = next_label_id - 1;
+    next_label_id += decl->func.label_count;
+    local_base = next_temp_id - 1;
+    next_temp_id += decl->func.local_count;
+
     emit_function_params(fn, decl->func.params);
 
     current_function = fn;
 
-    hashmap_init(&label_ids);
-
     emit_stmt(decl->func.body);
 
     emit_implicit_fallthrough_return(decl);
 
-    hashmap_free(&label_ids);
-
     current_function = NULL;
 
     return fn;
@@ -785,8 +978,6 @@ struct ir_program *build_ir(struct ast_program *program)
     struct ir_program *ir = calloc(1, sizeof(struct ir_program));
 
     current_function = NULL;
-    next_temp_id = 0;
-    next_label_id = 1;
 
     for (struct decl *decl = program->decls; decl; decl = decl->next) {
         if (decl->kind == DECL_OBJECT) {
@@ -803,3 +994,13 @@ struct ir_program *build_ir(struct ast_program *program)
 
     return ir;
 }
+
+struct ir_value ir_new_temp(void)
+{
+    return make_temp();
+}
+
+int ir_new_label(void)
+{
+    return make_label();
+}
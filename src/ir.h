@@ -11,12 +11,16 @@ enum ir_value_kind {
     IR_VALUE_STATIC,
 };
 
+/*
+ * Pseudos (locals, parameters and temporaries) and labels are numbers
+ * from 1, unique in the program. Only statics are named.
+ */
 struct ir_value {
     enum ir_value_kind kind;
 
     union {
         long constant;
-        
+        int pseudo;
         const char *name;
     };
 };
@@ -57,7 +61,8 @@ enum ir_instr_kind {
     IR_INSTR_JUMP_IF_ZERO,
     IR_INSTR_JUMP_IF_NOT_ZERO,
     IR_INSTR_LABEL,
-    IR_INSTR_CALL
+    IR_INSTR_CALL,
+    IR_INSTR_COUNT,     // -fprofile-generate counter += 1, on 64 bits
 };
 
 struct ir_instr {
@@ -105,26 +110,45 @@ struct ir_instr {
         struct {
             struct ir_value cond;
             int label_id;
+
+            bool has_count;     // From -fprofile-use
+            long taken_count;
         } jump_if_zero;
 
         struct {
             struct ir_value cond;
             int label_id;
+
+            bool has_count;
+            long taken_count;
         } jump_if_not_zero;
 
         struct {
             int label_id;
+
+            bool has_count;     // Executions of the block it starts
+            long count;
         } label;
+
+        struct {
+            struct ir_value counter;    // Static
+        } count;
     };
 };
 
 /* Function / Program */
 
 struct ir_param {
-    const char *name;
+    int pseudo;
     struct ir_param *next;
 };
 
+enum ir_section {
+    IR_SECTION_TEXT,
+    IR_SECTION_HOT,         // .text.hot
+    IR_SECTION_UNLIKELY,    // .text.unlikely
+};
+
 struct ir_function {
     const char *name;
     enum linkage linkage;
@@ -134,6 +158,17 @@ struct ir_function {
     struct ir_instr *first;
     struct ir_instr *last;
 
+    // Filled from -fprofile-use
+    bool has_profile;
+    long entry_count;
+    enum ir_section section;
+
+    // Blocks from 'cold_label' on were never run, they go in .text.unlikely
+    bool has_cold_part;
+    int cold_label;
+
+    int pseudo_count;       // Set by ir_number_pseudos
+
     struct ir_function *next;
 };
 
@@ -142,15 +177,34 @@ struct ir_static_variable {
     enum linkage linkage;
 
     int init; // Later ir_static_init
+    bool tentative; // No initializer was written, init is 0
+    bool counter;   // 64-bit -fprofile-generate counter, not an int
 
     struct ir_static_variable *next;
 };
 
+// Counter added by -fprofile-generate, written to the profile at exit
+struct ir_profile_counter {
+    const char *function;
+    int function_counters;  // Counters 'function' has, to detect stale profiles
+    int index;
+    const char *symbol;     // Static variable holding the count
+
+    struct ir_profile_counter *next;
+};
+
 struct ir_program {
     struct ir_function *functions;
     struct ir_static_variable *static_vars;
+
+    const char *profile_path;   // Set when instrumented
+    struct ir_profile_counter *profile_counters;
 };
 
 struct ir_program *build_ir(struct ast_program *program);
 
+// Fresh numbers for passes that run after build_ir
+struct ir_value ir_new_temp(void);
+int ir_new_label(void);
+
 #endif
@@ -0,0 +1,879 @@
+/*
+ * x86-64 machine code for the instructions emit_x86 would print.
+ *
+ * Every unit is encoded into one growable buffer. Jumps to labels that
+ * are already placed use the short form when it reaches, the rest get a
+ * rel32 patched at the end of the function. Calls and %rip relative data
+ * references are patched once the image is mapped:
+ *
+ *   [ code | call stubs | padding to a page | static variables ]
+ *
+ * Symbols are looked up in the unit first (static linkage), then among
+ * the globals of all units, then with dlsym() in the compiler's own
+ * process. Calls to the latter go through a stub holding the absolute
+ * address, like a PLT entry, since libc is usually further than rel32.
+ *
+ * Sections are ignored, cold blocks simply follow the hot ones.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "base/hash_map.h"
+
+#define STATIC_VAR_SIZE 4
+#define COUNTER_SIZE 8      // -fprofile-generate counters
+#define STUB_SIZE 16
+
+// Hardware numbers, the low 3 bits go in ModRM/SIB and bit 3 in REX
+#define HW_SP 4
+#define HW_BP 5
+
+static const int hw_regs[] = {
+    [REG_AX] = 0,
+    [REG_CX] = 1,
+    [REG_DX] = 2,
+    [REG_DI] = 7,
+    [REG_SI] = 6,
+    [REG_R8] = 8,
+    [REG_R9] = 9,
+    [REG_R10] = 10,
+    [REG_R11] = 11,
+    [REG_BX] = 3,
+    [REG_R12] = 12,
+    [REG_R13] = 13,
+    [REG_R14] = 14,
+    [REG_R15] = 15,
+};
+
+enum symbol_section {
+    SYM_CODE,
+    SYM_DATA,
+    SYM_EXTERNAL,   // Absolute address from dlsym()
+};
+
+struct symbol {
+    const char *name;
+    enum symbol_section section;
+    size_t offset;
+    void *address;  // SYM_EXTERNAL
+};
+
+enum fixup_kind {
+    FIXUP_LABEL,    // rel32 to a label of the function being encoded
+    FIXUP_CALL,     // rel32 to a function, or its stub
+    FIXUP_DATA,     // %rip relative disp32
+};
+
+struct fixup {
+    enum fixup_kind kind;
+    size_t pos;         // Of the rel32
+    size_t next_ip;     // Address the CPU adds the rel32 to
+    int label;
+    const char *symbol;
+    int unit;
+
+    struct fixup *next;
+};
+
+static struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} code;
+
+static hash_map *unit_symbols;  // Everything a unit defines
+static hash_map global_symbols;
+
+static struct fixup *symbol_fixups;
+static struct fixup *label_fixups;
+static struct fixup *pending_rip;   // Its next_ip is the end of the instruction
+
+// State of the function being encoded, like emit_fn in x86.c
+static struct asm_function *jit_fn;
+static int jit_unit;
+static int push_depth;
+static long *label_offsets;
+
+static void jit_error(const char *fmt, const char *name)
+{
+    fprintf(stderr, "cinc: ");
+    fprintf(stderr, fmt, name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/* Code buffer */
+
+static void emit_byte(int byte)
+{
+    if (code.size == code.capacity) {
+        code.capacity = code.capacity ? code.capacity * 2 : 4096;
+        code.data = realloc(code.data, code.capacity);
+    }
+    code.data[code.size++] = (unsigned char)byte;
+}
+
+static void emit_u32(uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emit_byte((value >> (8 * i)) & 0xff);
+}
+
+static void patch_u32(unsigned char *at, uint32_t value)
+{
+    memcpy(at, &value, sizeof(value));
+}
+
+static bool fits_int8(long value)
+{
+    return value >= -128 && value <= 127;
+}
+
+// Two byte opcodes are written as 0x0Fxx
+static void emit_opcode(int opcode)
+{
+    if (opcode > 0xff)
+        emit_byte(opcode >> 8);
+    emit_byte(opcode & 0xff);
+}
+
+static struct fixup *add_fixup(struct fixup **list, enum fixup_kind kind)
+{
+    struct fixup *fixup = calloc(1, sizeof(*fixup));
+    fixup->kind = kind;
+    fixup->pos = code.size;
+    fixup->next_ip = code.size + 4;
+    fixup->unit = jit_unit;
+
+    fixup->next = *list;
+    *list = fixup;
+    return fixup;
+}
+
+/* Operands */
+
+// ModRM r/m: a register, [base + index*scale + disp] or a %rip relative symbol
+struct rm {
+    bool is_reg;
+    int reg;
+
+    int base;       // -1 for none
+    int index;      // -1 for none
+    int scale;
+    int disp;
+    const char *symbol;
+};
+
+static struct rm rm_reg(int reg)
+{
+    return (struct rm) { .is_reg = true, .reg = reg };
+}
+
+static struct rm rm_mem(int base, int disp)
+{
+    return (struct rm) { .base = base, .index = -1, .scale = 1, .disp = disp };
+}
+
+static struct rm rm_operand(struct operand op)
+{
+    switch (op.type) {
+        case OPERAND_REG:
+            return rm_reg(hw_regs[op.reg]);
+        case OPERAND_STACK:
+            if (jit_fn->omit_frame_pointer)
+                return rm_mem(HW_SP, op.stack + jit_fn->frame_bias + push_depth);
+            return rm_mem(HW_BP, op.stack);
+        case OPERAND_DATA: {
+            struct rm rm = rm_mem(-1, 0);
+            rm.symbol = op.data;
+            return rm;
+        }
+        default:
+            jit_error("operand can't be encoded in %s", jit_fn->name);
+            return rm_reg(0);
+    }
+}
+
+static int scale_bits(int scale)
+{
+    switch (scale) {
+        case 2:  return 1;
+        case 4:  return 2;
+        case 8:  return 3;
+        default: return 0;
+    }
+}
+
+/*
+ * [REX] opcode ModRM [SIB] [disp]. 'reg' is a register or an opcode
+ * extension. With 'byte_reg' r/m is an 8 bit register, which needs a
+ * REX prefix for %sil and %dil (%dh and %bh without one).
+ */
+static void encode_rm(int opcode, bool rex_w, int reg, struct rm rm, bool byte_reg)
+{
+    int rex = (rex_w ? 8 : 0) | (reg & 8 ? 4 : 0);
+
+    if (rm.is_reg) {
+        rex |= rm.reg & 8 ? 1 : 0;
+        if (byte_reg && rm.reg >= 4 && rm.reg < 8)
+            rex |= 0x40;
+    } else {
+        rex |= rm.index >= 0 && (rm.index & 8) ? 2 : 0;
+        rex |= rm.base >= 0 && (rm.base & 8) ? 1 : 0;
+    }
+
+    if (rex)
+        emit_byte(0x40 | rex);
+    emit_opcode(opcode);
+
+    if (rm.is_reg) {
+        emit_byte(0xc0 | (reg & 7) << 3 | (rm.reg & 7));
+        return;
+    }
+
+    if (rm.symbol) {
+        emit_byte((reg & 7) << 3 | 5);
+        pending_rip = add_fixup(&symbol_fixups, FIXUP_DATA);
+        pending_rip->symbol = rm.symbol;
+        emit_u32(0);
+        return;
+    }
+
+    // %rsp and %r12 as base, or any index, need a SIB byte
+    bool need_sib = rm.index >= 0 || rm.base < 0 || (rm.base & 7) == HW_SP;
+
+    int mod;
+    if (rm.base < 0)
+        mod = 0;
+    else if (rm.disp == 0 && (rm.base & 7) != HW_BP)
+        mod = 0;
+    else if (fits_int8(rm.disp))
+        mod = 1;
+    else
+        mod = 2;
+
+    emit_byte(mod << 6 | (reg & 7) << 3 | (need_sib ? 4 : rm.base & 7));
+
+    if (need_sib) {
+        int index = rm.index >= 0 ? rm.index & 7 : 4;
+        int base = rm.base >= 0 ? rm.base & 7 : 5;
+        emit_byte(scale_bits(rm.scale) << 6 | index << 3 | base);
+    }
+
+    if (mod == 1)
+        emit_byte(rm.disp & 0xff);
+    else if (mod == 2 || rm.base < 0)
+        emit_u32(rm.disp);
+}
+
+static void encode_reg_op(int opcode, int reg)
+{
+    if (reg & 8)
+        emit_byte(0x41);
+    emit_byte(opcode + (reg & 7));
+}
+
+// <op>q $imm, %rsp
+static void encode_rsp_imm(int ext, int imm)
+{
+    if (fits_int8(imm)) {
+        encode_rm(0x83, true, ext, rm_reg(HW_SP), false);
+        emit_byte(imm & 0xff);
+    } else {
+        encode_rm(0x81, true, ext, rm_reg(HW_SP), false);
+        emit_u32(imm);
+    }
+}
+
+/* Instructions */
+
+struct alu_encoding {
+    int to_rm;      // op reg, r/m
+    int from_rm;    // op r/m, reg
+    int ext;        // op $imm, r/m
+};
+
+static const struct alu_encoding cmp_encoding = { 0x39, 0x3b, 7 };
+
+static struct alu_encoding alu_encoding(enum asm_op op)
+{
+    switch (op) {
+        case ASM_ADD: return (struct alu_encoding) { 0x01, 0x03, 0 };
+        case ASM_OR:  return (struct alu_encoding) { 0x09, 0x0b, 1 };
+        case ASM_AND: return (struct alu_encoding) { 0x21, 0x23, 4 };
+        case ASM_SUB: return (struct alu_encoding) { 0x29, 0x2b, 5 };
+        case ASM_XOR: return (struct alu_encoding) { 0x31, 0x33, 6 };
+        default:      return cmp_encoding;
+    }
+}
+
+static int shift_ext(enum asm_op op)
+{
+    switch (op) {
+        case ASM_SHL: return 4;
+        case ASM_SHR: return 5;
+        default:      return 7;  // sar
+    }
+}
+
+static int cond_bits(enum cond_code c)
+{
+    switch (c) {
+        case COND_E:  return 0x4;
+        case COND_NE: return 0x5;
+        case COND_L:  return 0xc;
+        case COND_GE: return 0xd;
+        case COND_LE: return 0xe;
+        default:      return 0xf;  // g
+    }
+}
+
+// add/sub/and/or/xor/cmp in AT&T order: dst <op>= src
+static void encode_alu(struct alu_encoding enc, struct operand src, struct operand dst)
+{
+    if (src.type == OPERAND_IMM) {
+        if (fits_int8(src.imm)) {
+            encode_rm(0x83, false, enc.ext, rm_operand(dst), false);
+            emit_byte(src.imm & 0xff);
+        } else {
+            encode_rm(0x81, false, enc.ext, rm_operand(dst), false);
+            emit_u32(src.imm);
+        }
+    } else if (src.type == OPERAND_REG) {
+        encode_rm(enc.to_rm, false, hw_regs[src.reg], rm_operand(dst), false);
+    } else {
+        encode_rm(enc.from_rm, false, hw_regs[dst.reg], rm_operand(src), false);
+    }
+}
+
+static void encode_mov(struct operand src, struct operand dst)
+{
+    if (src.type == OPERAND_REG && dst.type == OPERAND_REG && src.reg == dst.reg)
+        return;
+
+    if (src.type == OPERAND_IMM && dst.type == OPERAND_REG) {
+        encode_reg_op(0xb8, hw_regs[dst.reg]);
+        emit_u32(src.imm);
+    } else if (src.type == OPERAND_IMM) {
+        encode_rm(0xc7, false, 0, rm_operand(dst), false);
+        emit_u32(src.imm);
+    } else if (src.type == OPERAND_REG) {
+        encode_rm(0x89, false, hw_regs[src.reg], rm_operand(dst), false);
+    } else {
+        encode_rm(0x8b, false, hw_regs[dst.reg], rm_operand(src), false);
+    }
+}
+
+static void encode_binary(struct asm_instr *instr)
+{
+    struct operand src = instr->binary.src;
+    struct operand dst = instr->binary.dst;
+
+    switch (instr->binary.op) {
+        case ASM_IMUL:
+            if (src.type != OPERAND_IMM) {
+                encode_rm(0x0faf, false, hw_regs[dst.reg], rm_operand(src), false);
+            } else if (fits_int8(src.imm)) {
+                encode_rm(0x6b, false, hw_regs[dst.reg], rm_operand(dst), false);
+                emit_byte(src.imm & 0xff);
+            } else {
+                encode_rm(0x69, false, hw_regs[dst.reg], rm_operand(dst), false);
+                emit_u32(src.imm);
+            }
+            break;
+        case ASM_SHL:
+        case ASM_SHR:
+        case ASM_SAR:
+            // Phase 3 leaves an immediate or %cl
+            if (src.type == OPERAND_IMM) {
+                encode_rm(0xc1, false, shift_ext(instr->binary.op), rm_operand(dst), false);
+                emit_byte(src.imm & 0xff);
+            } else {
+                encode_rm(0xd3, false, shift_ext(instr->binary.op), rm_operand(dst), false);
+            }
+            break;
+        default:
+            encode_alu(alu_encoding(instr->binary.op), src, dst);
+            break;
+    }
+}
+
+static void encode_unary(struct asm_instr *instr)
+{
+    struct rm rm = rm_operand(instr->unary.oper);
+
+    switch (instr->unary.op) {
+        case ASM_NEG: encode_rm(0xf7, false, 3, rm, false); break;
+        case ASM_NOT: encode_rm(0xf7, false, 2, rm, false); break;
+        case ASM_INC: encode_rm(0xff, false, 0, rm, false); break;
+        case ASM_DEC: encode_rm(0xff, false, 1, rm, false); break;
+        case ASM_INCQ: encode_rm(0xff, true, 0, rm, false); break;
+        default: break;
+    }
+}
+
+static void encode_lea(struct asm_instr *instr)
+{
+    struct rm rm = rm_mem(-1, instr->lea.disp);
+
+    if (instr->lea.has_base)
+        rm.base = hw_regs[instr->lea.base.reg];
+    if (instr->lea.has_index) {
+        rm.index = hw_regs[instr->lea.index.reg];
+        rm.scale = instr->lea.scale;
+    }
+
+    encode_rm(0x8d, false, hw_regs[instr->lea.dst.reg], rm, false);
+}
+
+// jmp/jcc, 'cc' is -1 for jmp. Backward jumps take the short form if it reaches
+static void encode_jump(int cc, int label)
+{
+    long target = label_offsets[label];
+
+    if (target >= 0 && fits_int8(target - (long)(code.size + 2))) {
+        emit_byte(cc < 0 ? 0xeb : 0x70 | cc);
+        emit_byte((target - (long)(code.size + 1)) & 0xff);
+        return;
+    }
+
+    emit_opcode(cc < 0 ? 0xe9 : 0x0f80 | cc);
+
+    if (target >= 0) {
+        emit_u32(target - (long)(code.size + 4));
+        return;
+    }
+
+    struct fixup *fixup = add_fixup(&label_fixups, FIXUP_LABEL);
+    fixup->label = label;
+    emit_u32(0);
+}
+
+static void encode_call(int opcode, const char *name)
+{
+    emit_byte(opcode);
+    struct fixup *fixup = add_fixup(&symbol_fixups, FIXUP_CALL);
+    fixup->symbol = name;
+    emit_u32(0);
+}
+
+static void encode_epilogue(struct asm_function *fn)
+{
+    if (fn->saved_reg_count > 0 || fn->omit_frame_pointer) {
+        if (fn->frame_size > 0)
+            encode_rsp_imm(0, fn->frame_size);
+
+        for (int i = fn->saved_reg_count - 1; i >= 0; i--)
+            encode_reg_op(0x58, hw_regs[fn->saved_regs[i]]);
+    } else if (fn->frame_size > 0) {
+        encode_rm(0x89, true, HW_BP, rm_reg(HW_SP), false);
+    }
+
+    if (!fn->omit_frame_pointer)
+        encode_reg_op(0x58, HW_BP);
+}
+
+// Recommended multi-byte nops, index is the length
+static const unsigned char nops[][9] = {
+    [1] = { 0x90 },
+    [2] = { 0x66, 0x90 },
+    [3] = { 0x0f, 0x1f, 0x00 },
+    [4] = { 0x0f, 0x1f, 0x40, 0x00 },
+    [5] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    [6] = { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    [7] = { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+    [8] = { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    [9] = { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+
+// Same rule as .p2align: nops when executed, int3 between functions
+static void align_code(struct code_alignment alignment, bool executed)
+{
+    if (alignment.align <= 1)
+        return;
+
+    int padding = (alignment.align - code.size % alignment.align) % alignment.align;
+
+    if (alignment.max_skip > 0 && padding > alignment.max_skip)
+        return;
+
+    if (!executed) {
+        while (padding-- > 0)
+            emit_byte(0xcc);
+        return;
+    }
+
+    while (padding > 0) {
+        int len = padding < 9 ? padding : 9;
+        for (int i = 0; i < len; i++)
+            emit_byte(nops[len][i]);
+        padding -= len;
+    }
+}
+
+static void encode_instr(struct asm_instr *instr, struct codegen_options *opts)
+{
+    switch (instr->type) {
+        case ASM_MOV:
+            encode_mov(instr->mov.src, instr->mov.dst);
+            break;
+        case ASM_UNARY:
+            encode_unary(instr);
+            break;
+        case ASM_BINARY:
+            encode_binary(instr);
+            break;
+        case ASM_CMP:
+            encode_alu(cmp_encoding, instr->cmp.lhs, instr->cmp.rhs);
+            break;
+        case ASM_TEST: {
+            int reg = hw_regs[instr->test.oper.reg];
+            encode_rm(0x85, false, reg, rm_reg(reg), false);
+            break;
+        }
+        case ASM_IDIV:
+            encode_rm(0xf7, false, 7, rm_operand(instr->idiv.oper), false);
+            break;
+        case ASM_IMUL_WIDE:
+            encode_rm(0xf7, false, 5, rm_operand(instr->imul_wide.oper), false);
+            break;
+        case ASM_LEA:
+            encode_lea(instr);
+            break;
+        case ASM_CDQ:
+            emit_byte(0x99);
+            break;
+        case ASM_JMP:
+            encode_jump(-1, instr->jmp.identifier);
+            break;
+        case ASM_JMPCC:
+            encode_jump(cond_bits(instr->jmpcc.code), instr->jmpcc.identifier);
+            break;
+        case ASM_SETCC:
+            encode_rm(0x0f90 | cond_bits(instr->setcc.code), false, 0,
+                      rm_operand(instr->setcc.oper), true);
+            break;
+        case ASM_LABEL:
+            if (instr->label.loop_header)
+                align_code(opts->align_loops, true);
+            else if (instr->label.no_fallthrough)
+                align_code(opts->align_jumps, true);
+            label_offsets[instr->label.identifier] = code.size;
+            break;
+        case ASM_ALLOCSTACK:
+            encode_rsp_imm(5, instr->allocate_stack.val);
+            push_depth += instr->allocate_stack.val;
+            break;
+        case ASM_DEALLOCSTACK:
+            encode_rsp_imm(0, instr->deallocate_stack.val);
+            push_depth -= instr->deallocate_stack.val;
+            break;
+        case ASM_PUSH:
+            if (instr->push.oper.type == OPERAND_IMM) {
+                if (fits_int8(instr->push.oper.imm)) {
+                    emit_byte(0x6a);
+                    emit_byte(instr->push.oper.imm & 0xff);
+                } else {
+                    emit_byte(0x68);
+                    emit_u32(instr->push.oper.imm);
+                }
+            } else {
+                encode_reg_op(0x50, hw_regs[instr->push.oper.reg]);
+            }
+            push_depth += 8;
+            break;
+        case ASM_CALL:
+            encode_call(0xe8, instr->call.identifier);
+            break;
+        case ASM_TAIL_CALL:
+            encode_epilogue(jit_fn);
+            encode_call(0xe9, instr->tail_call.identifier);
+            break;
+        case ASM_RET:
+            encode_epilogue(jit_fn);
+            emit_byte(0xc3);
+            break;
+    }
+
+    if (pending_rip) {
+        pending_rip->next_ip = code.size;
+        pending_rip = NULL;
+    }
+}
+
+/* Symbols */
+
+static void define_symbol(int unit, const char *name, bool global,
+                          enum symbol_section section, size_t offset)
+{
+    struct symbol *sym = calloc(1, sizeof(*sym));
+    sym->name = name;
+    sym->section = section;
+    sym->offset = offset;
+
+    int len = strlen(name);
+
+    if (!hashmap_set(&unit_symbols[unit], name, len, sym))
+        jit_error("multiple definition of '%s'", name);
+
+    if (global) {
+        if (hashmap_get(&global_symbols, name, len))
+            jit_error("multiple definition of '%s'", name);
+        hashmap_set(&global_symbols, name, len, sym);
+    }
+}
+
+// Unit, then globals, then the compiler's process
+static struct symbol *lookup_symbol(int unit, const char *name)
+{
+    int len = strlen(name);
+
+    struct symbol *sym = hashmap_get(&unit_symbols[unit], name, len);
+    if (!sym)
+        sym = hashmap_get(&global_symbols, name, len);
+    if (sym)
+        return sym;
+
+    void *address = dlsym(RTLD_DEFAULT, name);
+    if (!address)
+        jit_error("undefined reference to '%s'", name);
+
+    sym = calloc(1, sizeof(*sym));
+    sym->name = name;
+    sym->section = SYM_EXTERNAL;
+    sym->address = address;
+    hashmap_set(&global_symbols, name, len, sym);
+    return sym;
+}
+
+static int max_label(struct asm_function *fn)
+{
+    int max = fn->has_cold_part ? fn->cold_label : 0;
+
+    for (struct asm_instr *instr = fn->first; instr; instr = instr->next) {
+        int label = -1;
+        if (instr->type == ASM_LABEL)
+            label = instr->label.identifier;
+        else if (instr->type == ASM_JMP)
+            label = instr->jmp.identifier;
+        else if (instr->type == ASM_JMPCC)
+            label = instr->jmpcc.identifier;
+
+        if (label > max)
+            max = label;
+    }
+
+    return max;
+}
+
+static void encode_function(struct asm_function *fn, int unit,
+                            struct codegen_options *opts)
+{
+    align_code(opts->align_functions, false);
+    define_symbol(unit, fn->name, fn->global, SYM_CODE, code.size);
+
+    jit_fn = fn;
+    jit_unit = unit;
+    push_depth = 0;
+
+    int labels = max_label(fn) + 1;
+    label_offsets = malloc(labels * sizeof(*label_offsets));
+    for (int i = 0; i < labels; i++)
+        label_offsets[i] = -1;
+
+    if (!fn->omit_frame_pointer) {
+        encode_reg_op(0x50, HW_BP);
+        encode_rm(0x89, true, HW_SP, rm_reg(HW_BP), false);
+    }
+    for (int i = 0; i < fn->saved_reg_count; i++)
+        encode_reg_op(0x50, hw_regs[fn->saved_regs[i]]);
+    if (fn->frame_size > 0)
+        encode_rsp_imm(5, fn->frame_size);
+
+    for (struct asm_instr *instr = fn->first; instr; instr = instr->next)
+        encode_instr(instr, opts);
+
+    while (label_fixups) {
+        struct fixup *fixup = label_fixups;
+        label_fixups = fixup->next;
+
+        long target = label_offsets[fixup->label];
+        patch_u32(code.data + fixup->pos, target - (long)fixup->next_ip);
+        free(fixup);
+    }
+
+    free(label_offsets);
+}
+
+/* -fprofile-generate */
+
+static struct asm_program **profiled_programs;
+static int profiled_count;
+static unsigned char *image_data;   // Start of the static variables
+
+// Same records as the runtime emit_x86 writes into instrumented programs
+static void dump_profiles(void)
+{
+    for (int unit = 0; unit < profiled_count; unit++) {
+        struct asm_program *program = profiled_programs[unit];
+        if (!program->profile_path)
+            continue;
+
+        FILE *file = fopen(program->profile_path, "a");
+        if (!file)
+            continue;
+
+        for (struct ir_profile_counter *c = program->profile_counters; c; c = c->next) {
+            struct symbol *sym = hashmap_get(&unit_symbols[unit], c->symbol,
+                                             strlen(c->symbol));
+            uint64_t count;
+            memcpy(&count, image_data + sym->offset, sizeof(count));
+
+            if (count)
+                fprintf(file, "%s %d %d %lu\n", c->function, c->function_counters,
+                        c->index, (unsigned long)count);
+        }
+
+        fclose(file);
+    }
+}
+
+/* Linking */
+
+static size_t align_size(size_t value, size_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+int jit_run(struct asm_program **programs, int count,
+            struct codegen_options *opts, int argc, char **argv)
+{
+    unit_symbols = calloc(count, sizeof(*unit_symbols));
+    hashmap_init(&global_symbols);
+
+    size_t data_size = 0;
+
+    for (int unit = 0; unit < count; unit++) {
+        hashmap_init(&unit_symbols[unit]);
+
+        for (struct asm_static_variable *var = programs[unit]->static_vars; var; var = var->next) {
+            if (var->counter)
+                data_size = align_size(data_size, COUNTER_SIZE);
+
+            define_symbol(unit, var->name, var->global, SYM_DATA, data_size);
+            data_size += var->counter ? COUNTER_SIZE : STATIC_VAR_SIZE;
+        }
+    }
+
+    for (int unit = 0; unit < count; unit++) {
+        for (struct asm_function *fn = programs[unit]->functions; fn; fn = fn->next)
+            encode_function(fn, unit, opts);
+    }
+
+    // Calls out of the image go through a stub: jmp *2(%rip); int3; int3; .quad address
+    hash_map stubs;
+    hashmap_init(&stubs);
+    size_t stubs_start = align_size(code.size, STUB_SIZE);
+    size_t stubs_size = 0;
+
+    for (struct fixup *fixup = symbol_fixups; fixup; fixup = fixup->next) {
+        struct symbol *sym = lookup_symbol(fixup->unit, fixup->symbol);
+
+        if (fixup->kind == FIXUP_CALL && sym->section == SYM_EXTERNAL &&
+            !hashmap_get(&stubs, sym->name, strlen(sym->name))) {
+            hashmap_set(&stubs, sym->name, strlen(sym->name),
+                        (void *)(uintptr_t)(stubs_start + stubs_size));
+            stubs_size += STUB_SIZE;
+        }
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t data_start = align_size(stubs_start + stubs_size, page);
+    size_t image_size = align_size(data_start + data_size, page);
+
+    unsigned char *image = mmap(NULL, image_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (image == MAP_FAILED) {
+        perror("cinc: mmap");
+        exit(1);
+    }
+
+    memcpy(image, code.data, code.size);
+    memset(image + code.size, 0xcc, stubs_start - code.size);
+
+    for (size_t i = 0; i < stubs.capacity; i++) {
+        hm_entry *entry = &stubs.entries[i];
+        if (!entry->key)
+            continue;
+
+        struct symbol *sym = hashmap_get(&global_symbols, entry->key, entry->key_len);
+        unsigned char *stub = image + (uintptr_t)entry->value;
+        static const unsigned char jmp[] = { 0xff, 0x25, 0x02, 0x00, 0x00, 0x00, 0xcc, 0xcc };
+        uint64_t address = (uintptr_t)sym->address;
+
+        memcpy(stub, jmp, sizeof(jmp));
+        memcpy(stub + sizeof(jmp), &address, sizeof(address));
+    }
+
+    image_data = image + data_start;
+    for (int unit = 0; unit < count; unit++) {
+        for (struct asm_static_variable *var = programs[unit]->static_vars; var; var = var->next) {
+            struct symbol *sym = hashmap_get(&unit_symbols[unit], var->name, strlen(var->name));
+            int32_t init = var->init;
+            memcpy(image_data + sym->offset, &init, sizeof(init));
+        }
+    }
+
+    for (struct fixup *fixup = symbol_fixups; fixup; fixup = fixup->next) {
+        struct symbol *sym = lookup_symbol(fixup->unit, fixup->symbol);
+        unsigned char *target;
+
+        if (sym->section == SYM_CODE)
+            target = image + sym->offset;
+        else if (sym->section == SYM_DATA)
+            target = image_data + sym->offset;
+        else if (fixup->kind == FIXUP_CALL)
+            target = image + (uintptr_t)hashmap_get(&stubs, sym->name, strlen(sym->name));
+        else
+            target = sym->address;
+
+        long rel = (long)((intptr_t)target - (intptr_t)(image + fixup->next_ip));
+        if (rel < INT32_MIN || rel > INT32_MAX)
+            jit_error("'%s' is out of %%rip relative range", sym->name);
+
+        patch_u32(image + fixup->pos, (uint32_t)rel);
+    }
+
+    if (mprotect(image, data_start, PROT_READ | PROT_EXEC)) {
+        perror("cinc: mprotect");
+        exit(1);
+    }
+
+    hashmap_free(&stubs);
+    free(code.data);
+
+    // The caller's array may be gone by the time exit runs the dump
+    profiled_programs = malloc(count * sizeof(*programs));
+    memcpy(profiled_programs, programs, count * sizeof(*programs));
+    profiled_count = count;
+    atexit(dump_profiles);
+
+    struct symbol *main_sym = hashmap_get(&global_symbols, "main", 4);
+    if (!main_sym || main_sym->section != SYM_CODE)
+        jit_error("undefined reference to '%s'", "main");
+
+    // ISO C has no object to function pointer conversion
+    int (*entry)(int, char **);
+    void *address = image + main_sym->offset;
+    memcpy(&entry, &address, sizeof(entry));
+
+    return entry(argc, argv);
+}
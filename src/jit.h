@@ -0,0 +1,18 @@
+/*
+ * In-process execution (--run).
+ *
+ * Encodes the final x86 instructions into executable memory, links the
+ * translation units against each other and against the symbols already
+ * loaded in the compiler's process (libc), then calls main directly.
+ */
+
+#ifndef CINC_JIT_H
+#define CINC_JIT_H
+
+#include "x86.h"
+
+// Returns main's result, unresolved symbols are reported and exit(1)
+int jit_run(struct asm_program **programs, int count,
+            struct codegen_options *opts, int argc, char **argv);
+
+#endif
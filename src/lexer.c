@@ -1,26 +1,35 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "lexer.h"
 
 struct lexer {
     const char *start;
     const char *current;
-    const char *line_start;
-    int line;
+    bool line_start;    // A newline was skipped since the last token
 };
 
 static struct lexer lexer_state;
 
-extern const char *current_filename;
+static void init_tables(void);
 
 void lexer_init(const char *source)
 {
+    static bool tables_ready;
+    if (!tables_ready) {
+        init_tables();
+        tables_ready = true;
+    }
+
     lexer_state.start = source;
     lexer_state.current = source;
-    lexer_state.line_start = source;
-    lexer_state.line = 1;
+    lexer_state.line_start = true;
 }
 
 static bool is_at_end(void)
@@ -57,20 +66,25 @@ static bool match(char expected)
     return true;
 }
 
-static bool is_alpha(char c)
-{
-    if ((c >= 'a' && c <= 'z') ||
-        (c >= 'A' && c <= 'Z') ||
-         c == '_') return true;
+/*
+ * Character classes, a table lookup instead of range compares. Filled
+ * by init_tables, like the keyword hash below.
+ */
+enum {
+    CHAR_IDENT = 1 << 0,    // Letter or '_'
+    CHAR_DIGIT = 1 << 1,
+};
 
-    return false;
+static unsigned char char_class[256];
+
+static bool is_ident(char c)
+{
+    return char_class[(unsigned char)c] & (CHAR_IDENT | CHAR_DIGIT);
 }
 
 static bool is_digit(char c)
 {
-    if (c >= '0' && c <= '9')
-        return true;
-    return false;
+    return char_class[(unsigned char)c] & CHAR_DIGIT;
 }
 
 static struct token make_token(enum token_type type)
@@ -79,37 +93,155 @@ static struct token make_token(enum token_type type)
     tok.start = lexer_state.start;
     tok.length = lexer_state.current - lexer_state.start;
     tok.type = type;
-    tok.line = lexer_state.line;
     tok.line_start = lexer_state.line_start;
-    tok.filename = current_filename;
+
+    lexer_state.line_start = false;
     return tok;
 }
 
 /*
- * Skips block comments
- * Returns next token after block comment
+ * Whitespace and comments are scanned a chunk at a time: one mask per
+ * byte class, bit i for byte i of the chunk. Chunks may read up to
+ * LEXER_PADDING bytes past the NUL, never further.
  */
-static struct token skip_block_comment(void)
+#define CHUNK 16
+
+struct chunk {
+    unsigned blank;     // ' ', '\t', '\v', '\f', '\r'
+    unsigned newline;
+    unsigned star;
+    unsigned slash;
+    unsigned nul;
+};
+
+#ifdef __SSE2__
+static void load_chunk(const char *p, struct chunk *c)
 {
-    while (!is_at_end()) {
-        if (peek() == '*' && peek_next() == '/') {
-            advance();
-            advance();
-            return lexer_next_token();
+    __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+
+    // '\t' to '\r' minus the newline, by a signed range compare
+    __m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('\t' - 1)),
+                                 _mm_cmplt_epi8(bytes, _mm_set1_epi8('\r' + 1)));
+    __m128i newline = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'));
+    __m128i blank = _mm_or_si128(_mm_andnot_si128(newline, ctrl),
+                                 _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+
+    c->blank = _mm_movemask_epi8(blank);
+    c->newline = _mm_movemask_epi8(newline);
+    c->star = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('*')));
+    c->slash = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('/')));
+    c->nul = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+}
+#else
+static void load_chunk(const char *p, struct chunk *c)
+{
+    memset(c, 0, sizeof(*c));
+
+    for (int i = 0; i < CHUNK; i++) {
+        unsigned bit = 1u << i;
+
+        switch (p[i]) {
+            case ' ': case '\t': case '\v': case '\f': case '\r':
+                c->blank |= bit;
+                break;
+            case '\n': c->newline |= bit; break;
+            case '*': c->star |= bit; break;
+            case '/': c->slash |= bit; break;
+            case '\0': c->nul |= bit; break;
         }
-        if (peek() == '\n') {
-            lexer_state.line++;
-            advance();
-            lexer_state.line_start = lexer_state.current;
-        } else {
-            advance();
+    }
+}
+#endif
+
+// Bits below 'n', n <= CHUNK
+static unsigned low_bits(int n)
+{
+    return (1u << n) - 1;
+}
+
+// Up to the first byte neither blank nor newline
+static void skip_blanks(void)
+{
+    // Most runs are a space or two between tokens, not worth a chunk
+    if (peek() == ' ') {
+        advance();
+        if (peek() != ' ' && peek() != '\n' && peek() != '\t')
+            return;
+    }
+
+    const char *p = lexer_state.current;
+
+    for (;; p += CHUNK) {
+        struct chunk c;
+        load_chunk(p, &c);
+
+        unsigned stop = ~(c.blank | c.newline) & low_bits(CHUNK);
+        if (stop) {
+            int end = __builtin_ctz(stop);
+            if (c.newline & low_bits(end))
+                lexer_state.line_start = true;
+
+            lexer_state.current = p + end;
+            return;
+        }
+
+        if (c.newline)
+            lexer_state.line_start = true;
+    }
+}
+
+// Up to the newline ending the comment, or the end
+static void skip_line_comment(void)
+{
+    const char *p = lexer_state.current;
+
+    for (;; p += CHUNK) {
+        struct chunk c;
+        load_chunk(p, &c);
+
+        unsigned stop = c.newline | c.nul;
+        if (stop) {
+            lexer_state.current = p + __builtin_ctz(stop);
+            return;
         }
     }
+}
 
-    return make_token(TOKEN_ERROR);
+/*
+ * Past the '*' '/' closing the comment 'current' is in, false if the
+ * end comes first. The '*' may end the previous chunk.
+ */
+static bool skip_block_comment(void)
+{
+    const char *p = lexer_state.current;
+    unsigned star_before = 0;
+
+    for (;; p += CHUNK) {
+        struct chunk c;
+        load_chunk(p, &c);
+
+        unsigned close = c.slash & ((c.star << 1) | star_before);
+        unsigned stop = (close | c.nul) & low_bits(CHUNK);
+        star_before = (c.star >> (CHUNK - 1)) & 1;
+
+        if (stop) {
+            int end = __builtin_ctz(stop);
+            lexer_state.current = p + end;
+
+            if (c.nul & (1u << end))
+                return false;
+
+            lexer_state.current++;
+            return true;
+        }
+    }
 }
 
-static void skip_whitespace(void)
+/*
+ * False on an unterminated block comment, which 'start' is left at.
+ * A backslash before a newline joins the lines.
+ */
+static bool skip_whitespace(void)
 {
     for (;;) {
         switch (peek()) {
@@ -118,22 +250,34 @@ static void skip_whitespace(void)
             case '\t':
             case '\v':
             case '\f':
-                advance();
-                break;
             case '\n':
-                advance();
-                lexer_state.line++;
-                lexer_state.line_start = lexer_state.current;
+                skip_blanks();
                 break;
             case '/':
-                if (peek_next() == '/')
-                    while (peek() != '\n' && !is_at_end())
-                        advance();
-                else
-                    return;
+                if (peek_next() == '/') {
+                    lexer_state.current += 2;
+                    skip_line_comment();
+                } else if (peek_next() == '*') {
+                    // Reported where the comment opens
+                    lexer_state.start = lexer_state.current;
+                    lexer_state.current += 2;
+                    if (!skip_block_comment())
+                        return false;
+                } else {
+                    return true;
+                }
+                break;
+            case '\\':
+                if (peek_next() == '\n') {
+                    lexer_state.current += 2;
+                } else if (peek_next() == '\r' && lexer_state.current[2] == '\n') {
+                    lexer_state.current += 3;
+                } else {
+                    return true;
+                }
                 break;
             default:
-                return;
+                return true;
         }
     }
 }
@@ -145,96 +289,157 @@ static struct token number(void)
     return make_token(TOKEN_NUMBER);
 }
 
-static enum token_type check_keyword(unsigned int start, unsigned int length,
-        const char *rest, enum token_type type)
+#define KEYWORD_LIST            \
+    X("auto", TOKEN_AUTO)         \
+    X("break", TOKEN_BREAK)       \
+    X("case", TOKEN_CASE)         \
+    X("continue", TOKEN_CONTINUE) \
+    X("default", TOKEN_DEFAULT)   \
+    X("do", TOKEN_DO)             \
+    X("else", TOKEN_ELSE)         \
+    X("extern", TOKEN_EXTERN)     \
+    X("for", TOKEN_FOR)           \
+    X("goto", TOKEN_GOTO)         \
+    X("if", TOKEN_IF)             \
+    X("int", TOKEN_INT)           \
+    X("register", TOKEN_REGISTER) \
+    X("return", TOKEN_RETURN)     \
+    X("static", TOKEN_STATIC)     \
+    X("switch", TOKEN_SWITCH)     \
+    X("void", TOKEN_VOID)         \
+    X("while", TOKEN_WHILE)
+
+struct keyword {
+    const char *name;
+    int length;
+    enum token_type type;
+};
+
+static const struct keyword keywords[] = {
+#define X(name, type) { name, sizeof(name) - 1, type },
+    KEYWORD_LIST
+#undef X
+};
+
+#define KEYWORD_COUNT (int)(sizeof(keywords) / sizeof(keywords[0]))
+
+static int keyword_min_length, keyword_max_length;
+
+/*
+ * Perfect hash of the keywords on their first two bytes, last byte and
+ * length, so an identifier costs one multiply and at most one memcmp.
+ * The multiplier is searched for once, at the first lexer_init.
+ */
+#define KEYWORD_HASH_BITS 6
+
+static uint32_t keyword_multiplier;
+static const struct keyword *keyword_table[1 << KEYWORD_HASH_BITS];
+
+static uint32_t keyword_hash(const char *name, int length, uint32_t multiplier)
+{
+    uint32_t key = (unsigned char)name[0] |
+                   (unsigned char)name[1] << 8 |
+                   (uint32_t)(unsigned char)name[length - 1] << 16 |
+                   (uint32_t)length << 24;
+
+    return (key * multiplier) >> (32 - KEYWORD_HASH_BITS);
+}
+
+static bool try_keyword_multiplier(uint32_t multiplier)
 {
-    if (lexer_state.current - lexer_state.start == start + length &&
-            memcmp(lexer_state.start + start, rest, length) == 0) {
-        return type;
+    memset(keyword_table, 0, sizeof(keyword_table));
+
+    for (int i = 0; i < KEYWORD_COUNT; i++) {
+        const struct keyword *kw = &keywords[i];
+        uint32_t slot = keyword_hash(kw->name, kw->length, multiplier);
+
+        if (keyword_table[slot])
+            return false;
+        keyword_table[slot] = kw;
     }
-    return TOKEN_IDENTIFIER;
+
+    keyword_multiplier = multiplier;
+    return true;
 }
 
-// Trie based keyword recognition
-static enum token_type identifier_type(void)
+static void init_tables(void)
 {
-    switch (lexer_state.start[0]) {
-        case 'a': return check_keyword(1, 3, "uto", TOKEN_AUTO);
-        case 'b': return check_keyword(1, 4, "reak", TOKEN_BREAK);
-        case 'c': 
-            if (lexer_state.current - lexer_state.start > 1)
-                switch (lexer_state.start[1]) {
-                    case 'a': return check_keyword(2, 2, "se", TOKEN_CASE);
-                    case 'o': return check_keyword(2, 6, "ntinue", TOKEN_CONTINUE);
-                }
-            break;
-        case 'd':
-            if (lexer_state.current - lexer_state.start > 1)
-                switch(lexer_state.start[1]) {
-                    case 'e': return check_keyword(2, 5, "fault", TOKEN_DEFAULT);
-                    case 'o': return check_keyword(2, 0, "", TOKEN_DO);
-                }
-            break;
-        case 'e':
-            if (lexer_state.current - lexer_state.start > 1)
-                switch(lexer_state.start[1]) {
-                    case 'l': return check_keyword(2, 2, "se", TOKEN_ELSE);
-                    case 'x': return check_keyword(2, 4, "tern", TOKEN_EXTERN);
-                }
-            break;
-        case 'f': return check_keyword(1, 2, "or", TOKEN_FOR);
-        case 'g': return check_keyword(1, 3, "oto", TOKEN_GOTO);
-        case 'i': 
-            if (lexer_state.current - lexer_state.start > 1)
-                switch (lexer_state.start[1]) {
-                    case 'f': return check_keyword(2, 0, "", TOKEN_IF);
-                    case 'n': return check_keyword(2, 1, "t", TOKEN_INT);
-                }
-            break;
-        case 's': 
-            if (lexer_state.current - lexer_state.start > 1)
-                switch (lexer_state.start[1]) {
-                    case 't': return check_keyword(2, 4, "atic", TOKEN_STATIC);
-                    case 'w': return check_keyword(2, 4, "itch", TOKEN_SWITCH);
-                }
-            break;
-        case 'r': 
-            if (lexer_state.current - lexer_state.start > 1)
-                switch (lexer_state.start[1]) {
-                    case 'e':
-                        if (lexer_state.current - lexer_state.start > 2)
-                            switch (lexer_state.start[2]) {
-                                case 't': return check_keyword(3, 3, "urn", TOKEN_RETURN);
-                                case 'g': return check_keyword(3, 5, "ister", TOKEN_REGISTER);
-                            }
-                }
-            break;
-        case 'w': return check_keyword(1, 4, "hile", TOKEN_WHILE);
-        case 'v': return check_keyword(1, 3, "oid", TOKEN_VOID);
+    for (int c = 'a'; c <= 'z'; c++)
+        char_class[c] = CHAR_IDENT;
+    for (int c = 'A'; c <= 'Z'; c++)
+        char_class[c] = CHAR_IDENT;
+    char_class['_'] = CHAR_IDENT;
+    for (int c = '0'; c <= '9'; c++)
+        char_class[c] = CHAR_DIGIT;
+
+    keyword_min_length = keywords[0].length;
+    for (int i = 0; i < KEYWORD_COUNT; i++) {
+        if (keywords[i].length < keyword_min_length)
+            keyword_min_length = keywords[i].length;
+        if (keywords[i].length > keyword_max_length)
+            keyword_max_length = keywords[i].length;
     }
+
+    // Odd multipliers from a fixed LCG, the same table every run
+    uint32_t multiplier = 0x9e3779b1;
+    while (!try_keyword_multiplier(multiplier | 1))
+        multiplier = multiplier * 1664525 + 1013904223;
+}
+
+static enum token_type identifier_type(void)
+{
+    int length = lexer_state.current - lexer_state.start;
+    if (length < keyword_min_length || length > keyword_max_length)
+        return TOKEN_IDENTIFIER;
+
+    const struct keyword *kw =
+        keyword_table[keyword_hash(lexer_state.start, length, keyword_multiplier)];
+
+    if (kw && kw->length == length && !memcmp(kw->name, lexer_state.start, length))
+        return kw->type;
+
     return TOKEN_IDENTIFIER;
 }
 
+// Only for #include "file" for now, there are no string literals
+static struct token string(void)
+{
+    while (peek() != '"') {
+        if (is_at_end() || peek() == '\n')
+            return make_token(TOKEN_ERROR);
+
+        // An escape, a quote after it doesn't end the string
+        if (peek() == '\\' && peek_next() != '\n' && peek_next() != '\0')
+            advance();
+        advance();
+    }
+
+    advance();
+    return make_token(TOKEN_STRING);
+}
+
 static struct token identifier(void)
 {
-    while (is_alpha(peek()) || is_digit(peek()))
+    while (is_ident(peek()))
         advance();
     return make_token(identifier_type());
 }
 
 struct token lexer_next_token()
 {
-    skip_whitespace();
+    if (!skip_whitespace())
+        return make_token(TOKEN_ERROR);
+
     lexer_state.start = lexer_state.current;
 
     if (is_at_end())
         return make_token(TOKEN_EOF);
 
     char c = advance();
-    if (is_digit(c))
-        return number();
-    if (is_alpha(c))
-        return identifier();
+    switch (char_class[(unsigned char)c]) {
+        case CHAR_IDENT: return identifier();
+        case CHAR_DIGIT: return number();
+    }
 
     switch (c) {
         case '(': return make_token(TOKEN_LEFT_PAREN);
@@ -254,7 +459,6 @@ struct token lexer_next_token()
             else return make_token(TOKEN_STAR);
         case '/': 
             if (match('=')) return make_token(TOKEN_SLASH_EQUAL);
-            else if (match('*')) return skip_block_comment();
             else return make_token(TOKEN_SLASH);
         case '%': 
             if (match('=')) return make_token(TOKEN_PERCENT_EQUAL);
@@ -296,15 +500,135 @@ struct token lexer_next_token()
         case ':': return make_token(TOKEN_COLON);
         case '?': return make_token(TOKEN_QUESTION_MARK);
         case ',': return make_token(TOKEN_COMMA);
+        case '#':
+            if (match('#')) return make_token(TOKEN_HASH_HASH);
+            else return make_token(TOKEN_HASH);
+        case '"': return string();
     }
 
     return make_token(TOKEN_ERROR);
 }
 
-char *token_to_cstr(struct token tok)
+/* Token streams */
+
+struct token_stream *current_tokens;
+
+struct token_stream *lex_source(struct source_file *file)
+{
+    const char *source = file->text;
+
+    struct token_stream *stream = calloc(1, sizeof(struct token_stream));
+    stream->sources = malloc(sizeof(*stream->sources));
+    stream->sources[0] = file;
+    stream->source_count = 1;
+
+    // Grown by doubling, a token per 4 bytes is plenty for most sources
+    uint32_t capacity = strlen(source) / 4 + 16;
+    stream->types = malloc(capacity * sizeof(*stream->types));
+    stream->offsets = malloc(capacity * sizeof(*stream->offsets));
+    stream->lengths = malloc(capacity * sizeof(*stream->lengths));
+    stream->atoms = malloc(capacity * sizeof(*stream->atoms));
+    stream->files = malloc(capacity * sizeof(*stream->files));
+    stream->line_starts = malloc(capacity * sizeof(*stream->line_starts));
+
+    lexer_init(source);
+
+    for (;;) {
+        struct token tok = lexer_next_token();
+
+        if (stream->count == capacity) {
+            capacity *= 2;
+            stream->types = realloc(stream->types, capacity * sizeof(*stream->types));
+            stream->offsets = realloc(stream->offsets, capacity * sizeof(*stream->offsets));
+            stream->lengths = realloc(stream->lengths, capacity * sizeof(*stream->lengths));
+            stream->atoms = realloc(stream->atoms, capacity * sizeof(*stream->atoms));
+            stream->files = realloc(stream->files, capacity * sizeof(*stream->files));
+            stream->line_starts = realloc(stream->line_starts,
+                                          capacity * sizeof(*stream->line_starts));
+        }
+
+        stream->types[stream->count] = tok.type;
+        stream->offsets[stream->count] = tok.start - source;
+        stream->lengths[stream->count] = tok.length;
+        stream->atoms[stream->count] =
+            tok.type == TOKEN_IDENTIFIER ? intern(tok.start, tok.length) : NO_ATOM;
+        stream->files[stream->count] = 0;
+        stream->line_starts[stream->count] = tok.line_start;
+        stream->count++;
+
+        if (tok.type == TOKEN_EOF)
+            break;
+    }
+
+    current_tokens = stream;
+    return stream;
+}
+
+void token_stream_free(struct token_stream *stream)
+{
+    if (current_tokens == stream)
+        current_tokens = NULL;
+
+    free(stream->types);
+    free(stream->offsets);
+    free(stream->lengths);
+    free(stream->atoms);
+    free(stream->files);
+    free(stream->line_starts);
+    free(stream->sources);
+    free(stream);
+}
+
+// Lines aren't kept per token, they are counted again for each diagnostic
+static int source_line(const char *text, const char *start, const char **line_start)
 {
-    char *buf = malloc(tok.length + 1);
-    memcpy(buf, tok.start, tok.length);
-    buf[tok.length] = '\0';
+    int line = 1;
+
+    *line_start = text;
+    for (const char *p = text; p < start; p++) {
+        if (*p == '\n') {
+            line++;
+            *line_start = p + 1;
+        }
+    }
+
+    return line;
+}
+
+void source_error(const struct source_file *file, uint32_t offset, uint32_t length,
+                  const char *message)
+{
+    const char *start = file->text + offset;
+
+    const char *line_start;
+    int line = source_line(file->text, start, &line_start);
+    int col = (int)(start - line_start);
+
+    fprintf(stderr, "%s: Error at line %d, col %d: %s\n",
+            file->name, line, col, message);
+
+    const char *line_end = line_start;
+    while (*line_end != '\0' && *line_end != '\n')
+        line_end++;
+    fprintf(stderr, "  %.*s\n", (int)(line_end - line_start), line_start);
+
+    fprintf(stderr, "  %*s", col, "");
+    for (uint32_t i = 0; i < (length > 0 ? length : 1); i++)
+        fputc('^', stderr);
+    fputc('\n', stderr);
+}
+
+void tok_error(tok_id tok, const char *message)
+{
+    source_error(tok_file(tok), current_tokens->offsets[tok], tok_length(tok), message);
+}
+
+char *token_to_cstr(tok_id tok)
+{
+    int length = tok_length(tok);
+
+    char *buf = malloc(length + 1);
+    memcpy(buf, tok_start(tok), length);
+    buf[length] = '\0';
     return buf;
 }
@@ -1,6 +1,7 @@
 /*
- * On demand lexer for C subset.
- * lexer_token_next() returns one at a time token.
+ * Lexer for C subset.
+ * lexer_next_token() returns one token at a time, lex_source() a whole
+ * file as a token_stream.
  */
 
 #ifndef CINC_LEXER_H
@@ -8,6 +9,9 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+#include "base/intern.h"
 
 // X-Macro for all token types
 #define TOKEN_LIST \
@@ -22,6 +26,8 @@
     X(TOKEN_COLON)                \
     X(TOKEN_COMMA)                \
     X(TOKEN_QUESTION_MARK)        \
+    X(TOKEN_HASH)                 \
+    X(TOKEN_HASH_HASH)            \
     /* One or two char tokens */  \
     X(TOKEN_PLUS)                 \
     X(TOKEN_MINUS)                \
@@ -59,6 +65,7 @@
     /* Literals */                \
     X(TOKEN_IDENTIFIER)           \
     X(TOKEN_NUMBER)               \
+    X(TOKEN_STRING)               \
     /* Keywords */                \
     X(TOKEN_INT)                  \
     X(TOKEN_VOID)                 \
@@ -92,14 +99,89 @@ struct token {
     enum token_type type;
     const char *start;      // Pointer to original source string
     int length;
-
-    const char *filename;
-    int line;
-    const char *line_start; // Line start for current token 
+    bool line_start;        // First token on its line
 };
 
+/*
+ * Bytes after the NUL of a source the lexer may read, they must be
+ * readable (their values don't matter).
+ */
+#define LEXER_PADDING 16
+
 void lexer_init(const char *source);
 struct token lexer_next_token(void);
-char *token_to_cstr(struct token tok);
+
+/*
+ * Text of a file, NUL terminated and followed by LEXER_PADDING readable
+ * bytes. Owned by whoever made it, token streams only point to it.
+ */
+struct source_file {
+    const char *name;
+    const char *text;
+};
+
+/*
+ * A whole translation unit lexed up front, one array per token field.
+ * The parser and the AST refer to tokens by their index in it; lines
+ * are only worked out for diagnostics.
+ */
+typedef uint32_t tok_id;
+
+#define NO_TOKEN ((tok_id)-1)   // E.g. the name of an unnamed parameter
+
+struct token_stream {
+    uint32_t count;
+
+    uint8_t *types;         // enum token_type
+    uint32_t *offsets;      // Into the text of the token's file
+    uint32_t *lengths;
+    atom *atoms;            // Of identifiers, NO_ATOM for other tokens
+    uint16_t *files;        // Index in 'sources' of the file the token is spelled in
+    uint8_t *line_starts;   // Nonzero for the first token of a line, lex_source only
+
+    struct source_file **sources;
+    int source_count;
+};
+
+// The translation unit being compiled, which tok_id's refer to
+extern struct token_stream *current_tokens;
+
+// Lexes one file to EOF, without preprocessing. The result becomes current_tokens.
+struct token_stream *lex_source(struct source_file *file);
+void token_stream_free(struct token_stream *stream);
+
+static inline enum token_type tok_type(tok_id tok)
+{
+    return (enum token_type)current_tokens->types[tok];
+}
+
+static inline const struct source_file *tok_file(tok_id tok)
+{
+    return current_tokens->sources[current_tokens->files[tok]];
+}
+
+static inline const char *tok_start(tok_id tok)
+{
+    return tok_file(tok)->text + current_tokens->offsets[tok];
+}
+
+static inline int tok_length(tok_id tok)
+{
+    return (int)current_tokens->lengths[tok];
+}
+
+static inline atom tok_atom(tok_id tok)
+{
+    return current_tokens->atoms[tok];
+}
+
+// Prints "file: Error at line L, col C: message", then the line marked under 'tok'
+void tok_error(tok_id tok, const char *message);
+
+// Like tok_error, for the 'length' bytes at 'offset' in 'file'
+void source_error(const struct source_file *file, uint32_t offset, uint32_t length,
+                  const char *message);
+
+char *token_to_cstr(tok_id tok);
 
 #endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "lto.h"
+#include "cfg.h"
+#include "ir.h"
+#include "base/hash_map.h"
+
+static hash_map renames;    // Internal name in the unit -> name in the program
+
+static const char *renamed(const char *name)
+{
+    const char *to = hashmap_get(&renames, name, strlen(name));
+    return to ? to : name;
+}
+
+static void rename_value(struct ir_value *value, void *ctx)
+{
+    (void)ctx;
+
+    if (value->kind == IR_VALUE_STATIC)
+        value->name = renamed(value->name);
+}
+
+static const char *unit_name(const char *name, int unit)
+{
+    int len = snprintf(NULL, 0, "%s.%d", name, unit);
+    char *buf = malloc(len + 1);
+    snprintf(buf, len + 1, "%s.%d", name, unit);
+
+    return buf;
+}
+
+/*
+ * Internal names are only unique within their unit (sema numbers them
+ * from 0 in every file), 'counter.2' of unit 1 becomes 'counter.2.1'.
+ */
+static void rename_internal(struct ir_program *program, int unit)
+{
+    hashmap_init(&renames);
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        if (fn->linkage != LINK_INTERNAL)
+            continue;
+
+        const char *to = unit_name(fn->name, unit);
+        hashmap_set(&renames, fn->name, strlen(fn->name), (void *)to);
+        fn->name = to;
+    }
+
+    for (struct ir_static_variable *var = program->static_vars; var; var = var->next) {
+        if (var->linkage != LINK_INTERNAL)
+            continue;
+
+        const char *to = unit_name(var->name, unit);
+        hashmap_set(&renames, var->name, strlen(var->name), (void *)to);
+        var->name = to;
+    }
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+            ir_for_each_value(instr, rename_value, NULL);
+
+            if (instr->kind == IR_INSTR_CALL)
+                instr->call.calle = renamed(instr->call.calle);
+        }
+    }
+
+    hashmap_free(&renames);
+}
+
+static void link_error(const char *name)
+{
+    fprintf(stderr, "cinc: multiple definition of '%s'\n", name);
+}
+
+struct ir_program *lto_link(struct ir_program **units, int count, bool internalize)
+{
+    struct ir_program *program = calloc(1, sizeof(struct ir_program));
+
+    struct ir_function *fn_tail = NULL;
+    struct ir_static_variable *var_tail = NULL;
+
+    hash_map functions;     // External name -> struct ir_function
+    hash_map variables;     // External name -> struct ir_static_variable
+    hashmap_init(&functions);
+    hashmap_init(&variables);
+
+    bool ok = true;
+
+    for (int unit = 0; unit < count; unit++) {
+        if (unit > 0)
+            rename_internal(units[unit], unit);
+
+        struct ir_function *next_fn;
+        for (struct ir_function *fn = units[unit]->functions; fn; fn = next_fn) {
+            next_fn = fn->next;
+            fn->next = NULL;
+
+            if (fn->linkage == LINK_EXTERNAL) {
+                if (hashmap_get(&functions, fn->name, strlen(fn->name))) {
+                    link_error(fn->name);
+                    ok = false;
+                    continue;
+                }
+                hashmap_set(&functions, fn->name, strlen(fn->name), fn);
+            }
+
+            LIST_APPEND(program->functions, fn_tail, fn);
+        }
+
+        struct ir_static_variable *next_var;
+        for (struct ir_static_variable *var = units[unit]->static_vars; var; var = next_var) {
+            next_var = var->next;
+            var->next = NULL;
+
+            /*
+             * Tentative definitions in several files are one object, like
+             * -fcommon. Only one of them may have an initializer, even
+             * an explicit '= 0'.
+             */
+            if (var->linkage == LINK_EXTERNAL) {
+                struct ir_static_variable *prior =
+                    hashmap_get(&variables, var->name, strlen(var->name));
+
+                if (prior) {
+                    if (!prior->tentative && !var->tentative) {
+                        link_error(var->name);
+                        ok = false;
+                    } else if (!var->tentative) {
+                        prior->init = var->init;
+                        prior->tentative = false;
+                    }
+                    continue;
+                }
+                hashmap_set(&variables, var->name, strlen(var->name), var);
+            }
+
+            LIST_APPEND(program->static_vars, var_tail, var);
+        }
+    }
+
+    hashmap_free(&functions);
+    hashmap_free(&variables);
+
+    if (!ok)
+        return NULL;
+
+    // Nothing outside the program can refer to its definitions, except to main
+    if (internalize) {
+        for (struct ir_function *fn = program->functions; fn; fn = fn->next)
+            if (strcmp(fn->name, "main"))
+                fn->linkage = LINK_INTERNAL;
+
+        for (struct ir_static_variable *var = program->static_vars; var; var = var->next)
+            var->linkage = LINK_INTERNAL;
+    }
+
+    return program;
+}
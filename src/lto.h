@@ -0,0 +1,21 @@
+/*
+ * Whole-program mode (-flto).
+ *
+ * The IR of every input is merged into one program before the IR
+ * passes run, so calls across files can be inlined like calls within
+ * one. The result is emitted as a single object.
+ */
+
+#ifndef CINC_LTO_H
+#define CINC_LTO_H
+
+#include "ir.h"
+
+/*
+ * Merges 'units' into one program, NULL on conflicting definitions.
+ * With 'internalize' the program is the whole executable, so every
+ * definition except main gets internal linkage.
+ */
+struct ir_program *lto_link(struct ir_program **units, int count, bool internalize);
+
+#endif
@@ -3,45 +3,60 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "preprocessor.h"
+#include "ast_cache.h"
 #include "parser.h"
 #include "sema.h"
 #include "ir.h"
+#include "opt.h"
 #include "x86.h"
+#include "jit.h"
+#include "lto.h"
 
+static bool opt_E;
 static bool opt_c;
 static bool opt_S;
+static bool opt_run;
+static bool opt_lto;
 static char *opt_o;
 
 static bool opt_lex;
 static bool opt_parse;
 
+// -fprofile-generate[=dir] / -fprofile-use[=dir], dir is NULL without '='
+static bool opt_profile_generate;
+static bool opt_profile_use;
+static const char *profile_dir;
+
+// -fcache-ast[=dir], dir is NULL without '='
+static bool opt_cache_ast;
+static const char *cache_ast_dir;
+
+static struct opt_options opt_opts = {
+    .tail_calls = true,
+    .reorder_blocks = true,
+    .inline_functions = true,
+    .ipa_cp = true,
+    .ipa_dead_args = true,
+    .remove_dead_symbols = true,
+};
+
+static struct codegen_options codegen_opts = {
+    .red_zone = true,
+    .sibling_calls = true,
+    .callee_saved_regs = true,
+    .align_functions = { .align = 16 },
+    .align_loops = { .align = 16, .max_skip = 10 },
+    .align_jumps = { .align = 1 },
+};
+
 static char *input_files[64];
 static int input_file_count = 0;
 
-const char *current_filename;
 bool had_error = false;
 
-static char *read_file(const char *filename)
-{
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Opening file %s failed\n", filename);
-        exit(1);
-    }
-
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
-
-    char *buffer = malloc(file_size + 1);
-    size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
-    buffer[bytes_read] = '\0';
-
-    fclose(file);
-    return buffer;
-}
-
 static void run_cmd(const char *cmd)
 {
     int status = system(cmd);
@@ -78,9 +93,38 @@ static void usage(const char *prog)
     fprintf(stderr, 
             "Usage: %s [options] <file1 file2...>\n"
             "Options:\n"
+            "   -E          Stop after preprocessing, print the tokens\n"
             "   -S          Stop after assembly (.s)\n"
             "   -c          Compile and assemble but don't link (.o)\n"
             "   -o <file>   Place the output into <file>\n"
+            "   --run       Compile in memory and run, exit with main's result\n"
+            "Preprocessor Options:\n"
+            "   -I <dir>    Search <dir> for #include files\n"
+            "   -D <name>[=<value>]\n"
+            "               Define <name> as <value>, or as 1\n"
+            "   -U <name>   Undefine <name>\n"
+            "Code Generation Options:\n"
+            "   -fomit-frame-pointer   Address locals off %%rsp, don't set up %%rbp\n"
+            "   -mno-red-zone          Always allocate the frame of leaf functions\n"
+            "   -fno-callee-saved-regs Keep every pseudo in a stack slot\n"
+            "   -fno-reorder-blocks    Keep basic blocks in source order\n"
+            "   -fno-inline-functions  Keep every call\n"
+            "   -fno-ipa-cp            Keep constant arguments and results of static functions\n"
+            "   -fno-ipa-dead-args     Keep unused parameters and results of static functions\n"
+            "   -fno-remove-dead-symbols\n"
+            "                          Emit unreferenced static functions and variables\n"
+            "   -flto                  Optimize all files as one program, emit one object\n"
+            "   -fprofile-generate[=dir]\n"
+            "                          Instrument, runs append to <source>.prof, next to it\n"
+            "                          or in <dir>\n"
+            "   -fprofile-use[=dir]    Optimize with the profile collected for each source\n"
+            "   -falign-functions=N[:M], -falign-loops=N[:M], -falign-jumps=N[:M]\n"
+            "                          Align to N bytes, skipping at most M-1\n"
+            "                          (defaults 16, 16:11 and 1, 1 disables)\n"
+            "   -fcache-ast[=dir]      Reuse the checked AST of unchanged sources,\n"
+            "                          kept next to it or in <dir>\n"
+            "   -fno-optimize-sibling-calls\n"
+            "                          Keep tail calls and tail recursion as calls\n"
             "Compiler Debug Options:\n"
             "   --lex       Debug: print tokens\n"
             "   --parse     Debug: pretty-print AST after parsing and sema\n"
@@ -89,6 +133,75 @@ static void usage(const char *prog)
     exit(1);
 }
 
+#define DEFAULT_CODE_ALIGNMENT 16
+#define MAX_CODE_ALIGNMENT 4096
+
+/*
+ * -falign-<kind>[=N[:M]] and -fno-align-<kind>. Like GCC, N is rounded
+ * up to a power of two and at most M-1 bytes are skipped; N of 0 picks
+ * the default and N of 1 disables alignment.
+ * Returns false if 'arg' isn't an alignment flag for 'kind'.
+ */
+static bool parse_alignment(const char *prog, const char *arg, const char *kind,
+                            struct code_alignment *out)
+{
+    if (strncmp(arg, "-f", 2))
+        return false;
+
+    arg += 2;
+    bool negated = !strncmp(arg, "no-", 3);
+    if (negated)
+        arg += 3;
+
+    size_t kind_len = strlen(kind);
+    if (strncmp(arg, "align-", 6) || strncmp(arg + 6, kind, kind_len))
+        return false;
+
+    arg += 6 + kind_len;
+
+    if (negated) {
+        if (*arg)
+            return false;
+
+        *out = (struct code_alignment) { .align = 1 };
+        return true;
+    }
+
+    *out = (struct code_alignment) { .align = DEFAULT_CODE_ALIGNMENT };
+
+    if (!*arg)
+        return true;
+
+    if (*arg != '=')
+        return false;
+
+    char *end;
+    long align = strtol(arg + 1, &end, 10);
+    long skip = 0;
+
+    if (*end == ':')
+        skip = strtol(end + 1, &end, 10);
+
+    if (*end || align < 0 || align > MAX_CODE_ALIGNMENT || skip < 0)
+        usage(prog);
+
+    if (align == 0)
+        align = DEFAULT_CODE_ALIGNMENT;
+
+    int rounded = 1;
+    while (rounded < align)
+        rounded *= 2;
+
+    out->align = rounded;
+    out->max_skip = skip > 0 ? skip - 1 : 0;
+
+    // M of 1 allows no padding at all
+    if (skip == 1)
+        out->align = 1;
+
+    return true;
+}
+
 static void parse_args(int argc, char **argv)
 {
     if (argc < 2)
@@ -112,6 +225,29 @@ static void parse_args(int argc, char **argv)
             continue;
         }
 
+        // -I dir or -Idir, same for -D and -U
+        if (arg[0] == '-' && (arg[1] == 'I' || arg[1] == 'D' || arg[1] == 'U')) {
+            const char *value = arg + 2;
+            if (!*value) {
+                if (argc <= i + 1)
+                    usage(argv[0]);
+                value = argv[++i];
+            }
+
+            if (arg[1] == 'I')
+                pp_add_include_dir(value);
+            else if (arg[1] == 'D')
+                pp_define(value);
+            else
+                pp_undefine(value);
+            continue;
+        }
+
+        if (!strcmp(arg, "-E")) {
+            opt_E = true;
+            continue;
+        }
+
         if (!strcmp(arg, "-S")) {
             opt_S = true;
             continue;
@@ -122,6 +258,119 @@ static void parse_args(int argc, char **argv)
             continue;
         }
 
+        if (!strcmp(arg, "--run")) {
+            opt_run = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "-fomit-frame-pointer")) {
+            codegen_opts.omit_frame_pointer = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "-fno-omit-frame-pointer")) {
+            codegen_opts.omit_frame_pointer = false;
+            continue;
+        }
+
+        if (!strcmp(arg, "-mred-zone")) {
+            codegen_opts.red_zone = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "-mno-red-zone")) {
+            codegen_opts.red_zone = false;
+            continue;
+        }
+
+        if (!strcmp(arg, "-foptimize-sibling-calls") ||
+            !strcmp(arg, "-fno-optimize-sibling-calls")) {
+            bool enable = arg[2] != 'n';
+            opt_opts.tail_calls = enable;
+            codegen_opts.sibling_calls = enable;
+            continue;
+        }
+
+        if (parse_alignment(argv[0], arg, "functions", &codegen_opts.align_functions) ||
+            parse_alignment(argv[0], arg, "loops", &codegen_opts.align_loops) ||
+            parse_alignment(argv[0], arg, "jumps", &codegen_opts.align_jumps))
+            continue;
+
+        if (!strncmp(arg, "-fprofile-generate", 18) &&
+            (arg[18] == '\0' || arg[18] == '=')) {
+            opt_profile_generate = true;
+            profile_dir = arg[18] ? arg + 19 : NULL;
+            continue;
+        }
+
+        if (!strncmp(arg, "-fprofile-use", 13) &&
+            (arg[13] == '\0' || arg[13] == '=')) {
+            opt_profile_use = true;
+            profile_dir = arg[13] ? arg + 14 : NULL;
+            continue;
+        }
+
+        if (!strncmp(arg, "-fcache-ast", 11) && (arg[11] == '\0' || arg[11] == '=')) {
+            opt_cache_ast = true;
+            cache_ast_dir = arg[11] ? arg + 12 : NULL;
+            continue;
+        }
+
+        if (!strcmp(arg, "-freorder-blocks")) {
+            opt_opts.reorder_blocks = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "-fno-reorder-blocks")) {
+            opt_opts.reorder_blocks = false;
+            continue;
+        }
+
+        if (!strcmp(arg, "-finline-functions")) {
+            opt_opts.inline_functions = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "-fno-inline-functions")) {
+            opt_opts.inline_functions = false;
+            continue;
+        }
+
+        if (!strcmp(arg, "-fipa-cp") || !strcmp(arg, "-fno-ipa-cp")) {
+            opt_opts.ipa_cp = arg[2] != 'n';
+            continue;
+        }
+
+        if (!strcmp(arg, "-fipa-dead-args") || !strcmp(arg, "-fno-ipa-dead-args")) {
+            opt_opts.ipa_dead_args = arg[2] != 'n';
+            continue;
+        }
+
+        if (!strcmp(arg, "-fremove-dead-symbols") || !strcmp(arg, "-fno-remove-dead-symbols")) {
+            opt_opts.remove_dead_symbols = arg[2] != 'n';
+            continue;
+        }
+
+        if (!strcmp(arg, "-flto")) {
+            opt_lto = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "-fno-lto")) {
+            opt_lto = false;
+            continue;
+        }
+
+        if (!strcmp(arg, "-fcallee-saved-regs")) {
+            codegen_opts.callee_saved_regs = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "-fno-callee-saved-regs")) {
+            codegen_opts.callee_saved_regs = false;
+            continue;
+        }
+
         if (!strcmp(arg, "-o")) {
             if (argc <= i + 1)
                 usage(argv[0]);
@@ -136,39 +385,225 @@ static void parse_args(int argc, char **argv)
     if (input_file_count == 0)
         usage(argv[0]);
 
-    if (opt_o && input_file_count > 1 && (opt_S || opt_c)) {
+    if (opt_o && input_file_count > 1 && (opt_S || opt_c) && !opt_lto) {
+        usage(argv[0]);
+    }
+
+    if (opt_profile_generate && opt_profile_use)
+        usage(argv[0]);
+
+    // Profiles are kept per source file
+    if (opt_lto && (opt_profile_generate || opt_profile_use))
         usage(argv[0]);
+
+    if (opt_run && (opt_S || opt_c || opt_o))
+        usage(argv[0]);
+}
+
+// Absolute directory of 'filename'
+static char *source_dir(const char *filename)
+{
+    char *source = realpath(filename, NULL);
+    if (!source)
+        source = strdup(filename);
+
+    char *slash = strrchr(source, '/');
+    if (!slash) {
+        free(source);
+        return strdup(".");
     }
+
+    *slash = '\0';
+    return source;
 }
 
-static bool compile_to_asm(const char *filename, const char *out_file)
+/*
+ * <dir>/<source name><ext>. In a directory shared by several sources,
+ * 'keyed' puts a hash of the absolute source path before the extension
+ * to keep sources of the same name apart.
+ */
+static char *source_file_path(const char *dir, const char *filename,
+                              const char *ext, bool keyed)
 {
-    current_filename = filename;
-    char *source = read_file(filename);
+    char keyed_ext[32];
 
-    struct ast_program *root = parse_translation_unit(source);
-    if (!root) {
-        had_error = true;
-        return false;
+    if (keyed) {
+        char *source = realpath(filename, NULL);
+        uint32_t hash = 2166136261u;
+        for (const char *c = source ? source : filename; *c; c++)
+            hash = (hash ^ (uint8_t)*c) * 16777619;
+        free(source);
+
+        snprintf(keyed_ext, sizeof(keyed_ext), ".%08x%s", hash, ext);
+        ext = keyed_ext;
     }
 
-    root = sema_analysis(root);
+    char *name = replace_ext(filename, ext);
+
+    size_t size = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(size);
+    snprintf(path, size, "%s/%s", dir, name);
+
+    free(name);
+    return path;
+}
+
+/*
+ * Profile of 'filename': <source name>.prof next to the source, or
+ * <source name>.<hash>.prof in the -fprofile-*= directory. Made
+ * absolute so the instrumented program can run from any directory.
+ */
+static char *profile_path(const char *filename)
+{
+    char *dir;
+
+    if (profile_dir) {
+        dir = realpath(profile_dir, NULL);
+        if (!dir)
+            dir = strdup(profile_dir);
+    } else {
+        dir = source_dir(filename);
+    }
+
+    char *path = source_file_path(dir, filename, ".prof", profile_dir != NULL);
+
+    free(dir);
+    return path;
+}
+
+// Cached AST of 'filename', next to it or in the -fcache-ast= directory
+static char *ast_cache_path(const char *filename)
+{
+    if (cache_ast_dir)
+        return source_file_path(cache_ast_dir, filename, ".ast", true);
+
+    char *dir = source_dir(filename);
+    char *path = source_file_path(dir, filename, ".ast", false);
+
+    free(dir);
+    return path;
+}
+
+// The checked AST, from the cache when it is still valid
+static struct ast_program *analyze(const char *filename)
+{
+    char *cache = opt_cache_ast ? ast_cache_path(filename) : NULL;
+
+    struct ast_program *root = cache ? ast_cache_read(cache, filename) : NULL;
+    if (root) {
+        free(cache);
+        return root;
+    }
+
+    struct token_stream *tokens = preprocess(filename);
+    if (tokens)
+        root = parse_translation_unit(tokens);
+    if (root)
+        root = sema_analysis(root);
+
+    if (root && cache)
+        ast_cache_write(cache, root);
+
+    free(cache);
+    return root;
+}
+
+static struct ir_program *front_end(const char *filename)
+{
+    struct ast_program *root = analyze(filename);
     if (!root) {
         had_error = true;
-        return false;
+        return NULL;
     }
 
+    struct token_stream *tokens = current_tokens;
+
     struct ir_program *program = build_ir(root);
     if (!program) {
         had_error = true;
-        return false;
+        return NULL;
     }
 
-    FILE *out_f = fopen(out_file, "w");
-    emit_x86(program, out_f);
+    token_stream_free(tokens);
+    return program;
+}
+
+/*
+ * Front end and IR passes. The profile path is returned in 'profile'
+ * since an instrumented program keeps pointing at it.
+ */
+static struct ir_program *compile_to_ir(const char *filename, char **profile)
+{
+    struct ir_program *program = front_end(filename);
+    if (!program)
+        return NULL;
+
+    *profile = NULL;
+    if (opt_profile_generate || opt_profile_use)
+        *profile = profile_path(filename);
+
+    opt_opts.profile_generate = opt_profile_generate ? *profile : NULL;
+    opt_opts.profile_use = opt_profile_use ? *profile : NULL;
+
+    optimize_ir(program, &opt_opts);
+
+    return program;
+}
+
+/*
+ * -flto: the front end runs on every input, then the IR passes on all
+ * of them as one program. 'internalize' when it becomes an executable.
+ */
+static struct ir_program *compile_whole_program(bool internalize)
+{
+    struct ir_program *units[64];
+
+    for (int i = 0; i < input_file_count; i++)
+        units[i] = front_end(input_files[i]);
+
+    if (had_error)
+        return NULL;
+
+    struct ir_program *program = lto_link(units, input_file_count, internalize);
+    if (!program) {
+        had_error = true;
+        return NULL;
+    }
+
+    opt_opts.profile_generate = NULL;
+    opt_opts.profile_use = NULL;
 
+    optimize_ir(program, &opt_opts);
+
+    return program;
+}
+
+static void write_asm(struct ir_program *program, const char *out_file)
+{
+    FILE *out_f = fopen(out_file, "w");
+    emit_x86(program, &codegen_opts, out_f);
     fclose(out_f);
-    free(source);
+}
+
+// With -flto 'filename' (the first input) only names the output
+static bool compile_to_asm(const char *filename, const char *out_file)
+{
+    if (opt_lto) {
+        struct ir_program *program = compile_whole_program(!opt_S && !opt_c);
+        if (!program)
+            return false;
+
+        write_asm(program, out_file);
+        return true;
+    }
+
+    char *profile;
+    struct ir_program *program = compile_to_ir(filename, &profile);
+    if (!program)
+        return false;
+
+    write_asm(program, out_file);
+    free(profile);
     return true;
 }
 
@@ -209,14 +644,14 @@ static char *compile_file(const char *filename)
     return obj_file;
 }
 
-static void link_files(char **objects)
+static void link_files(char **objects, int count)
 {
     const char *out = opt_o ? opt_o : "a.out";
 
     char cmd[4096];
     snprintf(cmd, sizeof(cmd), "cc");
 
-    for (int i = 0; i < input_file_count; i++) {
+    for (int i = 0; i < count; i++) {
         strncat(cmd, " ", sizeof(cmd) - strlen(cmd) - 1);
         strncat(cmd, objects[i], sizeof(cmd) - strlen(cmd) - 1);
     }
@@ -229,30 +664,25 @@ static void link_files(char **objects)
 
 static void debug_file(const char *filename)
 {
-    current_filename = filename;
-
-    char *source = read_file(filename);
-
     const char *token_kind_strings[] = {
 #define X(tok_name) [tok_name] = #tok_name,
         TOKEN_LIST
 #undef X
     };
 
-    if (opt_lex) {
-        lexer_init(source);
+    struct token_stream *tokens = preprocess(filename);
+    if (!tokens)
+        exit(1);
 
-        struct token tok = lexer_next_token();
-        while (tok.type != TOKEN_EOF) {
-            printf("%s\n", token_kind_strings[tok.type]);
-            tok = lexer_next_token();
-        }
+    if (opt_lex) {
+        for (tok_id tok = 0; tok_type(tok) != TOKEN_EOF; tok++)
+            printf("%s\n", token_kind_strings[tok_type(tok)]);
 
         exit(0);
     }
 
     if (opt_parse) {
-        struct ast_program *program = parse_translation_unit(source);
+        struct ast_program *program = parse_translation_unit(tokens);
         program = sema_analysis(program);
 
         ast_print(program);
@@ -261,6 +691,50 @@ static void debug_file(const char *filename)
     }
 }
 
+// -E: spelled with a space between tokens, a line per statement or brace
+static void print_preprocessed(const char *filename)
+{
+    struct token_stream *tokens = preprocess(filename);
+    if (!tokens) {
+        had_error = true;
+        return;
+    }
+
+    for (tok_id tok = 0; tok_type(tok) != TOKEN_EOF; tok++) {
+        enum token_type type = tok_type(tok);
+        bool line_end = type == TOKEN_SEMICOLON || type == TOKEN_LEFT_BRACE ||
+                        type == TOKEN_RIGHT_BRACE;
+
+        printf("%.*s%c", tok_length(tok), tok_start(tok), line_end ? '\n' : ' ');
+    }
+
+    token_stream_free(tokens);
+}
+
+// --run: all files are linked in memory, main gets the first one as argv[0]
+static int run_files(void)
+{
+    struct asm_program *programs[64];
+    int count = opt_lto ? 1 : input_file_count;
+
+    if (opt_lto) {
+        struct ir_program *program = compile_whole_program(true);
+        programs[0] = program ? build_x86(program, &codegen_opts) : NULL;
+    } else {
+        for (int i = 0; i < input_file_count; i++) {
+            char *profile;
+            struct ir_program *program = compile_to_ir(input_files[i], &profile);
+            programs[i] = program ? build_x86(program, &codegen_opts) : NULL;
+        }
+    }
+
+    if (had_error)
+        return 1;
+
+    char *run_argv[] = { input_files[0], NULL };
+    return jit_run(programs, count, &codegen_opts, 1, run_argv);
+}
+
 int main(int argc, char **argv)
 {
     parse_args(argc, argv);
@@ -270,13 +744,26 @@ int main(int argc, char **argv)
             debug_file(input_files[i]);
     }
 
+    if (opt_E) {
+        for (int i = 0; i < input_file_count; i++)
+            print_preprocessed(input_files[i]);
+
+        return had_error ? 1 : 0;
+    }
+
+    if (opt_run)
+        return run_files();
+
     char *objects[64];
 
-    for (int i = 0; i < input_file_count; i++)
+    // -flto compiles everything into the first input's object
+    int object_count = opt_lto ? 1 : input_file_count;
+
+    for (int i = 0; i < object_count; i++)
         objects[i] = compile_file(input_files[i]);
 
     if (had_error) {
-        for (int i = 0; i < input_file_count; i++) { 
+        for (int i = 0; i < object_count; i++) { 
             if (objects[i])
                 remove(objects[i]);
         }
@@ -285,8 +772,8 @@ int main(int argc, char **argv)
     }
 
     if (!opt_S && !opt_c) {
-        link_files(objects);
-        for (int i = 0; i <  input_file_count; i++)
+        link_files(objects, object_count);
+        for (int i = 0; i <  object_count; i++)
             remove(objects[i]);
     }
 
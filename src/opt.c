@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "opt.h"
+#include "cfg.h"
+#include "profile.h"
+#include "ipo.h"
+#include "ir.h"
+
+static struct ir_instr *new_instr(enum ir_instr_kind kind)
+{
+    struct ir_instr *instr = calloc(1, sizeof(struct ir_instr));
+    instr->kind = kind;
+
+    return instr;
+}
+
+static struct ir_instr *new_copy(struct ir_value src, struct ir_value dst)
+{
+    struct ir_instr *instr = new_instr(IR_INSTR_COPY);
+    instr->copy.src = src;
+    instr->copy.dst = dst;
+
+    return instr;
+}
+
+static bool is_pseudo(struct ir_value value, int pseudo)
+{
+    return value.kind == IR_VALUE_PSEUDO && value.pseudo == pseudo;
+}
+
+static int count_params(struct ir_function *fn)
+{
+    int count = 0;
+    for (struct ir_param *p = fn->params; p; p = p->next)
+        count++;
+
+    return count;
+}
+
+/*
+ * call f(args) -> dst; return dst     (or a void call and return)
+ */
+static bool is_tail_call(struct ir_instr *instr)
+{
+    if (instr->kind != IR_INSTR_CALL || !instr->next)
+        return false;
+
+    struct ir_instr *ret = instr->next;
+    if (ret->kind != IR_INSTR_RETURN)
+        return false;
+
+    if (!instr->call.has_dst)
+        return !ret->ret.has_value;
+
+    return ret->ret.has_value &&
+           is_pseudo(ret->ret.src, instr->call.dst.pseudo);
+}
+
+// Index of the parameter 'value' names, -1 if it isn't one
+static int param_index(struct ir_function *fn, struct ir_value value)
+{
+    if (value.kind != IR_VALUE_PSEUDO)
+        return -1;
+
+    int i = 0;
+    for (struct ir_param *p = fn->params; p; p = p->next, i++)
+        if (value.pseudo == p->pseudo)
+            return i;
+
+    return -1;
+}
+
+/*
+ * Self tail recursion -> loop
+ *
+ *   f(a, b):                 f(a, b):
+ *     ...                    entry:
+ *     t = f(b, a)              ...
+ *     return t                 tmp = a
+ *                              a = b
+ *                              b = tmp
+ *                              jump entry
+ */
+static void eliminate_tail_recursion(struct ir_function *fn)
+{
+    int param_count = count_params(fn);
+    int entry_label = -1;
+
+    struct ir_instr *prev = NULL;
+    for (struct ir_instr *instr = fn->first; instr; prev = instr, instr = instr->next) {
+        if (!is_tail_call(instr))
+            continue;
+
+        if (strcmp(instr->call.calle, fn->name) != 0)
+            continue;
+
+        if (instr->call.arg_count != param_count)
+            continue;
+
+        if (entry_label < 0) {
+            struct ir_instr *label = new_instr(IR_INSTR_LABEL);
+            entry_label = ir_new_label();
+            label->label.label_id = entry_label;
+
+            label->next = fn->first;
+            fn->first = label;
+            if (!prev)
+                prev = label;
+        }
+
+        struct ir_instr *head = NULL;
+        struct ir_instr *tail = NULL;
+
+        struct ir_value *srcs = calloc(param_count, sizeof(struct ir_value));
+
+        /*
+         * Parameters are reassigned in order, so an argument that reads
+         * an earlier parameter is saved in a temporary first.
+         */
+        for (int i = 0; i < param_count; i++) {
+            srcs[i] = instr->call.args[i];
+
+            int read = param_index(fn, srcs[i]);
+            if (read >= 0 && read < i) {
+                struct ir_value tmp = ir_new_temp();
+                struct ir_instr *copy = new_copy(srcs[i], tmp);
+                LIST_APPEND(head, tail, copy);
+                srcs[i] = tmp;
+            }
+        }
+
+        int i = 0;
+        for (struct ir_param *p = fn->params; p; p = p->next, i++) {
+            if (param_index(fn, srcs[i]) == i)
+                continue;
+
+            struct ir_instr *copy = new_copy(srcs[i], (struct ir_value) {
+                .kind = IR_VALUE_PSEUDO,
+                .pseudo = p->pseudo
+            });
+            LIST_APPEND(head, tail, copy);
+        }
+
+        free(srcs);
+
+        struct ir_instr *jump = new_instr(IR_INSTR_JUMP);
+        jump->jump.label_id = entry_label;
+        LIST_APPEND(head, tail, jump);
+
+        // Splice over call + return
+        struct ir_instr *ret = instr->next;
+        tail->next = ret->next;
+        prev->next = head;
+
+        if (fn->last == ret)
+            fn->last = tail;
+
+        free(instr->call.args);
+        free(instr);
+        free(ret);
+
+        instr = tail;
+    }
+}
+
+/*
+ * Basic block layout
+ *
+ * The function is split into basic blocks (see cfg.h), jumps to
+ * jump-only blocks are threaded and unreachable blocks are dropped.
+ * Blocks are then chained greedily in source order: each block is
+ * followed by one of its successors when that doesn't take the place
+ * of another block's fall-through. Without a profile that's the target
+ * of the final jump (the source fall-through), with one the more
+ * frequent edge. Blocks a profile shows never ran go last, and the
+ * backend puts them in .text.unlikely. Finally jumps to the next
+ * block are removed, and
+ *   if x == 0 jump L1; jump L2; L1:  ->  if x != 0 jump L2; L1:
+ */
+
+// A block made only of labels and a jump forwards to the jump's target
+static int thread_jump(struct ir_cfg *cfg, int label)
+{
+    for (int hops = 0; hops < 8; hops++) {
+        struct ir_instr *instr = cfg->blocks[cfg->block_of[label]].first;
+        while (instr && instr->kind == IR_INSTR_LABEL)
+            instr = instr->next;
+
+        if (!instr || instr->kind != IR_INSTR_JUMP || instr->jump.label_id == label)
+            break;
+
+        label = instr->jump.label_id;
+    }
+
+    return label;
+}
+
+// Walks an explicit worklist: a function can have more blocks than fit the C stack
+static void mark_reachable(struct ir_cfg *cfg, int entry)
+{
+    // Each block is pushed once, when it is marked
+    int *worklist = malloc(cfg->count * sizeof(int));
+    int count = 0;
+
+    cfg->blocks[entry].reachable = true;
+    worklist[count++] = entry;
+
+    while (count) {
+        int i = worklist[--count];
+
+        for (struct ir_instr *instr = cfg->blocks[i].first; instr; instr = instr->next) {
+            int *target = ir_branch_target(instr);
+            if (!target)
+                continue;
+
+            int next = cfg->block_of[*target];
+            if (!cfg->blocks[next].reachable) {
+                cfg->blocks[next].reachable = true;
+                worklist[count++] = next;
+            }
+        }
+    }
+
+    free(worklist);
+}
+
+static long block_count(struct ir_block *b)
+{
+    return b->first->label.count;
+}
+
+static bool is_cold(struct ir_function *fn, struct ir_block *b)
+{
+    return fn->has_profile && fn->entry_count > 0 &&
+           b->first->label.has_count && block_count(b) == 0;
+}
+
+static long taken_count(struct ir_instr *cond)
+{
+    if (cond->kind == IR_INSTR_JUMP_IF_ZERO)
+        return cond->jump_if_zero.taken_count;
+
+    return cond->jump_if_not_zero.taken_count;
+}
+
+// 'next' may follow 'b' without displacing another block's fall-through
+static bool can_follow(struct ir_function *fn, struct ir_cfg *cfg, int b, int next,
+                       bool allow_cold)
+{
+    struct ir_block *n = &cfg->blocks[next];
+
+    return n->reachable && !n->placed &&
+           (allow_cold || !is_cold(fn, n)) &&
+           (n->layout_pred < 0 || n->layout_pred == b);
+}
+
+static void swap_jumps(struct ir_instr *cond, struct ir_instr *jump)
+{
+    int *cond_target = ir_branch_target(cond);
+    int tmp = *cond_target;
+
+    *cond_target = jump->jump.label_id;
+    jump->jump.label_id = tmp;
+
+    // The taken count would now be the other edge's
+    if (cond->kind == IR_INSTR_JUMP_IF_ZERO) {
+        cond->kind = IR_INSTR_JUMP_IF_NOT_ZERO;
+        cond->jump_if_not_zero.has_count = false;
+    } else {
+        cond->kind = IR_INSTR_JUMP_IF_ZERO;
+        cond->jump_if_zero.has_count = false;
+    }
+}
+
+// Successor of 'b' to place right after it, -1 if none can be
+static int pick_successor(struct ir_function *fn, struct ir_cfg *cfg, int b, bool allow_cold)
+{
+    struct ir_instr *cond, *jump;
+    cfg_block_exits(&cfg->blocks[b], &cond, &jump);
+
+    if (!jump)
+        return -1;
+
+    int fall = cfg->block_of[jump->jump.label_id];
+    bool fall_ok = can_follow(fn, cfg, b, fall, allow_cold);
+
+    if (!cond || cond->kind == IR_INSTR_JUMP)
+        return fall_ok ? fall : -1;
+
+    int taken = cfg->block_of[*ir_branch_target(cond)];
+    bool taken_ok = can_follow(fn, cfg, b, taken, allow_cold);
+
+    if (fall_ok && taken_ok && fn->has_profile) {
+        long taken_edge = taken_count(cond);
+        long fall_edge = block_count(&cfg->blocks[b]) - taken_edge;
+
+        if (taken_edge > fall_edge)
+            fall_ok = false;
+    }
+
+    if (fall_ok)
+        return fall;
+
+    if (taken_ok) {
+        // Fall into the conditional target instead, inverting the test
+        swap_jumps(cond, jump);
+        return taken;
+    }
+
+    return -1;
+}
+
+static void place_chains(struct ir_function *fn, struct ir_cfg *cfg, int *order,
+                         int *placed, bool allow_cold)
+{
+    for (int start = 0; start < cfg->count; start++) {
+        int b = start;
+
+        if (!allow_cold && is_cold(fn, &cfg->blocks[b]))
+            continue;
+
+        while (b >= 0 && cfg->blocks[b].reachable && !cfg->blocks[b].placed) {
+            cfg->blocks[b].placed = true;
+            order[(*placed)++] = b;
+
+            b = pick_successor(fn, cfg, b, allow_cold);
+        }
+    }
+}
+
+// Returns how many blocks were placed in 'order'
+static int order_blocks(struct ir_function *fn, struct ir_cfg *cfg, int *order)
+{
+    int placed = 0;
+
+    place_chains(fn, cfg, order, &placed, false);
+    int hot = placed;
+
+    place_chains(fn, cfg, order, &placed, true);
+
+    if (placed > hot) {
+        fn->has_cold_part = true;
+        fn->cold_label = cfg->blocks[order[hot]].label;
+    }
+
+    return placed;
+}
+
+// The labels right after 'instr' include 'label' (and not the cold split)
+static bool falls_into_label(struct ir_function *fn, struct ir_instr *instr, int label)
+{
+    bool found = false;
+
+    for (instr = instr->next; instr && instr->kind == IR_INSTR_LABEL; instr = instr->next) {
+        if (fn->has_cold_part && instr->label.label_id == fn->cold_label)
+            return false;
+        if (instr->label.label_id == label)
+            found = true;
+    }
+
+    return found;
+}
+
+/*
+ * Removes jumps to the next instruction and inverts conditional
+ * branches over a jump.
+ */
+static void remove_redundant_jumps(struct ir_function *fn)
+{
+    struct ir_instr *prev = NULL;
+    struct ir_instr *instr = fn->first;
+
+    while (instr) {
+        struct ir_instr *next = instr->next;
+
+        if ((instr->kind == IR_INSTR_JUMP_IF_ZERO || instr->kind == IR_INSTR_JUMP_IF_NOT_ZERO) &&
+            next && next->kind == IR_INSTR_JUMP &&
+            falls_into_label(fn, next, *ir_branch_target(instr))) {
+            swap_jumps(instr, next);
+        }
+
+        int *target = ir_branch_target(instr);
+        if (target && falls_into_label(fn, instr, *target)) {
+            if (prev)
+                prev->next = next;
+            else
+                fn->first = next;
+            free(instr);
+            instr = next;
+            continue;
+        }
+
+        prev = instr;
+        instr = next;
+    }
+
+    fn->last = prev;
+}
+
+static void remove_unused_labels(struct ir_function *fn)
+{
+    int max_label = 0;
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next)
+        if (instr->kind == IR_INSTR_LABEL && instr->label.label_id > max_label)
+            max_label = instr->label.label_id;
+
+    bool *used = calloc(max_label + 1, sizeof(bool));
+
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+        int *target = ir_branch_target(instr);
+        if (target && *target <= max_label)
+            used[*target] = true;
+    }
+
+    if (fn->has_cold_part)
+        used[fn->cold_label] = true;
+
+    struct ir_instr *prev = NULL;
+    struct ir_instr *instr = fn->first;
+    while (instr) {
+        struct ir_instr *next = instr->next;
+
+        if (instr->kind == IR_INSTR_LABEL && !used[instr->label.label_id]) {
+            if (prev)
+                prev->next = next;
+            else
+                fn->first = next;
+            free(instr);
+        } else {
+            prev = instr;
+        }
+
+        instr = next;
+    }
+
+    fn->last = prev;
+    free(used);
+}
+
+// Leaves jumps only where control doesn't fall through
+static void tidy_jumps(struct ir_function *fn)
+{
+    remove_redundant_jumps(fn);
+    remove_unused_labels(fn);
+}
+
+static void layout_blocks(struct ir_function *fn)
+{
+    if (!fn->first)
+        return;
+
+    struct ir_cfg cfg;
+    cfg_build(&cfg, fn);
+
+    for (int i = 0; i < cfg.count; i++) {
+        for (struct ir_instr *instr = cfg.blocks[i].first; instr; instr = instr->next) {
+            int *target = ir_branch_target(instr);
+            if (target)
+                *target = thread_jump(&cfg, *target);
+        }
+    }
+
+    mark_reachable(&cfg, 0);
+
+    // Unreachable blocks are dropped
+    int *order = malloc(cfg.count * sizeof(int));
+    int placed = order_blocks(fn, &cfg, order);
+    cfg_relink(&cfg, fn, order, placed);
+
+    tidy_jumps(fn);
+
+    free(order);
+    cfg_free(&cfg);
+}
+
+void optimize_ir(struct ir_program *program, struct opt_options *opts)
+{
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        if (opts->tail_calls)
+            eliminate_tail_recursion(fn);
+    }
+
+    if (opts->profile_generate)
+        profile_instrument(program, opts->profile_generate);
+
+    if (opts->profile_use && !profile_apply(program, opts->profile_use))
+        fprintf(stderr, "warning: can't read profile '%s'\n", opts->profile_use);
+
+    if (opts->inline_functions)
+        ipo_inline(program);
+
+    if (opts->ipa_cp)
+        ipo_propagate_constants(program);
+
+    if (opts->ipa_dead_args)
+        ipo_remove_dead_arguments(program);
+
+    // Before the per-function passes, so dead code isn't laid out or lowered
+    if (opts->remove_dead_symbols)
+        ipo_remove_dead_symbols(program);
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        // Inlining can turn mutual recursion into self tail recursion
+        if (opts->inline_functions && opts->tail_calls)
+            eliminate_tail_recursion(fn);
+
+        if (opts->reorder_blocks)
+            layout_blocks(fn);
+        else if (opts->profile_generate || opts->profile_use)
+            tidy_jumps(fn);
+    }
+}
@@ -0,0 +1,25 @@
+/*
+ * IR -> IR optimization passes.
+ * Run between build_ir() and emit_x86().
+ */
+
+#ifndef CINC_OPT_H
+#define CINC_OPT_H
+
+#include "ir.h"
+
+struct opt_options {
+    bool tail_calls;        // Self tail recursion becomes a loop
+    bool reorder_blocks;    // Fall-through aware block layout
+    bool inline_functions;  // Inline small callees and single-use static functions
+    bool ipa_cp;            // Constant arguments and results of static functions
+    bool ipa_dead_args;     // Drop unused parameters and results of static functions
+    bool remove_dead_symbols;   // Drop unreferenced static functions and variables
+
+    const char *profile_generate;   // Profile file to instrument for, or NULL
+    const char *profile_use;        // Profile file to optimize with, or NULL
+};
+
+void optimize_ir(struct ir_program *program, struct opt_options *opts);
+
+#endif
@@ -8,14 +8,19 @@
 #include "type.h"
 
 struct parser {
-    struct token previous;
-    struct token current;
+    tok_id previous;
+    tok_id current;
+    tok_id next;
     bool had_error;
     bool panic_mode;
 };
 
-typedef struct expr *(*prefix_parse_fn)(void);
-typedef struct expr *(*infix_parse_fn)(struct expr *);
+/*
+ * Rules act on the innermost expression frame, see parse_expression().
+ * A rule either finishes its part or waits for an operand.
+ */
+typedef void (*prefix_parse_fn)(void);
+typedef void (*infix_parse_fn)(void);
 
 enum precedence {
     PREC_NONE,
@@ -45,33 +50,19 @@ struct parse_rule {
 struct decl_specs {
     struct type *base_type;
     enum storage_class storage_class;
-    struct token type_tok;
-    struct token storage_tok;
+    tok_id type_tok;
+    tok_id storage_tok;
 };
 
 static struct parser parser_state;
 
-static void error(struct token *tok, const char *message)
+static void error(tok_id tok, const char *message)
 {
     if (parser_state.panic_mode)
         return;
 
     parser_state.panic_mode = true;
-
-    int col = (int)(tok->start - tok->line_start);
-
-    fprintf(stderr, "%s: Error at line %d, col %d: %s\n", tok->filename, tok->line, col, message);
-
-    const char *line_end = tok->line_start;
-    while (*line_end != '\0' && *line_end != '\n')
-        line_end++;
-    fprintf(stderr, "  %.*s\n", (int)(line_end - tok->line_start), tok->line_start);
-
-    fprintf(stderr, "  %*s", col, "");
-    for (int i = 0; i < (tok->length > 0 ? tok->length : 1); i++)
-        fputc('^', stderr);
-    fputc('\n', stderr);
-
+    tok_error(tok, message);
     parser_state.had_error = true;
 }
 
@@ -80,18 +71,22 @@ static void advance(void)
     parser_state.previous = parser_state.current;
 
     for (;;) {
-        parser_state.current = lexer_next_token();
+        parser_state.current = parser_state.next;
+
+        // The stream ends with an EOF, which stays current
+        if (tok_type(parser_state.next) != TOKEN_EOF)
+            parser_state.next++;
 
-        if (parser_state.current.type != TOKEN_ERROR)
+        if (tok_type(parser_state.current) != TOKEN_ERROR)
             break;
 
-        error(&parser_state.current, "Unexpected character");
+        error(parser_state.current, "Unexpected character");
     }
 }
 
 static bool check(enum token_type type)
 {
-    return parser_state.current.type == type;
+    return tok_type(parser_state.current) == type;
 }
 
 static bool match(enum token_type type)
@@ -110,7 +105,7 @@ static void consume(enum token_type type, const char *message)
         return;
     }
 
-    error(&parser_state.current, message);
+    error(parser_state.current, message);
 }
 
 static bool is_type_specifier(enum token_type type)
@@ -135,14 +130,14 @@ static void synchronize_block_item(void)
 {
     parser_state.panic_mode = false;
 
-    while (parser_state.current.type != TOKEN_EOF) {
-        if (parser_state.previous.type == TOKEN_SEMICOLON)
+    while (tok_type(parser_state.current) != TOKEN_EOF) {
+        if (tok_type(parser_state.previous) == TOKEN_SEMICOLON)
             return;
 
-        if (is_declaration_start(parser_state.current.type))
+        if (is_declaration_start(tok_type(parser_state.current)))
             return;
 
-        switch (parser_state.current.type) {
+        switch (tok_type(parser_state.current)) {
             case TOKEN_RETURN:
             case TOKEN_IF:
             case TOKEN_ELSE:
@@ -169,8 +164,8 @@ static void synchronize_translation_unit(void)
 {
     parser_state.panic_mode = false;
 
-    while (parser_state.current.type != TOKEN_EOF) {
-        if (is_declaration_start(parser_state.current.type))
+    while (tok_type(parser_state.current) != TOKEN_EOF) {
+        if (is_declaration_start(tok_type(parser_state.current)))
             return;
 
         advance();
@@ -179,137 +174,135 @@ static void synchronize_translation_unit(void)
 
 /* Expression parsing */
 
-static struct expr *parse_expression(enum precedence prec);
+/*
+ * Expressions nest through an explicit stack of frames instead of
+ * recursion, so generated code with thousands of nested operands
+ * ('a = b = ...', '- - x', '?:' chains, parentheses) doesn't grow the C
+ * stack. A frame is one level of precedence climbing: it builds 'left'
+ * in its infix loop and while an operand is parsed in the frame above
+ * it, 'step' says what becomes of that operand.
+ */
+enum expr_step {
+    STEP_UNARY,         // Operand of a prefix operator
+    STEP_PRE,
+    STEP_GROUPING,      // Inside '(' ')'
+    STEP_BINARY,        // Right operand
+    STEP_ASSIGNMENT,
+    STEP_THEN,          // Between '?' and ':'
+    STEP_ELSE,
+    STEP_ARGUMENT,
+};
+
+struct expr_frame {
+    enum precedence prec;
+    enum expr_step step;
+    tok_id op;                  // That started the step
+    struct expr *left;
+    struct expr *then_expr;     // STEP_ELSE
+    struct expr *args_head;     // STEP_ARGUMENT
+    struct expr *args_tail;
+};
+
+static struct expr_frame *expr_frames;
+static int expr_frame_count;
+static int expr_frame_capacity;
+
 static struct parse_rule *get_rule(enum token_type type);
 
-static struct expr *number(void)
+static struct expr_frame *top_frame(void)
 {
-    struct expr *expr = expr_new(EXPR_INT_LITERAL, parser_state.previous);
-    expr->int_value = strtol(parser_state.previous.start, NULL, 10);
-    return expr;
+    return &expr_frames[expr_frame_count - 1];
 }
 
-static struct expr *identifier(void)
+static void push_expr_frame(enum precedence prec)
 {
-    struct expr *expr = expr_new(EXPR_IDENTIFIER, parser_state.previous);
-    expr->identifier.name = parser_state.previous;
-    return expr;
+    if (expr_frame_count == expr_frame_capacity) {
+        expr_frame_capacity = expr_frame_capacity ? expr_frame_capacity * 2 : 64;
+        expr_frames = realloc(expr_frames, expr_frame_capacity * sizeof(struct expr_frame));
+    }
+
+    expr_frames[expr_frame_count++] = (struct expr_frame) { .prec = prec };
 }
 
-static struct expr *unary(void)
+// The innermost frame waits while an operand is parsed from 'prec' up
+static void await_operand(enum expr_step step, enum precedence prec)
 {
-    struct token op = parser_state.previous;
-    struct expr *operand = parse_expression(PREC_UNARY);
-    if (!operand)
-        return NULL;
-
-    struct expr *expr = expr_new(EXPR_UNARY, op);
-    expr->unary.op = op;
-    expr->unary.operand = operand;
-    return expr;
+    top_frame()->step = step;
+    push_expr_frame(prec);
 }
 
-static struct expr *pre(void)
+static void number(void)
 {
-    struct token op = parser_state.previous;
-    struct expr *operand = parse_expression(PREC_UNARY);
-    if (!operand)
-        return NULL;
-
-    struct expr *expr = expr_new(EXPR_PRE, op);
-    expr->unary.op = op;
-    expr->unary.operand = operand;
-    return expr;
+    struct expr *expr = expr_new(EXPR_INT_LITERAL, parser_state.previous);
+    expr->int_value = strtol(tok_start(parser_state.previous), NULL, 10);
+    top_frame()->left = expr;
 }
 
-static struct expr *grouping(void)
+static void identifier(void)
 {
-    struct expr *expr = parse_expression(PREC_ASSIGNMENT);
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' after expression");
-    return expr;
+    top_frame()->left = expr_new(EXPR_IDENTIFIER, parser_state.previous);
 }
 
-static struct expr *binary(struct expr *left)
+static void unary(void)
 {
-    struct token op = parser_state.previous;
-    struct parse_rule *rule = get_rule(op.type);
-
-    struct expr *right = parse_expression(rule->prec + 1);
-    if (!right)
-        return NULL;
-
-    struct expr *expr = expr_new(EXPR_BINARY, op);
-    expr->binary.op = op;
-    expr->binary.left = left;
-    expr->binary.right = right;
-    return expr;
+    await_operand(STEP_UNARY, PREC_UNARY);
 }
 
-static struct expr *assignment(struct expr *left)
+static void pre(void)
 {
-    struct token op = parser_state.previous;
-    struct expr *right = parse_expression(PREC_ASSIGNMENT);
-    if (!right)
-        return NULL;
-
-    struct expr *expr = expr_new(EXPR_ASSIGNMENT, op);
-    expr->assignment.op = op;
-    expr->assignment.lvalue = left;
-    expr->assignment.rvalue = right;
-    return expr;
+    await_operand(STEP_PRE, PREC_UNARY);
 }
 
-static struct expr *post(struct expr *left)
+static void grouping(void)
 {
-    struct token op = parser_state.previous;
+    await_operand(STEP_GROUPING, PREC_ASSIGNMENT);
+}
 
-    struct expr *expr = expr_new(EXPR_POST, op);
-    expr->unary.op = op;
-    expr->unary.operand = left;
-    return expr;
+static void binary(void)
+{
+    struct parse_rule *rule = get_rule(tok_type(parser_state.previous));
+    await_operand(STEP_BINARY, rule->prec + 1);
 }
 
-static struct expr *ternary(struct expr *left)
+static void assignment(void)
 {
-    struct token tok = parser_state.previous; // ? tok
-    
-    struct expr *then_expr = parse_expression(PREC_ASSIGNMENT);
-    if (!then_expr)
-        return NULL;
+    await_operand(STEP_ASSIGNMENT, PREC_ASSIGNMENT);
+}
 
-    consume(TOKEN_COLON, "Expected ':' after conditional expression");
-    struct expr *else_expr = parse_expression(PREC_TERNARY);
-    if (!else_expr)
-        return NULL;
+static void post(void)
+{
+    struct expr_frame *frame = top_frame();
 
-    struct expr *expr = expr_new(EXPR_CONDITIONAL, tok);
-    expr->conditional.condition = left;
-    expr->conditional.then_expr = then_expr;
-    expr->conditional.else_expr = else_expr;
-    return expr;
+    struct expr *expr = expr_new(EXPR_POST, frame->op);
+    expr->unary.operand = frame->left;
+    frame->left = expr;
 }
 
-static struct expr *call(struct expr *left)
+static void ternary(void)
 {
-    struct token tok = parser_state.previous;
-    struct expr *args_head = NULL;
-    struct expr *args_tail = NULL;
-
-    if (!check(TOKEN_RIGHT_PAREN)) {
-        do {
-            struct expr *arg = parse_expression(PREC_ASSIGNMENT);
-            if (!arg)
-                return NULL;
-            LIST_APPEND(args_head, args_tail, arg);
-        } while (match(TOKEN_COMMA));
-    }
+    await_operand(STEP_THEN, PREC_ASSIGNMENT);
+}
 
+static void finish_call(struct expr_frame *frame)
+{
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after arguments");
 
-    struct expr *expr = expr_new(EXPR_CALL, tok);
-    expr->call.callee = left;
-    expr->call.args = args_head;
-    return expr;
+    struct expr *expr = expr_new(EXPR_CALL, frame->op);
+    expr->call.callee = frame->left;
+    expr->call.args = frame->args_head;
+    frame->left = expr;
+}
+
+static void call(void)
+{
+    struct expr_frame *frame = top_frame();
+    frame->args_head = NULL;
+    frame->args_tail = NULL;
+
+    if (check(TOKEN_RIGHT_PAREN))
+        finish_call(frame);
+    else
+        await_operand(STEP_ARGUMENT, PREC_ASSIGNMENT);
 }
 
 /* Each token maps to a prefix rule at the start of an expression,
@@ -392,6 +385,88 @@ static struct parse_rule parse_rules[] = {
     [TOKEN_EOF]           = {NULL, NULL, PREC_NONE},
 };
 
+/*
+ * The operand a frame waited for is there, NULL after an error. Like a
+ * rule, this either finishes the step or waits for another operand.
+ */
+static void finish_step(struct expr_frame *frame, struct expr *operand)
+{
+    struct expr *expr;
+
+    switch (frame->step) {
+        case STEP_UNARY:
+        case STEP_PRE:
+            expr = NULL;
+            if (operand) {
+                expr = expr_new(frame->step == STEP_UNARY ? EXPR_UNARY : EXPR_PRE, frame->op);
+                expr->unary.operand = operand;
+            }
+            frame->left = expr;
+            break;
+
+        case STEP_GROUPING:
+            frame->left = operand;
+            consume(TOKEN_RIGHT_PAREN, "Expected ')' after expression");
+            break;
+
+        case STEP_BINARY:
+            expr = NULL;
+            if (operand) {
+                expr = expr_new(EXPR_BINARY, frame->op);
+                expr->binary.left = frame->left;
+                expr->binary.right = operand;
+            }
+            frame->left = expr;
+            break;
+
+        case STEP_ASSIGNMENT:
+            expr = NULL;
+            if (operand) {
+                expr = expr_new(EXPR_ASSIGNMENT, frame->op);
+                expr->assignment.lvalue = frame->left;
+                expr->assignment.rvalue = operand;
+            }
+            frame->left = expr;
+            break;
+
+        case STEP_THEN:
+            if (!operand) {
+                frame->left = NULL;
+                break;
+            }
+
+            frame->then_expr = operand;
+            consume(TOKEN_COLON, "Expected ':' after conditional expression");
+            await_operand(STEP_ELSE, PREC_TERNARY);
+            break;
+
+        case STEP_ELSE:
+            expr = NULL;
+            if (operand) {
+                expr = expr_new(EXPR_CONDITIONAL, frame->op);
+                expr->conditional.condition = frame->left;
+                expr->conditional.then_expr = frame->then_expr;
+                expr->conditional.else_expr = operand;
+            }
+            frame->left = expr;
+            break;
+
+        case STEP_ARGUMENT:
+            if (!operand) {
+                frame->left = NULL;
+                break;
+            }
+
+            LIST_APPEND(frame->args_head, frame->args_tail, operand);
+
+            if (match(TOKEN_COMMA))
+                await_operand(STEP_ARGUMENT, PREC_ASSIGNMENT);
+            else
+                finish_call(frame);
+            break;
+    }
+}
+
 static struct parse_rule *get_rule(enum token_type type)
 {
     return &parse_rules[type];
@@ -399,117 +474,242 @@ static struct parse_rule *get_rule(enum token_type type)
 
 static struct expr *parse_expression(enum precedence prec)
 {
-    advance();
-    prefix_parse_fn prefix = get_rule(parser_state.previous.type)->prefix;
-    if (!prefix) {
-        error(&parser_state.previous, "Expected expression");
-        return NULL;
+    int floor = expr_frame_count;
+    push_expr_frame(prec);
+
+    // The innermost frame starts with a prefix rule, or runs its infix loop
+    bool starting = true;
+    struct expr *operand;
+
+    for (;;) {
+        int top = expr_frame_count;
+        struct expr_frame *frame = top_frame();
+
+        if (starting) {
+            advance();
+            prefix_parse_fn prefix = get_rule(tok_type(parser_state.previous))->prefix;
+            if (!prefix) {
+                error(parser_state.previous, "Expected expression");
+                operand = NULL;
+                expr_frame_count--;
+            } else {
+                frame->op = parser_state.previous;
+                prefix();
+                starting = expr_frame_count > top;
+                continue;
+            }
+        } else if (frame->prec <= get_rule(tok_type(parser_state.current))->prec) {
+            advance();
+            frame->op = parser_state.previous;
+            get_rule(tok_type(parser_state.previous))->infix();
+            starting = expr_frame_count > top;
+            continue;
+        } else {
+            operand = frame->left;
+            expr_frame_count--;
+        }
+
+        // The frame is done, its expression is the operand of the one below
+        if (expr_frame_count == floor)
+            return operand;
+
+        top = expr_frame_count;
+        finish_step(top_frame(), operand);
+        starting = expr_frame_count > top;
     }
+}
 
-    struct expr *left = prefix();
+static struct decl *parse_declaration(void);
 
-    while (prec <= get_rule(parser_state.current.type)->prec) {
-        advance();
-        infix_parse_fn infix = get_rule(parser_state.previous.type)->infix;
-        left = infix(left);
+/*
+ * Statements nest through an explicit stack as well, 'else if' chains
+ * and blocks thousands deep only grow the frames array. A frame is a
+ * statement waiting for the statement nested in it, which goes to
+ * 'slot', or one collecting its block items.
+ */
+enum stmt_await {
+    AWAIT_THEN,
+    AWAIT_ELSE,
+    AWAIT_BODY,         // Of for, while and switch, which end with it
+    AWAIT_DO_BODY,
+    AWAIT_LABELED,
+    AWAIT_BLOCK_ITEM,   // Until '}'
+    AWAIT_LABEL_ITEM,   // Of a case or default, until the next label or '}'
+};
+
+struct stmt_frame {
+    enum stmt_await await;
+    struct stmt *stmt;
+    struct stmt **slot;
+    struct block_item **items;
+    struct block_item *tail;
+    bool first;         // AWAIT_LABEL_ITEM with no item yet
+};
+
+static struct stmt_frame *stmt_frames;
+static int stmt_frame_count;
+static int stmt_frame_capacity;
+
+static struct stmt_frame *push_stmt_frame(enum stmt_await await, struct stmt *stmt)
+{
+    if (stmt_frame_count == stmt_frame_capacity) {
+        stmt_frame_capacity = stmt_frame_capacity ? stmt_frame_capacity * 2 : 64;
+        stmt_frames = realloc(stmt_frames, stmt_frame_capacity * sizeof(struct stmt_frame));
     }
 
-    return left;
+    struct stmt_frame *frame = &stmt_frames[stmt_frame_count++];
+    *frame = (struct stmt_frame) { .await = await, .stmt = stmt };
+    return frame;
 }
 
-static struct stmt *parse_statement(void);
-static struct block_item *parse_block_item(void);
-static struct stmt *parse_block_after_lbrace(void);
-static struct decl *parse_declaration(void);
+static void await_stmt(enum stmt_await await, struct stmt *stmt, struct stmt **slot)
+{
+    push_stmt_frame(await, stmt)->slot = slot;
+}
 
-static struct block_item *parse_case_default_items()
+static struct block_item *parse_declaration_item(void)
 {
-    struct block_item *head = NULL;
-    struct block_item *tail = NULL;
+    struct decl *decls = parse_declaration();
+    if (!decls)
+        return NULL;
+
+    struct block_item *item = block_item_new(BLOCK_ITEM_DECL, parser_state.current);
+    item->decls = decls;
+    return item;
+}
+
+/*
+ * Parses the declarations of an item frame up to its next statement.
+ * True when the items are done instead, which finishes the frame.
+ */
+static bool next_items(struct stmt_frame *frame)
+{
+    if (frame->await == AWAIT_BLOCK_ITEM) {
+        while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+            if (!is_declaration_start(tok_type(parser_state.current)))
+                return false;
+
+            struct block_item *item = parse_declaration_item();
+
+            if (!item || parser_state.panic_mode) {
+                synchronize_block_item();
+                continue;
+            }
+
+            LIST_APPEND(*frame->items, frame->tail, item);
+        }
+
+        consume(TOKEN_RIGHT_BRACE, "Expected '}' after compound statement");
+        return true;
+    }
 
     /*
      * C11 doesn't allow decl after label, C23 does
      * TODO: Maybe allow this
      */
-    bool first = true;
     while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) &&
             !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        if (first && is_declaration_start(parser_state.current.type)) {
-            error(&parser_state.current, "Label followed by declaration");
-            return NULL;
+        if (!is_declaration_start(tok_type(parser_state.current)))
+            return false;
+
+        if (frame->first) {
+            error(parser_state.current, "Label followed by declaration");
+            *frame->items = NULL;
+            return true;
         }
 
-        struct block_item *item = parse_block_item();
-        if (!item)
-            return NULL;
+        struct block_item *item = parse_declaration_item();
+        if (!item) {
+            *frame->items = NULL;
+            return true;
+        }
 
-        first = false;
-        LIST_APPEND(head, tail, item);
+        LIST_APPEND(*frame->items, frame->tail, item);
     }
 
-    return head;
+    return true;
+}
+
+// Pushes a frame for the items of 'stmt', finished right away if it has no statements
+static bool start_items(enum stmt_await await, struct stmt *stmt,
+                        struct block_item **items, struct stmt **result)
+{
+    struct stmt_frame *frame = push_stmt_frame(await, stmt);
+    frame->items = items;
+    frame->first = true;
+
+    if (!next_items(frame))
+        return false;
+
+    stmt_frame_count--;
+    *result = stmt;
+    return true;
+}
+
+static bool start_block(struct stmt **result)
+{
+    struct stmt *block = stmt_new(STMT_BLOCK, parser_state.previous);
+    return start_items(AWAIT_BLOCK_ITEM, block, &block->block.items, result);
 }
 
-static struct stmt *parse_statement(void)
+/*
+ * Parses a statement up to the statement nested in it, if any. True
+ * when it is finished instead, with 'result' NULL after errors.
+ */
+static bool start_statement(struct stmt **result)
 {
+    *result = NULL;
+
      /*
      * TODO: Should this guard be here or in sema?
      */
-    if (is_declaration_start(parser_state.current.type)) {
-        error(&parser_state.current, "Expected statement, not declaration");
-        return NULL;
+    if (is_declaration_start(tok_type(parser_state.current))) {
+        error(parser_state.current, "Expected statement, not declaration");
+        return true;
     }
 
     if (match(TOKEN_LEFT_BRACE))
-        return parse_block_after_lbrace();
+        return start_block(result);
 
     if (match(TOKEN_RETURN)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
         struct expr *expr = NULL;
 
         if (!check(TOKEN_SEMICOLON) && !check(TOKEN_EOF)) {
             expr = parse_expression(PREC_ASSIGNMENT);
             if (!expr)
-                return NULL;
+                return true;
         }
 
         consume(TOKEN_SEMICOLON, "Expected ';' after return");
 
         struct stmt *stmt = stmt_new(STMT_RETURN, tok);
         stmt->return_stmt.expr = expr;
-        return stmt;
+        *result = stmt;
+        return true;
     }
 
     if (match(TOKEN_IF)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
 
         consume(TOKEN_LEFT_PAREN, "Expected '(' after 'if'");
         struct expr *cond = parse_expression(PREC_ASSIGNMENT);
         consume(TOKEN_RIGHT_PAREN, "Expected ')' after 'if' condition");
 
-        struct stmt *then_stmt = parse_statement();
-        if (!then_stmt)
-            return NULL;
-
-        struct stmt *else_stmt = NULL;
-        if (match(TOKEN_ELSE))
-            else_stmt = parse_statement();
-
         struct stmt *stmt = stmt_new(STMT_IF, tok);
         stmt->if_stmt.condition = cond;
-        stmt->if_stmt.then_stmt = then_stmt;
-        stmt->if_stmt.else_stmt = else_stmt;
-        return stmt;
+        await_stmt(AWAIT_THEN, stmt, &stmt->if_stmt.then_stmt);
+        return false;
     }
 
     if (match(TOKEN_FOR)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
 
         consume(TOKEN_LEFT_PAREN, "Expected '(' after 'for'");
 
         struct for_init *init = NULL;
 
-        if (is_declaration_start(parser_state.current.type)) {
+        if (is_declaration_start(tok_type(parser_state.current))) {
             init = calloc(1, sizeof(struct for_init));
             init->is_decl = true;
             init->decls = parse_declaration();
@@ -518,7 +718,7 @@ static struct stmt *parse_statement(void)
             init->is_decl = false;
             init->expr = parse_expression(PREC_ASSIGNMENT);
             if (!init->expr)
-                return NULL;
+                return true;
 
             consume(TOKEN_SEMICOLON, "Expected ';' after for-init expression");
         }
@@ -527,7 +727,7 @@ static struct stmt *parse_statement(void)
         if (!match(TOKEN_SEMICOLON)) {
             cond = parse_expression(PREC_ASSIGNMENT);
             if (!cond)
-                return NULL;
+                return true;
 
             consume(TOKEN_SEMICOLON, "Expected ';' after for-condition");
         }
@@ -536,129 +736,106 @@ static struct stmt *parse_statement(void)
         if (!check(TOKEN_RIGHT_PAREN)) {
             post = parse_expression(PREC_ASSIGNMENT);
             if (!post)
-                return NULL;
+                return true;
         }
 
         consume(TOKEN_RIGHT_PAREN, "Expected ')' after for clauses");
 
-        struct stmt *body = parse_statement();
-        if (!body)
-            return NULL;
-
         struct stmt *stmt = stmt_new(STMT_FOR, tok);
         stmt->for_stmt.init = init;
         stmt->for_stmt.condition = cond;
         stmt->for_stmt.post = post;
-        stmt->for_stmt.body = body;
-        return stmt;
+        await_stmt(AWAIT_BODY, stmt, &stmt->for_stmt.body);
+        return false;
     }
 
     if (match(TOKEN_WHILE)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
 
         consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'");
         struct expr *cond = parse_expression(PREC_ASSIGNMENT);
         consume(TOKEN_RIGHT_PAREN, "Expected ')' after 'while' condition");
 
-        struct stmt *body = parse_statement();
-        if (!body)
-            return NULL;
-
         struct stmt *stmt = stmt_new(STMT_WHILE, tok);
         stmt->while_stmt.condition = cond;
-        stmt->while_stmt.body = body;
-        return stmt;
+        await_stmt(AWAIT_BODY, stmt, &stmt->while_stmt.body);
+        return false;
     }
 
     if (match(TOKEN_DO)) {
-        struct token tok = parser_state.previous;
-
-        struct stmt *body = parse_statement();
-        if (!body)
-            return NULL;
-
-        consume(TOKEN_WHILE, "Expected 'while' after 'do' body");
-        consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'");
-        struct expr *cond = parse_expression(PREC_ASSIGNMENT);
-        consume(TOKEN_RIGHT_PAREN, "Expected ')' after do-while condition");
-        consume(TOKEN_SEMICOLON, "Expected ';' after do-while");
-
-        struct stmt *stmt = stmt_new(STMT_DOWHILE, tok);
-        stmt->dowhile_stmt.condition = cond;
-        stmt->dowhile_stmt.body = body;
-        return stmt;
-
+        struct stmt *stmt = stmt_new(STMT_DOWHILE, parser_state.previous);
+        await_stmt(AWAIT_DO_BODY, stmt, &stmt->dowhile_stmt.body);
+        return false;
     }
 
     if (match(TOKEN_CASE)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
 
         struct expr *value = parse_expression(PREC_ASSIGNMENT);
         if (!value)
-            return NULL;
+            return true;
 
         consume(TOKEN_COLON, "Expected ':' after case value");
 
         struct stmt *stmt = stmt_new(STMT_CASE, tok);
         stmt->case_stmt.value = value;
-        stmt->case_stmt.items = parse_case_default_items();
-        return stmt;
+        return start_items(AWAIT_LABEL_ITEM, stmt, &stmt->case_stmt.items, result);
     }
 
     if (match(TOKEN_DEFAULT)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
 
         consume(TOKEN_COLON, "Expected ':' after 'default'");
 
         struct stmt *stmt = stmt_new(STMT_DEFAULT, tok);
-        stmt->default_stmt.items = parse_case_default_items();
-        return stmt;
+        return start_items(AWAIT_LABEL_ITEM, stmt, &stmt->default_stmt.items, result);
     }
 
     if (match(TOKEN_SWITCH)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
         
         consume(TOKEN_LEFT_PAREN, "Expected '(' after 'switch'");
         struct expr *cond = parse_expression(PREC_ASSIGNMENT);
         consume(TOKEN_RIGHT_PAREN, "Expected ')' after 'switch' condition");
 
-        struct stmt *body = parse_statement();
-        if (!body)
-            return NULL;
-
         struct stmt *stmt = stmt_new(STMT_SWITCH, tok);
         stmt->switch_stmt.condition = cond;
-        stmt->switch_stmt.body = body;
-        return stmt;
+        await_stmt(AWAIT_BODY, stmt, &stmt->switch_stmt.body);
+        return false;
     }
 
     if (match(TOKEN_BREAK)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
         consume(TOKEN_SEMICOLON, "Expected ';' after 'break'");
-        return stmt_new(STMT_BREAK, tok);
+        *result = stmt_new(STMT_BREAK, tok);
+        return true;
     }
 
     if (match(TOKEN_CONTINUE)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
         consume(TOKEN_SEMICOLON, "Expected ';' after 'continue'");
-        return stmt_new(STMT_CONTINUE, tok);
+        *result = stmt_new(STMT_CONTINUE, tok);
+        return true;
     }
 
     if (match(TOKEN_GOTO)) {
-        struct token tok = parser_state.previous;
+        tok_id tok = parser_state.previous;
         
         consume(TOKEN_IDENTIFIER, "Expected label after 'goto'");
-        struct token label = parser_state.previous;
+        tok_id label = parser_state.previous;
 
         consume(TOKEN_SEMICOLON, "Expected ';' after 'goto' statement");
 
         struct stmt *stmt = stmt_new(STMT_GOTO, tok);
         stmt->goto_stmt.label = label;
-        return stmt;
+        *result = stmt;
+        return true;
     }
 
-    if (match(TOKEN_SEMICOLON))
-        return stmt_new(STMT_NULL, parser_state.previous);
+    if (match(TOKEN_SEMICOLON)) {
+        *result = stmt_new(STMT_NULL, parser_state.previous);
+        return true;
+    }
 
     /*
      * Either an expression statement or
@@ -666,22 +843,122 @@ static struct stmt *parse_statement(void)
      */
     struct expr *expr = parse_expression(PREC_ASSIGNMENT);
     if (!expr)
-        return NULL;
+        return true;
 
     if (expr->kind == EXPR_IDENTIFIER && match(TOKEN_COLON)) {
-        struct stmt *labeled = parse_statement();
-
         struct stmt *stmt = stmt_new(STMT_LABEL, expr->tok);
-        stmt->label_stmt.name = expr->identifier.name;
-        stmt->label_stmt.stmt = labeled;
-        return stmt;
+        stmt->label_stmt.name = expr->tok;
+        await_stmt(AWAIT_LABELED, stmt, &stmt->label_stmt.stmt);
+        return false;
     }
 
     consume(TOKEN_SEMICOLON, "Expected ';' after expression-statement");
 
     struct stmt *stmt = stmt_new(STMT_EXPR, parser_state.previous);
     stmt->expr_stmt.expr = expr;
-    return stmt;
+    *result = stmt;
+    return true;
+}
+
+/*
+ * The statement the innermost frame waited for is finished, NULL after
+ * errors. True if that finishes the frame's statement too, into
+ * 'result', false when another nested statement is next.
+ */
+static bool finish_nested(struct stmt *nested, struct stmt **result)
+{
+    struct stmt_frame *frame = &stmt_frames[stmt_frame_count - 1];
+    struct stmt *stmt = frame->stmt;
+
+    switch (frame->await) {
+        case AWAIT_THEN:
+            if (!nested) {
+                stmt = NULL;
+                break;
+            }
+
+            *frame->slot = nested;
+
+            if (match(TOKEN_ELSE)) {
+                frame->await = AWAIT_ELSE;
+                frame->slot = &stmt->if_stmt.else_stmt;
+                return false;
+            }
+            break;
+
+        case AWAIT_ELSE:
+        case AWAIT_LABELED:
+            *frame->slot = nested;
+            break;
+
+        case AWAIT_BODY:
+            if (!nested)
+                stmt = NULL;
+            else
+                *frame->slot = nested;
+            break;
+
+        case AWAIT_DO_BODY:
+            if (!nested) {
+                stmt = NULL;
+                break;
+            }
+
+            *frame->slot = nested;
+
+            consume(TOKEN_WHILE, "Expected 'while' after 'do' body");
+            consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'");
+            stmt->dowhile_stmt.condition = parse_expression(PREC_ASSIGNMENT);
+            consume(TOKEN_RIGHT_PAREN, "Expected ')' after do-while condition");
+            consume(TOKEN_SEMICOLON, "Expected ';' after do-while");
+            break;
+
+        case AWAIT_BLOCK_ITEM:
+        case AWAIT_LABEL_ITEM: {
+            struct block_item *item = NULL;
+
+            if (nested) {
+                item = block_item_new(BLOCK_ITEM_STMT, parser_state.current);
+                item->stmt = nested;
+            }
+
+            if (frame->await == AWAIT_BLOCK_ITEM && (!item || parser_state.panic_mode)) {
+                synchronize_block_item();
+            } else if (!item) {
+                *frame->items = NULL;
+                break;
+            } else {
+                frame->first = false;
+                LIST_APPEND(*frame->items, frame->tail, item);
+            }
+
+            if (!next_items(frame))
+                return false;
+            break;
+        }
+    }
+
+    stmt_frame_count--;
+    *result = stmt;
+    return true;
+}
+
+// The body of a function, '{' is matched
+static struct stmt *parse_block_after_lbrace(void)
+{
+    int floor = stmt_frame_count;
+
+    struct stmt *stmt;
+    bool finished = start_block(&stmt);
+
+    for (;;) {
+        if (!finished)
+            finished = start_statement(&stmt);
+        else if (stmt_frame_count == floor)
+            return stmt;
+        else
+            finished = finish_nested(stmt, &stmt);
+    }
 }
 
 static struct decl *parse_declarator_from_specs(struct decl_specs *specs,
@@ -695,34 +972,34 @@ static struct decl_specs parse_decl_specs(void)
     bool saw_storage = false;
     bool saw_type = false;
 
-    while (is_declaration_start(parser_state.current.type)) {
-        if (is_storage_class_specifier(parser_state.current.type)) {
+    while (is_declaration_start(tok_type(parser_state.current))) {
+        if (is_storage_class_specifier(tok_type(parser_state.current))) {
             if (saw_storage)
-                error(&parser_state.current, "Multiple storage-class specifiers");
+                error(parser_state.current, "Multiple storage-class specifiers");
 
             saw_storage = true;
             specs.storage_tok = parser_state.current;
 
-            if (parser_state.current.type == TOKEN_STATIC)
+            if (tok_type(parser_state.current) == TOKEN_STATIC)
                 specs.storage_class = SC_STATIC;
-            else if (parser_state.current.type == TOKEN_EXTERN)
+            else if (tok_type(parser_state.current) == TOKEN_EXTERN)
                 specs.storage_class = SC_EXTERN;
-            else if (parser_state.current.type == TOKEN_AUTO)
+            else if (tok_type(parser_state.current) == TOKEN_AUTO)
                 specs.storage_class = SC_AUTO;
-            else if (parser_state.current.type == TOKEN_REGISTER)
+            else if (tok_type(parser_state.current) == TOKEN_REGISTER)
                 specs.storage_class = SC_REGISTER;
 
             advance();
-        } else if (is_type_specifier(parser_state.current.type)) {
+        } else if (is_type_specifier(tok_type(parser_state.current))) {
             if (saw_type)
-                error(&parser_state.current, "Multiple type specifiers");
+                error(parser_state.current, "Multiple type specifiers");
 
             saw_type = true;
             specs.type_tok = parser_state.current;
 
-            if (parser_state.current.type == TOKEN_INT)
+            if (tok_type(parser_state.current) == TOKEN_INT)
                 specs.base_type = type_int();
-            else if (parser_state.current.type == TOKEN_VOID)
+            else if (tok_type(parser_state.current) == TOKEN_VOID)
                 specs.base_type = type_void();
 
             advance();
@@ -730,7 +1007,7 @@ static struct decl_specs parse_decl_specs(void)
     }
 
     if (!saw_type) {
-        error(&parser_state.current, "Expected declaration type");
+        error(parser_state.current, "Expected declaration type");
         specs.base_type = type_int();
     }
 
@@ -753,7 +1030,7 @@ static struct decl *parse_parameter_declaration(void)
 static struct decl *parse_declarator_from_specs(struct decl_specs *specs,
                                                 bool allows_abstract_name)
 {
-    struct token name = {0};
+    tok_id name = NO_TOKEN;
 
     if (check(TOKEN_IDENTIFIER)) {
         advance();
@@ -810,7 +1087,7 @@ static struct decl *parse_init_declarator(struct decl_specs *specs)
 
     if (match(TOKEN_EQUAL)) {
         if (d->kind == DECL_FUNCTION) {
-            error(&d->name, "Function declaration cannot have an initializer");
+            error(d->name, "Function declaration cannot have an initializer");
             return NULL;
         }
 
@@ -841,49 +1118,6 @@ static struct decl *parse_declaration(void)
     return head;
 }
 
-static struct block_item *parse_block_item(void)
-{
-    if (is_declaration_start(parser_state.current.type)) {
-        struct decl *decls = parse_declaration();
-        if (!decls)
-            return NULL;
-
-        struct block_item *item = block_item_new(BLOCK_ITEM_DECL, parser_state.current);
-
-        item->decls = decls;
-        return item;
-    }
-
-    struct stmt *stmt = parse_statement();
-    if (!stmt)
-        return NULL;
-
-    struct block_item *item = block_item_new(BLOCK_ITEM_STMT, parser_state.current);
-    item->stmt = stmt;
-    return item;
-}
-
-static struct stmt *parse_block_after_lbrace()
-{
-    struct stmt *block = stmt_new(STMT_BLOCK, parser_state.previous);
-    struct block_item *tail = NULL;
-
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        struct block_item *item = parse_block_item();
-
-        if (!item || parser_state.panic_mode) {
-            synchronize_block_item();
-            continue;
-        }
-
-        LIST_APPEND(block->block.items, tail, item);
-    }
-
-    consume(TOKEN_RIGHT_BRACE, "Expected '}' after compound statement");
-
-    return block;
-}
-
 static struct decl *parse_external_declaration(void)
 {
     struct decl_specs specs = parse_decl_specs();
@@ -914,19 +1148,19 @@ static struct decl *parse_external_declaration(void)
     return head;
 }
 
-struct ast_program *parse_translation_unit(const char *source)
+struct ast_program *parse_translation_unit(struct token_stream *tokens)
 {
     parser_state = (struct parser){0};
 
-    lexer_init(source);
+    current_tokens = tokens;
     advance();
 
     struct ast_program *program = calloc(1, sizeof(struct ast_program));
     struct decl *tail = NULL;
 
     while (!check(TOKEN_EOF)) {
-        if (!is_declaration_start(parser_state.current.type)) {
-            error(&parser_state.current, "Expected external declaration");
+        if (!is_declaration_start(tok_type(parser_state.current))) {
+            error(parser_state.current, "Expected external declaration");
             synchronize_translation_unit();
             continue;
         }
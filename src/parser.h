@@ -3,6 +3,6 @@
 
 #include "ast.h"
 
-struct ast_program *parse_translation_unit(const char *source);
+struct ast_program *parse_translation_unit(struct token_stream *tokens);
 
 #endif
@@ -0,0 +1,1951 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "preprocessor.h"
+#include "base/atom_map.h"
+#include "base/hash_map.h"
+
+#define MAX_INCLUDE_DEPTH 200
+#define MAX_FILES 65536         // Token file indexes are 16 bits
+
+/* Macros and hidesets live until the end of the unit, in blocks */
+
+#define ARENA_BLOCK 16384
+
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static struct arena_block *arena;
+
+static void *pp_alloc(size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+
+    if (!arena || arena->used + size > arena->size) {
+        size_t block = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        struct arena_block *b = malloc(sizeof(struct arena_block) + block);
+        b->next = arena;
+        b->used = 0;
+        b->size = block;
+        arena = b;
+    }
+
+    void *p = arena->data + arena->used;
+    arena->used += size;
+    return p;
+}
+
+static void arena_free(void)
+{
+    while (arena) {
+        struct arena_block *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+/* Tokens */
+
+/*
+ * Names of the macros a token came out of, sorted from the highest
+ * atom. Macros defined later tend to have higher atoms and to be the
+ * ones added to a set, which then only takes a node in front.
+ */
+struct hideset {
+    atom name;
+    struct hideset *next;
+};
+
+struct pp_token {
+    uint8_t type;           // enum token_type
+    uint16_t file;          // Index in 'files' of its text
+    uint32_t offset;
+    uint32_t length;
+    atom atom;
+    struct hideset *hideset;    // Macros it mustn't expand again
+};
+
+struct token_vec {
+    struct pp_token *data;
+    size_t count;
+    size_t capacity;
+};
+
+static void vec_push(struct token_vec *v, struct pp_token tok)
+{
+    if (v->count == v->capacity) {
+        v->capacity = v->capacity ? v->capacity * 2 : 16;
+        v->data = realloc(v->data, v->capacity * sizeof(struct pp_token));
+    }
+
+    v->data[v->count++] = tok;
+}
+
+static bool hideset_contains(const struct hideset *hs, atom name)
+{
+    for (; hs && hs->name >= name; hs = hs->next)
+        if (hs->name == name)
+            return true;
+
+    return false;
+}
+
+/*
+ * Hidesets are hash-consed: a set is one list, whatever built it, so
+ * sets compare by address and unions and intersections are looked up
+ * after the first time. Like the nodes, the table lives for the unit.
+ */
+enum hideset_op {
+    HIDESET_CONS,           // Node 'lhs' (a name) in front of 'rhs'
+    HIDESET_ADD,            // Name 'lhs' added to 'rhs'
+    HIDESET_UNION,
+    HIDESET_INTERSECTION,
+};
+
+struct hideset_memo {
+    enum hideset_op op;
+    uintptr_t lhs;
+    uintptr_t rhs;
+    struct hideset *result;     // NULL for a free entry
+};
+
+static struct hideset_memo *hideset_memos;     // Open addressing
+static uint32_t hideset_memo_capacity;
+static uint32_t hideset_memo_count;
+
+static atom *hideset_names;     // Scratch for merging
+static size_t hideset_name_capacity;
+
+static uint32_t hideset_memo_hash(enum hideset_op op, uintptr_t lhs, uintptr_t rhs)
+{
+    uint64_t hash = ((uint64_t)lhs * 0x9e3779b97f4a7c15u) ^ (rhs + op);
+    hash *= 0x100000001b3u;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static struct hideset_memo *hideset_memo_slot(enum hideset_op op, uintptr_t lhs, uintptr_t rhs)
+{
+    uint32_t mask = hideset_memo_capacity - 1;
+    uint32_t idx = hideset_memo_hash(op, lhs, rhs) & mask;
+
+    for (; hideset_memos[idx].result; idx = (idx + 1) & mask) {
+        struct hideset_memo *m = &hideset_memos[idx];
+        if (m->op == op && m->lhs == lhs && m->rhs == rhs)
+            break;
+    }
+
+    return &hideset_memos[idx];
+}
+
+static void grow_hideset_memos(void)
+{
+    struct hideset_memo *old = hideset_memos;
+    uint32_t old_capacity = hideset_memo_capacity;
+
+    hideset_memo_capacity = old_capacity ? old_capacity * 2 : 1024;
+    hideset_memos = calloc(hideset_memo_capacity, sizeof(struct hideset_memo));
+
+    for (uint32_t i = 0; i < old_capacity; i++)
+        if (old[i].result)
+            *hideset_memo_slot(old[i].op, old[i].lhs, old[i].rhs) = old[i];
+
+    free(old);
+}
+
+static struct hideset *hideset_memo_get(enum hideset_op op, uintptr_t lhs, const void *rhs)
+{
+    if (!hideset_memo_count)
+        return NULL;
+
+    return hideset_memo_slot(op, lhs, (uintptr_t)rhs)->result;
+}
+
+static void hideset_memo_set(enum hideset_op op, uintptr_t lhs, const void *rhs,
+                             struct hideset *result)
+{
+    if ((hideset_memo_count + 1) * 2 > hideset_memo_capacity)
+        grow_hideset_memos();
+
+    *hideset_memo_slot(op, lhs, (uintptr_t)rhs) = (struct hideset_memo) {
+        .op = op,
+        .lhs = lhs,
+        .rhs = (uintptr_t)rhs,
+        .result = result,
+    };
+    hideset_memo_count++;
+}
+
+static void hideset_memos_free(void)
+{
+    free(hideset_memos);
+    hideset_memos = NULL;
+    hideset_memo_capacity = 0;
+    hideset_memo_count = 0;
+}
+
+// The one node for 'name' in front of 'next', which must be canonical
+static struct hideset *hideset_cons(atom name, struct hideset *next)
+{
+    struct hideset *hs = hideset_memo_get(HIDESET_CONS, name, next);
+    if (hs)
+        return hs;
+
+    hs = pp_alloc(sizeof(struct hideset));
+    hs->name = name;
+    hs->next = next;
+
+    hideset_memo_set(HIDESET_CONS, name, next, hs);
+    return hs;
+}
+
+static void reserve_hideset_names(size_t count)
+{
+    if (count <= hideset_name_capacity)
+        return;
+
+    hideset_name_capacity = count * 2;
+    hideset_names = realloc(hideset_names, hideset_name_capacity * sizeof(atom));
+}
+
+// The first 'count' scratch names in front of 'tail'
+static struct hideset *hideset_from_names(size_t count, struct hideset *tail)
+{
+    while (count-- > 0)
+        tail = hideset_cons(hideset_names[count], tail);
+
+    return tail;
+}
+
+static struct hideset *hideset_add(struct hideset *hs, atom name)
+{
+    if (!hs || hs->name < name)
+        return hideset_cons(name, hs);
+
+    struct hideset *added = hideset_memo_get(HIDESET_ADD, name, hs);
+    if (added)
+        return added;
+
+    // Names above 'name' go back in front of it
+    size_t count = 0;
+    struct hideset *rest = hs;
+    for (; rest && rest->name > name; rest = rest->next) {
+        reserve_hideset_names(count + 1);
+        hideset_names[count++] = rest->name;
+    }
+
+    if (rest && rest->name == name)
+        added = hs;
+    else
+        added = hideset_from_names(count, hideset_cons(name, rest));
+
+    hideset_memo_set(HIDESET_ADD, name, hs, added);
+    return added;
+}
+
+static size_t hideset_length(const struct hideset *hs)
+{
+    size_t length = 0;
+    for (; hs; hs = hs->next)
+        length++;
+
+    return length;
+}
+
+static struct hideset *hideset_union(struct hideset *a, struct hideset *b)
+{
+    if (!a || a == b)
+        return b;
+    if (!b)
+        return a;
+
+    struct hideset *hs = hideset_memo_get(HIDESET_UNION, (uintptr_t)a, b);
+    if (hs)
+        return hs;
+
+    reserve_hideset_names(hideset_length(a) + hideset_length(b));
+    size_t count = 0;
+    bool a_only = false;    // Some name is only in a
+    bool b_only = false;
+
+    for (struct hideset *x = a, *y = b; x || y;) {
+        if (!y || (x && x->name > y->name)) {
+            hideset_names[count++] = x->name;
+            x = x->next;
+            a_only = true;
+        } else if (!x || y->name > x->name) {
+            hideset_names[count++] = y->name;
+            y = y->next;
+            b_only = true;
+        } else {
+            hideset_names[count++] = x->name;
+            x = x->next;
+            y = y->next;
+        }
+    }
+
+    // One contains the other, as when a token comes back from a deeper expansion
+    if (!a_only)
+        hs = b;
+    else if (!b_only)
+        hs = a;
+    else
+        hs = hideset_from_names(count, NULL);
+
+    hideset_memo_set(HIDESET_UNION, (uintptr_t)a, b, hs);
+    return hs;
+}
+
+static struct hideset *hideset_intersection(struct hideset *a, struct hideset *b)
+{
+    if (!a || !b)
+        return NULL;
+    if (a == b)
+        return a;
+
+    // Empty results aren't kept, NULL marks a free entry
+    struct hideset *hs = hideset_memo_get(HIDESET_INTERSECTION, (uintptr_t)a, b);
+    if (hs)
+        return hs;
+
+    reserve_hideset_names(hideset_length(a));
+    size_t count = 0;
+
+    for (struct hideset *x = a, *y = b; x && y;) {
+        if (x->name > y->name) {
+            x = x->next;
+        } else if (y->name > x->name) {
+            y = y->next;
+        } else {
+            hideset_names[count++] = x->name;
+            x = x->next;
+            y = y->next;
+        }
+    }
+
+    hs = hideset_from_names(count, NULL);
+    if (hs)
+        hideset_memo_set(HIDESET_INTERSECTION, (uintptr_t)a, b, hs);
+    return hs;
+}
+
+/* Files */
+
+struct pp_file {
+    struct source_file source;
+    uint16_t index;                 // In 'files'
+    struct token_stream *tokens;    // As lexed, before preprocessing
+    atom guard;                     // X when all of the file is in #ifndef X ... #endif
+    int once_unit;                  // Unit of the last #pragma once, 0 for none
+    int read_unit;                  // Last unit that read it
+};
+
+static struct pp_file **files;      // Every file read, 0 is the scratch buffer
+static int file_count;
+static int file_capacity;
+
+static hash_map file_cache;         // Real path -> struct pp_file
+
+static const char *spelling(const struct pp_token *tok)
+{
+    return files[tok->file]->source.text + tok->offset;
+}
+
+static bool had_error;
+
+static void error(const struct pp_token *tok, const char *message)
+{
+    source_error(&files[tok->file]->source, tok->offset, tok->length, message);
+    had_error = true;
+}
+
+static void add_file(struct pp_file *file)
+{
+    if (file_count == MAX_FILES) {
+        fprintf(stderr, "cinc: too many files\n");
+        exit(1);
+    }
+
+    if (file_count == file_capacity) {
+        file_capacity = file_capacity ? file_capacity * 2 : 64;
+        files = realloc(files, file_capacity * sizeof(struct pp_file *));
+    }
+
+    file->index = file_count;
+    files[file_count++] = file;
+}
+
+static struct pp_token raw_token(const struct pp_file *file, uint32_t pos)
+{
+    const struct token_stream *raw = file->tokens;
+
+    return (struct pp_token) {
+        .type = raw->types[pos],
+        .file = file->index,
+        .offset = raw->offsets[pos],
+        .length = raw->lengths[pos],
+        .atom = raw->atoms[pos],
+    };
+}
+
+/*
+ * Text of tokens no file has: the results of ## and 'defined'. Each
+ * piece is a line of its own, so diagnostics show only that piece.
+ */
+static char *scratch;
+static size_t scratch_size;         // Up to the NUL after the last piece
+static size_t scratch_capacity;
+
+// Lexes 'text' in the scratch buffer, false unless it is exactly one token
+static bool scratch_token(const char *text, size_t length, struct pp_token *out)
+{
+    size_t offset = scratch_size;
+    size_t needed = offset + length + 1 + LEXER_PADDING;
+
+    if (needed > scratch_capacity) {
+        size_t capacity = scratch_capacity ? scratch_capacity : 1024;
+        while (capacity < needed)
+            capacity *= 2;
+
+        scratch = realloc(scratch, capacity);
+        memset(scratch + scratch_capacity, 0, capacity - scratch_capacity);
+        scratch_capacity = capacity;
+        files[0]->source.text = scratch;
+    }
+
+    if (offset > 0)
+        scratch[offset - 1] = '\n';
+
+    memcpy(scratch + offset, text, length);
+    scratch[offset + length] = '\0';
+    scratch_size = offset + length + 1;
+
+    lexer_init(scratch + offset);
+    struct token tok = lexer_next_token();
+    struct token end = lexer_next_token();
+
+    *out = (struct pp_token) {
+        .type = tok.type,
+        .file = 0,
+        .offset = tok.start - scratch,
+        .length = tok.length,
+        .atom = tok.type == TOKEN_IDENTIFIER ? intern(tok.start, tok.length) : NO_ATOM,
+    };
+
+    return tok.type != TOKEN_ERROR && tok.type != TOKEN_EOF &&
+           tok.start == scratch + offset && end.type == TOKEN_EOF;
+}
+
+/* Directives */
+
+enum directive {
+    DIR_NONE,       // '#' alone on its line
+    DIR_INCLUDE,
+    DIR_DEFINE,
+    DIR_UNDEF,
+    DIR_IF,
+    DIR_IFDEF,
+    DIR_IFNDEF,
+    DIR_ELIF,
+    DIR_ELSE,
+    DIR_ENDIF,
+    DIR_PRAGMA,
+    DIR_ERROR,
+    DIR_LINE,
+    DIR_UNKNOWN,
+};
+
+static const struct {
+    const char *name;
+    enum directive kind;
+} directive_names[] = {
+    { "include", DIR_INCLUDE },
+    { "define", DIR_DEFINE },
+    { "undef", DIR_UNDEF },
+    { "if", DIR_IF },
+    { "ifdef", DIR_IFDEF },
+    { "ifndef", DIR_IFNDEF },
+    { "elif", DIR_ELIF },
+    { "else", DIR_ELSE },
+    { "endif", DIR_ENDIF },
+    { "pragma", DIR_PRAGMA },
+    { "error", DIR_ERROR },
+    { "line", DIR_LINE },
+};
+
+static bool is_directive(const struct token_stream *raw, uint32_t pos)
+{
+    return raw->types[pos] == TOKEN_HASH && raw->line_starts[pos];
+}
+
+// First token of the next line, or the EOF
+static uint32_t line_end(const struct token_stream *raw, uint32_t pos)
+{
+    while (raw->types[pos] != TOKEN_EOF && !raw->line_starts[pos])
+        pos++;
+
+    return pos;
+}
+
+// Of the directive whose '#' is at 'pos'. 'if' and 'else' are keywords, names are compared.
+static enum directive directive_kind(const struct pp_file *file, uint32_t pos)
+{
+    const struct token_stream *raw = file->tokens;
+    uint32_t name = pos + 1;
+
+    if (raw->types[name] == TOKEN_EOF || raw->line_starts[name])
+        return DIR_NONE;
+
+    const char *text = file->source.text + raw->offsets[name];
+    size_t length = raw->lengths[name];
+
+    for (size_t i = 0; i < sizeof(directive_names) / sizeof(directive_names[0]); i++) {
+        if (strlen(directive_names[i].name) == length &&
+            !memcmp(directive_names[i].name, text, length))
+            return directive_names[i].kind;
+    }
+
+    return DIR_UNKNOWN;
+}
+
+/*
+ * Multiple-include optimization: when nothing but comments is outside
+ * '#ifndef X' ... '#endif', including the file again with X defined
+ * adds nothing, and the file needn't be gone through.
+ */
+static atom find_include_guard(const struct pp_file *file)
+{
+    const struct token_stream *raw = file->tokens;
+
+    if (!is_directive(raw, 0) || directive_kind(file, 0) != DIR_IFNDEF)
+        return NO_ATOM;
+
+    if (raw->types[2] != TOKEN_IDENTIFIER || line_end(raw, 2) != 3)
+        return NO_ATOM;
+
+    int depth = 0;
+
+    for (uint32_t pos = 3; raw->types[pos] != TOKEN_EOF; pos++) {
+        if (!is_directive(raw, pos))
+            continue;
+
+        switch (directive_kind(file, pos)) {
+            case DIR_IF:
+            case DIR_IFDEF:
+            case DIR_IFNDEF:
+                depth++;
+                break;
+            case DIR_ELIF:
+            case DIR_ELSE:
+                if (depth == 0)
+                    return NO_ATOM;
+                break;
+            case DIR_ENDIF:
+                if (depth == 0)
+                    return raw->types[line_end(raw, pos + 1)] == TOKEN_EOF
+                        ? raw->atoms[2] : NO_ATOM;
+                depth--;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return NO_ATOM;
+}
+
+static char *read_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    rewind(file);
+
+    // The lexer scans past the end in chunks
+    char *text = calloc(size + 1 + LEXER_PADDING, 1);
+    size_t bytes_read = fread(text, 1, size, file);
+    text[bytes_read] = '\0';
+
+    fclose(file);
+    return text;
+}
+
+// Read and lexed on the first use, NULL if there is no such file
+static struct pp_file *load_file(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) || !S_ISREG(st.st_mode))
+        return NULL;
+
+    char *real = realpath(path, NULL);
+    if (!real)
+        return NULL;
+
+    struct pp_file *file = hashmap_get(&file_cache, real, strlen(real));
+    if (file) {
+        free(real);
+        return file;
+    }
+
+    char *text = read_file(path);
+    if (!text) {
+        free(real);
+        return NULL;
+    }
+
+    file = calloc(1, sizeof(struct pp_file));
+    file->source.name = strdup(path);
+    file->source.text = text;
+    add_file(file);
+
+    file->tokens = lex_source(&file->source);
+    file->guard = find_include_guard(file);
+
+    hashmap_set(&file_cache, real, strlen(real), file);
+    return file;
+}
+
+/* The unit being preprocessed */
+
+// Undefined by #undef once they are NULL
+struct macro {
+    bool function_like;
+    int param_count;
+    atom *params;
+
+    int body_count;
+    struct pp_token *body;
+    int *body_params;       // Per body token, the parameter it names or -1
+};
+
+static atom_map macros;
+
+struct include_frame {
+    struct pp_file *file;
+    uint32_t pos;           // Next token of 'file'
+    int conditionals;       // Open when the file was entered
+};
+
+static struct include_frame include_stack[MAX_INCLUDE_DEPTH];
+static int include_depth;
+
+struct conditional {
+    struct pp_token hash;   // Of its #if, for the unterminated error
+    bool taken;             // A group was kept, the ones after are skipped
+    bool seen_else;
+};
+
+static struct conditional *conditionals;
+static int conditional_count;
+static int conditional_capacity;
+
+/*
+ * Macro expansions still to be read, the next token last. Reading
+ * the files only starts once they are used up.
+ */
+static struct token_vec pending;
+
+static struct token_stream *out;
+static uint32_t out_capacity;
+
+static int unit;    // Counts preprocess() calls, for #pragma once
+
+static const char **dependencies;   // Of the unit
+static int dependency_count;
+static int dependency_capacity;
+
+static atom atom_defined;
+static atom atom_once;
+static struct pp_token token_zero, token_one;
+
+static char **include_dirs;
+static int include_dir_count;
+
+static const char *system_dirs[] = { "/usr/local/include", "/usr/include" };
+
+static const char predefined[] =
+    "#define __STDC__ 1\n"
+    "#define __STDC_VERSION__ 201112L\n"
+    "#define __STDC_HOSTED__ 1\n"
+    "#define __x86_64__ 1\n";
+
+static char *command_line;          // -D and -U as directives
+static size_t command_line_size;
+static struct pp_file *command_line_file;
+
+// Every file entered once per unit, for pp_dependencies()
+static void enter_file(struct pp_file *file)
+{
+    include_stack[include_depth++] = (struct include_frame) {
+        .file = file,
+        .conditionals = conditional_count,
+    };
+
+    if (file->read_unit == unit || file == command_line_file)
+        return;
+    file->read_unit = unit;
+
+    if (dependency_count == dependency_capacity) {
+        dependency_capacity = dependency_capacity ? dependency_capacity * 2 : 16;
+        dependencies = realloc(dependencies, dependency_capacity * sizeof(char *));
+    }
+    dependencies[dependency_count++] = file->source.name;
+}
+
+/* Expansion */
+
+static void directive(struct include_frame *frame);
+
+/*
+ * Next token: from the expansions above 'floor', then with 'from_file'
+ * from the files, running the directives on the way. Ends with EOF.
+ */
+static struct pp_token next_token(size_t floor, bool from_file)
+{
+    if (pending.count > floor)
+        return pending.data[--pending.count];
+
+    if (!from_file)
+        return (struct pp_token) { .type = TOKEN_EOF };
+
+    for (;;) {
+        struct include_frame *frame = &include_stack[include_depth - 1];
+        const struct token_stream *raw = frame->file->tokens;
+
+        if (is_directive(raw, frame->pos)) {
+            directive(frame);
+            continue;
+        }
+
+        if (raw->types[frame->pos] != TOKEN_EOF)
+            return raw_token(frame->file, frame->pos++);
+
+        while (conditional_count > frame->conditionals)
+            error(&conditionals[--conditional_count].hash, "Unterminated conditional directive");
+
+        if (include_depth == 1)
+            return raw_token(frame->file, frame->pos);
+
+        include_depth--;
+    }
+}
+
+static bool next_is(enum token_type type, size_t floor, bool from_file)
+{
+    if (pending.count > floor)
+        return pending.data[pending.count - 1].type == type;
+
+    if (!from_file)
+        return false;
+
+    const struct include_frame *frame = &include_stack[include_depth - 1];
+    return frame->file->tokens->types[frame->pos] == type;
+}
+
+static bool expand_macro(const struct pp_token *tok, size_t floor, bool from_file);
+
+// Fully expands 'in' on its own, into 'out'
+static void expand_list(const struct token_vec *in, struct token_vec *out)
+{
+    size_t floor = pending.count;
+
+    for (size_t i = in->count; i-- > 0;)
+        vec_push(&pending, in->data[i]);
+
+    for (;;) {
+        struct pp_token tok = next_token(floor, false);
+        if (tok.type == TOKEN_EOF)
+            break;
+
+        if (!expand_macro(&tok, floor, false))
+            vec_push(out, tok);
+    }
+}
+
+// 'lhs' becomes lhs ## rhs
+static void paste(struct pp_token *lhs, const struct pp_token *rhs)
+{
+    size_t length = lhs->length + rhs->length;
+    char *text = malloc(length);
+    memcpy(text, spelling(lhs), lhs->length);
+    memcpy(text + lhs->length, spelling(rhs), rhs->length);
+
+    struct pp_token pasted;
+    bool ok = scratch_token(text, length, &pasted);
+    free(text);
+
+    if (!ok) {
+        error(rhs, "Pasting does not give a valid token");
+        return;
+    }
+
+    pasted.hideset = lhs->hideset;
+    *lhs = pasted;
+}
+
+// Body of 'm' with the arguments in place of the parameters
+static void substitute(const struct macro *m, const struct token_vec *args,
+                       struct token_vec *out)
+{
+    // An empty argument before ## leaves nothing to paste to
+    bool placemarker = false;
+
+    for (int i = 0; i < m->body_count; i++) {
+        const struct pp_token *tok = &m->body[i];
+        int param = m->body_params[i];
+
+        if (tok->type == TOKEN_HASH && i + 1 < m->body_count && m->body_params[i + 1] >= 0) {
+            error(tok, "Stringizing with '#' is not supported");
+            placemarker = true;
+            i++;
+            continue;
+        }
+
+        if (tok->type == TOKEN_HASH_HASH) {
+            i++;
+            int rhs_param = m->body_params[i];
+            const struct token_vec *arg = rhs_param >= 0 ? &args[rhs_param] : NULL;
+
+            if (arg && arg->count == 0)
+                continue;
+
+            const struct pp_token *first = arg ? &arg->data[0] : &m->body[i];
+
+            if (placemarker || out->count == 0)
+                vec_push(out, *first);
+            else
+                paste(&out->data[out->count - 1], first);
+
+            for (size_t j = 1; arg && j < arg->count; j++)
+                vec_push(out, arg->data[j]);
+
+            placemarker = false;
+            continue;
+        }
+
+        placemarker = false;
+
+        if (param < 0) {
+            vec_push(out, *tok);
+            continue;
+        }
+
+        // Operands of ## aren't expanded first
+        const struct token_vec *arg = &args[param];
+
+        if (i + 1 < m->body_count && m->body[i + 1].type == TOKEN_HASH_HASH) {
+            for (size_t j = 0; j < arg->count; j++)
+                vec_push(out, arg->data[j]);
+            placemarker = arg->count == 0;
+        } else {
+            expand_list(arg, out);
+        }
+    }
+}
+
+// After the '(', false on errors. 'args' has a vector per parameter.
+static bool read_arguments(const struct pp_token *name, const struct macro *m,
+                           struct token_vec *args, struct pp_token *rparen,
+                           size_t floor, bool from_file)
+{
+    int commas = 0;
+    int depth = 0;
+    bool empty = true;
+
+    for (;;) {
+        struct pp_token tok = next_token(floor, from_file);
+
+        if (tok.type == TOKEN_EOF) {
+            error(name, "Unterminated macro invocation");
+            return false;
+        }
+
+        if (depth == 0 && tok.type == TOKEN_RIGHT_PAREN) {
+            *rparen = tok;
+            break;
+        }
+
+        if (depth == 0 && tok.type == TOKEN_COMMA) {
+            commas++;
+            continue;
+        }
+
+        if (tok.type == TOKEN_LEFT_PAREN)
+            depth++;
+        else if (tok.type == TOKEN_RIGHT_PAREN)
+            depth--;
+
+        empty = false;
+        if (commas < m->param_count)
+            vec_push(&args[commas], tok);
+    }
+
+    // F() passes no arguments to F with no parameters, one empty one otherwise
+    bool ok = m->param_count == 0 ? commas == 0 && empty : commas + 1 == m->param_count;
+    if (!ok)
+        error(name, "Wrong number of macro arguments");
+
+    return ok;
+}
+
+/*
+ * If 'tok' names a macro, its expansion goes on the pending stack in
+ * its place. A function-like macro's arguments are read from the same
+ * source as 'tok'. Hidesets keep a macro from expanding within itself.
+ */
+static bool expand_macro(const struct pp_token *tok, size_t floor, bool from_file)
+{
+    if (tok->type != TOKEN_IDENTIFIER)
+        return false;
+
+    struct macro *m = atommap_get(&macros, tok->atom);
+    if (!m || hideset_contains(tok->hideset, tok->atom))
+        return false;
+
+    struct token_vec body = { 0 };
+    struct hideset *hideset = NULL;
+
+    if (!m->function_like) {
+        hideset = hideset_add(tok->hideset, tok->atom);
+
+        for (int i = 0; i < m->body_count; i++)
+            vec_push(&body, m->body[i]);
+    } else {
+        if (!next_is(TOKEN_LEFT_PAREN, floor, from_file))
+            return false;
+
+        next_token(floor, from_file);
+
+        int arg_count = m->param_count ? m->param_count : 1;
+        struct token_vec *args = calloc(arg_count, sizeof(struct token_vec));
+        struct pp_token rparen;
+
+        if (read_arguments(tok, m, args, &rparen, floor, from_file)) {
+            hideset = hideset_add(hideset_intersection(tok->hideset, rparen.hideset),
+                                  tok->atom);
+            substitute(m, args, &body);
+        }
+
+        for (int i = 0; i < arg_count; i++)
+            free(args[i].data);
+        free(args);
+    }
+
+    // Neighbouring tokens mostly share a hideset, and so the union
+    struct hideset *from = NULL;
+    struct hideset *to = hideset;
+
+    for (size_t i = body.count; i-- > 0;) {
+        struct pp_token expanded = body.data[i];
+
+        if (expanded.hideset != from) {
+            from = expanded.hideset;
+            to = hideset_union(from, hideset);
+        }
+
+        expanded.hideset = to;
+        vec_push(&pending, expanded);
+    }
+
+    free(body.data);
+    return true;
+}
+
+/* #if expressions */
+
+struct eval {
+    const struct pp_token *tokens;
+    size_t count;
+    size_t pos;
+    const struct pp_token *directive;   // Where errors without a token go
+    int unevaluated;                    // Inside the skipped side of && || ?:
+    bool failed;
+};
+
+static void eval_error(struct eval *e, const struct pp_token *tok, const char *message)
+{
+    if (!e->failed)
+        error(tok ? tok : e->directive, message);
+
+    e->failed = true;
+}
+
+static bool eval_match(struct eval *e, enum token_type type)
+{
+    if (e->pos >= e->count || e->tokens[e->pos].type != type)
+        return false;
+
+    e->pos++;
+    return true;
+}
+
+static bool is_keyword(enum token_type type)
+{
+    return type >= TOKEN_INT && type <= TOKEN_GOTO;
+}
+
+static long eval_number(struct eval *e, const struct pp_token *tok)
+{
+    char digits[32];
+    if (tok->length >= sizeof(digits)) {
+        eval_error(e, tok, "Number too long in #if");
+        return 0;
+    }
+
+    memcpy(digits, spelling(tok), tok->length);
+    digits[tok->length] = '\0';
+
+    char *end;
+    long value = (long)strtoul(digits, &end, 0);
+    if (*end)
+        eval_error(e, tok, "Invalid number in #if");
+
+    // The lexer leaves suffixes to identifiers, like the L of 201112L
+    if (e->pos < e->count) {
+        const struct pp_token *suffix = &e->tokens[e->pos];
+
+        if (suffix->type == TOKEN_IDENTIFIER && suffix->file == tok->file &&
+            suffix->offset == tok->offset + tok->length &&
+            strspn(spelling(suffix), "uUlL") >= suffix->length)
+            e->pos++;
+    }
+
+    return value;
+}
+
+static int binary_precedence(enum token_type type)
+{
+    switch (type) {
+        case TOKEN_STAR: case TOKEN_SLASH: case TOKEN_PERCENT:
+            return 10;
+        case TOKEN_PLUS: case TOKEN_MINUS:
+            return 9;
+        case TOKEN_LESS_LESS: case TOKEN_GREATER_GREATER:
+            return 8;
+        case TOKEN_LESS: case TOKEN_LESS_EQUAL:
+        case TOKEN_GREATER: case TOKEN_GREATER_EQUAL:
+            return 7;
+        case TOKEN_EQUAL_EQUAL: case TOKEN_BANG_EQUAL:
+            return 6;
+        case TOKEN_AND:
+            return 5;
+        case TOKEN_CARET:
+            return 4;
+        case TOKEN_OR:
+            return 3;
+        case TOKEN_AND_AND:
+            return 2;
+        case TOKEN_OR_OR:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Wraps around instead of overflowing
+static long eval_apply(struct eval *e, const struct pp_token *op, long lhs, long rhs)
+{
+    unsigned long l = lhs, r = rhs;
+
+    switch (op->type) {
+        case TOKEN_STAR: return (long)(l * r);
+        case TOKEN_PLUS: return (long)(l + r);
+        case TOKEN_MINUS: return (long)(l - r);
+        case TOKEN_LESS_LESS: return (long)(l << (r & 63));
+        case TOKEN_GREATER_GREATER: return lhs >> (r & 63);
+        case TOKEN_LESS: return lhs < rhs;
+        case TOKEN_LESS_EQUAL: return lhs <= rhs;
+        case TOKEN_GREATER: return lhs > rhs;
+        case TOKEN_GREATER_EQUAL: return lhs >= rhs;
+        case TOKEN_EQUAL_EQUAL: return lhs == rhs;
+        case TOKEN_BANG_EQUAL: return lhs != rhs;
+        case TOKEN_AND: return lhs & rhs;
+        case TOKEN_CARET: return lhs ^ rhs;
+        case TOKEN_OR: return lhs | rhs;
+        case TOKEN_SLASH:
+        case TOKEN_PERCENT:
+            if (rhs == 0 || (lhs == -__LONG_MAX__ - 1 && rhs == -1)) {
+                if (!e->unevaluated)
+                    eval_error(e, op, "Division by zero in #if");
+                return 0;
+            }
+            return op->type == TOKEN_SLASH ? lhs / rhs : lhs % rhs;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Expressions nest on an explicit stack, like the parser's, so a
+ * thousands deep '(' or '!' chain only grows the frames array. A frame
+ * is one level of precedence climbing over the operators from
+ * 'min_precedence' up, 'step' says what becomes of the operand
+ * evaluated in the frame above it.
+ */
+#define EVAL_CONDITIONAL 1      // Binary operators and ?:
+#define EVAL_OPERAND 11         // No binary operator, a unary operand
+
+enum eval_step {
+    EVAL_UNARY,         // Operand of the prefix operator 'op'
+    EVAL_GROUPING,      // Inside '(' ')'
+    EVAL_BINARY,        // Right operand of 'op'
+    EVAL_THEN,          // Between '?' and ':'
+    EVAL_ELSE,
+};
+
+struct eval_frame {
+    int min_precedence;
+    enum eval_step step;
+    const struct pp_token *op;
+    long left;
+    long then_value;    // EVAL_ELSE
+    bool skip;          // The operand is on the unevaluated side of && || ?:
+    bool done;          // After ?:, nothing binds looser
+};
+
+static struct eval_frame *eval_frames;
+static int eval_frame_count;
+static int eval_frame_capacity;
+
+static void push_eval_frame(int min_precedence)
+{
+    if (eval_frame_count == eval_frame_capacity) {
+        eval_frame_capacity = eval_frame_capacity ? eval_frame_capacity * 2 : 64;
+        eval_frames = realloc(eval_frames, eval_frame_capacity * sizeof(struct eval_frame));
+    }
+
+    eval_frames[eval_frame_count++] = (struct eval_frame) { .min_precedence = min_precedence };
+}
+
+// The innermost frame waits while an operand is evaluated in a new one
+static void await_eval_operand(struct eval *e, enum eval_step step, bool skip,
+                               int min_precedence)
+{
+    struct eval_frame *frame = &eval_frames[eval_frame_count - 1];
+    frame->step = step;
+    frame->skip = skip;
+    e->unevaluated += skip;
+
+    push_eval_frame(min_precedence);
+}
+
+// A value for a new frame, or an operand it waits for
+static void eval_prefix(struct eval *e, struct eval_frame *frame)
+{
+    if (e->pos >= e->count) {
+        eval_error(e, NULL, "Expected value in #if");
+        frame->left = 0;
+        return;
+    }
+
+    const struct pp_token *tok = &e->tokens[e->pos++];
+    frame->left = 0;
+
+    switch (tok->type) {
+        case TOKEN_NUMBER:
+            frame->left = eval_number(e, tok);
+            return;
+        case TOKEN_LEFT_PAREN:
+            await_eval_operand(e, EVAL_GROUPING, false, EVAL_CONDITIONAL);
+            return;
+        case TOKEN_MINUS:
+        case TOKEN_PLUS:
+        case TOKEN_TILDE:
+        case TOKEN_BANG:
+            frame->op = tok;
+            await_eval_operand(e, EVAL_UNARY, false, EVAL_OPERAND);
+            return;
+        case TOKEN_IDENTIFIER:
+            return;     // Not a macro
+        default:
+            break;
+    }
+
+    if (!is_keyword(tok->type))
+        eval_error(e, tok, "Invalid token in #if");
+}
+
+// The operand 'frame' waited for is there, it may wait for another
+static void eval_finish_step(struct eval *e, struct eval_frame *frame, long operand)
+{
+    e->unevaluated -= frame->skip;
+    frame->skip = false;
+
+    switch (frame->step) {
+        case EVAL_UNARY:
+            switch (frame->op->type) {
+                case TOKEN_MINUS: frame->left = (long)(0ul - (unsigned long)operand); break;
+                case TOKEN_TILDE: frame->left = ~operand; break;
+                case TOKEN_BANG:  frame->left = !operand; break;
+                default:          frame->left = operand; break;
+            }
+            break;
+
+        case EVAL_GROUPING:
+            frame->left = operand;
+            if (!eval_match(e, TOKEN_RIGHT_PAREN))
+                eval_error(e, NULL, "Expected ')' in #if");
+            break;
+
+        case EVAL_BINARY:
+            if (frame->op->type == TOKEN_AND_AND)
+                frame->left = frame->left && operand;
+            else if (frame->op->type == TOKEN_OR_OR)
+                frame->left = frame->left || operand;
+            else
+                frame->left = eval_apply(e, frame->op, frame->left, operand);
+            break;
+
+        case EVAL_THEN:
+            if (!eval_match(e, TOKEN_COLON)) {
+                eval_error(e, NULL, "Expected ':' in #if");
+                frame->left = 0;
+                frame->done = true;
+                break;
+            }
+
+            frame->then_value = operand;
+            await_eval_operand(e, EVAL_ELSE, !!frame->left, EVAL_CONDITIONAL);
+            break;
+
+        case EVAL_ELSE:
+            frame->left = frame->left ? frame->then_value : operand;
+            frame->done = true;
+            break;
+    }
+}
+
+static long eval_expression(struct eval *e)
+{
+    int floor = eval_frame_count;
+    push_eval_frame(EVAL_CONDITIONAL);
+
+    // The innermost frame starts with a prefix, or takes its operators
+    bool starting = true;
+
+    for (;;) {
+        int top = eval_frame_count;
+        struct eval_frame *frame = &eval_frames[top - 1];
+
+        if (starting) {
+            eval_prefix(e, frame);
+            starting = eval_frame_count > top;
+            continue;
+        }
+
+        const struct pp_token *op = e->pos < e->count ? &e->tokens[e->pos] : NULL;
+        int precedence = op ? binary_precedence(op->type) : 0;
+
+        if (!frame->done && precedence && precedence >= frame->min_precedence) {
+            e->pos++;
+            frame->op = op;
+
+            bool skip = false;
+            if (op->type == TOKEN_AND_AND)
+                skip = !frame->left;
+            else if (op->type == TOKEN_OR_OR)
+                skip = frame->left;
+
+            await_eval_operand(e, EVAL_BINARY, skip, precedence + 1);
+            starting = true;
+            continue;
+        }
+
+        if (!frame->done && frame->min_precedence == EVAL_CONDITIONAL &&
+            eval_match(e, TOKEN_QUESTION_MARK)) {
+            await_eval_operand(e, EVAL_THEN, !frame->left, EVAL_CONDITIONAL);
+            starting = true;
+            continue;
+        }
+
+        // The frame is done, its value is the operand of the one below
+        long value = frame->left;
+        eval_frame_count--;
+
+        if (eval_frame_count == floor)
+            return value;
+
+        top = eval_frame_count;
+        eval_finish_step(e, &eval_frames[top - 1], value);
+        starting = eval_frame_count > top;
+    }
+}
+
+/*
+ * Value of the #if or #elif expression in [pos, end). 'defined' is
+ * resolved before macros are expanded, identifiers left after are 0.
+ */
+static bool condition(const struct pp_file *file, uint32_t pos, uint32_t end,
+                      const struct pp_token *directive)
+{
+    const struct token_stream *raw = file->tokens;
+    struct token_vec line = { 0 };
+
+    if (pos == end) {
+        error(directive, "Expected expression in #if");
+        return false;
+    }
+
+    for (; pos < end; pos++) {
+        if (raw->types[pos] != TOKEN_IDENTIFIER || raw->atoms[pos] != atom_defined) {
+            vec_push(&line, raw_token(file, pos));
+            continue;
+        }
+
+        struct pp_token defined_tok = raw_token(file, pos);
+        bool paren = pos + 1 < end && raw->types[pos + 1] == TOKEN_LEFT_PAREN;
+        pos += paren ? 2 : 1;
+
+        if (pos >= end || raw->types[pos] != TOKEN_IDENTIFIER) {
+            error(&defined_tok, "Expected macro name after 'defined'");
+            free(line.data);
+            return false;
+        }
+
+        bool defined = atommap_get(&macros, raw->atoms[pos]) != NULL;
+
+        if (paren && (++pos >= end || raw->types[pos] != TOKEN_RIGHT_PAREN)) {
+            error(&defined_tok, "Expected ')' after 'defined(name'");
+            free(line.data);
+            return false;
+        }
+
+        vec_push(&line, defined ? token_one : token_zero);
+    }
+
+    struct token_vec expanded = { 0 };
+    expand_list(&line, &expanded);
+    free(line.data);
+
+    struct eval e = {
+        .tokens = expanded.data,
+        .count = expanded.count,
+        .directive = directive,
+    };
+
+    long value = eval_expression(&e);
+    if (e.pos < e.count)
+        eval_error(&e, &e.tokens[e.pos], "Extra tokens in #if");
+
+    free(expanded.data);
+    return !e.failed && value != 0;
+}
+
+/* Directive handlers, [pos, end) is the rest of the line */
+
+// A token to report at, the last one if the line ends before 'pos'
+static struct pp_token token_at(const struct pp_file *file, uint32_t pos, uint32_t end)
+{
+    return raw_token(file, pos < end ? pos : end - 1);
+}
+
+static void define_macro(const struct pp_file *file, uint32_t pos, uint32_t end)
+{
+    const struct token_stream *raw = file->tokens;
+
+    if (pos == end || raw->types[pos] != TOKEN_IDENTIFIER) {
+        struct pp_token at = token_at(file, pos, end);
+        error(&at, "Macro name must be an identifier");
+        return;
+    }
+
+    atom name = raw->atoms[pos++];
+
+    struct macro *m = pp_alloc(sizeof(struct macro));
+    *m = (struct macro) { 0 };
+
+    // Parameters only when the '(' touches the name
+    if (pos < end && raw->types[pos] == TOKEN_LEFT_PAREN &&
+        raw->offsets[pos] == raw->offsets[pos - 1] + raw->lengths[pos - 1]) {
+        m->function_like = true;
+        m->params = pp_alloc((end - pos) * sizeof(atom));
+        pos++;
+
+        if (pos < end && raw->types[pos] == TOKEN_RIGHT_PAREN) {
+            pos++;
+        } else {
+            for (;;) {
+                if (pos >= end || raw->types[pos] != TOKEN_IDENTIFIER) {
+                    struct pp_token at = token_at(file, pos, end);
+                    error(&at, "Expected parameter name");
+                    return;
+                }
+
+                for (int i = 0; i < m->param_count; i++) {
+                    if (m->params[i] == raw->atoms[pos]) {
+                        struct pp_token at = raw_token(file, pos);
+                        error(&at, "Duplicate macro parameter");
+                        return;
+                    }
+                }
+
+                m->params[m->param_count++] = raw->atoms[pos++];
+
+                if (pos < end && raw->types[pos] == TOKEN_RIGHT_PAREN) {
+                    pos++;
+                    break;
+                }
+
+                if (pos >= end || raw->types[pos] != TOKEN_COMMA) {
+                    struct pp_token at = token_at(file, pos, end);
+                    error(&at, "Expected ',' or ')' after macro parameter");
+                    return;
+                }
+                pos++;
+            }
+        }
+    }
+
+    m->body_count = end - pos;
+    m->body = pp_alloc(m->body_count * sizeof(struct pp_token));
+    m->body_params = pp_alloc(m->body_count * sizeof(int));
+
+    if (m->body_count > 0 && (raw->types[pos] == TOKEN_HASH_HASH ||
+                              raw->types[end - 1] == TOKEN_HASH_HASH)) {
+        struct pp_token at = raw_token(file, raw->types[pos] == TOKEN_HASH_HASH ? pos : end - 1);
+        error(&at, "'##' cannot be at either end of a macro");
+        return;
+    }
+
+    for (int i = 0; i < m->body_count; i++) {
+        m->body[i] = raw_token(file, pos + i);
+        m->body_params[i] = -1;
+
+        for (int p = 0; p < m->param_count; p++)
+            if (m->body[i].type == TOKEN_IDENTIFIER && m->body[i].atom == m->params[p])
+                m->body_params[i] = p;
+    }
+
+    atommap_set(&macros, name, m);
+}
+
+static char *join_path(const char *dir, size_t dir_length, const char *name, size_t length)
+{
+    bool slash = dir_length > 0 && dir[dir_length - 1] != '/';
+
+    char *path = malloc(dir_length + slash + length + 1);
+    memcpy(path, dir, dir_length);
+    if (slash)
+        path[dir_length] = '/';
+    memcpy(path + dir_length + slash, name, length);
+    path[dir_length + slash + length] = '\0';
+
+    return path;
+}
+
+static struct pp_file *try_include(const char *dir, size_t dir_length,
+                                   const char *name, size_t length)
+{
+    char *path = join_path(dir, dir_length, name, length);
+    struct pp_file *file = load_file(path);
+    free(path);
+
+    return file;
+}
+
+// "name" looks next to the includer first, then like <name>
+static struct pp_file *find_include(const struct pp_file *includer, const char *name,
+                                    size_t length, bool quoted)
+{
+    if (name[0] == '/')
+        return try_include("", 0, name, length);
+
+    struct pp_file *file = NULL;
+
+    if (quoted) {
+        const char *slash = strrchr(includer->source.name, '/');
+        size_t dir_length = slash ? (size_t)(slash - includer->source.name) + 1 : 0;
+        file = try_include(includer->source.name, dir_length, name, length);
+    }
+
+    for (int i = 0; i < include_dir_count && !file; i++)
+        file = try_include(include_dirs[i], strlen(include_dirs[i]), name, length);
+
+    for (size_t i = 0; i < sizeof(system_dirs) / sizeof(system_dirs[0]) && !file; i++)
+        file = try_include(system_dirs[i], strlen(system_dirs[i]), name, length);
+
+    return file;
+}
+
+static void include_file(const struct pp_file *file, uint32_t pos, uint32_t end)
+{
+    const struct token_stream *raw = file->tokens;
+    struct pp_token at = token_at(file, pos, end);
+
+    const char *name;
+    size_t length;
+    bool quoted;
+
+    if (pos < end && raw->types[pos] == TOKEN_STRING) {
+        name = spelling(&at) + 1;
+        length = at.length - 2;
+        quoted = true;
+    } else if (pos < end && raw->types[pos] == TOKEN_LESS) {
+        // The lexer doesn't know header names, this one is taken from the text
+        name = spelling(&at) + 1;
+
+        const char *close = name;
+        while (*close != '>' && *close != '\n' && *close != '\0')
+            close++;
+
+        if (*close != '>') {
+            error(&at, "Expected '>' after the file name");
+            return;
+        }
+
+        length = close - name;
+        quoted = false;
+    } else {
+        error(&at, "Expected \"FILENAME\" or <FILENAME>");
+        return;
+    }
+
+    if (length == 0) {
+        error(&at, "Empty file name in #include");
+        return;
+    }
+
+    struct pp_file *included = find_include(file, name, length, quoted);
+    if (!included) {
+        error(&at, "Cannot open include file");
+        return;
+    }
+
+    // Again in this unit, when it would add nothing
+    if (included->once_unit == unit)
+        return;
+
+    if (included->guard != NO_ATOM && atommap_get(&macros, included->guard))
+        return;
+
+    if (include_depth == MAX_INCLUDE_DEPTH) {
+        error(&at, "#include nested too deeply");
+        return;
+    }
+
+    enter_file(included);
+}
+
+static void push_conditional(const struct pp_token *hash, bool taken)
+{
+    if (conditional_count == conditional_capacity) {
+        conditional_capacity = conditional_capacity ? conditional_capacity * 2 : 16;
+        conditionals = realloc(conditionals,
+                               conditional_capacity * sizeof(struct conditional));
+    }
+
+    conditionals[conditional_count++] = (struct conditional) {
+        .hash = *hash,
+        .taken = taken,
+    };
+}
+
+// The innermost of the current file, NULL if there is none
+static struct conditional *open_conditional(const struct include_frame *frame)
+{
+    if (conditional_count > frame->conditionals)
+        return &conditionals[conditional_count - 1];
+
+    return NULL;
+}
+
+/*
+ * Skips a group that isn't kept, up to the #elif, #else or #endif that
+ * ends it, which runs next. Nested conditionals are only counted.
+ */
+static void skip_group(struct include_frame *frame)
+{
+    const struct token_stream *raw = frame->file->tokens;
+    uint32_t pos = frame->pos;
+    int depth = 0;
+
+    for (; raw->types[pos] != TOKEN_EOF; pos++) {
+        if (!is_directive(raw, pos))
+            continue;
+
+        enum directive kind = directive_kind(frame->file, pos);
+
+        if (kind == DIR_IF || kind == DIR_IFDEF || kind == DIR_IFNDEF) {
+            depth++;
+        } else if (kind == DIR_ELIF || kind == DIR_ELSE) {
+            if (depth == 0)
+                break;
+        } else if (kind == DIR_ENDIF) {
+            if (depth == 0)
+                break;
+            depth--;
+        }
+    }
+
+    // At the EOF the conditional is reported unterminated
+    frame->pos = pos;
+}
+
+static void directive(struct include_frame *frame)
+{
+    struct pp_file *file = frame->file;
+    const struct token_stream *raw = file->tokens;
+
+    uint32_t hash = frame->pos;
+    uint32_t name = hash + 1;
+    uint32_t end = line_end(raw, name);
+    enum directive kind = directive_kind(file, hash);
+
+    // Past the line first, #include pushes the next file on top
+    frame->pos = end;
+
+    struct pp_token hash_tok = raw_token(file, hash);
+    struct pp_token name_tok = token_at(file, name, end);
+    struct conditional *cond;
+
+    switch (kind) {
+        case DIR_NONE:
+        case DIR_LINE:
+            break;
+
+        case DIR_INCLUDE:
+            include_file(file, name + 1, end);
+            break;
+
+        case DIR_DEFINE:
+            define_macro(file, name + 1, end);
+            break;
+
+        case DIR_UNDEF:
+            if (name + 1 == end || raw->types[name + 1] != TOKEN_IDENTIFIER) {
+                struct pp_token at = token_at(file, name + 1, end);
+                error(&at, "Macro name must be an identifier");
+                break;
+            }
+            atommap_set(&macros, raw->atoms[name + 1], NULL);
+            break;
+
+        case DIR_IFDEF:
+        case DIR_IFNDEF: {
+            if (name + 1 == end || raw->types[name + 1] != TOKEN_IDENTIFIER) {
+                struct pp_token at = token_at(file, name + 1, end);
+                error(&at, "Macro name must be an identifier");
+                push_conditional(&hash_tok, true);
+                break;
+            }
+
+            bool defined = atommap_get(&macros, raw->atoms[name + 1]) != NULL;
+            bool taken = kind == DIR_IFDEF ? defined : !defined;
+
+            push_conditional(&hash_tok, taken);
+            if (!taken)
+                skip_group(frame);
+            break;
+        }
+
+        case DIR_IF: {
+            bool taken = condition(file, name + 1, end, &name_tok);
+
+            push_conditional(&hash_tok, taken);
+            if (!taken)
+                skip_group(frame);
+            break;
+        }
+
+        case DIR_ELIF:
+            cond = open_conditional(frame);
+            if (!cond) {
+                error(&name_tok, "#elif without #if");
+                break;
+            }
+
+            if (cond->seen_else)
+                error(&name_tok, "#elif after #else");
+
+            if (cond->taken) {
+                skip_group(frame);
+            } else if (condition(file, name + 1, end, &name_tok)) {
+                cond->taken = true;
+            } else {
+                skip_group(frame);
+            }
+            break;
+
+        case DIR_ELSE:
+            cond = open_conditional(frame);
+            if (!cond) {
+                error(&name_tok, "#else without #if");
+                break;
+            }
+
+            if (cond->seen_else)
+                error(&name_tok, "#else after #else");
+            cond->seen_else = true;
+
+            if (cond->taken)
+                skip_group(frame);
+            else
+                cond->taken = true;
+            break;
+
+        case DIR_ENDIF:
+            if (!open_conditional(frame)) {
+                error(&name_tok, "#endif without #if");
+                break;
+            }
+            conditional_count--;
+            break;
+
+        case DIR_PRAGMA:
+            // Other pragmas are ignored
+            if (name + 1 < end && raw->atoms[name + 1] == atom_once)
+                file->once_unit = unit;
+            break;
+
+        case DIR_ERROR: {
+            if (name + 1 == end) {
+                error(&name_tok, "#error");
+                break;
+            }
+
+            const char *text = file->source.text + raw->offsets[name + 1];
+            int length = raw->offsets[end - 1] + raw->lengths[end - 1] - raw->offsets[name + 1];
+
+            int size = snprintf(NULL, 0, "#error %.*s", length, text) + 1;
+            char *message = malloc(size);
+            snprintf(message, size, "#error %.*s", length, text);
+
+            error(&name_tok, message);
+            free(message);
+            break;
+        }
+
+        case DIR_UNKNOWN:
+            error(&name_tok, "Invalid preprocessing directive");
+            break;
+    }
+}
+
+/* Entry points */
+
+static void append_command_line(const char *directive, const char *name, int name_length,
+                                const char *value)
+{
+    int size = snprintf(NULL, 0, "#%s %.*s %s\n", directive, name_length, name, value);
+
+    command_line = realloc(command_line, command_line_size + size + 1);
+    snprintf(command_line + command_line_size, size + 1, "#%s %.*s %s\n",
+             directive, name_length, name, value);
+    command_line_size += size;
+}
+
+void pp_add_include_dir(const char *dir)
+{
+    include_dirs = realloc(include_dirs, (include_dir_count + 1) * sizeof(char *));
+    include_dirs[include_dir_count++] = strdup(dir);
+}
+
+void pp_define(const char *definition)
+{
+    const char *equal = strchr(definition, '=');
+
+    if (equal)
+        append_command_line("define", definition, equal - definition, equal + 1);
+    else
+        append_command_line("define", definition, strlen(definition), "1");
+}
+
+void pp_undefine(const char *name)
+{
+    append_command_line("undef", name, strlen(name), "");
+}
+
+static void pp_init(void)
+{
+    hashmap_init(&file_cache);
+
+    struct pp_file *scratch_file = calloc(1, sizeof(struct pp_file));
+    scratch_file->source.name = "<scratch space>";
+    add_file(scratch_file);
+
+    atom_defined = intern("defined", 7);
+    atom_once = intern("once", 4);
+
+    scratch_token("0", 1, &token_zero);
+    scratch_token("1", 1, &token_one);
+
+    // Predefined macros, then the options
+    size_t size = strlen(predefined) + command_line_size;
+    char *text = calloc(size + 1 + LEXER_PADDING, 1);
+    memcpy(text, predefined, strlen(predefined));
+    if (command_line_size)
+        memcpy(text + strlen(predefined), command_line, command_line_size);
+
+    command_line_file = calloc(1, sizeof(struct pp_file));
+    command_line_file->source.name = "<command line>";
+    command_line_file->source.text = text;
+    add_file(command_line_file);
+    command_line_file->tokens = lex_source(&command_line_file->source);
+}
+
+static void reserve_output(uint32_t count)
+{
+    if (out->count + count > out_capacity) {
+        while (out->count + count > out_capacity)
+            out_capacity *= 2;
+
+        out->types = realloc(out->types, out_capacity * sizeof(*out->types));
+        out->offsets = realloc(out->offsets, out_capacity * sizeof(*out->offsets));
+        out->lengths = realloc(out->lengths, out_capacity * sizeof(*out->lengths));
+        out->atoms = realloc(out->atoms, out_capacity * sizeof(*out->atoms));
+        out->files = realloc(out->files, out_capacity * sizeof(*out->files));
+    }
+}
+
+static void emit(const struct pp_token *tok)
+{
+    reserve_output(1);
+
+    out->types[out->count] = tok->type;
+    out->offsets[out->count] = tok->offset;
+    out->lengths[out->count] = tok->length;
+    out->atoms[out->count] = tok->atom;
+    out->files[out->count] = tok->file;
+    out->count++;
+}
+
+/*
+ * Most tokens are neither directives nor macro names, runs of them are
+ * copied from the file's arrays as they are.
+ */
+static void copy_plain_tokens(void)
+{
+    struct include_frame *frame = &include_stack[include_depth - 1];
+    const struct token_stream *raw = frame->file->tokens;
+
+    uint32_t start = frame->pos;
+    uint32_t pos = start;
+
+    for (;; pos++) {
+        enum token_type type = raw->types[pos];
+
+        if (type == TOKEN_EOF || (type == TOKEN_HASH && raw->line_starts[pos]))
+            break;
+        if (type == TOKEN_IDENTIFIER && atommap_get(&macros, raw->atoms[pos]))
+            break;
+    }
+
+    uint32_t count = pos - start;
+    reserve_output(count);
+
+    memcpy(out->types + out->count, raw->types + start, count * sizeof(*out->types));
+    memcpy(out->offsets + out->count, raw->offsets + start, count * sizeof(*out->offsets));
+    memcpy(out->lengths + out->count, raw->lengths + start, count * sizeof(*out->lengths));
+    memcpy(out->atoms + out->count, raw->atoms + start, count * sizeof(*out->atoms));
+    for (uint32_t i = 0; i < count; i++)
+        out->files[out->count + i] = frame->file->index;
+
+    out->count += count;
+    frame->pos = pos;
+}
+
+struct token_stream *preprocess(const char *filename)
+{
+    static bool ready;
+    if (!ready) {
+        pp_init();
+        ready = true;
+    }
+
+    struct pp_file *main_file = load_file(filename);
+    if (!main_file) {
+        fprintf(stderr, "Opening file %s failed\n", filename);
+        exit(1);
+    }
+
+    unit++;
+    had_error = false;
+    atommap_init(&macros);
+
+    include_depth = 0;
+    conditional_count = 0;
+    pending.count = 0;
+    dependency_count = 0;
+
+    // The command line runs first, as if included at the top
+    enter_file(main_file);
+    enter_file(command_line_file);
+
+    out = calloc(1, sizeof(struct token_stream));
+    out_capacity = main_file->tokens->count + 16;
+    out->types = malloc(out_capacity * sizeof(*out->types));
+    out->offsets = malloc(out_capacity * sizeof(*out->offsets));
+    out->lengths = malloc(out_capacity * sizeof(*out->lengths));
+    out->atoms = malloc(out_capacity * sizeof(*out->atoms));
+    out->files = malloc(out_capacity * sizeof(*out->files));
+
+    for (;;) {
+        if (pending.count == 0)
+            copy_plain_tokens();
+
+        struct pp_token tok = next_token(0, true);
+        if (expand_macro(&tok, 0, true))
+            continue;
+
+        emit(&tok);
+        if (tok.type == TOKEN_EOF)
+            break;
+    }
+
+    out->source_count = file_count;
+    out->sources = malloc(file_count * sizeof(*out->sources));
+    for (int i = 0; i < file_count; i++)
+        out->sources[i] = &files[i]->source;
+
+    atommap_free(&macros);
+    hideset_memos_free();
+    arena_free();
+
+    current_tokens = out;
+    if (had_error) {
+        token_stream_free(out);
+        return NULL;
+    }
+
+    return out;
+}
+
+int pp_dependencies(const char ***paths)
+{
+    *paths = dependencies;
+    return dependency_count;
+}
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t hash, const char *bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)bytes[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+uint64_t pp_options_hash(void)
+{
+    uint64_t hash = hash_bytes(14695981039346656037u, predefined, strlen(predefined));
+
+    if (command_line)
+        hash = hash_bytes(hash, command_line, command_line_size);
+
+    // The NUL separates the directories
+    for (int i = 0; i < include_dir_count; i++)
+        hash = hash_bytes(hash, include_dirs[i], strlen(include_dirs[i]) + 1);
+
+    return hash;
+}
@@ -0,0 +1,35 @@
+/*
+ * Preprocessor, between the lexer and the parser.
+ *
+ * Every file is read and lexed once per invocation, a header included
+ * by several inputs reuses the tokens of the first time. Directives and
+ * macros are applied while copying those tokens into the stream of the
+ * translation unit, so tokens keep pointing into the text they are
+ * spelled in and no preprocessed text is ever written out.
+ */
+
+#ifndef CINC_PREPROCESSOR_H
+#define CINC_PREPROCESSOR_H
+
+#include "lexer.h"
+
+// -I: searched for #include "file" after the includer's directory, and for <file>
+void pp_add_include_dir(const char *dir);
+
+// -D name[=value] and -U name, applied in order before every input
+void pp_define(const char *definition);
+void pp_undefine(const char *name);
+
+/*
+ * Preprocesses 'filename' into the tokens of one translation unit,
+ * NULL after errors. The result becomes current_tokens.
+ */
+struct token_stream *preprocess(const char *filename);
+
+// Files the last preprocess() read, the main one first. Paths as opened.
+int pp_dependencies(const char ***paths);
+
+// Of the -D, -U and -I options, which change what preprocess() gives
+uint64_t pp_options_hash(void);
+
+#endif
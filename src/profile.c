@@ -0,0 +1,519 @@
+/*
+ * Counters are numbered per function, in the order cfg_build() finds
+ * blocks and branches:
+ *   0 .. blocks-1                   block i was entered
+ *   blocks .. blocks+branches-1     conditional branch j was taken
+ * Both builds run the same passes before this one, so the numbering
+ * matches as long as the source does. A function whose counter count
+ * changed is reported as stale and keeps no profile.
+ *
+ * Profile lines: <function> <counters in function> <index> <count>
+ * Counters that stayed zero aren't written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "profile.h"
+#include "cfg.h"
+#include "ir.h"
+#include "base/hash_map.h"
+
+// A function is hot if its busiest block ran at least 1/HOT_FRACTION as often as the TU's busiest
+#define HOT_FRACTION 10
+
+#define MAX_NAME_LEN 255
+
+static char *copy_string(const char *str, int len)
+{
+    char *copy = malloc(len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static bool is_cond_branch(struct ir_instr *instr)
+{
+    return instr && (instr->kind == IR_INSTR_JUMP_IF_ZERO ||
+                     instr->kind == IR_INSTR_JUMP_IF_NOT_ZERO);
+}
+
+// Conditional branch ending block 'b', NULL if it has none
+static struct ir_instr *block_cond_branch(struct ir_block *b)
+{
+    struct ir_instr *cond, *jump;
+    cfg_block_exits(b, &cond, &jump);
+
+    return is_cond_branch(cond) ? cond : NULL;
+}
+
+static int count_cond_branches(struct ir_cfg *cfg)
+{
+    int count = 0;
+    for (int i = 0; i < cfg->count; i++)
+        if (block_cond_branch(&cfg->blocks[i]))
+            count++;
+
+    return count;
+}
+
+static void relink_in_source_order(struct ir_cfg *cfg, struct ir_function *fn)
+{
+    int *order = malloc(cfg->count * sizeof(int));
+    for (int i = 0; i < cfg->count; i++)
+        order[i] = i;
+
+    cfg_relink(cfg, fn, order, cfg->count);
+    free(order);
+}
+
+/* Instrumentation */
+
+static struct ir_value counter_value(const char *symbol)
+{
+    return (struct ir_value) {
+        .kind = IR_VALUE_STATIC,
+        .name = symbol
+    };
+}
+
+// counter = counter + 1, wider than an int so hot blocks don't wrap
+static struct ir_instr *make_increment(const char *symbol)
+{
+    struct ir_instr *instr = calloc(1, sizeof(struct ir_instr));
+    instr->kind = IR_INSTR_COUNT;
+    instr->count.counter = counter_value(symbol);
+    return instr;
+}
+
+static const char *add_counter(struct ir_program *program, struct ir_function *fn,
+                               int index, int function_counters)
+{
+    int len = snprintf(NULL, 0, "__cinc_prof.%s.%d", fn->name, index);
+    char *symbol = malloc(len + 1);
+    snprintf(symbol, len + 1, "__cinc_prof.%s.%d", fn->name, index);
+
+    struct ir_static_variable *var = calloc(1, sizeof(struct ir_static_variable));
+    var->name = symbol;
+    var->linkage = LINK_INTERNAL;
+    var->counter = true;
+    var->next = program->static_vars;
+    program->static_vars = var;
+
+    struct ir_profile_counter *counter = calloc(1, sizeof(struct ir_profile_counter));
+    counter->function = fn->name;
+    counter->function_counters = function_counters;
+    counter->index = index;
+    counter->symbol = symbol;
+    counter->next = program->profile_counters;
+    program->profile_counters = counter;
+
+    return symbol;
+}
+
+// Puts 'instr' after the labels starting 'b'
+static void insert_after_labels(struct ir_block *b, struct ir_instr *instr)
+{
+    struct ir_instr *pos = b->first;
+    while (pos->next && pos->next->kind == IR_INSTR_LABEL)
+        pos = pos->next;
+
+    instr->next = pos->next;
+    pos->next = instr;
+
+    if (b->last == pos)
+        b->last = instr;
+}
+
+/*
+ * Taken edges are split to count them:
+ *   if x == 0 jump L    ->    if x == 0 jump Ledge
+ *                             ...
+ *                           Ledge:
+ *                             counter++
+ *                             jump L
+ */
+static void instrument_function(struct ir_program *program, struct ir_function *fn)
+{
+    if (!fn->first)
+        return;
+
+    struct ir_cfg cfg;
+    cfg_build(&cfg, fn);
+
+    int counters = cfg.count + count_cond_branches(&cfg);
+
+    for (int i = 0; i < cfg.count; i++)
+        insert_after_labels(&cfg.blocks[i], make_increment(add_counter(program, fn, i, counters)));
+
+    struct ir_instr *edges = NULL;
+    struct ir_instr *edges_tail = NULL;
+
+    int index = cfg.count;
+    for (int i = 0; i < cfg.count; i++) {
+        struct ir_instr *cond = block_cond_branch(&cfg.blocks[i]);
+        if (!cond)
+            continue;
+
+        int *target = ir_branch_target(cond);
+        int edge_label = ir_new_label();
+
+        struct ir_instr *label = ir_make_label(edge_label);
+        struct ir_instr *incr = make_increment(add_counter(program, fn, index++, counters));
+        struct ir_instr *jump = ir_make_jump(*target);
+
+        LIST_APPEND(edges, edges_tail, label);
+        LIST_APPEND(edges, edges_tail, incr);
+        LIST_APPEND(edges, edges_tail, jump);
+
+        *target = edge_label;
+    }
+
+    relink_in_source_order(&cfg, fn);
+
+    if (edges) {
+        fn->last->next = edges;
+        fn->last = edges_tail;
+    }
+
+    cfg_free(&cfg);
+}
+
+void profile_instrument(struct ir_program *program, const char *path)
+{
+    program->profile_path = path;
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next)
+        instrument_function(program, fn);
+}
+
+/* Reading the profile back */
+
+struct function_profile {
+    int counters;
+    long *counts;
+    bool stale;
+};
+
+static bool read_profile(const char *path, hash_map *profiles)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    char name[MAX_NAME_LEN + 1];
+    int counters, index;
+    long count;
+
+    while (fscanf(file, "%255s %d %d %ld", name, &counters, &index, &count) == 4) {
+        int len = strlen(name);
+        struct function_profile *fp = hashmap_get(profiles, name, len);
+
+        if (!fp) {
+            fp = calloc(1, sizeof(struct function_profile));
+            fp->counters = counters;
+            fp->counts = calloc(counters > 0 ? counters : 1, sizeof(long));
+            hashmap_set(profiles, copy_string(name, len), len, fp);
+        }
+
+        if (counters != fp->counters || index < 0 || index >= counters) {
+            fp->stale = true;
+            continue;
+        }
+
+        // Every run appends its counts
+        fp->counts[index] += count;
+    }
+
+    fclose(file);
+    return true;
+}
+
+static void free_profiles(hash_map *profiles)
+{
+    for (size_t i = 0; i < profiles->capacity; i++) {
+        hm_entry *entry = &profiles->entries[i];
+        if (!entry->key)
+            continue;
+
+        struct function_profile *fp = entry->value;
+        free(fp->counts);
+        free(fp);
+        free((char *)entry->key);
+    }
+
+    hashmap_free(profiles);
+}
+
+static long label_count(struct ir_instr *label)
+{
+    return label->label.has_count ? label->label.count : 0;
+}
+
+static void set_label_count(struct ir_instr *label, long count)
+{
+    label->label.has_count = true;
+    label->label.count = count;
+}
+
+static void set_taken_count(struct ir_instr *cond, long count)
+{
+    if (cond->kind == IR_INSTR_JUMP_IF_ZERO) {
+        cond->jump_if_zero.has_count = true;
+        cond->jump_if_zero.taken_count = count;
+    } else {
+        cond->jump_if_not_zero.has_count = true;
+        cond->jump_if_not_zero.taken_count = count;
+    }
+}
+
+/*
+ * Annotates 'fn' with its counts. Functions missing from the profile
+ * never ran, their counters all stayed zero.
+ */
+static void apply_function_profile(struct ir_function *fn, struct function_profile *fp)
+{
+    if (!fn->first)
+        return;
+
+    struct ir_cfg cfg;
+    cfg_build(&cfg, fn);
+
+    int counters = cfg.count + count_cond_branches(&cfg);
+
+    if (fp && (fp->stale || fp->counters != counters)) {
+        fprintf(stderr, "warning: profile for '%s' doesn't match its code, ignoring it\n",
+                fn->name);
+        relink_in_source_order(&cfg, fn);
+        cfg_free(&cfg);
+        return;
+    }
+
+    int branch = cfg.count;
+    for (int i = 0; i < cfg.count; i++) {
+        long count = fp ? fp->counts[i] : 0;
+
+        for (struct ir_instr *instr = cfg.blocks[i].first;
+             instr && instr->kind == IR_INSTR_LABEL; instr = instr->next)
+            set_label_count(instr, count);
+
+        struct ir_instr *cond = block_cond_branch(&cfg.blocks[i]);
+        if (cond)
+            set_taken_count(cond, fp ? fp->counts[branch++] : 0);
+    }
+
+    fn->has_profile = true;
+    fn->entry_count = fp ? fp->counts[0] : 0;
+
+    relink_in_source_order(&cfg, fn);
+    cfg_free(&cfg);
+}
+
+/* Switch dispatch order */
+
+static bool is_case_test(struct ir_instr *instr)
+{
+    if (!instr || instr->kind != IR_INSTR_BINARY || instr->binary.op != IR_BINOP_EQ ||
+        instr->binary.lhs.kind == IR_VALUE_CONSTANT ||
+        instr->binary.rhs.kind != IR_VALUE_CONSTANT ||
+        instr->binary.dst.kind != IR_VALUE_PSEUDO)
+        return false;
+
+    struct ir_instr *jump = instr->next;
+    return jump && jump->kind == IR_INSTR_JUMP_IF_NOT_ZERO &&
+           jump->jump_if_not_zero.has_count &&
+           jump->jump_if_not_zero.cond.kind == IR_VALUE_PSEUDO &&
+           jump->jump_if_not_zero.cond.pseudo == instr->binary.dst.pseudo;
+}
+
+// Of the tested value, never a constant
+static bool same_operand_value(struct ir_value a, struct ir_value b)
+{
+    if (a.kind != b.kind)
+        return false;
+
+    if (a.kind == IR_VALUE_PSEUDO)
+        return a.pseudo == b.pseudo;
+
+    return !strcmp(a.name, b.name);
+}
+
+/*
+ * The glue between two tests after cfg_build():
+ *   jump L; L: <next test>
+ * with L used by nothing else. Returns the label, NULL if it isn't glue.
+ */
+static struct ir_instr *chain_glue(struct ir_instr *jump, struct ir_instr *test,
+                                   int *label_refs)
+{
+    if (!jump || jump->kind != IR_INSTR_JUMP)
+        return NULL;
+
+    struct ir_instr *label = jump->next;
+    if (!label || label->kind != IR_INSTR_LABEL ||
+        label->label.label_id != jump->jump.label_id ||
+        label_refs[label->label.label_id] != 1)
+        return NULL;
+
+    struct ir_instr *next = label->next;
+    if (!is_case_test(next) || !same_operand_value(next->binary.lhs, test->binary.lhs))
+        return NULL;
+
+    return label;
+}
+
+#define MAX_CHAIN 1024
+
+struct case_target {
+    long constant;
+    int target;
+    long taken;
+};
+
+/*
+ * switch lowers to a chain of
+ *   t = x == k; if t != 0 jump case_k
+ * Case values are distinct and the chain doesn't write x, so the
+ * tests can run in any order. The most taken cases are tested first,
+ * by permuting the constants and targets over the existing tests.
+ */
+static struct ir_instr *reorder_case_chain(struct ir_instr *first, int *label_refs)
+{
+    struct ir_instr *tests[MAX_CHAIN];
+    struct ir_instr *glue[MAX_CHAIN];
+    int count = 0;
+
+    struct ir_instr *test = first;
+    while (count < MAX_CHAIN) {
+        tests[count++] = test;
+
+        struct ir_instr *label = chain_glue(test->next->next, first, label_refs);
+        if (!label)
+            break;
+
+        glue[count - 1] = label;
+        test = label->next;
+    }
+
+    struct ir_instr *end = tests[count - 1]->next;
+    if (count < 2)
+        return end;
+
+    // Executions entering the chain, from the block after the first test
+    long entering = label_count(glue[0]) + tests[0]->next->jump_if_not_zero.taken_count;
+
+    struct case_target cases[MAX_CHAIN];
+
+    for (int i = 0; i < count; i++) {
+        cases[i].constant = tests[i]->binary.rhs.constant;
+        cases[i].target = tests[i]->next->jump_if_not_zero.label_id;
+        cases[i].taken = tests[i]->next->jump_if_not_zero.taken_count;
+    }
+
+    // Stable insertion sort, most taken first
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && cases[j].taken > cases[j - 1].taken; j--) {
+            struct case_target tmp = cases[j];
+            cases[j] = cases[j - 1];
+            cases[j - 1] = tmp;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct ir_instr *jump = tests[i]->next;
+
+        tests[i]->binary.rhs.constant = cases[i].constant;
+        jump->jump_if_not_zero.label_id = cases[i].target;
+        jump->jump_if_not_zero.taken_count = cases[i].taken;
+
+        entering -= cases[i].taken;
+        if (i + 1 < count)
+            set_label_count(glue[i], entering);
+    }
+
+    return end;
+}
+
+static void reorder_switch_dispatch(struct ir_function *fn)
+{
+    int max_label = 0;
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+        int *target = ir_branch_target(instr);
+        if (target && *target > max_label)
+            max_label = *target;
+        if (instr->kind == IR_INSTR_LABEL && instr->label.label_id > max_label)
+            max_label = instr->label.label_id;
+    }
+
+    int *label_refs = calloc(max_label + 1, sizeof(int));
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next) {
+        int *target = ir_branch_target(instr);
+        if (target)
+            label_refs[*target]++;
+    }
+
+    for (struct ir_instr *instr = fn->first; instr; ) {
+        if (is_case_test(instr))
+            instr = reorder_case_chain(instr, label_refs);
+        else
+            instr = instr->next;
+    }
+
+    free(label_refs);
+}
+
+static long max_block_count(struct ir_function *fn)
+{
+    long max = 0;
+    for (struct ir_instr *instr = fn->first; instr; instr = instr->next)
+        if (instr->kind == IR_INSTR_LABEL && label_count(instr) > max)
+            max = label_count(instr);
+
+    return max;
+}
+
+// Functions that never ran go to .text.unlikely, the busiest to .text.hot
+static void assign_sections(struct ir_program *program)
+{
+    long program_max = 0;
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        long max = max_block_count(fn);
+        if (max > program_max)
+            program_max = max;
+    }
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        if (!fn->has_profile)
+            continue;
+
+        if (fn->entry_count == 0)
+            fn->section = IR_SECTION_UNLIKELY;
+        else if (max_block_count(fn) * HOT_FRACTION >= program_max)
+            fn->section = IR_SECTION_HOT;
+    }
+}
+
+bool profile_apply(struct ir_program *program, const char *path)
+{
+    hash_map profiles;
+    hashmap_init(&profiles);
+
+    if (!read_profile(path, &profiles)) {
+        hashmap_free(&profiles);
+        return false;
+    }
+
+    for (struct ir_function *fn = program->functions; fn; fn = fn->next) {
+        struct function_profile *fp = hashmap_get(&profiles, fn->name, strlen(fn->name));
+        apply_function_profile(fn, fp);
+
+        if (fn->has_profile)
+            reorder_switch_dispatch(fn);
+    }
+
+    assign_sections(program);
+
+    free_profiles(&profiles);
+    return true;
+}
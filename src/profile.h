@@ -0,0 +1,20 @@
+/*
+ * Profile-guided optimization.
+ *
+ * -fprofile-generate counts executions of every basic block and of
+ * every taken conditional branch. The instrumented program appends the
+ * counts to a profile file at exit, so several runs add up.
+ * -fprofile-use reads them back onto the IR for the passes that follow.
+ */
+
+#ifndef CINC_PROFILE_H
+#define CINC_PROFILE_H
+
+#include "ir.h"
+
+void profile_instrument(struct ir_program *program, const char *path);
+
+// Returns false if the profile can't be read
+bool profile_apply(struct ir_program *program, const char *path);
+
+#endif
@@ -6,26 +6,35 @@
 #include "ast.h"
 #include "lexer.h"
 #include "type.h"
-#include "base/hash_map.h"
-
-struct scope {
-    struct scope *parent;
-    hash_map ordinary;
+#include "base/atom_map.h"
+
+/*
+ * Ordinary identifiers resolve through one table indexed by atom. Each
+ * entry is the stack of declarations of that name, innermost first, so
+ * a lookup is one load whatever the nesting. Leaving a scope pops only
+ * the names it declared, a block without declarations costs nothing.
+ */
+struct binding {
+    struct symbol *sym;
+    int depth;                  // Scope depth of the declaration
+    struct binding *shadowed;   // Outer declaration of the same name
 };
 
-struct loop_switch_ctx {
-    const char *break_label;
-    const char *continue_label;
-};
+static struct binding **bindings;    // Atom -> innermost binding
+static uint32_t bindings_capacity;
+static struct binding *free_bindings;
+
+static atom *declared;              // Names bound per scope, innermost last
+static int declared_count;
+static int declared_capacity;
 
-static struct scope *global_scope;
-static struct scope *current_scope;
+static int scope_depth;             // 0 is file scope
 static struct decl *current_function;
 
-static hash_map labels;
+static atom_map labels;
 
-static hash_map external_symbols;
-static hash_map internal_symbols;
+static atom_map external_symbols;
+static atom_map internal_symbols;
 
 // TODO: Change this shit
 struct symbol *all_symbols = NULL;
@@ -34,76 +43,113 @@ static struct symbol *all_symbols_tail = NULL;
 static int unique_counter;
 static bool had_error;
 
-static void error(struct token *tok, const char *message)
-{
-    int col = (int)(tok->start - tok->line_start);
-
-    fprintf(stderr, "%s: Error at line %d, col %d: %s\n", tok->filename, tok->line, col, message);
-
-    const char *line_end = tok->line_start;
-    while (*line_end != '\0' && *line_end != '\n')
-        line_end++;
-    fprintf(stderr, "  %.*s\n", (int)(line_end - tok->line_start), tok->line_start);
-
-    fprintf(stderr, "  %*s", col, "");
-    for (int i = 0; i < (tok->length > 0 ? tok->length : 1); i++)
-        fputc('^', stderr);
-    fputc('\n', stderr);
+// Numbers given out in the current function body
+static int label_count;
+static int local_count;
 
+static void error(tok_id tok, const char *message)
+{
+    tok_error(tok, message);
     had_error = true;
 }
 
-static char *make_unique(const char *name, int length)
+static char *make_unique(const char *name)
 {
-    int n = snprintf(NULL, 0, "%.*s.%d", length, name, unique_counter);
+    int n = snprintf(NULL, 0, "%s.%d", name, unique_counter);
     char *buf = malloc(n + 1);
-    snprintf(buf, n + 1, "%.*s.%d", length, name, unique_counter++);
+    snprintf(buf, n + 1, "%s.%d", name, unique_counter++);
 
     return buf;
 }
 
-static struct scope *scope_push(struct scope *parent)
+static int new_label(void)
 {
-    struct scope *s = calloc(1, sizeof(struct scope));
-
-    hashmap_init(&s->ordinary);
-    s->parent = parent;
+    return ++label_count;
+}
 
-    return s;
+// Returns the mark scope_pop unwinds to
+static int scope_push(void)
+{
+    scope_depth++;
+    return declared_count;
 }
 
-static struct scope *scope_pop(struct scope *s)
+static void unbind_to(int mark)
 {
-    struct scope *parent = s->parent;
+    while (declared_count > mark) {
+        atom name = declared[--declared_count];
 
-    hashmap_free(&s->ordinary);
-    free(s);
+        struct binding *b = bindings[name];
+        bindings[name] = b->shadowed;
 
-    return parent;
+        b->shadowed = free_bindings;
+        free_bindings = b;
+    }
+}
+
+static void scope_pop(int mark)
+{
+    unbind_to(mark);
+    scope_depth--;
 }
 
 static bool is_file_scope()
 {
-    return current_scope == global_scope;
+    return scope_depth == 0;
 }
 
-static struct symbol *scope_lookup_current(struct scope *s, const char *name, int length)
+static struct symbol *scope_lookup_visible(atom name)
 {
-    if (!s)
+    if (name >= bindings_capacity || !bindings[name])
         return NULL;
 
-    return hashmap_get(&s->ordinary, name, length);
+    return bindings[name]->sym;
 }
 
-static struct symbol *scope_lookup_visible(struct scope *s, const char *name, int length)
+static struct symbol *scope_lookup_current(atom name)
 {
-    for (struct scope *scp = s; scp != NULL; scp = scp->parent) {
-        struct symbol *sym = hashmap_get(&scp->ordinary, name, length);
-        if (sym)
-            return sym;
+    if (name >= bindings_capacity || !bindings[name])
+        return NULL;
+
+    struct binding *b = bindings[name];
+    return b->depth == scope_depth ? b->sym : NULL;
+}
+
+static void scope_bind(atom name, struct symbol *sym)
+{
+    if (name >= bindings_capacity) {
+        uint32_t capacity = bindings_capacity ? bindings_capacity : 256;
+        while (capacity <= name)
+            capacity *= 2;
+
+        bindings = realloc(bindings, capacity * sizeof(struct binding *));
+        for (uint32_t i = bindings_capacity; i < capacity; i++)
+            bindings[i] = NULL;
+        bindings_capacity = capacity;
     }
 
-    return NULL;
+    // Redeclaration in the same scope
+    if (bindings[name] && bindings[name]->depth == scope_depth) {
+        bindings[name]->sym = sym;
+        return;
+    }
+
+    struct binding *b = free_bindings;
+    if (b)
+        free_bindings = b->shadowed;
+    else
+        b = malloc(sizeof(struct binding));
+
+    b->sym = sym;
+    b->depth = scope_depth;
+    b->shadowed = bindings[name];
+    bindings[name] = b;
+
+    if (declared_count == declared_capacity) {
+        declared_capacity = declared_capacity ? declared_capacity * 2 : 64;
+        declared = realloc(declared, declared_capacity * sizeof(atom));
+    }
+    declared[declared_count++] = name;
 }
 
 static void append_to_all_symbols(struct symbol *sym)
@@ -124,8 +170,7 @@ static struct symbol *symbol_new(struct decl *d)
 {
     struct symbol *sym = calloc(1, sizeof(struct symbol));
     sym->kind = d->kind == DECL_FUNCTION ? SYM_FUNCTION : SYM_OBJECT;
-    sym->name = d->name.start;
-    sym->name_len = d->name.length;
+    sym->name = tok_atom(d->name);
     sym->ty = d->type;
     sym->decl = d;
     sym->linkage = d->linkage;
@@ -135,8 +180,10 @@ static struct symbol *symbol_new(struct decl *d)
 
     if (d->linkage == LINK_EXTERNAL)
         sym->ir_name = token_to_cstr(d->name);
+    else if (d->storage_duration == SD_AUTO)
+        sym->local = ++local_count;
     else
-        sym->ir_name = make_unique(d->name.start, d->name.length);
+        sym->ir_name = make_unique(atom_name(sym->name));
 
     append_to_all_symbols(sym);
 
@@ -269,45 +316,45 @@ static void validate_for_init_decls(struct decl *decls)
 {
     for (struct decl *d = decls; d; d = d->next) {
         if (d->kind != DECL_OBJECT) {
-            error(&d->name, "For-loop init declaration must declare an object");
+            error(d->name, "For-loop init declaration must declare an object");
             continue;
         }
 
         if (d->storage_class != SC_NONE &&
             d->storage_class != SC_AUTO &&
             d->storage_class != SC_REGISTER)
-            error(&d->name, "Illegal storage class for for-init");
+            error(d->name, "Illegal storage class for for-init");
     }
 }
 
 static void validate_function_params(struct decl *fn)
 {
-    hash_map params;
-    hashmap_init(&params);
+    atom_map params;
+    atommap_init(&params);
 
     for (struct decl *p = fn->func.params; p; p = p->next) {
         if (type_is_void(p->type))
-            error(&p->name, "Function parameter cannot be type void");
+            error(p->name, "Function parameter cannot be type void");
 
         if (p->storage_class != SC_NONE && p->storage_class != SC_REGISTER)
-            error(&p->name, "Only 'register' storage class can be used as a parameter");
+            error(p->name, "Only 'register' storage class can be used as a parameter");
 
-        if (p->name.length > 0 && p->name.start != NULL) {
-            if (hashmap_get(&params, p->name.start, p->name.length))
-                error(&p->name, "Duplicate parameter definiton");
+        if (p->name != NO_TOKEN) {
+            if (atommap_get(&params, tok_atom(p->name)))
+                error(p->name, "Duplicate parameter definiton");
 
-            hashmap_set(&params, p->name.start, p->name.length, p);
+            atommap_set(&params, tok_atom(p->name), p);
         }
     }
 
-    hashmap_free(&params);
+    atommap_free(&params);
 }
 
 static void validate_decl(struct decl *d)
 {
     if (is_file_scope() &&
         (d->storage_class == SC_AUTO || d->storage_class == SC_REGISTER)) {
-        error(&d->name, "Illegal storage class at file scope");
+        error(d->name, "Illegal storage class at file scope");
     }
 
     // TODO: Check typedef stuff
@@ -318,39 +365,39 @@ static void validate_decl(struct decl *d)
         if (!is_file_scope() && 
             d->storage_class != SC_NONE &&
             d->storage_class != SC_EXTERN) {
-            error(&d->name, "Block-scope function declaration may only use extern");
+            error(d->name, "Block-scope function declaration may only use extern");
         }
 
         if (d->func.body && d->storage_class != SC_NONE &&
             d->storage_class != SC_EXTERN && d->storage_class != SC_STATIC) {
-            error(&d->name, "Function definition may only use extern or static");
+            error(d->name, "Function definition may only use extern or static");
         }
 
         return;
     }
 
     if (type_is_void(d->type))
-        error(&d->name, "Object cannot have type void");
+        error(d->name, "Object cannot have type void");
 
     if (!is_file_scope() && d->storage_class == SC_EXTERN && d->object.init)
-        error(&d->name, "Block-scope extern declaration cannot have an initializer");
+        error(d->name, "Block-scope extern declaration cannot have an initializer");
 }
 
 static struct symbol *merge_symbol(struct decl *d, struct symbol *sym,
                                     bool install_in_current_scope)
 {
     if (d->linkage != sym->linkage)
-        error(&d->name, "Conflicting linkage for declaration");
+        error(d->name, "Conflicting linkage for declaration");
 
     if (!types_compatible(d->type, sym->ty)) {
-        error(&d->name, "Confilcting declaration types");
+        error(d->name, "Confilcting declaration types");
     } else {
         sym->ty = type_composite(sym->ty, d->type);
         d->type = sym->ty;
     }
 
     if (sym->defined && d->is_definition)
-        error(&d->name, "Redeclaration");
+        error(d->name, "Redeclaration");
     
     sym->defined |= d->is_definition;
     sym->tentative |= d->is_tentative;
@@ -359,31 +406,26 @@ static struct symbol *merge_symbol(struct decl *d, struct symbol *sym,
     d->ir_name = sym->ir_name;
 
     if (install_in_current_scope)
-        hashmap_set(&current_scope->ordinary,
-                    d->name.start,
-                    d->name.length,
-                    sym);
+        scope_bind(tok_atom(d->name), sym);
 
     return sym;
 }
 
 static struct symbol *declare_symbol(struct decl *d)
 {
-    struct symbol *prior_visible = scope_lookup_visible(current_scope,
-            d->name.start, d->name.length);
+    struct symbol *prior_visible = scope_lookup_visible(tok_atom(d->name));
 
     d->linkage = compute_linkage(d, prior_visible);
     d->storage_duration = compute_storage_duration(d);
     classify_definition(d);
 
 
-    struct symbol *prior_current = scope_lookup_current(current_scope,
-            d->name.start, d->name.length);
+    struct symbol *prior_current = scope_lookup_current(tok_atom(d->name));
 
     // Same scope declaration
     if (prior_current) {
         if (d->linkage == LINK_NONE || prior_current->linkage == LINK_NONE) {
-            error(&d->name, "Duplicate declaration");
+            error(d->name, "Duplicate declaration");
             d->sym = prior_current;
             d->ir_name = prior_current->ir_name;
             return prior_current;
@@ -418,7 +460,7 @@ static struct symbol *declare_symbol(struct decl *d)
      */
     if (d->linkage == LINK_EXTERNAL) {
         struct symbol *prior_external =
-            hashmap_get(&external_symbols, d->name.start, d->name.length);
+            atommap_get(&external_symbols, tok_atom(d->name));
 
         if (prior_external)
             return merge_symbol(d, prior_external, true);
@@ -427,18 +469,18 @@ static struct symbol *declare_symbol(struct decl *d)
     // Internal/external linkage confict in same translation unit
     if (d->linkage == LINK_EXTERNAL) {
         struct symbol *prior_internal =
-            hashmap_get(&internal_symbols, d->name.start, d->name.length);
+            atommap_get(&internal_symbols, tok_atom(d->name));
 
         if (prior_internal)
-            error(&d->name, "Identifier previously declared with internal linkage");
+            error(d->name, "Identifier previously declared with internal linkage");
     }
 
     if (d->linkage == LINK_INTERNAL) {
         struct symbol *prior_external =
-            hashmap_get(&external_symbols, d->name.start, d->name.length);
+            atommap_get(&external_symbols, tok_atom(d->name));
 
         if (prior_external)
-            error(&d->name, "Identifier previously declared with external linkage");
+            error(d->name, "Identifier previously declared with external linkage");
     }
 
     /*
@@ -446,20 +488,13 @@ static struct symbol *declare_symbol(struct decl *d)
      */
     struct symbol *sym = symbol_new(d);
 
-    hashmap_set(&current_scope->ordinary,
-                d->name.start,
-                d->name.length,
-                sym);
+    scope_bind(tok_atom(d->name), sym);
 
     if (d->linkage == LINK_EXTERNAL) {
-        hashmap_set(&external_symbols,
-                    d->name.start,
-                    d->name.length,
+        atommap_set(&external_symbols, tok_atom(d->name),
                     sym);
     } else if (d->linkage == LINK_INTERNAL) {
-        hashmap_set(&internal_symbols,
-                    d->name.start,
-                    d->name.length,
+        atommap_set(&internal_symbols, tok_atom(d->name),
                     sym);
     }
 
@@ -482,7 +517,7 @@ static void check_call_args(struct expr *expr)
 
     // TODO: Change the error function to handle stuff like "%s %s"
     if (arg_count != fn_ty->func.param_count) {
-        error(&expr->tok, "Wrong number of function arguments");
+        error(expr->tok, "Wrong number of function arguments");
         return;
     }
 
@@ -490,15 +525,77 @@ static void check_call_args(struct expr *expr)
     struct decl *param = fn_ty->func.params;
     for (; arg && param; arg = arg->next, param = param->next) {
         if (!types_compatible(arg->type, param->type))
-            error(&arg->tok, "Argument type does not match parameter type");
+            error(arg->tok, "Argument type does not match parameter type");
     }
 }
 
-static void analyze_expr(struct expr *expr)
+/*
+ * Expressions are checked bottom-up from an explicit stack of visits,
+ * a 100k term sum is as deep as it is long and would not fit the C
+ * stack. A visit walks the operands of its expression in order, then
+ * checks the expression itself.
+ */
+struct expr_visit {
+    struct expr *expr;
+    int operand;        // Index of the next one
+    struct expr *arg;   // Of a call, the last one visited
+};
+
+static struct expr_visit *expr_visits;
+static int expr_visit_count;
+static int expr_visit_capacity;
+
+static void visit_expr(struct expr *expr)
 {
-    if (!expr)
-        return;
+    if (expr_visit_count == expr_visit_capacity) {
+        expr_visit_capacity = expr_visit_capacity ? expr_visit_capacity * 2 : 64;
+        expr_visits = realloc(expr_visits, expr_visit_capacity * sizeof(struct expr_visit));
+    }
+
+    expr_visits[expr_visit_count++] = (struct expr_visit) { .expr = expr };
+}
+
+// NULL after the last operand
+static struct expr *next_operand(struct expr_visit *visit)
+{
+    struct expr *expr = visit->expr;
+    int i = visit->operand++;
+
+    switch (expr->kind) {
+        case EXPR_INT_LITERAL:
+        case EXPR_IDENTIFIER:
+            return NULL;
+
+        case EXPR_UNARY:
+        case EXPR_PRE:
+        case EXPR_POST:
+            return i == 0 ? expr->unary.operand : NULL;
+
+        case EXPR_BINARY:
+            return i == 0 ? expr->binary.left : i == 1 ? expr->binary.right : NULL;
+
+        case EXPR_ASSIGNMENT:
+            return i == 0 ? expr->assignment.lvalue : i == 1 ? expr->assignment.rvalue : NULL;
+
+        case EXPR_CONDITIONAL:
+            return i == 0 ? expr->conditional.condition :
+                   i == 1 ? expr->conditional.then_expr :
+                   i == 2 ? expr->conditional.else_expr : NULL;
 
+        case EXPR_CALL:
+            if (i == 0)
+                return expr->call.callee;
+
+            visit->arg = i == 1 ? expr->call.args : visit->arg->next;
+            return visit->arg;
+    }
+
+    return NULL;
+}
+
+// Once its operands are checked
+static void check_expr(struct expr *expr)
+{
     switch (expr->kind) {
         case EXPR_INT_LITERAL:
             expr->type = type_int();
@@ -506,11 +603,10 @@ static void analyze_expr(struct expr *expr)
             break;
 
         case EXPR_IDENTIFIER: {
-            struct symbol *sym = scope_lookup_visible(current_scope,
-                    expr->identifier.name.start, expr->identifier.name.length);
+            struct symbol *sym = scope_lookup_visible(tok_atom(expr->tok));
 
             if (!sym) {
-                error(&expr->tok, "Undeclared identifier");
+                error(expr->tok, "Undeclared identifier");
                 expr->type = type_int();
                 expr->is_lvalue = false;
                 return;
@@ -523,15 +619,12 @@ static void analyze_expr(struct expr *expr)
         }
 
         case EXPR_ASSIGNMENT: {
-            analyze_expr(expr->assignment.lvalue);
-            analyze_expr(expr->assignment.rvalue);
-
             if (!expr->assignment.lvalue->is_lvalue)
-                error(&expr->assignment.lvalue->tok, "Left side is not assignable");
+                error(expr->assignment.lvalue->tok, "Left side is not assignable");
 
             if (!types_compatible(expr->assignment.lvalue->type,
                         expr->assignment.rvalue->type))
-                error(&expr->tok, "Assignment types are not compatible");
+                error(expr->tok, "Assignment types are not compatible");
 
             expr->type = expr->assignment.lvalue->type;
             expr->is_lvalue = false;
@@ -540,41 +633,31 @@ static void analyze_expr(struct expr *expr)
 
         case EXPR_PRE:
         case EXPR_POST:
-            analyze_expr(expr->unary.operand);
-
             if (!expr->unary.operand->is_lvalue)
-                error(&expr->tok, "Operand of increment/decrement must be an lvalue");
+                error(expr->tok, "Operand of increment/decrement must be an lvalue");
 
             expr->type = expr->unary.operand->type;
             expr->is_lvalue = false;
             break;
 
         case EXPR_UNARY:
-            analyze_expr(expr->unary.operand);
             expr->type = expr->unary.operand->type;
             expr->is_lvalue = false;
             break;
 
         case EXPR_BINARY:
-            analyze_expr(expr->binary.left);
-            analyze_expr(expr->binary.right);
-
             if (!type_is_int(expr->binary.left->type) || 
                 !type_is_int(expr->binary.right->type))
-                error(&expr->tok, "For now we only support int binary ops");
+                error(expr->tok, "For now we only support int binary ops");
             
             expr->type = expr->binary.left->type;
             expr->is_lvalue = false;
             break;
 
         case EXPR_CONDITIONAL:
-            analyze_expr(expr->conditional.condition);
-            analyze_expr(expr->conditional.then_expr);
-            analyze_expr(expr->conditional.else_expr);
-
             if (!types_compatible(expr->conditional.then_expr->type,
                                   expr->conditional.else_expr->type)) {
-                error(&expr->tok,
+                error(expr->tok,
                       "Conditional expression arms have incompatible types");
             }
 
@@ -583,13 +666,8 @@ static void analyze_expr(struct expr *expr)
             break;
 
         case EXPR_CALL:
-            analyze_expr(expr->call.callee);
-
-            for (struct expr *arg = expr->call.args; arg; arg = arg->next)
-                analyze_expr(arg);
-
             if (!type_is_function(expr->call.callee->type)) {
-                error(&expr->call.callee->tok, "Called object is not a function");
+                error(expr->call.callee->tok, "Called object is not a function");
                 expr->type = type_int();
                 expr->is_lvalue = false;
                 return;
@@ -603,14 +681,33 @@ static void analyze_expr(struct expr *expr)
     }
 }
 
+static void analyze_expr(struct expr *expr)
+{
+    if (!expr)
+        return;
+
+    int floor = expr_visit_count;
+    visit_expr(expr);
+
+    while (expr_visit_count > floor) {
+        struct expr_visit *visit = &expr_visits[expr_visit_count - 1];
+        struct expr *operand = next_operand(visit);
+
+        if (operand) {
+            visit_expr(operand);
+        } else {
+            check_expr(visit->expr);
+            expr_visit_count--;
+        }
+    }
+}
+
 static void require_int_expression(struct expr *expr, const char *message)
 {
     if (!type_is_int(expr->type))
-        error(&expr->tok, message);
+        error(expr->tok, message);
 }
 
-static void analyze_stmt(struct stmt *stmt);
-
 static void record_static_initializer(struct decl *d)
 {
     if (d->kind != DECL_OBJECT)
@@ -623,7 +720,7 @@ static void record_static_initializer(struct decl *d)
         return;
 
     if (d->object.init->kind != EXPR_INT_LITERAL) {
-        error(&d->name, "Initializer for object with static storage must be constant");
+        error(d->name, "Initializer for object with static storage must be constant");
         return;
     }
 
@@ -647,451 +744,195 @@ static void analyze_decl_list(struct decl *decls)
     }
 }
 
-static void analyze_block(struct block_item *first, bool push_new_scope)
-{
-    if (!first)
-        return;
-
-    struct scope *old_scope = current_scope;
-    if (push_new_scope)
-        current_scope = scope_push(current_scope);
-
-    for (struct block_item *item = first; item; item = item->next) {
-        if (item->kind == BLOCK_ITEM_DECL) {
-            analyze_decl_list(item->decls);
-        } else {
-            analyze_stmt(item->stmt);
-        }
-    }
-
-    if (push_new_scope) {
-        scope_pop(current_scope);
-        current_scope = old_scope;
-    }
-
-}
-
-static void analyze_stmt(struct stmt *stmt)
-{
-    if (!stmt)
-        return;
-
-    switch (stmt->kind) {
-        case STMT_NULL:
-        case STMT_BREAK:
-        case STMT_CONTINUE:
-        case STMT_GOTO:
-            break;
-
-        case STMT_EXPR:
-            analyze_expr(stmt->expr_stmt.expr);
-            break;
-
-        case STMT_RETURN: {
-            struct type *ret_ty = current_function->type->func.return_type;
-
-            if (stmt->return_stmt.expr)
-                analyze_expr(stmt->return_stmt.expr);
-
-            if (type_is_void(ret_ty)) {
-                if (stmt->return_stmt.expr)
-                    error(&stmt->tok, "'void' function should not return a value");
-            } else {
-                if (!stmt->return_stmt.expr)
-                    error(&stmt->tok, "Non-void function should return a value");
-                else if (!types_compatible(ret_ty, stmt->return_stmt.expr->type))
-                    error(&stmt->tok, "Return type mismatch");
-            }
-            break;
-        }
-
-        case STMT_IF:
-            analyze_expr(stmt->if_stmt.condition);
-            analyze_stmt(stmt->if_stmt.then_stmt);
-            analyze_stmt(stmt->if_stmt.else_stmt);
-            break;
-
-        case STMT_FOR: {
-            struct scope *old_scope = current_scope;
-            current_scope = scope_push(current_scope);
-
-            if (stmt->for_stmt.init) {
-                if (stmt->for_stmt.init->is_decl) {
-                    validate_for_init_decls(stmt->for_stmt.init->decls);
-                    analyze_decl_list(stmt->for_stmt.init->decls);
-                } else {
-                    analyze_expr(stmt->for_stmt.init->expr);
-                }
-            }
-
-            if (stmt->for_stmt.condition) {
-                analyze_expr(stmt->for_stmt.condition);
-                require_int_expression(stmt->for_stmt.condition,
-                        "For condition must have type int");
-            }
-
-            if (stmt->for_stmt.post)
-                analyze_expr(stmt->for_stmt.post);
-
-            analyze_stmt(stmt->for_stmt.body);
-
-            scope_pop(current_scope);
-            current_scope = old_scope;
-            break;
-        }
+/*
+ * Statement walks keep their path on an explicit stack, so 'else if'
+ * chains and nested blocks of any depth cost no C stack. A walk yields
+ * each statement on the way down and on the way up, and between them
+ * the declarations of block items, all in source order.
+ */
+enum walk_event {
+    WALK_ENTER,
+    WALK_LEAVE,
+    WALK_DECLS,
+};
 
-        case STMT_WHILE:
-            analyze_expr(stmt->while_stmt.condition);
-            require_int_expression(stmt->while_stmt.condition,
-                                    "While condition must have type int");
-            analyze_stmt(stmt->while_stmt.body);
-            break;
+struct walk_frame {
+    struct stmt *stmt;
+    int nested;                 // Index of the next nested statement
+    struct block_item *item;    // Next item of a block, case or default
 
-        case STMT_DOWHILE:
-            analyze_stmt(stmt->dowhile_stmt.body);
-            analyze_expr(stmt->dowhile_stmt.condition);
-            require_int_expression(stmt->dowhile_stmt.condition,
-                                    "Do-while condition must have type int");
-            break;
+    // Set on an invalid case or default, its statements' labels are left out
+    bool cases_off;
 
-        case STMT_SWITCH:
-            analyze_expr(stmt->switch_stmt.condition);
-            require_int_expression(stmt->switch_stmt.condition,
-                                    "Switch condition must have type int");
-            analyze_stmt(stmt->switch_stmt.body);
-            break;
+    // Frames of the innermost enclosing loop and switch, -1 for none
+    int enclosing_loop;
+    int enclosing_switch;
 
-        case STMT_CASE:
-            analyze_expr(stmt->case_stmt.value);
-            require_int_expression(stmt->case_stmt.value,
-                                    "Case value must have type int");
-            analyze_block(stmt->case_stmt.items, false);
-            break;
+    int mark;                   // The walker's, e.g. a scope mark
+};
 
-        case STMT_DEFAULT:
-            analyze_block(stmt->default_stmt.items, false);
-            break;
+struct stmt_walk {
+    struct walk_frame *frames;
+    int count;
+    int capacity;
+    struct stmt *root;
 
-        case STMT_BLOCK:
-            analyze_block(stmt->block.items, true);
-            break;
+    enum walk_event event;
+    struct stmt *stmt;          // WALK_ENTER, WALK_LEAVE
+    struct decl *decls;         // WALK_DECLS
+};
 
-        case STMT_LABEL:
-            analyze_stmt(stmt->label_stmt.stmt);
-            break;
-    }
+static bool is_loop(struct stmt *stmt)
+{
+    return stmt->kind == STMT_FOR || stmt->kind == STMT_WHILE || stmt->kind == STMT_DOWHILE;
 }
 
-static void collect_labels_stmt(struct stmt *stmt);
-static void collect_labels_items(struct block_item *item)
+static void walk_begin(struct stmt_walk *walk, struct stmt *root)
 {
-    for (struct block_item *i = item; i; i = i->next)
-        if (i->kind == BLOCK_ITEM_STMT)
-            collect_labels_stmt(i->stmt);
+    *walk = (struct stmt_walk) { .root = root, .event = WALK_ENTER };
 }
 
-static void collect_labels_stmt(struct stmt *stmt)
+static void walk_end(struct stmt_walk *walk)
 {
-    if (!stmt)
-        return;
-
-    switch (stmt->kind) {
-        case STMT_LABEL: {
-            struct token *tok = &stmt->label_stmt.name;
-
-            if (hashmap_get(&labels, tok->start, tok->length))
-                error(tok, "Duplicate label definition");
-            else
-                hashmap_set(&labels, tok->start, tok->length, stmt);
-
-            collect_labels_stmt(stmt->label_stmt.stmt);
-            break;
-        }
-
-        case STMT_IF:
-            collect_labels_stmt(stmt->if_stmt.then_stmt);
-            collect_labels_stmt(stmt->if_stmt.else_stmt);
-            break;
-
-        case STMT_FOR:
-            collect_labels_stmt(stmt->for_stmt.body);
-            break;
-
-        case STMT_WHILE:
-            collect_labels_stmt(stmt->while_stmt.body);
-            break;
-
-        case STMT_DOWHILE:
-            collect_labels_stmt(stmt->dowhile_stmt.body);
-            break;
-
-        case STMT_SWITCH:
-            collect_labels_stmt(stmt->switch_stmt.body);
-            break;
+    free(walk->frames);
+}
 
-        case STMT_CASE:
-            collect_labels_items(stmt->case_stmt.items);
-            break;
+static void walk_push(struct stmt_walk *walk, struct stmt *stmt)
+{
+    if (walk->count == walk->capacity) {
+        walk->capacity = walk->capacity ? walk->capacity * 2 : 32;
+        walk->frames = realloc(walk->frames, walk->capacity * sizeof(struct walk_frame));
+    }
 
-        case STMT_DEFAULT:
-            collect_labels_items(stmt->default_stmt.items);
-            break;
+    struct walk_frame *frame = &walk->frames[walk->count];
+    *frame = (struct walk_frame) {
+        .stmt = stmt,
+        .enclosing_loop = -1,
+        .enclosing_switch = -1,
+    };
+
+    if (walk->count) {
+        int outer = walk->count - 1;
+        struct walk_frame *parent = &walk->frames[outer];
+
+        frame->enclosing_loop = is_loop(parent->stmt) ? outer : parent->enclosing_loop;
+        frame->enclosing_switch = parent->stmt->kind == STMT_SWITCH ? outer :
+                                  parent->enclosing_switch;
+        frame->cases_off = parent->stmt->kind != STMT_SWITCH && parent->cases_off;
+    }
 
-        case STMT_BLOCK:
-            collect_labels_items(stmt->block.items);
-            break;
+    if (stmt->kind == STMT_BLOCK)
+        frame->item = stmt->block.items;
+    else if (stmt->kind == STMT_CASE)
+        frame->item = stmt->case_stmt.items;
+    else if (stmt->kind == STMT_DEFAULT)
+        frame->item = stmt->default_stmt.items;
 
-        default:
-            break;
-    }
+    walk->count++;
+    walk->event = WALK_ENTER;
+    walk->stmt = stmt;
 }
 
-static void check_gotos_stmt(struct stmt *stmt);
-static void check_gotos_items(struct block_item *item)
+// The statement being entered or left
+static struct walk_frame *walk_frame(struct stmt_walk *walk)
 {
-    for (struct block_item *i = item; i; i = i->next)
-        if (i->kind == BLOCK_ITEM_STMT)
-            check_gotos_stmt(i->stmt);
+    return &walk->frames[walk->count - 1];
 }
 
-static void check_gotos_stmt(struct stmt *stmt)
+// False after the last nested statement
+static bool next_nested(struct walk_frame *frame, struct stmt **nested)
 {
-    if (!stmt)
-        return;
+    struct stmt *stmt = frame->stmt;
+    int i = frame->nested++;
 
     switch (stmt->kind) {
-        case STMT_GOTO: {
-            struct token *tok = &stmt->goto_stmt.label;
-
-            if (!hashmap_get(&labels, tok->start, tok->length))
-                error(tok, "Use of undeclared label");
-
-            break;
-        }
-
-        case STMT_LABEL:
-            check_gotos_stmt(stmt->label_stmt.stmt);
-            break;
-
         case STMT_IF:
-            check_gotos_stmt(stmt->if_stmt.then_stmt);
-            check_gotos_stmt(stmt->if_stmt.else_stmt);
-            break;
-
+            *nested = i == 0 ? stmt->if_stmt.then_stmt : stmt->if_stmt.else_stmt;
+            return i < 2;
         case STMT_FOR:
-            check_gotos_stmt(stmt->for_stmt.body);
-            break;
-
+            *nested = stmt->for_stmt.body;
+            return i < 1;
         case STMT_WHILE:
-            check_gotos_stmt(stmt->while_stmt.body);
-            break;
-
+            *nested = stmt->while_stmt.body;
+            return i < 1;
         case STMT_DOWHILE:
-            check_gotos_stmt(stmt->dowhile_stmt.body);
-            break;
-
+            *nested = stmt->dowhile_stmt.body;
+            return i < 1;
         case STMT_SWITCH:
-            check_gotos_stmt(stmt->switch_stmt.body);
-            break;
-
-        case STMT_CASE:
-            check_gotos_items(stmt->case_stmt.items);
-            break;
-
-        case STMT_DEFAULT:
-            check_gotos_items(stmt->default_stmt.items);
-            break;
-
-        case STMT_BLOCK:
-            check_gotos_items(stmt->block.items);
-            break;
-
+            *nested = stmt->switch_stmt.body;
+            return i < 1;
+        case STMT_LABEL:
+            *nested = stmt->label_stmt.stmt;
+            return i < 1;
         default:
-            break;
+            return false;
     }
 }
 
-static void resolve_break_continue_stmt(struct stmt *stmt, struct loop_switch_ctx *ctx);
-static void resolve_break_continue_items(struct block_item *item, struct loop_switch_ctx *ctx)
+static bool walk_next(struct stmt_walk *walk)
 {
-    for (struct block_item *i = item; i; i = i->next)
-        if (i->kind == BLOCK_ITEM_STMT)
-            resolve_break_continue_stmt(i->stmt, ctx);
-}
+    if (walk->root) {
+        walk_push(walk, walk->root);
+        walk->root = NULL;
+        return true;
+    }
 
-static void resolve_break_continue_stmt(struct stmt *stmt, struct loop_switch_ctx *ctx)
-{
-    if (!stmt)
-        return;
+    // Popped only now, the walker could look at the frame it was leaving
+    if (walk->event == WALK_LEAVE)
+        walk->count--;
 
-    switch (stmt->kind) {
-        case STMT_FOR: {
-            char *b_label = make_unique("b.for", 5);     
-            char *c_label = make_unique("c.for", 5);     
-            stmt->for_stmt.break_label = b_label;
-            stmt->for_stmt.continue_label = c_label;
-
-            struct loop_switch_ctx new_ctx = {
-                .break_label = b_label,
-                .continue_label = c_label
-            };
-            resolve_break_continue_stmt(stmt->for_stmt.body, &new_ctx);
-            break;
-        }
-
-        case STMT_WHILE: {
-            char *b_label = make_unique("b.while", 7);     
-            char *c_label = make_unique("c.while", 7);     
-            stmt->while_stmt.break_label = b_label;
-            stmt->while_stmt.continue_label = c_label;
-
-            struct loop_switch_ctx new_ctx = {
-                .break_label = b_label,
-                .continue_label = c_label
-            };
-            resolve_break_continue_stmt(stmt->while_stmt.body, &new_ctx);
-            break;
-        }
+    while (walk->count) {
+        struct walk_frame *frame = walk_frame(walk);
+        struct stmt *nested;
 
-        case STMT_DOWHILE: {
-            char *b_label = make_unique("b.dowhile", 9);     
-            char *c_label = make_unique("c.dowhile", 9);     
-            stmt->dowhile_stmt.break_label = b_label;
-            stmt->dowhile_stmt.continue_label = c_label;
-
-            struct loop_switch_ctx new_ctx = {
-                .break_label = b_label,
-                .continue_label = c_label
-            };
-            resolve_break_continue_stmt(stmt->dowhile_stmt.body, &new_ctx);
-            break;
-        }
+        if (frame->item) {
+            struct block_item *item = frame->item;
+            frame->item = item->next;
 
-        case STMT_SWITCH: {
-            char *b_label = make_unique("b.switch", 8);     
-            stmt->switch_stmt.break_label = b_label;
+            if (item->kind == BLOCK_ITEM_DECL) {
+                walk->event = WALK_DECLS;
+                walk->decls = item->decls;
+                return true;
+            }
 
-            struct loop_switch_ctx new_ctx = {
-                .break_label = b_label,
-                .continue_label = ctx ? ctx->continue_label : NULL
-            };
-            resolve_break_continue_stmt(stmt->switch_stmt.body, &new_ctx);
-            break;
+            if (item->stmt) {
+                walk_push(walk, item->stmt);
+                return true;
+            }
+            continue;
+        } else if (next_nested(frame, &nested)) {
+            if (nested) {
+                walk_push(walk, nested);
+                return true;
+            }
+            continue;
         }
 
-        case STMT_BREAK:
-            if (!ctx || !ctx->break_label)
-                error(&stmt->tok, "'break' statement outside of loop or switch");
-            else
-                stmt->break_stmt.target_label = ctx->break_label;
-            break;
-        
-        case STMT_CONTINUE:
-            if (!ctx || !ctx->continue_label)
-                error(&stmt->tok, "'continue' statement outside of loop");
-            else
-                stmt->continue_stmt.target_label = ctx->continue_label;
-            break;
-
-        case STMT_IF:
-            resolve_break_continue_stmt(stmt->if_stmt.then_stmt, ctx);
-            resolve_break_continue_stmt(stmt->if_stmt.else_stmt, ctx);
-            break;
-
-        case STMT_LABEL:
-            resolve_break_continue_stmt(stmt->label_stmt.stmt, ctx);
-            break;
-
-        case STMT_CASE:
-            resolve_break_continue_items(stmt->case_stmt.items, ctx);
-            break;
-
-        case STMT_DEFAULT:
-            resolve_break_continue_items(stmt->default_stmt.items, ctx);
-            break;
-
-        case STMT_BLOCK:
-            resolve_break_continue_items(stmt->block.items, ctx);
-            break;
-
-        default:
-            break;
+        walk->event = WALK_LEAVE;
+        walk->stmt = frame->stmt;
+        return true;
     }
-}
 
-static void check_case_placement_stmt(struct stmt *stmt, int switch_depth);
-static void check_case_placement_items(struct block_item *item, int switch_depth)
-{
-    for (struct block_item *i = item; i; i = i->next)
-        if (i->kind == BLOCK_ITEM_STMT)
-            check_case_placement_stmt(i->stmt, switch_depth);
+    return false;
 }
 
-static void check_case_placement_stmt(struct stmt *stmt, int switch_depth)
+static int break_label_of(struct stmt *stmt)
 {
-    if (!stmt)
-        return;
-
     switch (stmt->kind) {
-        case STMT_CASE:
-            if (switch_depth == 0)
-                error(&stmt->tok, "'case' label outside of switch");
-
-            check_case_placement_items(stmt->case_stmt.items, switch_depth);
-            break;
-
-        case STMT_DEFAULT:
-            if (switch_depth == 0)
-                error(&stmt->tok, "'default' label outside of switch");
-
-            check_case_placement_items(stmt->default_stmt.items,
-                                       switch_depth);
-            break;
-
-        case STMT_SWITCH:
-            check_case_placement_stmt(stmt->switch_stmt.body,
-                                      switch_depth + 1);
-            break;
-
-        case STMT_IF:
-            check_case_placement_stmt(stmt->if_stmt.then_stmt,
-                                      switch_depth);
-            check_case_placement_stmt(stmt->if_stmt.else_stmt,
-                                      switch_depth);
-            break;
-
-        case STMT_BLOCK:
-            check_case_placement_items(stmt->block.items, switch_depth);
-            break;
-
-        case STMT_FOR:
-            check_case_placement_stmt(stmt->for_stmt.body, switch_depth);
-            break;
-
-        case STMT_WHILE:
-            check_case_placement_stmt(stmt->while_stmt.body, switch_depth);
-            break;
-
-        case STMT_DOWHILE:
-            check_case_placement_stmt(stmt->dowhile_stmt.body,
-                                      switch_depth);
-            break;
-
-        case STMT_LABEL:
-            check_case_placement_stmt(stmt->label_stmt.stmt, switch_depth);
-            break;
-
-        default:
-            break;
+        case STMT_FOR:      return stmt->for_stmt.break_label;
+        case STMT_WHILE:    return stmt->while_stmt.break_label;
+        case STMT_DOWHILE:  return stmt->dowhile_stmt.break_label;
+        default:            return stmt->switch_stmt.break_label;
     }
 }
 
-static void resolve_cases_stmt(struct stmt *stmt, struct switch_annotation *ann);
-static void resolve_cases_items(struct block_item *item, struct switch_annotation *ann)
+static int continue_label_of(struct stmt *stmt)
 {
-    for (struct block_item *i = item; i; i = i->next)
-        if (i->kind == BLOCK_ITEM_STMT)
-            resolve_cases_stmt(i->stmt, ann);
+    switch (stmt->kind) {
+        case STMT_FOR:      return stmt->for_stmt.continue_label;
+        case STMT_WHILE:    return stmt->while_stmt.continue_label;
+        default:            return stmt->dowhile_stmt.continue_label;
+    }
 }
 
 static void append_case_entry(struct switch_annotation *ann, struct stmt *node)
@@ -1107,151 +948,267 @@ static void append_case_entry(struct switch_annotation *ann, struct stmt *node)
     *tail = entry;
 }
 
-static void resolve_cases_stmt(struct stmt *stmt, struct switch_annotation *ann)
+/*
+ * Adds a case or default to the annotation of its switch. After an
+ * invalid one, the labels in the statements it covers are left out.
+ */
+static void resolve_case(struct walk_frame *frame, struct switch_annotation *ann)
 {
-    if (!stmt)
-        return;
-
-    switch (stmt->kind) {
-        case STMT_CASE: {
-            /*
-             * TODO: This should calculate the constant from case value expr
-             */
-            if (stmt->case_stmt.value->kind != EXPR_INT_LITERAL) {
-                error(&stmt->tok, "'case' must be an integer constant");
-                return;
-            }
-
-            long value = stmt->case_stmt.value->int_value;
-
-            for (struct case_entry *e = ann->cases; e; e = e->next) {
-                if (e->node->kind != STMT_CASE)
-                    continue;
+    struct stmt *stmt = frame->stmt;
 
-                if (e->node->case_stmt.value->int_value == value) {
-                    error(&stmt->tok, "Duplicate case value in switch");
-                    return;
-                }
-            }
-
-            stmt->case_stmt.label = make_unique("case", 4);
-            append_case_entry(ann, stmt);
+    if (frame->cases_off)
+        return;
 
-            resolve_cases_items(stmt->case_stmt.items, ann);
-            break;
+    if (stmt->kind == STMT_DEFAULT) {
+        if (ann->default_node) {
+            error(stmt->tok, "Duplicate default labels in switch");
+            frame->cases_off = true;
+            return;
         }
 
-        case STMT_DEFAULT: {
-            if (ann->default_node) {
-                error(&stmt->tok, "Duplicate default labels in switch");
-                return;
-            }
+        stmt->default_stmt.label = new_label();
+        ann->default_node = stmt;
+        append_case_entry(ann, stmt);
+        return;
+    }
 
-            stmt->default_stmt.label = make_unique("default", 7);
-            ann->default_node = stmt;
-            append_case_entry(ann, stmt);
+    /*
+     * TODO: This should calculate the constant from case value expr
+     */
+    if (stmt->case_stmt.value->kind != EXPR_INT_LITERAL) {
+        error(stmt->tok, "'case' must be an integer constant");
+        frame->cases_off = true;
+        return;
+    }
 
-            resolve_cases_items(stmt->default_stmt.items, ann);
-            break;
+    long value = stmt->case_stmt.value->int_value;
+
+    for (struct case_entry *e = ann->cases; e; e = e->next) {
+        if (e->node->kind == STMT_CASE && e->node->case_stmt.value->int_value == value) {
+            error(stmt->tok, "Duplicate case value in switch");
+            frame->cases_off = true;
+            return;
         }
+    }
 
-        case STMT_SWITCH:
-            /*
-             * Nested switch owns its own cases.
-             */
-            break;
+    stmt->case_stmt.label = new_label();
+    append_case_entry(ann, stmt);
+}
 
-        case STMT_IF:
-            resolve_cases_stmt(stmt->if_stmt.then_stmt, ann);
-            resolve_cases_stmt(stmt->if_stmt.else_stmt, ann);
-            break;
+static void resolve_break(struct stmt_walk *walk, struct stmt *stmt)
+{
+    struct walk_frame *frame = walk_frame(walk);
 
-        case STMT_FOR:
-            resolve_cases_stmt(stmt->for_stmt.body, ann);
-            break;
+    // The innermost of the two
+    int target = frame->enclosing_loop > frame->enclosing_switch ?
+                 frame->enclosing_loop : frame->enclosing_switch;
 
-        case STMT_WHILE:
-            resolve_cases_stmt(stmt->while_stmt.body, ann);
-            break;
+    if (target < 0)
+        error(stmt->tok, "'break' statement outside of loop or switch");
+    else
+        stmt->break_stmt.target_label = break_label_of(walk->frames[target].stmt);
+}
 
-        case STMT_DOWHILE:
-            resolve_cases_stmt(stmt->dowhile_stmt.body, ann);
-            break;
+static void resolve_continue(struct stmt_walk *walk, struct stmt *stmt)
+{
+    struct walk_frame *frame = walk_frame(walk);
 
-        case STMT_LABEL:
-            resolve_cases_stmt(stmt->label_stmt.stmt, ann);
-            break;
+    if (frame->enclosing_loop < 0)
+        error(stmt->tok, "'continue' statement outside of loop");
+    else
+        stmt->continue_stmt.target_label =
+            continue_label_of(walk->frames[frame->enclosing_loop].stmt);
+}
 
-        case STMT_BLOCK:
-            resolve_cases_items(stmt->block.items, ann);
-            break;
+static void define_label(struct stmt *stmt)
+{
+    tok_id tok = stmt->label_stmt.name;
 
-        default:
-            break;
+    if (atommap_get(&labels, tok_atom(tok))) {
+        error(tok, "Duplicate label definition");
+        return;
     }
+
+    stmt->label_stmt.label = new_label();
+    atommap_set(&labels, tok_atom(tok), stmt);
 }
 
-static void resolve_switches_stmt(struct stmt *stmt);
-static void resolve_switches_items(struct block_item *item)
+// False if the label isn't defined yet
+static bool resolve_goto(struct stmt *stmt)
 {
-    for (struct block_item *i = item; i; i = i->next)
-        if (i->kind == BLOCK_ITEM_STMT)
-            resolve_switches_stmt(i->stmt);
+    struct stmt *target = atommap_get(&labels, tok_atom(stmt->goto_stmt.label));
+    if (!target)
+        return false;
+
+    stmt->goto_stmt.target_label = target->label_stmt.label;
+    return true;
 }
 
-static void resolve_switches_stmt(struct stmt *stmt)
+/*
+ * Checks a function body in one walk: types, scopes, labels, loop and
+ * switch targets and case labels. Its block shares the scope of the
+ * parameters, every other block and for loop has a scope of its own.
+ * Only gotos to labels further down are left for after the walk.
+ */
+static void analyze_body(struct stmt *body)
 {
-    if (!stmt)
-        return;
-    
-    switch (stmt->kind) {
-        case STMT_SWITCH: {
-            struct switch_annotation *ann = calloc(1, sizeof(*ann));
+    struct stmt_walk walk;
+    walk_begin(&walk, body);
+
+    struct stmt **forward_gotos = NULL;
+    int forward_goto_count = 0;
+    int forward_goto_capacity = 0;
+
+    while (walk_next(&walk)) {
+        if (walk.event == WALK_DECLS) {
+            analyze_decl_list(walk.decls);
+            continue;
+        }
 
-            resolve_cases_stmt(stmt->switch_stmt.body, ann);
+        struct stmt *stmt = walk.stmt;
+        struct walk_frame *frame = walk_frame(&walk);
 
-            stmt->switch_stmt.annotation = ann;
+        if (walk.event == WALK_LEAVE) {
+            if (stmt->kind == STMT_FOR || (stmt->kind == STMT_BLOCK && stmt != body))
+                scope_pop(frame->mark);
 
-            // Nested switches
-            resolve_switches_stmt(stmt->switch_stmt.body);
-            break;
+            if (stmt->kind == STMT_DOWHILE) {
+                analyze_expr(stmt->dowhile_stmt.condition);
+                require_int_expression(stmt->dowhile_stmt.condition,
+                                        "Do-while condition must have type int");
+            }
+            continue;
         }
-        case STMT_IF:
-            resolve_switches_stmt(stmt->if_stmt.then_stmt);
-            resolve_switches_stmt(stmt->if_stmt.else_stmt);
-            break;
 
-        case STMT_BLOCK:
-            resolve_switches_items(stmt->block.items);
-            break;
+        switch (stmt->kind) {
+            case STMT_NULL:
+                break;
 
-        case STMT_FOR:
-            resolve_switches_stmt(stmt->for_stmt.body);
-            break;
+            case STMT_BREAK:
+                resolve_break(&walk, stmt);
+                break;
 
-        case STMT_WHILE:
-            resolve_switches_stmt(stmt->while_stmt.body);
-            break;
+            case STMT_CONTINUE:
+                resolve_continue(&walk, stmt);
+                break;
 
-        case STMT_DOWHILE:
-            resolve_switches_stmt(stmt->dowhile_stmt.body);
-            break;
+            case STMT_LABEL:
+                define_label(stmt);
+                break;
 
-        case STMT_CASE:
-            resolve_switches_items(stmt->case_stmt.items);
-            break;
+            case STMT_GOTO:
+                if (resolve_goto(stmt))
+                    break;
 
-        case STMT_DEFAULT:
-            resolve_switches_items(stmt->default_stmt.items);
-            break;
+                if (forward_goto_count == forward_goto_capacity) {
+                    forward_goto_capacity = forward_goto_capacity ? forward_goto_capacity * 2 : 16;
+                    forward_gotos = realloc(forward_gotos,
+                                            forward_goto_capacity * sizeof(struct stmt *));
+                }
+                forward_gotos[forward_goto_count++] = stmt;
+                break;
 
-        case STMT_LABEL:
-            resolve_switches_stmt(stmt->label_stmt.stmt);
-            break;
+            case STMT_IF:
+                analyze_expr(stmt->if_stmt.condition);
+                break;
 
-        default:
-            break;
+            case STMT_EXPR:
+                analyze_expr(stmt->expr_stmt.expr);
+                break;
+
+            case STMT_RETURN: {
+                struct type *ret_ty = current_function->type->func.return_type;
+
+                if (stmt->return_stmt.expr)
+                    analyze_expr(stmt->return_stmt.expr);
+
+                if (type_is_void(ret_ty)) {
+                    if (stmt->return_stmt.expr)
+                        error(stmt->tok, "'void' function should not return a value");
+                } else {
+                    if (!stmt->return_stmt.expr)
+                        error(stmt->tok, "Non-void function should return a value");
+                    else if (!types_compatible(ret_ty, stmt->return_stmt.expr->type))
+                        error(stmt->tok, "Return type mismatch");
+                }
+                break;
+            }
+
+            case STMT_FOR:
+                stmt->for_stmt.break_label = new_label();
+                stmt->for_stmt.continue_label = new_label();
+                frame->mark = scope_push();
+
+                if (stmt->for_stmt.init) {
+                    if (stmt->for_stmt.init->is_decl) {
+                        validate_for_init_decls(stmt->for_stmt.init->decls);
+                        analyze_decl_list(stmt->for_stmt.init->decls);
+                    } else {
+                        analyze_expr(stmt->for_stmt.init->expr);
+                    }
+                }
+
+                if (stmt->for_stmt.condition) {
+                    analyze_expr(stmt->for_stmt.condition);
+                    require_int_expression(stmt->for_stmt.condition,
+                            "For condition must have type int");
+                }
+
+                if (stmt->for_stmt.post)
+                    analyze_expr(stmt->for_stmt.post);
+                break;
+
+            case STMT_WHILE:
+                stmt->while_stmt.break_label = new_label();
+                stmt->while_stmt.continue_label = new_label();
+                analyze_expr(stmt->while_stmt.condition);
+                require_int_expression(stmt->while_stmt.condition,
+                                        "While condition must have type int");
+                break;
+
+            case STMT_DOWHILE:
+                stmt->dowhile_stmt.break_label = new_label();
+                stmt->dowhile_stmt.continue_label = new_label();
+                break;
+
+            case STMT_SWITCH:
+                stmt->switch_stmt.break_label = new_label();
+                stmt->switch_stmt.annotation = calloc(1, sizeof(struct switch_annotation));
+                analyze_expr(stmt->switch_stmt.condition);
+                require_int_expression(stmt->switch_stmt.condition,
+                                        "Switch condition must have type int");
+                break;
+
+            case STMT_CASE:
+                analyze_expr(stmt->case_stmt.value);
+                require_int_expression(stmt->case_stmt.value,
+                                        "Case value must have type int");
+                // Fall through
+            case STMT_DEFAULT:
+                if (frame->enclosing_switch < 0) {
+                    error(stmt->tok, stmt->kind == STMT_CASE ?
+                                     "'case' label outside of switch" :
+                                     "'default' label outside of switch");
+                    break;
+                }
+
+                resolve_case(frame, walk.frames[frame->enclosing_switch].stmt->switch_stmt.annotation);
+                break;
+
+            case STMT_BLOCK:
+                if (stmt != body)
+                    frame->mark = scope_push();
+                break;
+        }
     }
+
+    walk_end(&walk);
+
+    for (int i = 0; i < forward_goto_count; i++)
+        if (!resolve_goto(forward_gotos[i]))
+            error(forward_gotos[i]->goto_stmt.label, "Use of undeclared label");
+
+    free(forward_gotos);
 }
 
 static void analyze_function_body(struct decl *fn)
@@ -1259,19 +1216,18 @@ static void analyze_function_body(struct decl *fn)
     if (!fn->func.body)
         return;
 
-    hashmap_init(&labels);
+    atommap_init(&labels);
+    label_count = 0;
+    local_count = 0;
 
-    collect_labels_stmt(fn->func.body);
-
-    struct scope *old_scope = current_scope;
     struct decl *old_function = current_function;
 
-    current_scope = scope_push(old_scope);
+    int mark = scope_push();
     current_function = fn;
 
     for (struct decl *p = fn->func.params; p; p = p->next) {
-        if (!p->name.start) {
-            error(&fn->name, "Function definition parameter needs a name");
+        if (p->name == NO_TOKEN) {
+            error(fn->name, "Function definition parameter needs a name");
             continue;
         }
 
@@ -1279,18 +1235,15 @@ static void analyze_function_body(struct decl *fn)
         declare_symbol(p);
     }
 
-    analyze_block(fn->func.body->block.items, false);
+    analyze_body(fn->func.body);
 
-    check_gotos_stmt(fn->func.body);
-    check_case_placement_stmt(fn->func.body, 0);
-    resolve_break_continue_stmt(fn->func.body, NULL);
-    resolve_switches_stmt(fn->func.body);
+    fn->func.label_count = label_count;
+    fn->func.local_count = local_count;
 
-    scope_pop(current_scope);
-    current_scope = old_scope;
+    scope_pop(mark);
     current_function = old_function;
 
-    hashmap_free(&labels);
+    atommap_free(&labels);
 }
 
 struct ast_program *sema_analysis(struct ast_program *program)
@@ -1301,11 +1254,10 @@ struct ast_program *sema_analysis(struct ast_program *program)
     all_symbols = NULL;
     all_symbols_tail = NULL;
 
-    hashmap_init(&internal_symbols);
-    hashmap_init(&external_symbols);
+    atommap_init(&internal_symbols);
+    atommap_init(&external_symbols);
 
-    global_scope = scope_push(NULL);
-    current_scope = global_scope;
+    scope_depth = 0;
     current_function = NULL;
 
     /*
@@ -1324,8 +1276,11 @@ struct ast_program *sema_analysis(struct ast_program *program)
             analyze_function_body(d);
     }
 
-    hashmap_free(&internal_symbols);
-    hashmap_free(&external_symbols);
+    // The next file starts with an empty file scope
+    unbind_to(0);
+
+    atommap_free(&internal_symbols);
+    atommap_free(&external_symbols);
     
     return had_error ? NULL : program;
 }
@@ -13,8 +13,7 @@ enum symbol_kind {
 struct symbol {
     enum symbol_kind kind;
 
-    const char *name;
-    int name_len;
+    atom name;
 
     struct type *ty;
     struct decl *decl;
@@ -28,7 +27,8 @@ struct symbol {
     bool has_static_init;
     long static_init;
 
-    char *ir_name;
+    char *ir_name;      // Functions and static objects
+    int local;          // Automatic objects, see ast.h
 
     struct symbol *next;
 };
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "ast.h"
 #include "type.h"
@@ -25,14 +26,85 @@ struct type *type_int(void)
     return &builtin_int;
 }
 
+/*
+ * Function types are interned: every declaration of the same signature
+ * gets the type the first one made, whose parameter list it keeps. As
+ * all types are then canonical, a signature is identified by the
+ * addresses of its return and parameter types.
+ */
+static struct type **function_types;   // Open addressing, NULL is empty
+static uint32_t function_types_capacity;
+static uint32_t function_types_count;
+
+static uint32_t signature_hash(struct type *return_type, struct decl *params, bool has_prototype)
+{
+    uint64_t hash = (uintptr_t)return_type ^ has_prototype;
+
+    for (struct decl *p = params; p; p = p->next)
+        hash = (hash ^ (uintptr_t)p->type) * 0x100000001b3u;
+
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static bool same_signature(struct type *ty, struct type *return_type, struct decl *params,
+                           int param_count, bool has_prototype)
+{
+    if (ty->func.return_type != return_type || ty->func.has_prototype != has_prototype ||
+        ty->func.param_count != param_count)
+        return false;
+
+    struct decl *p = ty->func.params;
+    for (; p && params; p = p->next, params = params->next)
+        if (p->type != params->type)
+            return false;
+
+    return !p && !params;
+}
+
+static void grow_function_types(void)
+{
+    uint32_t capacity = function_types_capacity ? function_types_capacity * 2 : 256;
+    struct type **table = calloc(capacity, sizeof(struct type *));
+
+    for (uint32_t i = 0; i < function_types_capacity; i++) {
+        struct type *ty = function_types[i];
+        if (!ty)
+            continue;
+
+        uint32_t idx = signature_hash(ty->func.return_type, ty->func.params,
+                                      ty->func.has_prototype) & (capacity - 1);
+        while (table[idx])
+            idx = (idx + 1) & (capacity - 1);
+        table[idx] = ty;
+    }
+
+    free(function_types);
+    function_types = table;
+    function_types_capacity = capacity;
+}
+
 struct type *type_function(struct type *return_type, struct decl *params, int param_count, bool has_prototype)
 {
+    if ((function_types_count + 1) * 2 > function_types_capacity)
+        grow_function_types();
+
+    uint32_t mask = function_types_capacity - 1;
+    uint32_t idx = signature_hash(return_type, params, has_prototype) & mask;
+
+    for (; function_types[idx]; idx = (idx + 1) & mask)
+        if (same_signature(function_types[idx], return_type, params, param_count, has_prototype))
+            return function_types[idx];
+
     struct type *t = calloc(1, sizeof(struct type));
     t->kind = TYPE_FUNCTION;
     t->func.return_type = return_type;
     t->func.params = params;
     t->func.param_count = param_count;
     t->func.has_prototype = has_prototype;
+
+    function_types[idx] = t;
+    function_types_count++;
+
     return t;
 }
 
@@ -56,6 +128,10 @@ bool type_is_object(struct type *ty)
     return ty && ty->kind != TYPE_FUNCTION && ty->kind != TYPE_VOID;
 }
 
+/*
+ * Interned types make this a pointer compare, except for a function
+ * type without a prototype and parameters of such types.
+ */
 bool types_compatible(struct type *a, struct type *b)
 {
     if (a == b)
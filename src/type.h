@@ -34,6 +34,7 @@ struct type {
 
 struct type *type_void(void);
 struct type *type_int(void);
+// The one type of this signature, it keeps the 'params' of its first declaration
 struct type *type_function(struct type *return_type, struct decl *params, int param_count, bool has_prototype);
 struct type *type_composite(struct type *a, struct type *b);
 
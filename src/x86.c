@@ -1,13 +1,19 @@
 /*
  * Tacky IR -> x86-64 Assembly (AT&T Syntax)
  *
- * Phase 1: Convert IR instructions into ASM instructions
+ * Phase 1: Convert IR instructions into ASM instructions by covering
+ *          small expression trees with the cheapest matching tile,
  *          keeps pseudo (temporary) operands
  *
- * Phase 2: Replace every pseudo operand with a stack slot.
- *          Returns total needed stack size
+ * Phase 2: Keep the hottest pseudos in callee-saved registers,
+ *          replace every other pseudo operand with a stack slot.
+ *          Computes the frame layout
  *
- * Phase 3: Function prologue, rewrite any illegal x86 ops.
+ * Phase 3: Rewrite any illegal x86 ops.
+ *
+ * Stack offsets are relative to the frame base, which is where %rbp
+ * points when the frame pointer is kept (return address at 8(base)).
+ * With -fomit-frame-pointer they are rebased onto %rsp at emission.
  */
 #include <alloca.h>
 #include <stdio.h>
@@ -15,14 +21,16 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #include "x86.h"
 #include "ast.h"
 #include "ir.h"
-#include "base/hash_map.h"
+#include "cfg.h"
 
 #define STACK_SLOT_SIZE 4
 #define ARG_REG_COUNT 6
+#define RED_ZONE_SIZE 128
 
 static const enum reg arg_regs[] = {
     REG_DI,
@@ -33,6 +41,15 @@ static const enum reg arg_regs[] = {
     REG_R9
 };
 
+// Lowering never uses these as scratch, so they are free for allocation
+static const enum reg callee_saved_regs[CALLEE_SAVED_COUNT] = {
+    REG_BX,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15
+};
+
 /* Phase 1: Build ASM AST from IR AST */
 
 static enum asm_op convert_unop(enum ir_unary_op op)
@@ -54,7 +71,7 @@ static enum asm_op convert_binop(enum ir_binary_op op)
         case IR_BINOP_BIT_OR:  return ASM_OR;
         case IR_BINOP_BIT_XOR: return ASM_XOR;
         case IR_BINOP_SHL:     return ASM_SHL;
-        case IR_BINOP_SHR:     return ASM_SHR;
+        case IR_BINOP_SHR:     return ASM_SAR;
         default:             return ASM_ADD; // Unreachable
     }
 }
@@ -87,9 +104,9 @@ static struct operand make_stack(int offset)
     return (struct operand){ .type = OPERAND_STACK, .stack = offset };
 }
 
-static struct operand make_pseudo(const char *name)
+static struct operand make_pseudo(int pseudo)
 {
-    return (struct operand){ .type = OPERAND_PSEUDO, .pseudo = name };
+    return (struct operand){ .type = OPERAND_PSEUDO, .pseudo = pseudo };
 }
 
 static struct operand make_data(const char *name)
@@ -145,6 +162,33 @@ static struct asm_instr *make_idiv(struct operand oper)
     return instr;
 }
 
+static struct asm_instr *make_imul_wide(struct operand oper)
+{
+    struct asm_instr *instr = new_instr(ASM_IMUL_WIDE);
+    instr->imul_wide.oper = oper;
+    return instr;
+}
+
+static struct asm_instr *make_lea(enum reg base, enum reg index, int scale,
+                                  struct operand dst)
+{
+    struct asm_instr *instr = new_instr(ASM_LEA);
+    instr->lea.base = make_reg(base);
+    instr->lea.index = make_reg(index);
+    instr->lea.has_base = true;
+    instr->lea.has_index = true;
+    instr->lea.scale = scale;
+    instr->lea.dst = dst;
+    return instr;
+}
+
+static struct asm_instr *make_test(struct operand oper)
+{
+    struct asm_instr *instr = new_instr(ASM_TEST);
+    instr->test.oper = oper;
+    return instr;
+}
+
 static struct asm_instr *make_jmp(int label_id)
 {
     struct asm_instr *instr = new_instr(ASM_JMP);
@@ -204,6 +248,27 @@ static bool is_memory_operand(struct operand op)
     return op.type == OPERAND_STACK || op.type == OPERAND_DATA;
 }
 
+static bool same_operand(struct operand a, struct operand b)
+{
+    if (a.type != b.type)
+        return false;
+
+    switch (a.type) {
+        case OPERAND_IMM:    return a.imm == b.imm;
+        case OPERAND_REG:    return a.reg == b.reg;
+        case OPERAND_STACK:  return a.stack == b.stack;
+        case OPERAND_DATA:   return !strcmp(a.data, b.data);
+        case OPERAND_PSEUDO: return a.pseudo == b.pseudo;
+    }
+
+    return false;
+}
+
+static bool is_shift_op(enum asm_op op)
+{
+    return op == ASM_SHL || op == ASM_SHR || op == ASM_SAR;
+}
+
 // Convert 'ir_val' to ASM operand (immediate or pseudo)
 static struct operand convert_val(struct ir_value val)
 {
@@ -211,12 +276,9 @@ static struct operand convert_val(struct ir_value val)
         return make_imm(val.constant);
 
     if (val.kind == IR_VALUE_PSEUDO)
-        return make_pseudo(val.name);
-
-    if (val.kind == IR_VALUE_STATIC)
-        return make_data(val.name);
+        return make_pseudo(val.pseudo);
 
-    return make_pseudo(val.name);
+    return make_data(val.name);
 }
 
 static void append_instr(struct asm_function *fn, struct asm_instr *instr)
@@ -256,6 +318,331 @@ static struct asm_instr *replace_instr(struct asm_function *fn,
     return last_new;
 }
 
+/*
+ * Strength reduction for multiplication, division and remainder
+ * by a constant. Every lowering reads 'src' fully before it writes
+ * 'dst', so compound assignments (x = x / 7) where they alias are safe.
+ */
+
+// Returns k if 'value' is 2^k, -1 otherwise
+static int log2_exact(long value)
+{
+    if (value <= 0 || (value & (value - 1)) != 0)
+        return -1;
+
+    int k = 0;
+    while ((1L << k) != value)
+        k++;
+
+    return k;
+}
+
+/*
+ * Signed magic number for division by 'd' (Hacker's Delight, 10-1).
+ * q = (hi32(M * n) [+/- n]) >> s, plus one if the result is negative.
+ * 'd' must not be 0, 1, -1 or INT_MIN.
+ */
+static void signed_div_magic(int d, int *magic, int *shift)
+{
+    const unsigned two31 = 0x80000000u;
+
+    unsigned ad = d < 0 ? -(unsigned)d : (unsigned)d;
+    unsigned t = two31 + ((unsigned)d >> 31);
+    unsigned anc = t - 1 - t % ad;  // Absolute value of nc
+    int p = 31;
+
+    unsigned q1 = two31 / anc;
+    unsigned r1 = two31 - q1 * anc;
+    unsigned q2 = two31 / ad;
+    unsigned r2 = two31 - q2 * ad;
+    unsigned delta;
+
+    do {
+        p++;
+
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = (int)(q2 + 1);
+    if (d < 0)
+        *magic = -*magic;
+    *shift = p - 32;
+}
+
+static bool fold_constant_binary(enum ir_binary_op op, int lhs, int rhs, int *result)
+{
+    switch (op) {
+        case IR_BINOP_MUL:
+            *result = (int)((unsigned)lhs * (unsigned)rhs);
+            return true;
+        case IR_BINOP_DIV:
+        case IR_BINOP_REM:
+            // Leave traps (x / 0, INT_MIN / -1) to run time
+            if (rhs == 0 || (lhs == -2147483647 - 1 && rhs == -1))
+                return false;
+            *result = op == IR_BINOP_DIV ? lhs / rhs : lhs % rhs;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * dst = src * c
+ *   c == 2^k           -> shll $k
+ *   c == 3, 5, 9       -> leal (%rax,%rax,c-1)
+ *   c == {3,5,9} * 2^k -> leal + shll $k
+ *   c < 0              -> same on |c|, then negl
+ * Anything else keeps imull $c.
+ */
+static bool lower_mul_const(struct asm_function *fn, struct operand src,
+                            int c, struct operand dst)
+{
+    struct operand ax = make_reg(REG_AX);
+
+    if (c == 0) {
+        append_instr(fn, make_mov(make_imm(0), dst));
+        return true;
+    }
+
+    if (c == -2147483647 - 1)
+        return false;
+
+    bool negate = c < 0;
+    int abs_c = negate ? -c : c;
+
+    int k = log2_exact(abs_c);
+    int lea_factor = 0;
+
+    if (k < 0) {
+        // Split off a power of two and look for a lea factor
+        int shift = 0;
+        int rest = abs_c;
+        while ((rest & 1) == 0) {
+            rest >>= 1;
+            shift++;
+        }
+
+        if (rest != 3 && rest != 5 && rest != 9)
+            return false;
+
+        lea_factor = rest;
+        k = shift;
+    }
+
+    append_instr(fn, make_mov(src, ax));
+
+    if (lea_factor)
+        append_instr(fn, make_lea(REG_AX, REG_AX, lea_factor - 1, ax));
+    if (k > 0)
+        append_instr(fn, make_binary(ASM_SHL, make_imm(k), ax));
+    if (negate)
+        append_instr(fn, make_unary(ASM_NEG, ax));
+
+    append_instr(fn, make_mov(ax, dst));
+    return true;
+}
+
+/*
+ * Signed division/remainder by |d| == 2^k, rounding toward zero:
+ *   bias = (src >> 31) >>> (32 - k)     (2^k - 1 for negative src)
+ *   q = (src + bias) >> k               (negated for negative d)
+ *   r = src - ((src + bias) & -2^k)
+ */
+static void lower_div_pow2(struct asm_function *fn, enum ir_binary_op op,
+                           struct operand src, int d, int k,
+                           struct operand dst)
+{
+    struct operand ax = make_reg(REG_AX);
+    struct operand dx = make_reg(REG_DX);
+
+    append_instr(fn, make_mov(src, ax));
+    append_instr(fn, make_mov(ax, dx));
+
+    if (k > 1)
+        append_instr(fn, make_binary(ASM_SAR, make_imm(31), dx));
+    append_instr(fn, make_binary(ASM_SHR, make_imm(32 - k), dx));
+    append_instr(fn, make_binary(ASM_ADD, dx, ax));
+
+    if (op == IR_BINOP_DIV) {
+        append_instr(fn, make_binary(ASM_SAR, make_imm(k), ax));
+        if (d < 0)
+            append_instr(fn, make_unary(ASM_NEG, ax));
+        append_instr(fn, make_mov(ax, dst));
+        return;
+    }
+
+    append_instr(fn, make_binary(ASM_AND, make_imm(-(1 << k)), ax));
+    append_instr(fn, make_mov(src, dx));
+    append_instr(fn, make_binary(ASM_SUB, ax, dx));
+    append_instr(fn, make_mov(dx, dst));
+}
+
+/*
+ * Signed division/remainder by any other constant:
+ *   movl $M, %eax
+ *   imull src          <- %edx = hi32(M * src)
+ *   addl/subl src, %edx  (when the signs of M and d differ)
+ *   sarl $s, %edx
+ *   %edx += %edx >>> 31   <- round toward zero
+ * Remainder is src - q * d.
+ */
+static void lower_div_magic(struct asm_function *fn, enum ir_binary_op op,
+                            struct operand src, int d, struct operand dst)
+{
+    struct operand ax = make_reg(REG_AX);
+    struct operand dx = make_reg(REG_DX);
+
+    int magic, shift;
+    signed_div_magic(d, &magic, &shift);
+
+    append_instr(fn, make_mov(make_imm(magic), ax));
+    append_instr(fn, make_imul_wide(src));
+
+    if (d > 0 && magic < 0)
+        append_instr(fn, make_binary(ASM_ADD, src, dx));
+    else if (d < 0 && magic > 0)
+        append_instr(fn, make_binary(ASM_SUB, src, dx));
+
+    if (shift > 0)
+        append_instr(fn, make_binary(ASM_SAR, make_imm(shift), dx));
+
+    append_instr(fn, make_mov(dx, ax));
+    append_instr(fn, make_binary(ASM_SHR, make_imm(31), ax));
+    append_instr(fn, make_binary(ASM_ADD, ax, dx));
+
+    if (op == IR_BINOP_DIV) {
+        append_instr(fn, make_mov(dx, dst));
+        return;
+    }
+
+    append_instr(fn, make_binary(ASM_IMUL, make_imm(d), dx));
+    append_instr(fn, make_mov(src, ax));
+    append_instr(fn, make_binary(ASM_SUB, dx, ax));
+    append_instr(fn, make_mov(ax, dst));
+}
+
+static bool lower_div_const(struct asm_function *fn, enum ir_binary_op op,
+                            struct operand src, int d, struct operand dst)
+{
+    if (d == 0 || d == -2147483647 - 1)
+        return false;
+
+    if (d == 1 || d == -1) {
+        if (op == IR_BINOP_REM) {
+            append_instr(fn, make_mov(make_imm(0), dst));
+            return true;
+        }
+
+        append_instr(fn, make_mov(src, dst));
+        if (d == -1)
+            append_instr(fn, make_unary(ASM_NEG, dst));
+        return true;
+    }
+
+    int k = log2_exact(d < 0 ? -(long)d : d);
+    if (k > 0)
+        lower_div_pow2(fn, op, src, d, k, dst);
+    else
+        lower_div_magic(fn, op, src, d, dst);
+
+    return true;
+}
+
+static void lower_call(struct asm_function *fn, struct ir_instr *instr)
+{
+    int arg_count = instr->call.arg_count;
+
+    int stack_arg_count = 0;
+    if (arg_count > ARG_REG_COUNT)
+        stack_arg_count = arg_count - ARG_REG_COUNT;
+
+    /*
+     * Keep the stack 16-byte aligned before the call.
+     *
+     * At this point stack is 16-byte aligned.
+     * If we push uneven number of stack args (8 byte)
+     * align to 16 byte again.
+     */
+    int padding = 0;
+    if (stack_arg_count % 2 != 0)
+        padding = 8;
+
+    if (padding)
+        append_instr(fn, make_alloc_stack(padding));
+
+    // Push stack args right-to-left
+    for (int i = arg_count - 1; i >= ARG_REG_COUNT; i--) {
+        struct operand arg = convert_val(instr->call.args[i]);
+        append_instr(fn, make_push(arg));
+    }
+
+    for (int i = 0; i < arg_count && i < ARG_REG_COUNT; i++) {
+        struct operand arg = convert_val(instr->call.args[i]);
+        append_instr(fn, make_mov(arg, make_reg(arg_regs[i])));
+    }
+
+    struct asm_instr *call = new_instr(ASM_CALL);
+    call->call.identifier = instr->call.calle;
+    append_instr(fn, call);
+
+    int bytes_to_remove = 8 * stack_arg_count + padding;
+    if (bytes_to_remove)
+        append_instr(fn, make_dealloc_stack(bytes_to_remove));
+}
+
+/*
+ * Sibling call: 'call f -> dst; return dst' where every argument is
+ * passed in a register. The callee reuses our return address, so
+ * the frame is torn down and the call becomes a jmp.
+ */
+static bool is_sibling_call(struct ir_instr *instr)
+{
+    if (instr->kind != IR_INSTR_CALL || !instr->next)
+        return false;
+
+    if (instr->call.arg_count > ARG_REG_COUNT)
+        return false;
+
+    struct ir_instr *ret = instr->next;
+    if (ret->kind != IR_INSTR_RETURN)
+        return false;
+
+    if (!instr->call.has_dst)
+        return !ret->ret.has_value;
+
+    return ret->ret.has_value &&
+           ret->ret.src.kind == IR_VALUE_PSEUDO &&
+           instr->call.dst.kind == IR_VALUE_PSEUDO &&
+           ret->ret.src.pseudo == instr->call.dst.pseudo;
+}
+
+static void lower_sibling_call(struct asm_function *fn, struct ir_instr *instr)
+{
+    for (int i = 0; i < instr->call.arg_count; i++) {
+        struct operand arg = convert_val(instr->call.args[i]);
+        append_instr(fn, make_mov(arg, make_reg(arg_regs[i])));
+    }
+
+    struct asm_instr *jmp = new_instr(ASM_TAIL_CALL);
+    jmp->tail_call.identifier = instr->call.calle;
+    append_instr(fn, jmp);
+}
+
 static void lower_ir_instr(struct asm_function *fn, struct ir_instr *instr)
 {
     switch (instr->kind) {
@@ -269,45 +656,11 @@ static void lower_ir_instr(struct asm_function *fn, struct ir_instr *instr)
             append_instr(fn, make_ret());
             break;
         }
+        case IR_INSTR_COUNT:
+            append_instr(fn, make_unary(ASM_INCQ, convert_val(instr->count.counter)));
+            break;
         case IR_INSTR_CALL: {
-            int arg_count = instr->call.arg_count;
-
-            int stack_arg_count = 0;
-            if (arg_count > ARG_REG_COUNT)
-                stack_arg_count = arg_count - ARG_REG_COUNT;
-
-            /*
-             * Keep the stack 16-byte aligned before the call.
-             *
-             * At this point stack is 16-byte aligned.
-             * If we push uneven number of stack args (8 byte)
-             * align to 16 byte again.
-             */
-            int padding = 0;
-            if (stack_arg_count % 2 != 0)
-                padding = 8;
-
-            if (padding)
-                append_instr(fn, make_alloc_stack(padding));
-
-            // Push stack args right-to-left
-            for (int i = arg_count - 1; i >= ARG_REG_COUNT; i--) {
-                struct operand arg = convert_val(instr->call.args[i]);
-                append_instr(fn, make_push(arg));
-            }
-
-            for (int i = 0; i < arg_count && i < ARG_REG_COUNT; i++) {
-                struct operand arg = convert_val(instr->call.args[i]);
-                append_instr(fn, make_mov(arg, make_reg(arg_regs[i])));
-            }
-
-            struct asm_instr *call = new_instr(ASM_CALL);
-            call->call.identifier = instr->call.calle;
-            append_instr(fn, call);
-
-            int bytes_to_remove = 8 * stack_arg_count + padding;
-            if (bytes_to_remove)
-                append_instr(fn, make_dealloc_stack(bytes_to_remove));
+            lower_call(fn, instr);
 
             if (instr->call.has_dst) {
                 struct operand dst = convert_val(instr->call.dst);
@@ -335,7 +688,8 @@ static void lower_ir_instr(struct asm_function *fn, struct ir_instr *instr)
             // Bitwise NOT, Arithmetic negation
             // movl src, dst
             // op dst
-            append_instr(fn, make_mov(src, dst));
+            if (!same_operand(src, dst))
+                append_instr(fn, make_mov(src, dst));
             append_instr(fn, make_unary(convert_unop(instr->unary.op), dst));
             break;
         }
@@ -345,6 +699,31 @@ static void lower_ir_instr(struct asm_function *fn, struct ir_instr *instr)
             struct operand dst = convert_val(instr->binary.dst);
             enum ir_binary_op op = instr->binary.op;
 
+            int folded;
+            if (src1.type == OPERAND_IMM && src2.type == OPERAND_IMM &&
+                fold_constant_binary(op, src1.imm, src2.imm, &folded)) {
+                append_instr(fn, make_mov(make_imm(folded), dst));
+                break;
+            }
+
+            if (op == IR_BINOP_MUL) {
+                // Multiplication commutes, keep the constant on the right
+                if (src1.type == OPERAND_IMM) {
+                    struct operand tmp = src1;
+                    src1 = src2;
+                    src2 = tmp;
+                }
+
+                if (src2.type == OPERAND_IMM &&
+                    lower_mul_const(fn, src1, src2.imm, dst))
+                    break;
+            }
+
+            if ((op == IR_BINOP_DIV || op == IR_BINOP_REM) &&
+                src2.type == OPERAND_IMM &&
+                lower_div_const(fn, op, src1, src2.imm, dst))
+                break;
+
             if (op == IR_BINOP_DIV || op == IR_BINOP_REM) {
                 /*
                  * Signed division: x86 IDIV divides EDX:EAX by the operand
@@ -375,80 +754,743 @@ static void lower_ir_instr(struct asm_function *fn, struct ir_instr *instr)
                 break;
             }
 
-            if (op == IR_BINOP_BIT_AND ||
-                op == IR_BINOP_BIT_OR ||
-                op == IR_BINOP_BIT_XOR) {
+            if (op == IR_BINOP_SHL || op == IR_BINOP_SHR) {
                 /*
-                 * Bitwise ops route through %eax
-                 * movl src1, %eax
-                 * op src2, %eax
-                 * mov %eax, dst
+                 * Shifts: count must be immediate or %cl, loaded first
+                 * in case it aliases dst
+                 * movl src2, %ecx
+                 * movl src1, dst
+                 * op %cl, dst
                  */
-                struct operand ax = make_reg(REG_AX);
+                struct operand count = src2;
 
-                append_instr(fn, make_mov(src1, ax));
-                append_instr(fn, make_binary(convert_binop(op), src2, ax));
-                append_instr(fn, make_mov(ax, dst));
+                if (src2.type != OPERAND_IMM) {
+                    count = make_reg(REG_CX);
+                    append_instr(fn, make_mov(src2, count));
+                }
+
+                if (!same_operand(src1, dst))
+                    append_instr(fn, make_mov(src1, dst));
+                append_instr(fn, make_binary(convert_binop(op), count, dst));
                 break;
-            } 
+            }
 
-            if (op == IR_BINOP_SHL || op == IR_BINOP_SHR) {
-                // Shifts: count must be immediate or %cx
-                struct operand ax = make_reg(REG_AX);
-                struct operand count;
+            // ADD, SUB, IMUL, AND, OR, XOR
+            // movl src1, dst  <- dropped for compound assignment
+            // op src2, dst
+            if (!same_operand(src1, dst))
+                append_instr(fn, make_mov(src1, dst));
+            append_instr(fn, make_binary(convert_binop(op), src2, dst));
+            break;
+        }
+        case IR_INSTR_JUMP_IF_ZERO: {
+            // if (!cond) goto label -> cmpl $0, val, je
+            struct operand val = convert_val(instr->jump_if_zero.cond);
+
+            append_instr(fn, make_cmp(val, make_imm(0)));
+            append_instr(fn, make_jmpcc(COND_E, instr->jump_if_zero.label_id));
+            break;
+        }
+        case IR_INSTR_JUMP_IF_NOT_ZERO: {
+            // if (cond) goto label -> cmpl $0, val, jne
+            struct operand val = convert_val(instr->jump_if_not_zero.cond);
+
+            append_instr(fn, make_cmp(val, make_imm(0)));
+            append_instr(fn, make_jmpcc(COND_NE, instr->jump_if_not_zero.label_id));
+            break;
+        }
+        case IR_INSTR_JUMP: {
+            append_instr(fn, make_jmp(instr->jump.label_id));
+            break;
+        }
+        case IR_INSTR_COPY: {
+            struct operand src = convert_val(instr->copy.src);
+            struct operand dst = convert_val(instr->copy.dst);
+
+            if (!same_operand(src, dst))
+                append_instr(fn, make_mov(src, dst));
+            break;
+        }
+        case IR_INSTR_LABEL: {
+            append_instr(fn, make_label(instr->label.label_id));
+            break;
+        }
+    }
+}
+
+/*
+ * Instruction selection
+ *
+ * A pseudo that is defined once and read once, by the very next
+ * instruction, is folded into its reader. That gives small expression
+ * trees (a root with at most one child) that are covered by tiles:
+ * each tile matches a tree shape and lowers it, and the cheapest
+ * matching tile wins. A copy out of such a pseudo is a chain rule,
+ * the value is computed straight into the copy's destination.
+ */
+
+// Indexed by pseudo
+struct use_count {
+    int defs;
+    int uses;
+};
+
+struct sel_tree {
+    struct ir_instr root;
+    struct ir_instr child;  // Computes one of root's operands
+    bool has_child;
+};
+
+typedef bool (*tile_fn)(struct asm_function *fn, struct sel_tree *tree);
+
+static void select_tree(struct asm_function *fn, struct sel_tree *tree);
+
+static struct use_count *use_count_of(struct use_count *counts, struct ir_value val)
+{
+    if (val.kind != IR_VALUE_PSEUDO)
+        return NULL;
+
+    return &counts[val.pseudo];
+}
+
+static void count_use(struct use_count *counts, struct ir_value val)
+{
+    struct use_count *c = use_count_of(counts, val);
+    if (c)
+        c->uses++;
+}
+
+// Returns the value 'instr' writes, NULL if it doesn't write one
+static struct ir_value *ir_instr_dst(struct ir_instr *instr)
+{
+    switch (instr->kind) {
+        case IR_INSTR_UNARY:  return &instr->unary.dst;
+        case IR_INSTR_BINARY: return &instr->binary.dst;
+        case IR_INSTR_COPY:   return &instr->copy.dst;
+        case IR_INSTR_CALL:
+            return instr->call.has_dst ? &instr->call.dst : NULL;
+        default:
+            return NULL;
+    }
+}
+
+static void count_uses(struct use_count *counts, struct ir_function *ir_fn)
+{
+    for (struct ir_instr *i = ir_fn->first; i; i = i->next) {
+        switch (i->kind) {
+            case IR_INSTR_RETURN:
+                if (i->ret.has_value)
+                    count_use(counts, i->ret.src);
+                break;
+            case IR_INSTR_UNARY:
+                count_use(counts, i->unary.src);
+                break;
+            case IR_INSTR_BINARY:
+                count_use(counts, i->binary.lhs);
+                count_use(counts, i->binary.rhs);
+                break;
+            case IR_INSTR_COPY:
+                count_use(counts, i->copy.src);
+                break;
+            case IR_INSTR_CALL:
+                for (int a = 0; a < i->call.arg_count; a++)
+                    count_use(counts, i->call.args[a]);
+                break;
+            case IR_INSTR_JUMP_IF_ZERO:
+                count_use(counts, i->jump_if_zero.cond);
+                break;
+            case IR_INSTR_JUMP_IF_NOT_ZERO:
+                count_use(counts, i->jump_if_not_zero.cond);
+                break;
+            default:
+                break;
+        }
+
+        struct ir_value *dst = ir_instr_dst(i);
+        if (dst) {
+            struct use_count *c = use_count_of(counts, *dst);
+            if (c)
+                c->defs++;
+        }
+    }
+}
+
+static bool same_value(struct ir_value a, struct ir_value b)
+{
+    if (a.kind != b.kind)
+        return false;
+
+    if (a.kind == IR_VALUE_CONSTANT)
+        return a.constant == b.constant;
+
+    if (a.kind == IR_VALUE_PSEUDO)
+        return a.pseudo == b.pseudo;
+
+    return !strcmp(a.name, b.name);
+}
+
+// 'instr' writes a pseudo nothing but the next instruction reads
+static bool defines_single_use(struct ir_instr *instr, struct use_count *counts)
+{
+    struct ir_value *dst = ir_instr_dst(instr);
+    if (!dst || dst->kind != IR_VALUE_PSEUDO)
+        return false;
+
+    struct use_count *c = &counts[dst->pseudo];
+    return c->defs == 1 && c->uses == 1;
+}
+
+static bool reads_value(struct ir_instr *instr, struct ir_value val)
+{
+    switch (instr->kind) {
+        case IR_INSTR_RETURN:
+            return instr->ret.has_value && same_value(instr->ret.src, val);
+        case IR_INSTR_UNARY:
+            return same_value(instr->unary.src, val);
+        case IR_INSTR_BINARY:
+            return same_value(instr->binary.lhs, val) ||
+                   same_value(instr->binary.rhs, val);
+        case IR_INSTR_COPY:
+            return same_value(instr->copy.src, val);
+        case IR_INSTR_CALL:
+            for (int a = 0; a < instr->call.arg_count; a++)
+                if (same_value(instr->call.args[a], val))
+                    return true;
+            return false;
+        case IR_INSTR_JUMP_IF_ZERO:
+            return same_value(instr->jump_if_zero.cond, val);
+        case IR_INSTR_JUMP_IF_NOT_ZERO:
+            return same_value(instr->jump_if_not_zero.cond, val);
+        default:
+            return false;
+    }
+}
+
+/*
+ * Folds 'dst = t' into the instruction computing t when 'next' is
+ * that copy. The binary templates write dst before reading rhs, so
+ * dst must not be the rhs.
+ */
+static bool fold_copy(struct ir_instr *instr, struct ir_instr *next,
+                      struct use_count *counts)
+{
+    if (!next || next->kind != IR_INSTR_COPY || !defines_single_use(instr, counts))
+        return false;
+
+    struct ir_value *dst = ir_instr_dst(instr);
+    if (!same_value(next->copy.src, *dst))
+        return false;
+
+    if (instr->kind == IR_INSTR_BINARY &&
+        same_value(instr->binary.rhs, next->copy.dst))
+        return false;
+
+    *dst = next->copy.dst;
+    return true;
+}
+
+/*
+ * Builds the tree rooted at 'first' (or at the instruction after it,
+ * when 'first' is its child). Returns how many IR instructions it covers.
+ */
+static int build_sel_tree(struct sel_tree *tree, struct ir_instr *first,
+                          struct use_count *counts, struct codegen_options *opts)
+{
+    struct ir_instr *root = first;
+    int covered = 1;
+
+    tree->has_child = false;
+    tree->root = *first;
+
+    struct ir_instr *parent = first->next;
+    bool parent_is_tail = parent && opts->sibling_calls && is_sibling_call(parent);
+
+    if (parent && parent->kind != IR_INSTR_COPY && !parent_is_tail &&
+        defines_single_use(first, counts) &&
+        reads_value(parent, *ir_instr_dst(first))) {
+        tree->child = *first;
+        tree->has_child = true;
+        tree->root = *parent;
+        root = parent;
+        covered++;
+    }
+
+    if (fold_copy(&tree->root, root->next, counts))
+        covered++;
+
+    return covered;
+}
+
+static bool is_relational(enum ir_binary_op op)
+{
+    return op == IR_BINOP_EQ || op == IR_BINOP_NE ||
+           op == IR_BINOP_LT || op == IR_BINOP_LE ||
+           op == IR_BINOP_GT || op == IR_BINOP_GE;
+}
+
+static enum cond_code negate_cond(enum cond_code c)
+{
+    switch (c) {
+        case COND_E:  return COND_NE;
+        case COND_NE: return COND_E;
+        case COND_G:  return COND_LE;
+        case COND_GE: return COND_L;
+        case COND_L:  return COND_GE;
+        case COND_LE: return COND_G;
+    }
+    return c;
+}
+
+// Condition that holds for (b, a) when 'c' holds for (a, b)
+static enum cond_code swap_cond(enum cond_code c)
+{
+    switch (c) {
+        case COND_G:  return COND_L;
+        case COND_GE: return COND_LE;
+        case COND_L:  return COND_G;
+        case COND_LE: return COND_GE;
+        default:      return c;
+    }
+}
+
+// If 'instr' is a conditional jump, returns its label and whether it jumps on zero
+static bool is_cond_jump(struct ir_instr *instr, int *label, bool *on_zero)
+{
+    if (instr->kind == IR_INSTR_JUMP_IF_ZERO) {
+        *label = instr->jump_if_zero.label_id;
+        *on_zero = true;
+        return true;
+    }
+
+    if (instr->kind == IR_INSTR_JUMP_IF_NOT_ZERO) {
+        *label = instr->jump_if_not_zero.label_id;
+        *on_zero = false;
+        return true;
+    }
+
+    return false;
+}
+
+// Pseudos will mostly end up in stack slots
+static bool is_memory_like(struct operand op)
+{
+    return is_memory_operand(op) || op.type == OPERAND_PSEUDO;
+}
+
+/*
+ * Estimated cost of 'instr': one, plus the extra instructions
+ * phase 3 will need to make it legal.
+ */
+static int instr_cost(struct asm_instr *instr)
+{
+    switch (instr->type) {
+        case ASM_MOV:
+            return 1 + (is_memory_like(instr->mov.src) && is_memory_like(instr->mov.dst));
+        case ASM_BINARY:
+            if (instr->binary.op == ASM_IMUL)
+                return 1 + 2 * is_memory_like(instr->binary.dst);
+            return 1 + (is_memory_like(instr->binary.src) && is_memory_like(instr->binary.dst));
+        case ASM_CMP:
+            return 1 + ((is_memory_like(instr->cmp.lhs) && is_memory_like(instr->cmp.rhs)) ||
+                        instr->cmp.rhs.type == OPERAND_IMM);
+        case ASM_TEST:
+            return 1 + (instr->test.oper.type == OPERAND_IMM);
+        case ASM_IDIV:
+            return 1 + (instr->idiv.oper.type == OPERAND_IMM);
+        case ASM_LEA:
+            return 1 + is_memory_like(instr->lea.dst) +
+                   (instr->lea.has_base && is_memory_like(instr->lea.base)) +
+                   (instr->lea.has_index && is_memory_like(instr->lea.index));
+        default:
+            return 1;
+    }
+}
+
+static int instrs_cost(struct asm_instr *first)
+{
+    int cost = 0;
+    for (struct asm_instr *instr = first; instr; instr = instr->next)
+        cost += instr_cost(instr);
+    return cost;
+}
+
+static void free_instrs(struct asm_instr *first)
+{
+    while (first) {
+        struct asm_instr *next = first->next;
+        free(first);
+        first = next;
+    }
+}
+
+// leal disp(base, index, scale), dst, with pseudo or register operands
+static struct asm_instr *make_lea_address(struct operand *base,
+        struct operand *index, int scale, int disp, struct operand dst)
+{
+    struct asm_instr *instr = new_instr(ASM_LEA);
+
+    if (base) {
+        instr->lea.base = *base;
+        instr->lea.has_base = true;
+    }
+
+    if (index) {
+        instr->lea.index = *index;
+        instr->lea.has_index = true;
+    }
+
+    instr->lea.scale = scale;
+    instr->lea.disp = disp;
+    instr->lea.dst = dst;
+    return instr;
+}
+
+// Lowers a lone instruction using the fixed templates
+static bool tile_template(struct asm_function *fn, struct sel_tree *tree)
+{
+    if (tree->has_child)
+        return false;
+
+    lower_ir_instr(fn, &tree->root);
+    return true;
+}
+
+// Child and root selected separately, through the temporary
+static bool tile_separate(struct asm_function *fn, struct sel_tree *tree)
+{
+    if (!tree->has_child)
+        return false;
+
+    struct sel_tree child = { .root = tree->child };
+    struct sel_tree root = { .root = tree->root };
+
+    select_tree(fn, &child);
+    select_tree(fn, &root);
+    return true;
+}
+
+// x + 1 -> incl, x - 1 -> decl
+static bool tile_inc_dec(struct asm_function *fn, struct sel_tree *tree)
+{
+    struct ir_instr *instr = &tree->root;
+
+    if (tree->has_child || instr->kind != IR_INSTR_BINARY)
+        return false;
+
+    enum ir_binary_op op = instr->binary.op;
+    struct operand src = convert_val(instr->binary.lhs);
+    struct operand rhs = convert_val(instr->binary.rhs);
+    struct operand dst = convert_val(instr->binary.dst);
+
+    if ((op != IR_BINOP_ADD && op != IR_BINOP_SUB) ||
+        src.type == OPERAND_IMM || rhs.type != OPERAND_IMM ||
+        (rhs.imm != 1 && rhs.imm != -1))
+        return false;
+
+    bool inc = (op == IR_BINOP_ADD) == (rhs.imm == 1);
+
+    if (!same_operand(src, dst))
+        append_instr(fn, make_mov(src, dst));
+    append_instr(fn, make_unary(inc ? ASM_INC : ASM_DEC, dst));
+    return true;
+}
+
+// a + b -> leal (a,b), dst / a +- imm -> leal imm(a), dst
+static bool tile_lea_add(struct asm_function *fn, struct sel_tree *tree)
+{
+    struct ir_instr *instr = &tree->root;
+
+    if (tree->has_child || instr->kind != IR_INSTR_BINARY)
+        return false;
+
+    enum ir_binary_op op = instr->binary.op;
+    struct operand a = convert_val(instr->binary.lhs);
+    struct operand b = convert_val(instr->binary.rhs);
+    struct operand dst = convert_val(instr->binary.dst);
+
+    if (op == IR_BINOP_ADD && a.type == OPERAND_IMM) {
+        struct operand tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    if (a.type == OPERAND_IMM)
+        return false;
+
+    if (op == IR_BINOP_SUB && b.type == OPERAND_IMM && b.imm != -2147483647 - 1) {
+        append_instr(fn, make_lea_address(&a, NULL, 1, -b.imm, dst));
+        return true;
+    }
+
+    if (op != IR_BINOP_ADD)
+        return false;
+
+    if (b.type == OPERAND_IMM)
+        append_instr(fn, make_lea_address(&a, NULL, 1, b.imm, dst));
+    else
+        append_instr(fn, make_lea_address(&a, &b, 1, 0, dst));
+    return true;
+}
+
+// Relational compare against a constant on the left: swap the operands
+static bool tile_compare_swapped(struct asm_function *fn, struct sel_tree *tree)
+{
+    struct ir_instr *instr = &tree->root;
+
+    if (tree->has_child || instr->kind != IR_INSTR_BINARY ||
+        !is_relational(instr->binary.op))
+        return false;
+
+    struct operand a = convert_val(instr->binary.lhs);
+    struct operand b = convert_val(instr->binary.rhs);
+    struct operand dst = convert_val(instr->binary.dst);
+
+    if (a.type != OPERAND_IMM || b.type == OPERAND_IMM)
+        return false;
+
+    enum cond_code cond = swap_cond(convert_to_cond(instr->binary.op));
+
+    append_instr(fn, make_cmp(a, b));
+    append_instr(fn, make_mov(make_imm(0), dst));
+    append_instr(fn, make_setcc(cond, dst));
+    return true;
+}
+
+// if (x) / if (!x) -> testl x, x / jcc
+static bool tile_zero_test(struct asm_function *fn, struct sel_tree *tree)
+{
+    int label;
+    bool on_zero;
+
+    if (tree->has_child || !is_cond_jump(&tree->root, &label, &on_zero))
+        return false;
+
+    struct ir_value cond = on_zero ? tree->root.jump_if_zero.cond
+                                   : tree->root.jump_if_not_zero.cond;
+    struct operand val = convert_val(cond);
+
+    if (val.type == OPERAND_IMM)
+        return false;
+
+    append_instr(fn, make_test(val));
+    append_instr(fn, make_jmpcc(on_zero ? COND_E : COND_NE, label));
+    return true;
+}
+
+// if (a < b) -> cmpl b, a / jcc, no setcc
+static bool tile_compare_branch(struct asm_function *fn, struct sel_tree *tree)
+{
+    struct ir_instr *cmp = &tree->child;
+    int label;
+    bool on_zero;
+
+    if (!tree->has_child || cmp->kind != IR_INSTR_BINARY ||
+        !is_relational(cmp->binary.op) ||
+        !is_cond_jump(&tree->root, &label, &on_zero))
+        return false;
+
+    struct operand a = convert_val(cmp->binary.lhs);
+    struct operand b = convert_val(cmp->binary.rhs);
+    enum cond_code cond = convert_to_cond(cmp->binary.op);
+
+    if (a.type == OPERAND_IMM) {
+        struct operand tmp = a;
+        a = b;
+        b = tmp;
+        cond = swap_cond(cond);
+    }
+
+    if (a.type == OPERAND_IMM)
+        return false;
+
+    if (on_zero)
+        cond = negate_cond(cond);
+
+    append_instr(fn, make_cmp(b, a));
+    append_instr(fn, make_jmpcc(cond, label));
+    return true;
+}
+
+// if (!x) -> testl x, x / jcc, no setcc
+static bool tile_not_branch(struct asm_function *fn, struct sel_tree *tree)
+{
+    struct ir_instr *not = &tree->child;
+    int label;
+    bool on_zero;
+
+    if (!tree->has_child || not->kind != IR_INSTR_UNARY ||
+        not->unary.op != IR_UNOP_LOG_NOT ||
+        !is_cond_jump(&tree->root, &label, &on_zero))
+        return false;
+
+    struct operand val = convert_val(not->unary.src);
+    if (val.type == OPERAND_IMM)
+        return false;
+
+    append_instr(fn, make_test(val));
+    append_instr(fn, make_jmpcc(on_zero ? COND_NE : COND_E, label));
+    return true;
+}
+
+// Returns the scale if 'instr' is x * {1,2,4,8} or x << {0..3}
+static int scaled_index(struct ir_instr *instr, struct operand *index)
+{
+    if (instr->kind != IR_INSTR_BINARY)
+        return 0;
+
+    struct operand a = convert_val(instr->binary.lhs);
+    struct operand b = convert_val(instr->binary.rhs);
+
+    if (instr->binary.op == IR_BINOP_MUL && a.type == OPERAND_IMM) {
+        struct operand tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    if (a.type == OPERAND_IMM || b.type != OPERAND_IMM)
+        return 0;
+
+    int scale = 0;
+    if (instr->binary.op == IR_BINOP_MUL &&
+        (b.imm == 1 || b.imm == 2 || b.imm == 4 || b.imm == 8))
+        scale = b.imm;
+    else if (instr->binary.op == IR_BINOP_SHL && b.imm >= 0 && b.imm <= 3)
+        scale = 1 << b.imm;
+
+    *index = a;
+    return scale;
+}
+
+/*
+ * Root is an add/sub of the child's value and 'other'.
+ * Returns false if it has any other shape.
+ */
+static bool split_add_root(struct sel_tree *tree, struct operand *other, int *sign)
+{
+    struct ir_instr *root = &tree->root;
+    struct ir_value t = *ir_instr_dst(&tree->child);
+
+    if (root->kind != IR_INSTR_BINARY)
+        return false;
+
+    if (root->binary.op == IR_BINOP_ADD) {
+        *sign = 1;
+        if (same_value(root->binary.lhs, t))
+            *other = convert_val(root->binary.rhs);
+        else
+            *other = convert_val(root->binary.lhs);
+        return !same_value(root->binary.lhs, root->binary.rhs);
+    }
+
+    // t - imm only, anything else isn't an address
+    if (root->binary.op == IR_BINOP_SUB && same_value(root->binary.lhs, t) &&
+        root->binary.rhs.kind == IR_VALUE_CONSTANT) {
+        *sign = -1;
+        *other = convert_val(root->binary.rhs);
+        return other->imm != -2147483647 - 1;
+    }
+
+    return false;
+}
+
+// b + a * s -> leal (b,a,s), dst / a * s + imm -> leal imm(,a,s), dst
+static bool tile_lea_scaled(struct asm_function *fn, struct sel_tree *tree)
+{
+    if (!tree->has_child)
+        return false;
+
+    struct operand index, other;
+    int sign;
+    int scale = scaled_index(&tree->child, &index);
+
+    if (!scale || !split_add_root(tree, &other, &sign))
+        return false;
+
+    struct operand dst = convert_val(*ir_instr_dst(&tree->root));
+
+    if (other.type == OPERAND_IMM)
+        append_instr(fn, make_lea_address(NULL, &index, scale, sign * other.imm, dst));
+    else
+        append_instr(fn, make_lea_address(&other, &index, scale, 0, dst));
+    return true;
+}
+
+// (a + b) + imm, (a + imm) + b -> leal imm(a,b), dst
+static bool tile_lea_add_add(struct asm_function *fn, struct sel_tree *tree)
+{
+    struct ir_instr *child = &tree->child;
+    struct operand other;
+    int sign;
+
+    if (!tree->has_child || child->kind != IR_INSTR_BINARY ||
+        child->binary.op != IR_BINOP_ADD ||
+        !split_add_root(tree, &other, &sign))
+        return false;
+
+    struct operand a = convert_val(child->binary.lhs);
+    struct operand b = convert_val(child->binary.rhs);
+    struct operand dst = convert_val(*ir_instr_dst(&tree->root));
+
+    if (a.type == OPERAND_IMM) {
+        struct operand tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    if (a.type == OPERAND_IMM)
+        return false;
+
+    if (b.type != OPERAND_IMM && other.type == OPERAND_IMM)
+        append_instr(fn, make_lea_address(&a, &b, 1, sign * other.imm, dst));
+    else if (b.type == OPERAND_IMM && other.type != OPERAND_IMM && sign > 0)
+        append_instr(fn, make_lea_address(&a, &other, 1, b.imm, dst));
+    else
+        return false;
+
+    return true;
+}
 
-                append_instr(fn, make_mov(src1, ax));
+// Earlier tiles win ties
+static const tile_fn tiles[] = {
+    tile_inc_dec,
+    tile_template,
+    tile_separate,
+    tile_lea_add,
+    tile_compare_swapped,
+    tile_zero_test,
+    tile_compare_branch,
+    tile_not_branch,
+    tile_lea_scaled,
+    tile_lea_add_add,
+};
 
-                if (src2.type == OPERAND_IMM) {
-                    count = src2;
-                } else {
-                    append_instr(fn, make_mov(src2, make_reg(REG_CX)));
-                    count = make_reg(REG_CX);
-                }
+static void select_tree(struct asm_function *fn, struct sel_tree *tree)
+{
+    struct asm_function best = {0};
+    int best_cost = 0;
 
-                append_instr(fn, make_binary(convert_binop(op), count, ax));
-                append_instr(fn, make_mov(ax, dst));
-                break;
-            }
+    for (size_t i = 0; i < sizeof(tiles) / sizeof(tiles[0]); i++) {
+        struct asm_function candidate = {0};
 
-            // ADD, SUB, IMUL
-            // movl src1, dst
-            // op src2, dst
-            append_instr(fn, make_mov(src1, dst));
-            append_instr(fn, make_binary(convert_binop(op), src2, dst));
-            break;
-        }
-        case IR_INSTR_JUMP_IF_ZERO: {
-            // if (!cond) goto label -> cmpl $0, val, je
-            struct operand val = convert_val(instr->jump_if_zero.cond);
+        if (!tiles[i](&candidate, tree))
+            continue;
 
-            append_instr(fn, make_cmp(val, make_imm(0)));
-            append_instr(fn, make_jmpcc(COND_E, instr->jump_if_zero.label_id));
-            break;
+        int cost = instrs_cost(candidate.first);
+        if (best.first && cost >= best_cost) {
+            free_instrs(candidate.first);
+            continue;
         }
-        case IR_INSTR_JUMP_IF_NOT_ZERO: {
-            // if (cond) goto label -> cmpl $0, val, jne
-            struct operand val = convert_val(instr->jump_if_not_zero.cond);
 
-            append_instr(fn, make_cmp(val, make_imm(0)));
-            append_instr(fn, make_jmpcc(COND_NE, instr->jump_if_not_zero.label_id));
-            break;
-        }
-        case IR_INSTR_JUMP: {
-            append_instr(fn, make_jmp(instr->jump.label_id));
-            break;
-        }
-        case IR_INSTR_COPY: {
-            struct operand src = convert_val(instr->copy.src);
-            struct operand dst = convert_val(instr->copy.dst);
+        free_instrs(best.first);
+        best = candidate;
+        best_cost = cost;
+    }
 
-            append_instr(fn, make_mov(src, dst));
-            break;
-        }
-        case IR_INSTR_LABEL: {
-            append_instr(fn, make_label(instr->label.label_id));
-            break;
-        }
+    for (struct asm_instr *instr = best.first; instr; ) {
+        struct asm_instr *next = instr->next;
+        instr->next = NULL;
+        append_instr(fn, instr);
+        instr = next;
     }
 }
 
@@ -456,7 +1498,7 @@ static void lower_ir_params(struct asm_function *asm_fn, struct ir_function *ir_
 {
     int i = 0;
     for (struct ir_param *param = ir_fn->params; param; param = param->next) {
-        struct operand dst = make_pseudo(param->name);
+        struct operand dst = make_pseudo(param->pseudo);
         struct operand src;
 
         if (i < ARG_REG_COUNT) {
@@ -478,7 +1520,8 @@ static void lower_ir_params(struct asm_function *asm_fn, struct ir_function *ir_
     }
 }
 
-static struct asm_function *lower_ir_function(struct ir_function *ir_fn)
+static struct asm_function *lower_ir_function(struct ir_function *ir_fn,
+                                              struct codegen_options *opts)
 {
     struct asm_function *asm_fn = calloc(1, sizeof(struct asm_function));
     asm_fn->name = ir_fn->name;
@@ -488,12 +1531,34 @@ static struct asm_function *lower_ir_function(struct ir_function *ir_fn)
     else
         asm_fn->global = false;
 
+    asm_fn->section = ir_fn->section;
+    asm_fn->has_cold_part = ir_fn->has_cold_part;
+    asm_fn->cold_label = ir_fn->cold_label;
+
+    ir_number_pseudos(ir_fn);
+    asm_fn->pseudo_count = ir_fn->pseudo_count;
+
     lower_ir_params(asm_fn, ir_fn);
 
-    for (struct ir_instr *i = ir_fn->first; i != NULL; i = i->next) {
-        lower_ir_instr(asm_fn, i);
+    struct use_count *counts = calloc(ir_fn->pseudo_count + 1, sizeof(struct use_count));
+    count_uses(counts, ir_fn);
+
+    for (struct ir_instr *i = ir_fn->first; i != NULL; ) {
+        if (opts->sibling_calls && is_sibling_call(i)) {
+            lower_sibling_call(asm_fn, i);
+            i = i->next->next; // Skip the return
+            continue;
+        }
+
+        struct sel_tree tree;
+        int covered = build_sel_tree(&tree, i, counts, opts);
+        select_tree(asm_fn, &tree);
+
+        while (covered--)
+            i = i->next;
     }
 
+    free(counts);
     return asm_fn;
 }
 
@@ -504,11 +1569,13 @@ static struct asm_static_variable *lower_ir_static_variable(struct ir_static_var
     asm_var->name = ir_var->name;
     asm_var->global = ir_var->linkage == LINK_EXTERNAL;
     asm_var->init = ir_var->init;
+    asm_var->counter = ir_var->counter;
 
     return asm_var;
 }
 
-static struct asm_program *lower_ir_program(struct ir_program *ir)
+static struct asm_program *lower_ir_program(struct ir_program *ir,
+                                            struct codegen_options *opts)
 {
     struct asm_program *program = calloc(1, sizeof(struct asm_program));
 
@@ -521,7 +1588,7 @@ static struct asm_program *lower_ir_program(struct ir_program *ir)
     }
 
     for (struct ir_function *ir_fn = ir->functions; ir_fn; ir_fn = ir_fn->next) {
-        struct asm_function *asm_fn = lower_ir_function(ir_fn);
+        struct asm_function *asm_fn = lower_ir_function(ir_fn, opts);
 
         if (!head)
             head = asm_fn;
@@ -531,90 +1598,114 @@ static struct asm_program *lower_ir_program(struct ir_program *ir)
     }
 
     program->functions = head;
+    program->profile_path = ir->profile_path;
+    program->profile_counters = ir->profile_counters;
 
     return program;
 }
 
 /* Phase 2: Replace pseduo operands with RBP-relative stack slots */
-struct pseudo_entry {
-    const char *name; // Pseudo from IR
-    int stack_offset; // Negative offset from %rbp
-};
-
-struct pseudo_map {
-    hash_map entries;
+struct stack_slots {
+    int *offsets;           // Pseudo -> offset from the frame base
+    uint64_t *assigned;     // Bit per pseudo
     int current_offset;
 };
 
-static int pseudo_map_get_or_insert(struct pseudo_map *pm, const char *name)
+static void replace_pseudo(struct operand *oper, struct stack_slots *slots)
 {
-    struct pseudo_entry *entry = hashmap_get(&pm->entries, name, strlen(name));
-    if (entry)
-        return entry->stack_offset;
-
-    pm->current_offset -= STACK_SLOT_SIZE;
+    if (oper->type != OPERAND_PSEUDO)
+        return;
 
-    entry = malloc(sizeof(struct pseudo_entry));
-    entry->name = name;
-    entry->stack_offset = pm->current_offset;
+    int pseudo = oper->pseudo;
+    uint64_t bit = 1ull << (pseudo % 64);
 
-    hashmap_set(&pm->entries, name, strlen(name), entry);
+    if (!(slots->assigned[pseudo / 64] & bit)) {
+        slots->assigned[pseudo / 64] |= bit;
+        slots->current_offset -= STACK_SLOT_SIZE;
+        slots->offsets[pseudo] = slots->current_offset;
+    }
 
-    return pm->current_offset;
+    oper->type  = OPERAND_STACK;
+    oper->stack = slots->offsets[pseudo];
 }
 
-static void replace_pseudo(struct operand *oper, struct pseudo_map *pm)
-{
-    if (oper->type != OPERAND_PSEUDO)
-        return;
+#define MAX_INSTR_OPERANDS 3
 
-    int offset = pseudo_map_get_or_insert(pm, oper->pseudo);
-    oper->type  = OPERAND_STACK;
-    oper->stack = offset;
+/*
+ * Collects pointers to the operands of 'instr'.
+ * Returns how many were stored in 'ops'.
+ */
+static int instr_operands(struct asm_instr *instr, struct operand **ops)
+{
+    switch (instr->type) {
+        case ASM_MOV:
+            ops[0] = &instr->mov.src;
+            ops[1] = &instr->mov.dst;
+            return 2;
+        case ASM_UNARY:
+            ops[0] = &instr->unary.oper;
+            return 1;
+        case ASM_BINARY:
+            ops[0] = &instr->binary.src;
+            ops[1] = &instr->binary.dst;
+            return 2;
+        case ASM_SETCC:
+            ops[0] = &instr->setcc.oper;
+            return 1;
+        case ASM_IDIV:
+            ops[0] = &instr->idiv.oper;
+            return 1;
+        case ASM_IMUL_WIDE:
+            ops[0] = &instr->imul_wide.oper;
+            return 1;
+        case ASM_LEA: {
+            int count = 0;
+            ops[count++] = &instr->lea.dst;
+            if (instr->lea.has_base)
+                ops[count++] = &instr->lea.base;
+            if (instr->lea.has_index)
+                ops[count++] = &instr->lea.index;
+            return count;
+        }
+        case ASM_TEST:
+            ops[0] = &instr->test.oper;
+            return 1;
+        case ASM_CMP:
+            ops[0] = &instr->cmp.lhs;
+            ops[1] = &instr->cmp.rhs;
+            return 2;
+        case ASM_PUSH:
+            ops[0] = &instr->push.oper;
+            return 1;
+        default:
+            return 0;
+    }
 }
 
 /*
  * Replace every pseudo variable with a stack operand.
+ * Slots are handed out downward from 'start_offset'.
  */
-static int assign_stack_slots(struct asm_function *fn)
+static int assign_stack_slots(struct asm_function *fn, int start_offset)
 {
-    struct pseudo_map pm = {0};
-    hashmap_init(&pm.entries);
+    struct stack_slots slots = {
+        .offsets = malloc((fn->pseudo_count + 1) * sizeof(int)),
+        .assigned = calloc(fn->pseudo_count / 64 + 1, sizeof(uint64_t)),
+        .current_offset = start_offset,
+    };
 
     for (struct asm_instr *instr = fn->first; instr; instr = instr->next) {
-        switch (instr->type) {
-            case ASM_MOV:
-                replace_pseudo(&instr->mov.src, &pm);
-                replace_pseudo(&instr->mov.dst, &pm);
-                break;
-            case ASM_UNARY:
-                replace_pseudo(&instr->unary.oper, &pm);
-                break;
-            case ASM_BINARY:
-                replace_pseudo(&instr->binary.src, &pm);
-                replace_pseudo(&instr->binary.dst, &pm);
-                break;
-            case ASM_SETCC:
-                replace_pseudo(&instr->setcc.oper, &pm);
-                break;
-            case ASM_IDIV:
-                replace_pseudo(&instr->idiv.oper, &pm);
-                break;
-            case ASM_CMP:
-                replace_pseudo(&instr->cmp.lhs, &pm);
-                replace_pseudo(&instr->cmp.rhs, &pm);
-                break;
-            case ASM_PUSH:
-                replace_pseudo(&instr->push.oper, &pm);
-            default:
-                break;
-        }
+        struct operand *ops[MAX_INSTR_OPERANDS];
+        int count = instr_operands(instr, ops);
+
+        for (int i = 0; i < count; i++)
+            replace_pseudo(ops[i], &slots);
     }
 
-    int raw_size = -pm.current_offset;
-    hashmap_free(&pm.entries);
+    free(slots.offsets);
+    free(slots.assigned);
 
-    return raw_size;
+    return start_offset - slots.current_offset;
 }
 
 static int align_to(int value, int align)
@@ -622,16 +1713,238 @@ static int align_to(int value, int align)
     return (value + (align - 1)) / align * align;
 }
 
-static void asm_phase2(struct asm_program *program)
+static bool function_is_leaf(struct asm_function *fn)
 {
-    for (struct asm_function *fn = program->functions; fn; fn = fn->next) {
-        int stack_size = assign_stack_slots(fn);
+    for (struct asm_instr *instr = fn->first; instr; instr = instr->next)
+        if (instr->type == ASM_CALL)
+            return false;
+
+    return true;
+}
+
+/*
+ * Loop nesting depth of every instruction, found from backward jumps:
+ * a jump to an earlier label closes a loop spanning label..jump.
+ */
+static int *compute_loop_depths(struct asm_function *fn, int instr_count)
+{
+    int *depths = calloc(instr_count + 1, sizeof(int));
+
+    int max_label = 0;
+    for (struct asm_instr *instr = fn->first; instr; instr = instr->next)
+        if (instr->type == ASM_LABEL && instr->label.identifier > max_label)
+            max_label = instr->label.identifier;
+
+    int *label_pos = malloc((max_label + 1) * sizeof(int));
+    for (int i = 0; i <= max_label; i++)
+        label_pos[i] = -1;
+
+    int pos = 0;
+    for (struct asm_instr *instr = fn->first; instr; instr = instr->next, pos++) {
+        int target = -1;
+
+        if (instr->type == ASM_LABEL)
+            label_pos[instr->label.identifier] = pos;
+        else if (instr->type == ASM_JMP)
+            target = instr->jmp.identifier;
+        else if (instr->type == ASM_JMPCC)
+            target = instr->jmpcc.identifier;
+
+        if (target < 0 || target > max_label || label_pos[target] < 0)
+            continue;
+
+        // Difference array: +1 at the header, -1 after the back edge
+        depths[label_pos[target]]++;
+        depths[pos + 1]--;
+    }
+
+    for (int i = 1; i < instr_count; i++)
+        depths[i] += depths[i - 1];
+
+    free(label_pos);
+    return depths;
+}
+
+struct reg_candidate {
+    int pseudo;
+    long weight;
+    bool allocated;
+    enum reg reg;
+};
+
+static int compare_candidates(const void *a, const void *b)
+{
+    const struct reg_candidate *ca = *(const struct reg_candidate **)a;
+    const struct reg_candidate *cb = *(const struct reg_candidate **)b;
+
+    if (ca->weight != cb->weight)
+        return ca->weight < cb->weight ? 1 : -1;
+
+    return ca->pseudo - cb->pseudo;
+}
+
+/*
+ * Whole-function register assignment: the pseudos with the highest
+ * use counts (weighted 8x per loop level) each get a callee-saved
+ * register for their whole lifetime. Callee-saved registers survive
+ * calls, so no interference or call-crossing analysis is needed,
+ * the cost is one push/pop pair per register used.
+ */
+static void allocate_callee_saved(struct asm_function *fn)
+{
+    int instr_count = 0;
+    for (struct asm_instr *instr = fn->first; instr; instr = instr->next)
+        instr_count++;
+
+    int *depths = compute_loop_depths(fn, instr_count);
+
+    // Indexed by pseudo
+    struct reg_candidate *candidates = calloc(fn->pseudo_count + 1, sizeof(struct reg_candidate));
+
+    int pos = 0;
+    for (struct asm_instr *instr = fn->first; instr; instr = instr->next, pos++) {
+        struct operand *ops[MAX_INSTR_OPERANDS];
+        int count = instr_operands(instr, ops);
+
+        int depth = depths[pos] < 4 ? depths[pos] : 4;
+
+        for (int i = 0; i < count; i++) {
+            if (ops[i]->type != OPERAND_PSEUDO)
+                continue;
+
+            candidates[ops[i]->pseudo].weight += 1L << (3 * depth);
+        }
+    }
+
+    struct reg_candidate **list = malloc((fn->pseudo_count + 1) * sizeof(*list));
+    int list_count = 0;
+
+    for (int pseudo = 1; pseudo <= fn->pseudo_count; pseudo++) {
+        if (!candidates[pseudo].weight)
+            continue;
+
+        candidates[pseudo].pseudo = pseudo;
+        list[list_count++] = &candidates[pseudo];
+    }
+
+    qsort(list, list_count, sizeof(*list), compare_candidates);
+
+    fn->saved_reg_count = 0;
+
+    /*
+     * Saving a register costs a push and a pop, only worth it when
+     * the pseudo is touched more often than that.
+     */
+    for (int i = 0; i < list_count && fn->saved_reg_count < CALLEE_SAVED_COUNT; i++) {
+        if (list[i]->weight <= 2)
+            break;
+
+        list[i]->allocated = true;
+        list[i]->reg = callee_saved_regs[fn->saved_reg_count];
+        fn->saved_regs[fn->saved_reg_count++] = list[i]->reg;
+    }
+
+    for (struct asm_instr *instr = fn->first; instr; instr = instr->next) {
+        struct operand *ops[MAX_INSTR_OPERANDS];
+        int count = instr_operands(instr, ops);
+
+        for (int i = 0; i < count; i++) {
+            if (ops[i]->type != OPERAND_PSEUDO)
+                continue;
+
+            struct reg_candidate *c = &candidates[ops[i]->pseudo];
+
+            if (c->allocated)
+                *ops[i] = make_reg(c->reg);
+        }
+    }
+
+    free(list);
+    free(candidates);
+    free(depths);
+}
+
+/*
+ * Frame layout (addresses grow up):
+ *
+ *   16(base)  stack arguments
+ *    8(base)  return address
+ *    0(base)  saved %rbp
+ *             saved callee-saved registers
+ *             locals
+ *   (%rsp)    after the prologue
+ *
+ * With the frame pointer omitted %rbp isn't pushed, and the saved
+ * registers (or the locals) start at 0(base) instead.
+ *
+ * The prologue keeps %rsp 16-byte aligned at call sites (System-V ABI).
+ * Leaf functions whose locals fit in the red zone allocate nothing.
+ */
+static void layout_frame(struct asm_function *fn, struct codegen_options *opts)
+{
+    fn->omit_frame_pointer = opts->omit_frame_pointer;
+    fn->is_leaf = function_is_leaf(fn);
+
+    if (opts->callee_saved_regs)
+        allocate_callee_saved(fn);
+
+    int pushed = 8 * fn->saved_reg_count;
+    if (!opts->omit_frame_pointer)
+        pushed += 8;
+
+    int locals_size = assign_stack_slots(fn, 8 - pushed);
+
+    if (opts->red_zone && fn->is_leaf && locals_size <= RED_ZONE_SIZE)
+        fn->frame_size = 0;
+    else
+        fn->frame_size = align_to(locals_size + 8 + pushed, 16) - 8 - pushed;
+
+    // %rsp = base + 8 - pushed - frame_size
+    fn->frame_bias = pushed + fn->frame_size - 8;
+}
+
+/*
+ * Flags the labels alignment padding may go in front of: loop headers
+ * (targets of a later jump) and labels no instruction falls into,
+ * where the padding is never executed.
+ */
+static void mark_label_kinds(struct asm_function *fn)
+{
+    int max_label = 0;
+    for (struct asm_instr *instr = fn->first; instr; instr = instr->next)
+        if (instr->type == ASM_LABEL && instr->label.identifier > max_label)
+            max_label = instr->label.identifier;
+
+    struct asm_instr **seen = calloc(max_label + 1, sizeof(struct asm_instr *));
+
+    struct asm_instr *prev = NULL;
+    for (struct asm_instr *instr = fn->first; instr; prev = instr, instr = instr->next) {
+        int target = -1;
+
+        if (instr->type == ASM_LABEL) {
+            seen[instr->label.identifier] = instr;
+            instr->label.no_fallthrough = prev &&
+                (prev->type == ASM_JMP || prev->type == ASM_RET ||
+                 prev->type == ASM_TAIL_CALL ||
+                 (prev->type == ASM_LABEL && prev->label.no_fallthrough));
+        } else if (instr->type == ASM_JMP) {
+            target = instr->jmp.identifier;
+        } else if (instr->type == ASM_JMPCC) {
+            target = instr->jmpcc.identifier;
+        }
+
+        if (target >= 0 && target <= max_label && seen[target])
+            seen[target]->label.loop_header = true;
+    }
+
+    free(seen);
+}
 
-        /*
-         * Keep the stack frame 16 byte aligned.
-         * System-V ABI.
-         */
-        fn->stack_size = align_to(stack_size, 16);
+static void asm_phase2(struct asm_program *program, struct codegen_options *opts)
+{
+    for (struct asm_function *fn = program->functions; fn; fn = fn->next) {
+        layout_frame(fn, opts);
+        mark_label_kinds(fn);
     }
 }
 
@@ -644,25 +1957,16 @@ static void asm_phase2(struct asm_program *program)
  * <op> mem, mem -> MOV src, %r10d / <op> %r10d, dst
  * SHIFT mem, dst -> MOV src, %ecx / SHIFT %cl, dst
  * IDIV $imm -> MOV $imm, %r10d / IDIV %r10d
+ * IMUL $imm (one operand) -> MOV $imm, %r10d / IMUL %r10d
+ * LEA (mem,mem), mem -> MOV base, %r10d / MOV index, %r11d
+ *                      LEA (%r10,%r11), %r11d / MOV %r11d, mem
+ * TEST mem -> CMP $0, mem
+ * CMP $0, reg -> TEST reg
  * CMP mem, mem -> MOV oper1, %r10d / CMP %r10d, oper2
  * CMP oper1, $imm -> MOV $imm, %r11d / CMP oper1, %r11d
  */
 static void asm_phase3(struct asm_function *fn)
 {
-    /*
-     * Insert stack allocation for function prologue.
-     * Stack size calculated in phase 2.
-     */
-    if (fn->stack_size > 0) {
-        struct asm_instr *instr = make_alloc_stack(fn->stack_size);
-
-        instr->next = fn->first;
-        fn->first = instr;
-
-        if (!fn->last)
-            fn->last = instr;
-    }
-    
     struct operand r10 = make_reg(REG_R10);
     struct operand r11 = make_reg(REG_R11);
     struct operand cx = make_reg(REG_CX);
@@ -691,7 +1995,7 @@ static void asm_phase3(struct asm_function *fn)
                 bool src_mem = is_memory_operand(curr->binary.src);
                 bool dst_mem = is_memory_operand(curr->binary.dst);
                 bool is_mul = curr->binary.op == ASM_IMUL;
-                bool is_shift = curr->binary.op == ASM_SHL || curr->binary.op == ASM_SHR;
+                bool is_shift = is_shift_op(curr->binary.op);
 
                 if (is_mul && dst_mem) {
                     // imull src, mem  ->  movl mem, r11d / imull src, r11d / movl r11d, mem
@@ -728,8 +2032,83 @@ static void asm_phase3(struct asm_function *fn)
                 curr = replace_instr(fn, prev, curr, a, b);
                 break;
             }
+
+            // imull $imm -> movl $imm, %r10d / imull %r10d
+            case ASM_IMUL_WIDE: {
+                if (curr->imul_wide.oper.type != OPERAND_IMM) break;
+
+                struct asm_instr *a = make_mov(curr->imul_wide.oper, r10);
+                struct asm_instr *b = make_imul_wide(r10);
+                a->next = b;
+                curr = replace_instr(fn, prev, curr, a, b);
+                break;
+            }
+
+            /*
+             * Address operands must be registers:
+             * leal (mem1,mem2), mem3 -> movl mem1, %r10d / movl mem2, %r11d
+             *                           leal (%r10,%r11), %r11d / movl %r11d, mem3
+             */
+            case ASM_LEA: {
+                bool base_mem = curr->lea.has_base && is_memory_operand(curr->lea.base);
+                bool index_mem = curr->lea.has_index && is_memory_operand(curr->lea.index);
+                bool dst_mem = is_memory_operand(curr->lea.dst);
+
+                if (!base_mem && !index_mem && !dst_mem) break;
+
+                struct asm_instr *lea = new_instr(ASM_LEA);
+                lea->lea = curr->lea;
+
+                struct asm_instr *first = lea;
+                struct asm_instr *last = lea;
+
+                if (index_mem) {
+                    struct asm_instr *load = make_mov(curr->lea.index, r11);
+                    load->next = first;
+                    first = load;
+                    lea->lea.index = r11;
+                }
+                if (base_mem) {
+                    struct asm_instr *load = make_mov(curr->lea.base, r10);
+                    load->next = first;
+                    first = load;
+                    lea->lea.base = r10;
+                }
+                if (dst_mem) {
+                    lea->lea.dst = r11;
+                    last = make_mov(r11, curr->lea.dst);
+                    lea->next = last;
+                }
+
+                curr = replace_instr(fn, prev, curr, first, last);
+                break;
+            }
+
+            /*
+             * testl mem -> cmpl $0, mem
+             * testl $imm -> movl $imm, %r11d / testl %r11d
+             */
+            case ASM_TEST: {
+                struct operand oper = curr->test.oper;
+
+                if (is_memory_operand(oper)) {
+                    struct asm_instr *a = make_cmp(make_imm(0), oper);
+                    curr = replace_instr(fn, prev, curr, a, a);
+                } else if (oper.type == OPERAND_IMM) {
+                    struct asm_instr *a = make_mov(oper, r11);
+                    struct asm_instr *b = make_test(r11);
+                    a->next = b;
+                    curr = replace_instr(fn, prev, curr, a, b);
+                }
+                break;
+            }
             case ASM_CMP: {
-                if (is_memory_operand(curr->cmp.lhs) &&
+                // cmpl $0, reg -> testl reg, reg (same flags)
+                if (curr->cmp.lhs.type == OPERAND_IMM && curr->cmp.lhs.imm == 0 &&
+                    curr->cmp.rhs.type == OPERAND_REG) {
+                    struct asm_instr *a = make_test(curr->cmp.rhs);
+                    curr = replace_instr(fn, prev, curr, a, a);
+                } else if (is_memory_operand(curr->cmp.lhs) &&
                     is_memory_operand(curr->cmp.rhs)) {
                     struct asm_instr *a = make_mov(curr->cmp.lhs, r10);
                     struct asm_instr *b = make_cmp(r10, curr->cmp.rhs);
@@ -774,6 +2153,11 @@ static const char *reg_name_8(enum reg r)
         case REG_R9: return  "r9b";
         case REG_R10: return "r10b";
         case REG_R11: return "r11b";
+        case REG_BX:  return "bl";
+        case REG_R12: return "r12b";
+        case REG_R13: return "r13b";
+        case REG_R14: return "r14b";
+        case REG_R15: return "r15b";
         default:      return "unknown";
     }
 }
@@ -790,6 +2174,11 @@ static const char *reg_name_32(enum reg r)
         case REG_R9: return  "r9d";
         case REG_R10: return "r10d";
         case REG_R11: return "r11d";
+        case REG_BX:  return "ebx";
+        case REG_R12: return "r12d";
+        case REG_R13: return "r13d";
+        case REG_R14: return "r14d";
+        case REG_R15: return "r15d";
         default:      return "unknown";
     }
 }
@@ -806,6 +2195,11 @@ static const char *reg_name_64(enum reg r)
         case REG_R9: return  "r9";
         case REG_R10: return "r10";
         case REG_R11: return "r11";
+        case REG_BX:  return "rbx";
+        case REG_R12: return "r12";
+        case REG_R13: return "r13";
+        case REG_R14: return "r14";
+        case REG_R15: return "r15";
         default:      return "unknown";
     }
 }
@@ -833,13 +2227,24 @@ static const char *asm_op_str(enum asm_op op)
         case ASM_OR:   return "orl";
         case ASM_XOR:  return "xorl";
         case ASM_SHL:  return "shll";
-        case ASM_SHR:  return "sarl";
+        case ASM_SHR:  return "shrl";
+        case ASM_SAR:  return "sarl";
         case ASM_NEG:  return "negl";
         case ASM_NOT:  return "notl";
+        case ASM_INC:  return "incl";
+        case ASM_DEC:  return "decl";
+        case ASM_INCQ: return "incq";
         default:       return "???";
     }
 }
 
+/*
+ * Function being emitted and how far %rsp has moved below its
+ * post-prologue value (call padding and pushed arguments).
+ */
+static struct asm_function *emit_fn;
+static int emit_push_depth;
+
 static void write_operand(FILE *file, struct operand op, int reg_size)
 {
     switch (op.type) {
@@ -852,7 +2257,10 @@ static void write_operand(FILE *file, struct operand op, int reg_size)
                 fprintf(file, "%%%s", reg_name_64(op.reg));
             break;
         case OPERAND_STACK:
-            fprintf(file, "%d(%%rbp)", op.stack);
+            if (emit_fn->omit_frame_pointer)
+                fprintf(file, "%d(%%rsp)", op.stack + emit_fn->frame_bias + emit_push_depth);
+            else
+                fprintf(file, "%d(%%rbp)", op.stack);
             break;
         case OPERAND_IMM:
             fprintf(file, "$%d", op.imm);
@@ -865,12 +2273,33 @@ static void write_operand(FILE *file, struct operand op, int reg_size)
     }
 }
 
+static void write_lea_address(FILE *file, struct asm_instr *instr)
+{
+    if (instr->lea.disp)
+        fprintf(file, "%d", instr->lea.disp);
+
+    fprintf(file, "(");
+    if (instr->lea.has_base)
+        write_operand(file, instr->lea.base, 64);
+    if (instr->lea.has_index) {
+        fprintf(file, ",");
+        write_operand(file, instr->lea.index, 64);
+        fprintf(file, ",%d", instr->lea.scale);
+    }
+    fprintf(file, ")");
+}
+
 static void emit_static_variable(struct asm_static_variable *var, FILE *file)
 {
     if (var->global)
         fprintf(file, "    .globl %s\n", var->name);
 
-    if (var->init == 0) {
+    if (var->counter) {
+        fprintf(file, "    .bss\n");
+        fprintf(file, "    .align 8\n");
+        fprintf(file, "%s:\n", var->name);
+        fprintf(file, "    .zero 8\n");
+    } else if (var->init == 0) {
         fprintf(file, "    .bss\n");
         fprintf(file, "    .align 4\n");
         fprintf(file, "%s:\n", var->name);
@@ -883,27 +2312,96 @@ static void emit_static_variable(struct asm_static_variable *var, FILE *file)
     }
 }
 
-static void emit_function(struct asm_function *fn, FILE *file)
+static void emit_epilogue(struct asm_function *fn, FILE *file)
+{
+    if (fn->saved_reg_count > 0 || fn->omit_frame_pointer) {
+        if (fn->frame_size > 0)
+            fprintf(file, "    addq     $%d, %%rsp\n", fn->frame_size);
+
+        for (int i = fn->saved_reg_count - 1; i >= 0; i--)
+            fprintf(file, "    popq     %%%s\n", reg_name_64(fn->saved_regs[i]));
+    } else if (fn->frame_size > 0) {
+        fprintf(file, "    movq     %%rbp, %%rsp\n");
+    }
+
+    if (!fn->omit_frame_pointer)
+        fprintf(file, "    popq     %%rbp\n");
+}
+
+// .p2align log2,,max: the assembler pads with multi-byte nops
+static void emit_alignment(struct code_alignment alignment, FILE *file)
+{
+    if (alignment.align <= 1)
+        return;
+
+    int log2 = log2_exact(alignment.align);
+
+    if (alignment.max_skip > 0 && alignment.max_skip < alignment.align - 1)
+        fprintf(file, "    .p2align %d,,%d\n", log2, alignment.max_skip);
+    else
+        fprintf(file, "    .p2align %d\n", log2);
+}
+
+static void emit_label_alignment(struct asm_instr *label,
+                                 struct codegen_options *opts, FILE *file)
+{
+    if (label->label.loop_header)
+        emit_alignment(opts->align_loops, file);
+    else if (label->label.no_fallthrough)
+        emit_alignment(opts->align_jumps, file);
+}
+
+static void emit_section(enum ir_section section, FILE *file)
+{
+    switch (section) {
+        case IR_SECTION_TEXT:
+            fprintf(file, "    .text\n");
+            break;
+        case IR_SECTION_HOT:
+            fprintf(file, "    .section .text.hot,\"ax\",@progbits\n");
+            break;
+        case IR_SECTION_UNLIKELY:
+            fprintf(file, "    .section .text.unlikely,\"ax\",@progbits\n");
+            break;
+    }
+}
+
+static void emit_function(struct asm_function *fn, struct codegen_options *opts,
+                          FILE *file)
 {
     if (fn->global)
         fprintf(file, "    .globl %s\n", fn->name);
-    fprintf(file, "    .text\n");
+    emit_section(fn->section, file);
+    emit_alignment(opts->align_functions, file);
     fprintf(file, "%s:\n", fn->name);
-    fprintf(file, "    pushq    %%rbp\n");
-    fprintf(file, "    movq     %%rsp, %%rbp\n");
+
+    emit_fn = fn;
+    emit_push_depth = 0;
+
+    if (!fn->omit_frame_pointer) {
+        fprintf(file, "    pushq    %%rbp\n");
+        fprintf(file, "    movq     %%rsp, %%rbp\n");
+    }
+    for (int i = 0; i < fn->saved_reg_count; i++)
+        fprintf(file, "    pushq    %%%s\n", reg_name_64(fn->saved_regs[i]));
+    if (fn->frame_size > 0)
+        fprintf(file, "    subq     $%d, %%rsp\n", fn->frame_size);
 
     for (struct asm_instr *instr = fn->first; instr; instr = instr->next) {
         switch (instr->type) {
             case ASM_ALLOCSTACK:
                 fprintf(file, "    subq     $%d, %%rsp\n", instr->allocate_stack.val);
+                emit_push_depth += instr->allocate_stack.val;
                 break;
             case ASM_DEALLOCSTACK:
                 fprintf(file, "    addq     $%d, %%rsp\n", instr->deallocate_stack.val);
+                emit_push_depth -= instr->deallocate_stack.val;
                 break;
             case ASM_PUSH:
                 fprintf(file, "    pushq    ");
                 write_operand(file, instr->push.oper, 64);
                 fprintf(file, "\n");
+                emit_push_depth += 8;
                 break;
             case ASM_CALL:
                 // TODO: Add @PLT
@@ -912,7 +2410,18 @@ static void emit_function(struct asm_function *fn, FILE *file)
             case ASM_CDQ:
                 fprintf(file, "    cdq\n");
                 break;
+            case ASM_TEST:
+                fprintf(file, "    testl    ");
+                write_operand(file, instr->test.oper, 32);
+                fprintf(file, ", ");
+                write_operand(file, instr->test.oper, 32);
+                fprintf(file, "\n");
+                break;
             case ASM_MOV:
+                // Left behind when both sides got the same register
+                if (instr->mov.src.type == OPERAND_REG && instr->mov.dst.type == OPERAND_REG
+                        && instr->mov.src.reg == instr->mov.dst.reg)
+                    break;
                 fprintf(file, "    movl     ");
                 write_operand(file, instr->mov.src, 32);
                 fprintf(file, ", ");
@@ -925,7 +2434,7 @@ static void emit_function(struct asm_function *fn, FILE *file)
                 fprintf(file, "\n");
                 break;
             case ASM_BINARY: {
-                bool is_shift = instr->binary.op == ASM_SHL || instr->binary.op == ASM_SHR;
+                bool is_shift = is_shift_op(instr->binary.op);
                 bool is_reg = instr->binary.src.type == OPERAND_REG;
                 fprintf(file, "    %s     ", asm_op_str(instr->binary.op));
                 write_operand(file, instr->binary.src, is_shift && is_reg ? 8 : 32);
@@ -939,11 +2448,26 @@ static void emit_function(struct asm_function *fn, FILE *file)
                 write_operand(file, instr->idiv.oper, 32);
                 fprintf(file, "\n");
                 break;
+            case ASM_IMUL_WIDE:
+                fprintf(file, "    imull    ");
+                write_operand(file, instr->imul_wide.oper, 32);
+                fprintf(file, "\n");
+                break;
+            case ASM_LEA:
+                fprintf(file, "    leal     ");
+                write_lea_address(file, instr);
+                fprintf(file, ", ");
+                write_operand(file, instr->lea.dst, 32);
+                fprintf(file, "\n");
+                break;
             case ASM_RET:
-                fprintf(file, "    movq     %%rbp, %%rsp\n");
-                fprintf(file, "    popq     %%rbp\n");
+                emit_epilogue(fn, file);
                 fprintf(file, "    ret\n");
                 break;
+            case ASM_TAIL_CALL:
+                emit_epilogue(fn, file);
+                fprintf(file, "    jmp      %s\n", instr->tail_call.identifier);
+                break;
             case ASM_CMP:
                 fprintf(file, "    cmpl     ");
                 write_operand(file, instr->cmp.lhs, 32);
@@ -969,6 +2493,11 @@ static void emit_function(struct asm_function *fn, FILE *file)
                 fprintf(file, "\n");
                 break;
             case ASM_LABEL: {
+                if (fn->has_cold_part && instr->label.identifier == fn->cold_label)
+                    emit_section(IR_SECTION_UNLIKELY, file);
+
+                emit_label_alignment(instr, opts, file);
+
                 char l[10];
                 sprintf(l, ".L%d", instr->label.identifier);
                 fprintf(file, "%s:\n", l);
@@ -978,22 +2507,126 @@ static void emit_function(struct asm_function *fn, FILE *file)
     }
 }
 
-void emit_x86(struct ir_program *ir, FILE *file)
+static void write_string_literal(FILE *file, const char *str)
+{
+    fprintf(file, "\"");
+    for (const char *c = str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else
+            fprintf(file, "%c", *c);
+    }
+    fprintf(file, "\"");
+}
+
+/*
+ * -fprofile-generate runtime, one per translation unit. A constructor
+ * registers the dump with atexit(), the dump appends every nonzero
+ * counter to the profile:
+ *   fprintf(f, "%s %d %d %u\n", function, counters, index, count)
+ * The table has an entry of 24 bytes per counter:
+ *   .quad function name, counter address
+ *   .long counters in function, index
+ */
+static void emit_profile_runtime(struct asm_program *program, FILE *file)
+{
+    fprintf(file, "    .section .rodata\n");
+    fprintf(file, ".Lprof_path:\n    .string ");
+    write_string_literal(file, program->profile_path);
+    fprintf(file, "\n.Lprof_mode:\n    .string \"a\"\n");
+    fprintf(file, ".Lprof_format:\n    .string \"%%s %%d %%d %%lu\\n\"\n");
+
+    int i = 0;
+    for (struct ir_profile_counter *c = program->profile_counters; c; c = c->next, i++) {
+        fprintf(file, ".Lprof_name%d:\n    .string ", i);
+        write_string_literal(file, c->function);
+        fprintf(file, "\n");
+    }
+
+    fprintf(file, "    .data\n");
+    fprintf(file, "    .p2align 3\n");
+    fprintf(file, ".Lprof_table:\n");
+
+    i = 0;
+    for (struct ir_profile_counter *c = program->profile_counters; c; c = c->next, i++) {
+        fprintf(file, "    .quad .Lprof_name%d, %s\n", i, c->symbol);
+        fprintf(file, "    .long %d, %d\n", c->function_counters, c->index);
+    }
+    fprintf(file, ".Lprof_table_end:\n");
+
+    fprintf(file, "    .section .init_array,\"aw\"\n");
+    fprintf(file, "    .p2align 3\n");
+    fprintf(file, "    .quad .Lprof_init\n");
+
+    fprintf(file,
+            "    .text\n"
+            ".Lprof_init:\n"
+            "    leaq     .Lprof_dump(%%rip), %%rdi\n"
+            "    jmp      atexit@PLT\n"
+            ".Lprof_dump:\n"
+            "    pushq    %%rbx\n"
+            "    pushq    %%r12\n"
+            "    subq     $8, %%rsp\n"
+            "    leaq     .Lprof_path(%%rip), %%rdi\n"
+            "    leaq     .Lprof_mode(%%rip), %%rsi\n"
+            "    call     fopen@PLT\n"
+            "    testq    %%rax, %%rax\n"
+            "    je       .Lprof_done\n"
+            "    movq     %%rax, %%rbx\n"
+            "    leaq     .Lprof_table(%%rip), %%r12\n"
+            ".Lprof_loop:\n"
+            "    leaq     .Lprof_table_end(%%rip), %%rax\n"
+            "    cmpq     %%rax, %%r12\n"
+            "    jae      .Lprof_close\n"
+            "    movq     8(%%r12), %%rax\n"
+            "    movq     (%%rax), %%r9\n"
+            "    testq    %%r9, %%r9\n"
+            "    je       .Lprof_next\n"
+            "    movq     %%rbx, %%rdi\n"
+            "    leaq     .Lprof_format(%%rip), %%rsi\n"
+            "    movq     (%%r12), %%rdx\n"
+            "    movl     16(%%r12), %%ecx\n"
+            "    movl     20(%%r12), %%r8d\n"
+            "    xorl     %%eax, %%eax\n"
+            "    call     fprintf@PLT\n"
+            ".Lprof_next:\n"
+            "    addq     $24, %%r12\n"
+            "    jmp      .Lprof_loop\n"
+            ".Lprof_close:\n"
+            "    movq     %%rbx, %%rdi\n"
+            "    call     fclose@PLT\n"
+            ".Lprof_done:\n"
+            "    addq     $8, %%rsp\n"
+            "    popq     %%r12\n"
+            "    popq     %%rbx\n"
+            "    ret\n");
+}
+
+struct asm_program *build_x86(struct ir_program *ir, struct codegen_options *opts)
 {
-    struct asm_program *program = lower_ir_program(ir);
-    asm_phase2(program);
+    struct asm_program *program = lower_ir_program(ir, opts);
+    asm_phase2(program, opts);
     for (struct asm_function *fn = program->functions; fn; fn = fn->next)
         asm_phase3(fn);
 
+    return program;
+}
+
+void emit_x86(struct ir_program *ir, struct codegen_options *opts, FILE *file)
+{
+    struct asm_program *program = build_x86(ir, opts);
 
     for (struct asm_static_variable *var = program->static_vars; var; var = var->next)
         emit_static_variable(var, file);
 
 
     for (struct asm_function *fn = program->functions; fn; fn = fn->next) {
-        emit_function(fn, file);
+        emit_function(fn, opts, file);
     }
 
+    if (program->profile_path)
+        emit_profile_runtime(program, file);
+
     // Linux/ELF requirement
     fprintf(file, "\n    .section .note.GNU-stack,\"\",@progbits\n");
 }
@@ -18,8 +18,16 @@ enum reg {
     REG_R9,
     REG_R10,
     REG_R11,
+    // Callee-saved
+    REG_BX,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
 };
 
+#define CALLEE_SAVED_COUNT 5
+
 enum operand_type {
     OPERAND_IMM,
     OPERAND_REG,
@@ -40,7 +48,7 @@ struct operand {
 
         const char *data;
 
-        const char *pseudo;
+        int pseudo;     // The IR's number
     };
 };
 
@@ -59,6 +67,9 @@ enum asm_op {
     // Unary
     ASM_NEG,
     ASM_NOT,
+    ASM_INC,
+    ASM_DEC,
+    ASM_INCQ,   // 64-bit, for profile counters
     // Binary
     ASM_ADD,
     ASM_SUB,
@@ -67,7 +78,8 @@ enum asm_op {
     ASM_OR,
     ASM_XOR,
     ASM_SHL,
-    ASM_SHR,
+    ASM_SHR,    // Logical right shift
+    ASM_SAR,    // Arithmetic right shift
 };
 
 enum asm_instr_type { 
@@ -75,7 +87,10 @@ enum asm_instr_type {
     ASM_UNARY,
     ASM_BINARY,
     ASM_CMP,
+    ASM_TEST,
     ASM_IDIV,
+    ASM_IMUL_WIDE,
+    ASM_LEA,
     ASM_CDQ,
     ASM_JMP,
     ASM_JMPCC,
@@ -85,6 +100,7 @@ enum asm_instr_type {
     ASM_DEALLOCSTACK,
     ASM_PUSH,
     ASM_CALL,
+    ASM_TAIL_CALL,  // Epilogue + jmp
     ASM_RET,
 };
 
@@ -114,10 +130,31 @@ struct asm_instr {
             struct operand rhs;
         } cmp;
 
+        // testl oper, oper
+        struct {
+            struct operand oper;
+        } test;
+
         struct {
             struct operand oper;
         } idiv;
 
+        // imull oper -> EDX:EAX = EAX * oper
+        struct {
+            struct operand oper;
+        } imul_wide;
+
+        // leal disp(base, index, scale), dst
+        struct {
+            struct operand base;
+            struct operand index;
+            bool has_base;
+            bool has_index;
+            int scale;
+            int disp;
+            struct operand dst;
+        } lea;
+
         struct {
             int identifier;
         } jmp;
@@ -134,6 +171,8 @@ struct asm_instr {
 
         struct {
             int identifier;
+            bool loop_header;       // Target of a backward jump
+            bool no_fallthrough;    // Only reached by jumping to it
         } label;
 
         struct {
@@ -152,6 +191,10 @@ struct asm_instr {
             const char *identifier;
         } call;
 
+        struct {
+            const char *identifier;
+        } tail_call;
+
         struct { } ret;
         struct { } cdq;
     };
@@ -163,6 +206,7 @@ struct asm_static_variable {
     const char *name;
     bool global;
     long init;
+    bool counter;   // 8 bytes, not 4
 
     struct asm_static_variable *next;
 };
@@ -176,14 +220,52 @@ struct asm_function {
     struct asm_instr *first;
     struct asm_instr *last;
 
-    int stack_size;
+    enum ir_section section;
+    bool has_cold_part;     // Code from 'cold_label' on goes in .text.unlikely
+    int cold_label;
+
+    int pseudo_count;         // Pseudo operands are numbered 1 to this
+
+    bool is_leaf;             // Makes no calls (tail calls don't count)
+    bool omit_frame_pointer;  // Stack operands are %rsp relative
+
+    // Callee-saved registers used, pushed in this order by the prologue
+    enum reg saved_regs[CALLEE_SAVED_COUNT];
+    int saved_reg_count;
+
+    int frame_size;   // Bytes the prologue subtracts from %rsp
+    int frame_bias;   // Added to stack offsets when addressing off %rsp
 };
 
 struct asm_program {
     struct asm_function *functions;
     struct asm_static_variable *static_vars;
+
+    // -fprofile-generate counters, dumped to 'profile_path' at exit
+    const char *profile_path;
+    struct ir_profile_counter *profile_counters;
 };
 
-void emit_x86(struct ir_program *ir, FILE *file);
+// Align to 'align' bytes unless that takes more than 'max_skip' bytes of padding
+struct code_alignment {
+    int align;      // Power of two, 1 disables alignment
+    int max_skip;   // 0 for no limit
+};
+
+struct codegen_options {
+    bool omit_frame_pointer;  // -fomit-frame-pointer
+    bool red_zone;            // Leaf functions keep locals below %rsp
+    bool sibling_calls;       // call f + ret -> jmp f
+    bool callee_saved_regs;   // Keep hot pseudos in %rbx, %r12-%r15
+
+    struct code_alignment align_functions;  // -falign-functions=
+    struct code_alignment align_loops;      // -falign-loops=
+    struct code_alignment align_jumps;      // -falign-jumps=
+};
+
+// Phases 1-3, the result only has legal operand forms left
+struct asm_program *build_x86(struct ir_program *ir, struct codegen_options *opts);
+
+void emit_x86(struct ir_program *ir, struct codegen_options *opts, FILE *file);
 
 #endif
@@ -0,0 +1,51 @@
+/*
+ * Static functions always called with the same constant argument,
+ * with results nobody uses, or returning a constant.
+ */
+static int calls = 0;
+
+static int power(int base, int n, int flag) {
+    if (n == 0)
+        return 1;
+    // base and flag are only passed on unchanged
+    return base * power(base, n - 1, flag);
+}
+
+static int countdown(int n, int step) {
+    int steps = 0;
+    while (n > 0) {
+        n = n - step;
+        steps = steps + 1;
+    }
+    step = 0;   // Assigns the constant parameter
+    return steps + step;
+}
+
+static int note(int x) {
+    calls = calls + x;
+    return x * 2;
+}
+
+static int ready(int unused) {
+    calls = calls + 1;
+    return 1;
+}
+
+int main(void) {
+    if (power(3, 4, 1) != 81 || power(3, 0, 1) != 1)
+        return 1;
+
+    if (countdown(10, 2) != 5 || countdown(7, 2) != 4)
+        return 2;
+
+    note(5);
+    note(6);
+
+    if (!ready(100) || !ready(100))
+        return 3;
+
+    if (calls != 13)
+        return 4;
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Static functions and variables nothing outside reaches, next to
+ * ones only reached through another static function.
+ */
+static int unused_counter = 5;
+static int used_counter = 0;
+
+static int never_called(int x);
+
+static int also_never_called(int x) {
+    unused_counter = unused_counter + x;
+    return never_called(x);
+}
+
+static int never_called(int x) {
+    return also_never_called(x - 1);
+}
+
+static int bump(int x) {
+    used_counter = used_counter + x;
+    return used_counter;
+}
+
+static int twice(int x) {
+    bump(x);
+    return bump(x);
+}
+
+int main(void) {
+    static int local_unused = 3;
+
+    if (twice(4) != 8)
+        return 1;
+
+    return used_counter - 8;
+}
@@ -0,0 +1,37 @@
+#define ANSWER 40
+#define ADD(a, b) ((a) + (b))
+#define TWICE(x) ADD(x, x)
+#define PASTE(a, b) a ## b
+#define SELF SELF
+#define NOTHING
+
+#if defined(ANSWER) && ANSWER > 30 && !defined NOT_DEFINED
+#define EXTRA 1
+#elif 1
+#define EXTRA 100
+#else
+#error not reached
+#endif
+
+#ifdef NOT_DEFINED
+#error not reached either
+#endif
+
+#if 0
+    unbalanced ( garbage " in a skipped group
+#if 1
+#else
+#endif
+#endif
+
+#undef ANSWER
+#ifndef ANSWER
+#define ANSWER 41
+#endif
+
+int main(void) {
+    int SELF = 1;
+    int PASTE(va, lue) = TWICE(EXTRA) - SELF \
+        + NOTHING ANSWER;
+    return value;
+}
@@ -0,0 +1,6 @@
+/**/int main(void) {/*/ still a comment */
+    // A line comment ending at the end of the line /*
+    return 14 /* a comment long enough to span more than one sixteen byte chunk ***/
+        /// 3
+        /*************** a '*' just before the end of a chunk ***************/ / 2;
+}
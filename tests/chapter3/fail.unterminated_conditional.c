@@ -0,0 +1,4 @@
+#ifdef NOT_DEFINED
+int main(void) {
+    return 0;
+}
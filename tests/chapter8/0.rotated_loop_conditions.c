@@ -0,0 +1,63 @@
+/* Loops test at the bottom: the condition must still run once per check */
+
+int checks = 0;
+
+int below(int i, int n) {
+    checks = checks + 1;
+    return i < n;
+}
+
+int main(void) {
+    int sum = 0;
+
+    for (int i = 0; below(i, 10); i = i + 1) {
+        if (i == 3)
+            continue;
+        sum = sum + i;
+    }
+
+    if (checks != 11 || sum != 42)
+        return 1;
+
+    checks = 0;
+    int j = 0;
+    while (below(j, 0))
+        j = j + 1;
+
+    if (checks != 1 || j != 0)
+        return 2;
+
+    checks = 0;
+    j = 0;
+    while (below(j, 5)) {
+        j = j + 1;
+        if (j == 2)
+            continue;
+        if (j == 4)
+            break;
+    }
+
+    if (checks != 4 || j != 4)
+        return 3;
+
+    // Jumping into the body skips the first check
+    checks = 0;
+    j = 0;
+    goto inside;
+    while (below(j, 3)) {
+    inside:
+        j = j + 1;
+    }
+
+    if (checks != 3 || j != 3)
+        return 4;
+
+    int k = 0;
+    for (;;) {
+        k = k + 1;
+        if (k == 7)
+            break;
+    }
+
+    return k == 7 ? 0 : 5;
+}
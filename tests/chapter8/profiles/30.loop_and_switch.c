@@ -0,0 +1,22 @@
+int classify(int i) {
+    switch (i % 4) {
+        case 0:
+            return 3;
+        case 1:
+            return i > 50 ? 5 : 1;
+        case 3:
+            return 7;
+        default:
+            return 0;
+    }
+}
+
+int main(void) {
+    int total = 0;
+    for (int i = 0; i < 100; i = i + 1) {
+        if (i == 90)
+            break;
+        total = total + classify(i);
+    }
+    return total % 256;
+}
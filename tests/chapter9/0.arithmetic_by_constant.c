@@ -0,0 +1,35 @@
+int div_var(int a, int b) { return a / b; }
+int rem_var(int a, int b) { return a % b; }
+int mul_var(int a, int b) { return a * b; }
+int check(int x) {
+    if (x / 7 != div_var(x, 7)) return 1;
+    if (x % 7 != rem_var(x, 7)) return 2;
+    if (x / 8 != div_var(x, 8)) return 3;
+    if (x % 8 != rem_var(x, 8)) return 4;
+    if (x / 2 != div_var(x, 2)) return 5;
+    if (x % 2 != rem_var(x, 2)) return 6;
+    if (x / 1000 != div_var(x, 1000)) return 7;
+    if (x % 641 != rem_var(x, 641)) return 8;
+    if (x / 1 != div_var(x, 1)) return 9;
+    if (x * 9 != mul_var(x, 9)) return 10;
+    if (x * 24 != mul_var(x, 24)) return 11;
+    if (x * 16 != mul_var(x, 16)) return 12;
+    if (x * 7 != mul_var(x, 7)) return 13;
+    if (x / 2147483647 != div_var(x, 2147483647)) return 14;
+    if (x / 3 != div_var(x, 3)) return 15;
+    if (x % 1073741824 != rem_var(x, 1073741824)) return 16;
+    return 0;
+}
+int main(void) {
+    int r = check(-2147483647 - 1) || check(2147483647);
+    if (r) return r;
+    for (int x = -100000; x < 100000; x = x + 7) {
+        r = check(x);
+        if (r) return r;
+    }
+    for (int x = 2147483647; x > 2000000000; x = x - 12345) {
+        r = check(x) || check(-x);
+        if (r) return 100 + r;
+    }
+    return 0;
+}
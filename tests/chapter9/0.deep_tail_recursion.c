@@ -0,0 +1,42 @@
+/*
+ * Self tail recursion that becomes a loop and mutual tail calls that
+ * become jumps. Shallow enough to still fit the stack as real calls
+ * under -fno-optimize-sibling-calls.
+ */
+int is_even(int n);
+
+int is_odd(int n) {
+    if (n == 0)
+        return 0;
+    return is_even(n - 1);
+}
+
+int is_even(int n) {
+    if (n == 0)
+        return 1;
+    return is_odd(n - 1);
+}
+
+int sum_mod(int n, int acc) {
+    if (n == 0)
+        return acc;
+    return sum_mod(n - 1, (acc + n) % 1000);
+}
+
+int swap_count(int a, int b, int n) {
+    if (n == 0)
+        return a * 10 + b;
+    return swap_count(b, a, n - 1);
+}
+
+int main(void) {
+    if (!is_even(100000))
+        return 1;
+    if (is_odd(100000))
+        return 2;
+    if (sum_mod(100000, 0) != 0)
+        return 3;
+    if (swap_count(1, 2, 100001) != 21)
+        return 4;
+    return 0;
+}
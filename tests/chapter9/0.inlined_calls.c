@@ -0,0 +1,59 @@
+/*
+ * Small callees get inlined. Every copy needs its own parameters,
+ * temporaries and labels, and each return must leave the copy.
+ */
+int calls = 0;
+
+int clamp(int x, int lo, int hi) {
+    if (x < lo)
+        return lo;
+    if (x > hi)
+        return hi;
+    return x;
+}
+
+int bump(int x) {
+    calls = calls + 1;
+    x = x + 1;          // Writes its own copy of the parameter
+    return x;
+}
+
+void count(void) {
+    calls = calls + 1;
+}
+
+int twice(int x) {
+    return bump(bump(x));
+}
+
+int pick(int a, int b) {
+    return a > b ? twice(a) : clamp(b, 0, 5);
+}
+
+int main(void) {
+    int x = 3;
+
+    if (bump(x) != 4 || x != 3)
+        return 1;
+
+    int sum = 0;
+    for (int i = -3; i < 10; i++)
+        sum = sum + clamp(i, 0, 5) + clamp(i * 2, 1, 4);
+    if (sum != 73)
+        return 2;
+
+    if (twice(twice(1)) != 5)
+        return 3;
+
+    count();
+    count();
+
+    if (pick(7, 2) != 9 || pick(1, 9) != 5)
+        return 4;
+
+    // bump ran 1 + 4 + 2 times, count twice
+    if (calls != 9)
+        return 5;
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+/* Expression shapes the instruction selector covers with fused tiles */
+
+int scaled(int a, int b) {
+    int x = b + a * 4;
+    int y = a * 8 + 3;
+    int z = (a << 2) - 5;
+    int w = 2 * a + b;
+    return x + y + z + w;
+}
+
+int sums(int a, int b) {
+    int x = (a + b) + 7;
+    int y = (a + 9) + b;
+    int z = a - 100;
+    int w = 3 + a;
+    return x ^ y ^ z ^ w;
+}
+
+int branches(int a, int b) {
+    int n = 0;
+
+    if (a < b) n = n + 1;
+    if (5 < a) n = n + 2;
+    if (a >= 0) n = n + 4;
+    if (!a) n = n + 8;
+    if (!(a == b)) n = n + 16;
+    if (10 >= b) n = n + 32;
+    if (a) n = n + 64;
+
+    return n;
+}
+
+int counters(int n) {
+    int up = 0;
+    int down = n;
+
+    while (down) {
+        up++;
+        --down;
+        down = down - 1 + 1;
+    }
+
+    return up - n;
+}
+
+int aliasing(int x, int y) {
+    x = y - x;
+    y = y << x;
+    x = 2 - x;
+    return x * 100 + y;
+}
+
+int main(void) {
+    if (scaled(3, 10) != 22 + 27 + 7 + 16)
+        return 1;
+    if (scaled(-7, 2) != -26 + -53 + -33 + -12)
+        return 2;
+    if (sums(4, 5) != (16 ^ 18 ^ -96 ^ 7))
+        return 3;
+    if (branches(3, 4) != 1 + 4 + 16 + 32 + 64)
+        return 4;
+    if (branches(0, 0) != 4 + 8 + 32)
+        return 5;
+    if (branches(-6, 11) != 1 + 16 + 64)
+        return 6;
+    if (branches(9, 2) != 2 + 4 + 16 + 32 + 64)
+        return 7;
+    if (counters(37) != 0)
+        return 8;
+    if (aliasing(1, 3) != 0 * 100 + 12)
+        return 9;
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* Hot locals are kept in callee-saved registers, they must survive calls */
+
+int clobber(int a, int b, int c, int d, int e, int f, int g, int h) {
+    int x = a * b + c * d;
+    int y = e * f + g * h;
+    return x ^ y;
+}
+
+int shift_mix(int v, int s) {
+    return (v << (s & 7)) >> (s & 3);
+}
+
+int hot_loop(int n) {
+    int a = 1;
+    int b = 2;
+    int c = 3;
+    int d = 4;
+    int e = 5;
+    int f = 6;
+    int g = 7;
+
+    for (int i = 0; i < n; i = i + 1) {
+        a = a + clobber(i, a, b, c, d, e, f, g) % 7;
+        b = b + shift_mix(i, a) % 5;
+        c = c ^ i;
+        d = d + c % 3;
+        e = e + (d & 1);
+        f = f + e % 4;
+        g = g + f % 2;
+    }
+
+    return a + b + c + d + e + f + g;
+}
+
+int main(void) {
+    if (hot_loop(1000) != 8688)
+        return 1;
+
+    return hot_loop(0) == 28 ? 0 : 2;
+}
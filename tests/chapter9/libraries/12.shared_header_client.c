@@ -0,0 +1,7 @@
+#include "shared_header.h"
+#include "scale.h"
+#include "shared_header.h"
+
+int main(void) {
+    return scaled(2) + scale_by(1, SCALE * 2);
+}
@@ -0,0 +1,16 @@
+int lib_step(int x);
+int lib_counter(void);
+
+static int counter = 100;
+
+static int scale(int x) {
+    counter = counter + x;
+    return x * 2;
+}
+
+int main(void) {
+    int a = lib_step(4);    // 12 + 6
+    int b = scale(a);       // 36, counter is 118
+    int c = lib_step(1);    // 3 + 7
+    return a + b + c + lib_counter() + counter - 118;
+}
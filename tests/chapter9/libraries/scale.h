@@ -0,0 +1,5 @@
+#pragma once
+
+static int scale_by(int x, int factor) {
+    return x * factor;
+}
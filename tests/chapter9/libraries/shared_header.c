@@ -0,0 +1,6 @@
+#include "shared_header.h"
+#include "shared_header.h"
+
+int scaled(int x) {
+    return scale_by(x, SCALE);
+}
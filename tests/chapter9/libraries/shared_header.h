@@ -0,0 +1,11 @@
+#ifndef SHARED_HEADER_H
+#define SHARED_HEADER_H
+
+// Included twice by each file, the guard keeps the second from redefining these
+#include "scale.h"
+
+#define SCALE 3
+
+int scaled(int x);
+
+#endif
@@ -0,0 +1,15 @@
+/* Same static names as the client, they must stay apart with -flto */
+static int counter = 5;
+
+static int scale(int x) {
+    counter = counter + 1;
+    return x * 3;
+}
+
+int lib_step(int x) {
+    return scale(x) + counter;
+}
+
+int lib_counter(void) {
+    return counter;
+}
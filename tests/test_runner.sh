@@ -7,17 +7,21 @@ PASS=0
 FAIL=0
 VERBOSE=0
 CHAPTER=""
+FLAGS=""
+RUN=0
 
 GREEN="\e[32m"
 RED="\e[31m"
 YELLOW="\e[33m"
 ENDCOLOR="\e[0m"
 
-while getopts "vc:" opt; do
+while getopts "vrc:f:" opt; do
     case $opt in
         v) VERBOSE=1 ;;
+        r) RUN=1 ;;
         c) CHAPTER="$OPTARG" ;;
-        *) echo "Usage: $0 [-v] [-c <chapter>]"; exit 1 ;;
+        f) FLAGS="$OPTARG" ;;
+        *) echo "Usage: $0 [-v] [-r] [-c <chapter>] [-f <compiler flags>]"; exit 1 ;;
     esac
 done
 
@@ -46,11 +50,24 @@ compile_and_run() {
     local name="$1"
     shift
 
+    # -r: compile and run in process, a compiler error shows up as exit 1
+    if [ "$RUN" -eq 1 ]; then
+        "$CC" $FLAGS --run "$@"
+        local got=$?
+
+        if [ "$got" -eq "$expected" ]; then
+            pass "$name (exited $got)"
+        else
+            fail "$name (expected exit $expected, got $got)"
+        fi
+        return
+    fi
+
     local tmp
     tmp="$(mktemp -d)"
 
     local err
-    err=$("$CC" "$@" -o "$tmp/out 2>&1")
+    err=$("$CC" $FLAGS "$@" -o "$tmp/out 2>&1")
     local status=$?
 
     if [ "$status" -ne 0 ]; then
@@ -80,7 +97,7 @@ run_single_test() {
 
     if [ "$tag" = "fail" ]; then
         local err
-        err=$("$CC" "$src" 2>&1)
+        err=$("$CC" $FLAGS "$src" 2>&1)
         if [ $? -ne 0 ]; then
             pass "$base"
             [ "$VERBOSE" -eq 1 ] && echo "      $err"
@@ -122,6 +139,67 @@ run_library_test() {
     compile_and_run "$tag" "libraries/$base" "${inputs[@]}"
 }
 
+# Builds instrumented, runs it, then rebuilds with the profile it wrote
+run_profile_test() {
+    local src="$1"
+    local base tag
+    local tmp err got
+
+    base="$(basename "$src" .c)"
+    tag="$(tag_of "$src")"
+
+    # Profiles are kept per source, -flto refuses them
+    if [[ " $FLAGS " == *" -flto "* ]]; then
+        echo -e "${YELLOW}SKIP${ENDCOLOR}: profiles/$base (not with -flto)"
+        return
+    fi
+
+    tmp="$(mktemp -d)"
+
+    if [ "$RUN" -eq 1 ]; then
+        "$CC" $FLAGS -fprofile-generate="$tmp" --run "$src"
+        got=$?
+    elif err=$("$CC" $FLAGS -fprofile-generate="$tmp" "$src" -o "$tmp/gen" 2>&1); then
+        "$tmp/gen"
+        got=$?
+    else
+        fail "profiles/$base (compiler rejected -fprofile-generate)" "$err"
+        rm -rf "$tmp"
+        return
+    fi
+
+    # Named after a hash of the source path in a -fprofile-generate= directory
+    local profiles=("$tmp/$base".*.prof)
+    if [ "$got" -ne "$tag" ] || [ ${#profiles[@]} -ne 1 ]; then
+        fail "profiles/$base (instrumented: expected exit $tag, got $got)"
+        rm -rf "$tmp"
+        return
+    fi
+
+    if ! err=$("$CC" $FLAGS -fprofile-use="$tmp" "$src" -o "$tmp/use" 2>&1); then
+        fail "profiles/$base (compiler rejected -fprofile-use)" "$err"
+        rm -rf "$tmp"
+        return
+    fi
+
+    if [ -n "$err" ]; then
+        fail "profiles/$base (profile not used)" "$err"
+        rm -rf "$tmp"
+        return
+    fi
+
+    "$tmp/use"
+    got=$?
+
+    rm -rf "$tmp"
+
+    if [ "$got" -eq "$tag" ]; then
+        pass "profiles/$base (exited $got)"
+    else
+        fail "profiles/$base (expected exit $tag, got $got)"
+    fi
+}
+
 shopt -s globstar nullglob
 
 
@@ -137,7 +215,7 @@ fi
 
 for f in "$SEARCH_DIR"/**/*.c; do
     case "$f" in
-        */libraries/*) continue ;;
+        */libraries/* | */profiles/*) continue ;;
     esac
     run_single_test "$f"
 done
@@ -146,6 +224,10 @@ for f in "$SEARCH_DIR"/**/libraries/*_client.c; do
     run_library_test "$f"
 done
 
+for f in "$SEARCH_DIR"/**/profiles/*.c; do
+    run_profile_test "$f"
+done
+
 echo
 echo "Passed: $PASS"
 echo "Failed: $FAIL"